@@ -1,6 +1,11 @@
 #include <linux/io.h>
 #include <linux/string.h>
 #include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/wait.h>
+#include <linux/jiffies.h>
+#include <linux/device.h>
 #include <ftl/vfl.h>
 #include <ftl/ftl.h>
 #include <mach/iphone-clock.h>
@@ -82,6 +87,77 @@ typedef enum VFLStruct {
 #define FTL_ID_V2 0x43303034
 #define FTL_ID_V3 0x43303035
 
+// Background GC defaults. The write path merges synchronously once the pool
+// is down to 3 free virtual blocks, so the GC thread tops it up to this many
+// while the device is idle.
+#define FTL_GC_FREE_TARGET 8
+#define FTL_GC_IDLE_MS 100
+
+typedef struct FTLGCCounter {
+	u64 count;
+	u64 time;					// microseconds
+} FTLGCCounter;
+
+typedef struct FTLGCStats {
+	FTLGCCounter merges;		// background merges of full or old logs
+	FTLGCCounter compactions;	// background compactions of scattered logs
+	FTLGCCounter wearlevels;	// background block swaps
+	FTLGCCounter stalls;		// merges and swaps done inside FTL_Write
+	FTLGCCounter checkpoints;	// context commits, including the ones from ftl_sync
+} FTLGCStatsType;
+
+// Commit the context once this many blocks have been released since the last
+// commit. Each of them has to be scanned by an unclean restore. The GC thread
+// commits after fewer when the device is idle.
+#define FTL_CHECKPOINT_BLOCKS 64
+#define FTL_CHECKPOINT_IDLE_BLOCKS 4
+
+#define FTL_JOURNAL_MAGIC 0x4A524E4C
+#define FTL_JOURNAL_OVERFLOW 0xFFFF
+
+// Stored in the data of the unclean marks (type 0x4F). Lists every block released
+// since the context with usnDec cxtUsnDec was committed. Any of them may have been
+// reused since, so a restore from that context scans them along with its free and
+// log blocks. The list is rewritten before a released block is written to.
+typedef struct FTLJournal {
+	u32 magic;
+	u32 cxtUsnDec;
+	u16 count;				// FTL_JOURNAL_OVERFLOW if they didn't fit
+	u16 blocks[0];
+} __attribute__ ((packed)) FTLJournal;
+
+// Cached logical to virtual mapping for the read path. A logical block is described
+// as runs of logical pages that are also consecutive virtual pages, so a read only
+// has to look at the log once per block. Entries are direct mapped by lbn and must
+// be invalidated whenever the block's map or log changes.
+#define FTL_EXTENT_CACHE_SIZE 64
+#define FTL_EXTENT_MAX 16
+
+typedef struct FTLExtent {
+	u16 offset;				// first page within the logical block
+	u16 count;
+	u32 vpn;
+} FTLExtent;
+
+typedef struct FTLExtentCacheEntry {
+	u16 lbn;				// 0xFFFF if unused
+	u16 numExtents;
+	FTLExtent extents[FTL_EXTENT_MAX];
+} FTLExtentCacheEntry;
+
+typedef struct FTLExtentStatsType {
+	u64 hits;
+	u64 misses;
+	u64 fragmented;			// blocks with too many runs to cache
+} FTLExtentStatsType;
+
+typedef struct FTLRestoreStatsType {
+	u32 restored;
+	u32 incremental;
+	u32 blocksScanned;
+	u64 time;					// microseconds
+} FTLRestoreStatsType;
+
 // Shared counters
 
 VFLData1Type VFLData1;
@@ -118,9 +194,37 @@ static bool CleanFreeVb;
 
 static DEFINE_MUTEX(ftl_mutex);
 
+// Background GC, everything but the task pointer is protected by ftl_mutex
+
+static struct task_struct* ftl_gc_task;
+static DECLARE_WAIT_QUEUE_HEAD(ftl_gc_wait);
+static bool FTLGCPending;
+static unsigned long FTLLastIO;
+static int FTLGCFreeTarget = FTL_GC_FREE_TARGET;
+static int FTLGCIdleMs = FTL_GC_IDLE_MS;
+static FTLGCStatsType FTLGCStats;
+
+// Journal of released blocks, also protected by ftl_mutex
+
+static u16* FTLJournalBlocks;
+static int FTLJournalCapacity;
+static int FTLJournalCount;
+static int FTLJournalFlushed;		// entries already on flash
+static bool FTLJournalOverflow;
+static bool FTLJournalOverflowFlushed;
+static u32 FTLJournalCxtUsnDec;
+static FTLRestoreStatsType FTLRestoreStats;
+
+static FTLExtentCacheEntry FTLExtentCache[FTL_EXTENT_CACHE_SIZE];
+static FTLExtentStatsType FTLExtentStats;
+
 // Prototypes
 
 static bool ftl_merge(FTLCxtLog* pLog);
+static bool ftl_stall_merge(FTLCxtLog* pLog);
+static bool ftl_journal_flush(void);
+static bool ftl_checkpoint(void);
+static bool ftl_open_read_map_tables(void);
 static bool ftl_open_read_counter_tables(void);
 
 static int FTL_Init(void) {
@@ -144,7 +248,13 @@ static int FTL_Init(void) {
 
 	ScatteredVirtualPageNumberBuffer = (u32*) kmalloc(NANDGeometry->pagesPerSuBlk * sizeof(u32*), GFP_KERNEL);
 
-	if(!pstFTLCxt->pawMapTable || !pstFTLCxt->wPageOffsets || !pstFTLCxt->pawEraseCounterTable || !FTLCxtBuffer->pawReadCounterTable || ! FTLSpareBuffer || !ScatteredVirtualPageNumberBuffer)
+	for(i = 0; i < FTL_EXTENT_CACHE_SIZE; ++i)
+		FTLExtentCache[i].lbn = 0xFFFF;
+
+	FTLJournalCapacity = (NANDGeometry->bytesPerPage - sizeof(FTLJournal)) / sizeof(u16);
+	FTLJournalBlocks = (u16*) kmalloc(FTLJournalCapacity * sizeof(u16), GFP_KERNEL);
+
+	if(!pstFTLCxt->pawMapTable || !pstFTLCxt->wPageOffsets || !pstFTLCxt->pawEraseCounterTable || !FTLCxtBuffer->pawReadCounterTable || ! FTLSpareBuffer || !ScatteredVirtualPageNumberBuffer || !FTLJournalBlocks)
 		return -1;
 
 	for(i = 0; i < 18; i++) {
@@ -165,12 +275,56 @@ static void FTL_64bit_sum(u64* src, u64* dest, int size) {
 	}
 }
 
+// Starts an empty journal for the context that is on flash now.
+static void ftl_journal_reset(void)
+{
+	FTLJournalCount = 0;
+	FTLJournalFlushed = 0;
+	FTLJournalOverflow = false;
+	FTLJournalOverflowFlushed = false;
+	FTLJournalCxtUsnDec = pstFTLCxt->usnDec;
+}
+
+static void ftl_journal_release(u16 block)
+{
+	if(FTLJournalOverflow)
+		return;
+
+	if(FTLJournalCount == FTLJournalCapacity)
+	{
+		FTLJournalOverflow = true;
+		FTLJournalOverflowFlushed = false;
+		return;
+	}
+
+	FTLJournalBlocks[FTLJournalCount++] = block;
+}
+
+// Whether the journal on flash has to be rewritten before block may be written.
+static bool ftl_journal_needs_flush(u16 block)
+{
+	int i;
+
+	if(FTLJournalOverflow)
+		return !FTLJournalOverflowFlushed;
+
+	for(i = FTLJournalFlushed; i < FTLJournalCount; ++i)
+	{
+		if(FTLJournalBlocks[i] == block)
+			return true;
+	}
+
+	return false;
+}
+
 static bool ftl_set_free_vb(u16 block)
 {
 	// get to the end of the ring buffer
 	int nextFreeVb = (pstFTLCxt->nextFreeIdx + pstFTLCxt->wNumOfFreeVb) % 20;
 	++pstFTLCxt->wNumOfFreeVb;
 
+	ftl_journal_release(block);
+
 	++pstFTLCxt->pawEraseCounterTable[block];
 	pstFTLCxt->pawReadCounterTable[block] = 0;
 
@@ -185,14 +339,14 @@ static bool ftl_set_free_vb(u16 block)
 	return true;
 }
 
-static bool ftl_get_free_vb(u16* block)
+// Returns the index in awFreeVb of the least erased free block, or 20.
+static int ftl_choose_free_vb(void)
 {
 	int i;
 
 	int chosenVbIdx = 20;
 	int curFreeIdx = pstFTLCxt->nextFreeIdx;
 	u16 smallestEC = 0xFFFF;
-	u16 chosenVb;
 
 	for(i = 0; i < pstFTLCxt->wNumOfFreeVb; ++i)
 	{
@@ -207,10 +361,32 @@ static bool ftl_get_free_vb(u16* block)
 		curFreeIdx = (curFreeIdx + 1) % 20;
 	}
 
-	if(chosenVbIdx > 19)
+	return chosenVbIdx;
+}
+
+// The control area takes blocks without journal, the control blocks are
+// scanned by a restore anyway.
+static bool ftl_take_free_vb(u16* block, bool journal)
+{
+	int chosenVbIdx;
+	u16 chosenVb;
+
+	while(true)
 	{
-		LOG("ftl: could not find a free vb!\n");
-		return false;
+		chosenVbIdx = ftl_choose_free_vb();
+		if(chosenVbIdx > 19)
+		{
+			LOG("ftl: could not find a free vb!\n");
+			return false;
+		}
+
+		if(!journal || !ftl_journal_needs_flush(pstFTLCxt->awFreeVb[chosenVbIdx]))
+			break;
+
+		// Writing the journal can take a block for the control area,
+		// so choose again afterwards.
+		if(!ftl_journal_flush())
+			return false;
 	}
 
 	chosenVb = pstFTLCxt->awFreeVb[chosenVbIdx];
@@ -248,6 +424,11 @@ static bool ftl_get_free_vb(u16* block)
 	return true;
 }
 
+static bool ftl_get_free_vb(u16* block)
+{
+	return ftl_take_free_vb(block, true);
+}
+
 static bool ftl_next_ctrl_page(void)
 {
 	int i;
@@ -294,7 +475,7 @@ static bool ftl_next_ctrl_page(void)
 
 		++pstFTLCxt->eraseCounterPagesDirty;
 
-		if(!ftl_get_free_vb(&newBlock))
+		if(!ftl_take_free_vb(&newBlock, false))
 		{
 			LOG("ftl: next_ctrl_page failed to get free VB\n");
 			return false;
@@ -358,8 +539,137 @@ static bool determine_block_type(u16 block, u32* highest_usn)
 	return isSequential;
 }
 
+#define FTL_RESTORE_SCAN 1
+#define FTL_RESTORE_RELEASED 2
+
+static void ftl_restore_mark(u8* toScan, u16 block, u8 flags)
+{
+	if(block < (NANDGeometry->userSuBlksTotal + 23))
+		toScan[block] |= flags;
+}
+
+// Control pages are written in order, so the written ones can be found by bisection.
+static int ftl_ctrl_pages_used(u16 block)
+{
+	int lo = 0;
+	int hi = NANDGeometry->pagesPerSuBlk;
+
+	while(lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if(VFL_Read((block * NANDGeometry->pagesPerSuBlk) + mid, PageBuffer, (u8*) FTLSpareBuffer, true) == ERROR_EMPTYBLOCK)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return lo;
+}
+
+// Finds the newest unclean mark written after the context with cxtUsnDec, and marks the
+// blocks its journal lists. Fails if there is none we can trust, e.g. because the marks
+// were written by something that doesn't keep a journal.
+static bool ftl_restore_read_journal(u32 cxtUsnDec, u8* toScan)
+{
+	FTLJournal* journal = (FTLJournal*) PageBuffer;
+	u32 bestUsnDec = cxtUsnDec;
+	u32 bestPage = 0xFFFFFFFF;
+	int i;
+	int page;
+
+	for(i = 0; i < 3; ++i)
+	{
+		u16 block = pstFTLCxt->FTLCtrlBlock[i];
+
+		for(page = ftl_ctrl_pages_used(block) - 1; page >= 0; --page)
+		{
+			u32 vpn = (block * NANDGeometry->pagesPerSuBlk) + page;
+
+			if(VFL_Read(vpn, PageBuffer, (u8*) FTLSpareBuffer, true) != 0)
+				continue;
+
+			// anything below is older than the context
+			if(FTLSpareBuffer->type1 == 0x43)
+				break;
+
+			// tables from a commit that didn't finish
+			if(FTLSpareBuffer->type1 != 0x4F)
+				continue;
+
+			if(FTLSpareBuffer->meta.usnDec < bestUsnDec)
+			{
+				bestUsnDec = FTLSpareBuffer->meta.usnDec;
+				bestPage = vpn;
+			}
+			break;
+		}
+	}
+
+	if(bestPage == 0xFFFFFFFF)
+		return false;
+
+	if(VFL_Read(bestPage, PageBuffer, (u8*) FTLSpareBuffer, true) != 0)
+		return false;
+
+	if(journal->magic != FTL_JOURNAL_MAGIC || journal->cxtUsnDec != cxtUsnDec
+			|| journal->count == FTL_JOURNAL_OVERFLOW || journal->count > FTLJournalCapacity)
+		return false;
+
+	for(i = 0; i < journal->count; ++i)
+		ftl_restore_mark(toScan, journal->blocks[i], FTL_RESTORE_SCAN | FTL_RESTORE_RELEASED);
+
+	return true;
+}
+
+// Finds which logical block a virtual block belongs to, if any. Pages are written in
+// order, so with stopAtEmpty a block whose first page is empty is taken to be empty.
+static void ftl_restore_scan_block(int block, u16* blockMap, u8* isEmpty, u8* nonSequential, bool stopAtEmpty)
+{
+	int page;
+
+	blockMap[block] = 0xFFFF;
+	isEmpty[block] = 1;
+	nonSequential[block] = 0;
+
+	for(page = 0; page < NANDGeometry->pagesPerSuBlk; ++page)
+	{
+		int ret = VFL_Read(block * NANDGeometry->pagesPerSuBlk + page, PageBuffer, (u8*) FTLSpareBuffer, true);
+
+		if(ret == ERROR_EMPTYBLOCK)
+		{
+			if(stopAtEmpty && page == 0)
+				break;
+
+			continue;
+		}
+
+		isEmpty[block] = 0;
+
+		if(ret != 0)
+			continue;
+
+		if(FTLSpareBuffer->type1 >= 0x43 && FTLSpareBuffer->type1 <= 0x4F)
+			break;
+
+		// wtf is this? well, we'll just count it as empty
+		if(FTLSpareBuffer->type1 != 0x40 && FTLSpareBuffer->type1 != 0x41)
+			continue;
+
+		if((FTLSpareBuffer->user.logicalPageNumber % NANDGeometry->pagesPerSuBlk) != page)
+			nonSequential[block] = 1;
+
+		blockMap[block] = FTLSpareBuffer->user.logicalPageNumber / NANDGeometry->pagesPerSuBlk;
+		break;
+	}
+}
+
 // Assumptions: same conditions that FTL_Open would have been called in.
-static bool FTL_Restore(void)
+//
+// If incremental, the context found is used as a checkpoint. Its tables are loaded and
+// only the blocks that can have been written since are scanned: its free and log blocks,
+// and the blocks the journal in the unclean marks lists as released. Fails when there's
+// no usable checkpoint, so the caller can fall back to scanning everything.
+static bool FTL_Restore(bool incremental)
 {
 	u16* blockMap = (u16*) kmalloc((NANDGeometry->userSuBlksTotal + 23) * sizeof(u16), GFP_KERNEL);
 	u8* isEmpty = (u8*) kmalloc((NANDGeometry->userSuBlksTotal + 23) * sizeof(u8), GFP_KERNEL);
@@ -368,6 +678,13 @@ static bool FTL_Restore(void)
 	u32* usnB = (u32*) kmalloc(sizeof(u32) * NANDGeometry->pagesPerSuBlk, GFP_KERNEL);
 	u32* lpnA = (u32*) kmalloc(sizeof(u32) * NANDGeometry->pagesPerSuBlk, GFP_KERNEL);
 	u32* lpnB = (u32*) kmalloc(sizeof(u32) * NANDGeometry->pagesPerSuBlk, GFP_KERNEL);
+	u16* firstCandidate = (u16*) kmalloc(NANDGeometry->userSuBlksTotal * sizeof(u16), GFP_KERNEL);
+	u16* nextCandidate = (u16*) kmalloc((NANDGeometry->userSuBlksTotal + 23) * sizeof(u16), GFP_KERNEL);
+	u8* toScan = NULL;
+	u8* lbnScanned = NULL;
+	FTLCxtLog* ckptLog = NULL;
+	u16* ckptOffsets = NULL;
+	int ckptIndex[18];
 
 	u16* awFreeVb = &pstFTLCxt->awFreeVb[0];
 	u16* pawMapTable = pstFTLCxt->pawMapTable;
@@ -385,6 +702,9 @@ static bool FTL_Restore(void)
 	int page;
 	u32 highest_usn;
 	int numLogs;
+	int emptyCursor;
+	u32 blocksScanned = 0;
+	u64 startTime = iphone_microtime();
 
 	LOG("ftl: restore searching for latest FTL context...\n");
 
@@ -454,6 +774,44 @@ static bool FTL_Restore(void)
 	pstFTLCxt->pawReadCounterTable = pawReadCounterTable;
 	pstFTLCxt->wPageOffsets = wPageOffsets;
 
+	if(incremental)
+	{
+		// Take what we need from the checkpoint before its logs and free blocks are cleared.
+		u32 offsetsSize = NANDGeometry->pagesPerSuBlk * 17 * sizeof(u16);
+
+		toScan = (u8*) kmalloc(NANDGeometry->userSuBlksTotal + 23, GFP_KERNEL);
+		lbnScanned = (u8*) kmalloc(NANDGeometry->userSuBlksTotal, GFP_KERNEL);
+		ckptLog = (FTLCxtLog*) kmalloc(sizeof(FTLCxtLog) * 17, GFP_KERNEL);
+		ckptOffsets = (u16*) kmalloc(offsetsSize, GFP_KERNEL);
+		if(!toScan || !lbnScanned || !ckptLog || !ckptOffsets)
+		{
+			LOG("ftl: restore out of memory\n");
+			goto error_release;
+		}
+
+		if(pstFTLCxt->wNumOfFreeVb > 20 || pstFTLCxt->nextFreeIdx > 19 || !ftl_open_read_map_tables())
+		{
+			LOG("ftl: restore could not read back the checkpoint\n");
+			goto error_release;
+		}
+
+		memset(toScan, 0, NANDGeometry->userSuBlksTotal + 23);
+		if(!ftl_restore_read_journal(pstFTLCxt->usnDec, toScan))
+		{
+			LOG("ftl: restore found no journal since the checkpoint\n");
+			goto error_release;
+		}
+
+		for(i = 0; i < pstFTLCxt->wNumOfFreeVb; ++i)
+			ftl_restore_mark(toScan, awFreeVb[(pstFTLCxt->nextFreeIdx + i) % 20], FTL_RESTORE_SCAN);
+
+		for(i = 0; i < 17; ++i)
+			ftl_restore_mark(toScan, pLog[i].wVbn, FTL_RESTORE_SCAN);
+
+		memcpy(ckptLog, pLog, sizeof(FTLCxtLog) * 17);
+		memcpy(ckptOffsets, wPageOffsets, offsetsSize);
+	}
+
 	// Clean out now almost certainly invalid values
 
 	memset(&FTLCountsTable, 0, 0x58);
@@ -490,48 +848,104 @@ static bool FTL_Restore(void)
 	pstFTLCxt->FTLCtrlPage = (block * NANDGeometry->pagesPerSuBlk) + NANDGeometry->pagesPerSuBlk - 1;
 
 	numLogs = 0;
+	for(i = 0; i < 18; ++i)
+		ckptIndex[i] = -1;
 
 	// Step one, create an overview of which virtual blocks have pages belonging to which logical blocks.
 	// Mark any blocks discovered to be empty. Also to save time in the next step, if a block is proven
 	// to be non-sequential, mark it as such.
 
-	for(block = 0; block < (NANDGeometry->userSuBlksTotal + 23); ++block)
+	if(incremental)
 	{
-		if((block % 1000) == 0)
+		// Only blocks that came out of the pool can have been written since the checkpoint, and
+		// they were either in its pool or released after it. Everything else keeps its job from
+		// the checkpoint.
+
+		LOG("ftl: restore scanning the blocks changed since the checkpoint...\n");
+
+		for(block = 0; block < (NANDGeometry->userSuBlksTotal + 23); ++block)
 		{
-			LOG("ftl: restore scanning virtual blocks %d - %d\n", block,
-					block + ((((NANDGeometry->userSuBlksTotal + 23) - block) > 1000) ? 999 : ((NANDGeometry->userSuBlksTotal + 23) - block - 1)));
+			blockMap[block] = 0xFFFF;
+			isEmpty[block] = 0;
+			nonSequential[block] = 0;
+
+			if(toScan[block] & FTL_RESTORE_SCAN)
+			{
+				ftl_restore_scan_block(block, blockMap, isEmpty, nonSequential, true);
+				++blocksScanned;
+			}
 		}
 
-		blockMap[block] = 0xFFFF;
-		isEmpty[block] = 1;
-		nonSequential[block] = 0;
+		memset(lbnScanned, 0, NANDGeometry->userSuBlksTotal);
+		for(block = 0; block < (NANDGeometry->userSuBlksTotal + 23); ++block)
+		{
+			if(blockMap[block] < NANDGeometry->userSuBlksTotal && lbnScanned[blockMap[block]] < 0xFF)
+				++lbnScanned[blockMap[block]];
+		}
 
-		for(page = 0; page < NANDGeometry->pagesPerSuBlk; ++page)
+		for(block = 0; block < NANDGeometry->userSuBlksTotal; ++block)
 		{
-			int ret = VFL_Read(block * NANDGeometry->pagesPerSuBlk + page, PageBuffer, (u8*) FTLSpareBuffer, true);
+			if(pawMapTable[block] >= (NANDGeometry->userSuBlksTotal + 23))
+			{
+				LOG("ftl: restore found a bad map entry in the checkpoint\n");
+				goto error_release;
+			}
 
-			if(ret == ERROR_EMPTYBLOCK)
-				continue;
+			if(!(toScan[pawMapTable[block]] & FTL_RESTORE_SCAN))
+				blockMap[pawMapTable[block]] = block;
+		}
 
-			isEmpty[block] = 0;
+		// A log that is still attached to the same map block, and whose logical block
+		// didn't turn up anywhere else, only needs the pages written after the checkpoint
+		// read in step four. Keep it out of step two.
+		for(i = 0; i < 17; ++i)
+		{
+			u16 lbn = ckptLog[i].wLbn;
+			u16 vbn = ckptLog[i].wVbn;
 
-			if(ret != 0)
+			if(vbn >= (NANDGeometry->userSuBlksTotal + 23) || lbn >= NANDGeometry->userSuBlksTotal || ckptLog[i].pagesUsed == 0)
 				continue;
 
-			if(FTLSpareBuffer->type1 >= 0x43 && FTLSpareBuffer->type1 <= 0x4F)
-				break;
+			if((toScan[vbn] & FTL_RESTORE_RELEASED) || (toScan[pawMapTable[lbn]] & FTL_RESTORE_RELEASED))
+				continue;
 
-			// wtf is this? well, we'll just count it as empty
-			if(FTLSpareBuffer->type1 != 0x40 && FTLSpareBuffer->type1 != 0x41)
+			if(blockMap[vbn] != lbn || lbnScanned[lbn] != 1)
 				continue;
 
-			if((FTLSpareBuffer->user.logicalPageNumber % NANDGeometry->pagesPerSuBlk) != page)
-				nonSequential[block] = 1;
+			pLog[numLogs].wLbn = lbn;
+			pLog[numLogs].wVbn = vbn;
+			ckptIndex[numLogs] = i;
+			++numLogs;
 
-			blockMap[block] = FTLSpareBuffer->user.logicalPageNumber / NANDGeometry->pagesPerSuBlk;
-			break;
+			blockMap[vbn] = 0xFFFE;
 		}
+	} else
+	{
+		for(block = 0; block < (NANDGeometry->userSuBlksTotal + 23); ++block)
+		{
+			if((block % 1000) == 0)
+			{
+				LOG("ftl: restore scanning virtual blocks %d - %d\n", block,
+						block + ((((NANDGeometry->userSuBlksTotal + 23) - block) > 1000) ? 999 : ((NANDGeometry->userSuBlksTotal + 23) - block - 1)));
+			}
+
+			ftl_restore_scan_block(block, blockMap, isEmpty, nonSequential, false);
+		}
+
+		blocksScanned = NANDGeometry->userSuBlksTotal + 23;
+	}
+
+	// Chain the candidates for each logical block, in block order
+	for(block = 0; block < NANDGeometry->userSuBlksTotal; ++block)
+		firstCandidate[block] = 0xFFFF;
+
+	for(block = (NANDGeometry->userSuBlksTotal + 23) - 1; block >= 0; --block)
+	{
+		if(blockMap[block] >= NANDGeometry->userSuBlksTotal)
+			continue;
+
+		nextCandidate[block] = firstCandidate[blockMap[block]];
+		firstCandidate[blockMap[block]] = block;
 	}
 
 	// Step two, make sure each logical block has a mapping to virtual block. If more than one virtual
@@ -542,6 +956,7 @@ static bool FTL_Restore(void)
 
 	LOG("ftl: restore creating mapping table...\n");
 
+	emptyCursor = 0;
 	for(block = 0; block < NANDGeometry->userSuBlksTotal; ++block)
 	{
 		u16 mapCandidate = 0xFFFF;
@@ -556,7 +971,7 @@ static bool FTL_Restore(void)
 					block + (((NANDGeometry->userSuBlksTotal - block) > 1000) ? 999 : (NANDGeometry->userSuBlksTotal - block - 1)));
 		}
 
-		for(candidate = 0; candidate < (NANDGeometry->userSuBlksTotal + 23); ++candidate)
+		for(candidate = firstCandidate[block]; candidate != 0xFFFF; candidate = nextCandidate[candidate])
 		{
 			u32 candidateUSN;
 			bool origMCSeq;
@@ -564,9 +979,6 @@ static bool FTL_Restore(void)
 			u16 newLCandidate;
 			u32 newLCandidateUSN;
 
-			if(blockMap[candidate] != block)
-				continue;
-
 			if(nonSequential[candidate])
 			{
 				if(logCandidate == 0xFFFF)
@@ -655,12 +1067,13 @@ static bool FTL_Restore(void)
 
 		if(mapCandidate == 0xFFFF)
 		{
-			for(candidate = 0; candidate < (NANDGeometry->userSuBlksTotal + 23); ++candidate)
+			// empty blocks are only ever taken, so don't look at the taken ones again
+			for(; emptyCursor < (NANDGeometry->userSuBlksTotal + 23); ++emptyCursor)
 			{
-				if(isEmpty[candidate])
+				if(isEmpty[emptyCursor])
 				{
-					mapCandidate = candidate;
-					isEmpty[candidate] = 0;
+					mapCandidate = emptyCursor;
+					isEmpty[emptyCursor] = 0;
 					break;
 				}
 			}
@@ -695,7 +1108,7 @@ static bool FTL_Restore(void)
 
 	for(block = 0; block < (NANDGeometry->userSuBlksTotal + 23); ++block)
 	{
-		if(blockMap[block] == 0)
+		if(blockMap[block] == 0 || blockMap[block] == 0xFFFE)
 			continue;
 
 		for(i = 0; i < 3; ++i)
@@ -738,112 +1151,152 @@ static bool FTL_Restore(void)
 
 	for(i = 0; i < numLogs; ++i)
 	{
-		// Since we always store the highest USN block as the map in step two
-		// to ensure we always end up with the two highest USN blocks, we
-		// could have the ordering swapped. Figure out the correct one.
+		if(ckptIndex[i] >= 0)
+		{
+			// Carry on from where the checkpoint left this log. Anything newer was
+			// appended after pagesUsed.
+			FTLCxtLog* ckpt = &ckptLog[ckptIndex[i]];
 
-		u16 blockA = pawMapTable[pLog[i].wLbn];
-		u16 blockB = pLog[i].wVbn;
-		bool aSequential = true;
-		bool bSequential = true;
-		u32 aHighestUSN = 0;
-		u32 bHighestUSN = 0;
-		u32* mapBlockUSN;
-		u32* mapBlockLPN;
-		u32* logBlockUSN;
-		u32* logBlockLPN;
+			memcpy(pLog[i].wPageOffsets, ckptOffsets + (ckptIndex[i] * NANDGeometry->pagesPerSuBlk),
+					NANDGeometry->pagesPerSuBlk * sizeof(u16));
+			pLog[i].pagesUsed = ckpt->pagesUsed;
+			pLog[i].pagesCurrent = ckpt->pagesCurrent;
+			pLog[i].isSequential = ckpt->isSequential;
 
-		// Populate information about these two blocks
+			for(page = ckpt->pagesUsed; page < NANDGeometry->pagesPerSuBlk; ++page)
+			{
+				int logOffset;
+				int ret = VFL_Read((pLog[i].wVbn * NANDGeometry->pagesPerSuBlk) + page, PageBuffer, (u8*) FTLSpareBuffer, true);
 
-		for(page = NANDGeometry->pagesPerSuBlk - 1; page >= 0; --page)
-		{
-			int ret = VFL_Read((blockA * NANDGeometry->pagesPerSuBlk) + page, PageBuffer, (u8*) FTLSpareBuffer, true);
-			if(ret == ERROR_EMPTYBLOCK)
-				usnA[page] = 0;
-			else
-		{
-				usnA[page] = FTLSpareBuffer->user.usn;
-				lpnA[page] = FTLSpareBuffer->user.logicalPageNumber;
+				if(ret == ERROR_EMPTYBLOCK)
+					break;
+
+				// a failed write still uses up its page
+				pLog[i].pagesUsed = page + 1;
+				if(ret != 0)
+					continue;
 
-				if(usnA[page] > aHighestUSN)
-					aHighestUSN = usnA[page];
+				if(FTLSpareBuffer->user.usn > highest_usn)
+					highest_usn = FTLSpareBuffer->user.usn;
 
-				if((FTLSpareBuffer->user.logicalPageNumber % NANDGeometry->pagesPerSuBlk) != page)
-					aSequential = false;
-			}
-		}
+				logOffset = FTLSpareBuffer->user.logicalPageNumber % NANDGeometry->pagesPerSuBlk;
+				if(pLog[i].wPageOffsets[logOffset] == 0xFFFF)
+					++pLog[i].pagesCurrent;
 
-		for(page = NANDGeometry->pagesPerSuBlk - 1; page >= 0; --page)
+				pLog[i].wPageOffsets[logOffset] = page;
+				if(logOffset != page)
+					pLog[i].isSequential = 0;
+			}
+		} else
+		{
+			// Since we always store the highest USN block as the map in step two
+			// to ensure we always end up with the two highest USN blocks, we
+			// could have the ordering swapped. Figure out the correct one.
+
+			u16 blockA = pawMapTable[pLog[i].wLbn];
+			u16 blockB = pLog[i].wVbn;
+			bool aSequential = true;
+			bool bSequential = true;
+			u32 aHighestUSN = 0;
+			u32 bHighestUSN = 0;
+			u32* mapBlockUSN;
+			u32* mapBlockLPN;
+			u32* logBlockUSN;
+			u32* logBlockLPN;
+
+			// Populate information about these two blocks
+
+			for(page = NANDGeometry->pagesPerSuBlk - 1; page >= 0; --page)
 			{
-			int ret = VFL_Read((blockB * NANDGeometry->pagesPerSuBlk) + page, PageBuffer, (u8*) FTLSpareBuffer, true);
-			if(ret == ERROR_EMPTYBLOCK)
-				usnB[page] = 0;
-			else
+				int ret = VFL_Read((blockA * NANDGeometry->pagesPerSuBlk) + page, PageBuffer, (u8*) FTLSpareBuffer, true);
+				if(ret == ERROR_EMPTYBLOCK)
+					usnA[page] = 0;
+				else
 			{
-				usnB[page] = FTLSpareBuffer->user.usn;
-				lpnB[page] = FTLSpareBuffer->user.logicalPageNumber;
+					usnA[page] = FTLSpareBuffer->user.usn;
+					lpnA[page] = FTLSpareBuffer->user.logicalPageNumber;
 
-				if(usnB[page] > bHighestUSN)
-					bHighestUSN = usnB[page];
+					if(usnA[page] > aHighestUSN)
+						aHighestUSN = usnA[page];
 
-				if((FTLSpareBuffer->user.logicalPageNumber % NANDGeometry->pagesPerSuBlk) != page)
-					bSequential = false;
+					if((FTLSpareBuffer->user.logicalPageNumber % NANDGeometry->pagesPerSuBlk) != page)
+						aSequential = false;
+				}
 			}
-		}
 
-		// Determine which is which
-		if((aSequential && bSequential && bHighestUSN > aHighestUSN) || aSequential)
-		{
-			pLog[i].wVbn = blockB;
-			pawMapTable[pLog[i].wLbn] = blockA;
-			mapBlockUSN = usnA;
-			logBlockUSN = usnB;
-			mapBlockLPN = lpnA;
-			logBlockLPN = lpnB;
-			if(bHighestUSN > highest_usn)
-				highest_usn = bHighestUSN;
-		} else if((aSequential && bSequential && bHighestUSN <= aHighestUSN) || bSequential)
-		{
-			pLog[i].wVbn = blockA;
-			pawMapTable[pLog[i].wLbn] = blockB;
-			mapBlockUSN = usnB;
-			logBlockUSN = usnA;
-			mapBlockLPN = lpnB;
-			logBlockLPN = lpnA;
-			if(aHighestUSN > highest_usn)
-				highest_usn = aHighestUSN;
-		} else
-			{
-			LOG("ftl: restore failed, we have two non-sequential blocks!\n");
-				goto error_release;
+			for(page = NANDGeometry->pagesPerSuBlk - 1; page >= 0; --page)
+				{
+				int ret = VFL_Read((blockB * NANDGeometry->pagesPerSuBlk) + page, PageBuffer, (u8*) FTLSpareBuffer, true);
+				if(ret == ERROR_EMPTYBLOCK)
+					usnB[page] = 0;
+				else
+				{
+					usnB[page] = FTLSpareBuffer->user.usn;
+					lpnB[page] = FTLSpareBuffer->user.logicalPageNumber;
+
+					if(usnB[page] > bHighestUSN)
+						bHighestUSN = usnB[page];
+
+					if((FTLSpareBuffer->user.logicalPageNumber % NANDGeometry->pagesPerSuBlk) != page)
+						bSequential = false;
+				}
 			}
 
-		// okay, now we will populate the log block with the correct information.
+			// Determine which is which
+			if((aSequential && bSequential && bHighestUSN > aHighestUSN) || aSequential)
+			{
+				pLog[i].wVbn = blockB;
+				pawMapTable[pLog[i].wLbn] = blockA;
+				mapBlockUSN = usnA;
+				logBlockUSN = usnB;
+				mapBlockLPN = lpnA;
+				logBlockLPN = lpnB;
+				if(bHighestUSN > highest_usn)
+					highest_usn = bHighestUSN;
+			} else if((aSequential && bSequential && bHighestUSN <= aHighestUSN) || bSequential)
+			{
+				pLog[i].wVbn = blockA;
+				pawMapTable[pLog[i].wLbn] = blockB;
+				mapBlockUSN = usnB;
+				logBlockUSN = usnA;
+				mapBlockLPN = lpnB;
+				logBlockLPN = lpnA;
+				if(aHighestUSN > highest_usn)
+					highest_usn = aHighestUSN;
+			} else
+				{
+				LOG("ftl: restore failed, we have two non-sequential blocks!\n");
+					goto error_release;
+				}
 
-		for(page = NANDGeometry->pagesPerSuBlk - 1; page >= 0; --page)
-		{
-			int logOffset;
+			// okay, now we will populate the log block with the correct information.
 
-			// check if empty
-			if(logBlockUSN[page] == 0)
-				continue;
+			for(page = NANDGeometry->pagesPerSuBlk - 1; page >= 0; --page)
+			{
+				int logOffset;
 
-			// we set it to after the first non-empty page
-			if(pLog[i].pagesUsed == 0)
-				pLog[i].pagesUsed = page + 1;
+				// check if empty
+				if(logBlockUSN[page] == 0)
+					continue;
 
-			logOffset = logBlockLPN[page] % NANDGeometry->pagesPerSuBlk;
+				// we set it to after the first non-empty page
+				if(pLog[i].pagesUsed == 0)
+					pLog[i].pagesUsed = page + 1;
 
-			// is there a newer copy of this page already in this log block?
-			if(pLog[i].wPageOffsets[logOffset] != 0xFFFF)
-				continue;
+				logOffset = logBlockLPN[page] % NANDGeometry->pagesPerSuBlk;
 
-			// if not, we'll use it since it's the most recent.
-			pLog[i].wPageOffsets[logOffset] = page;
-			++pLog[i].pagesCurrent;
+				// is there a newer copy of this page already in this log block?
+				if(pLog[i].wPageOffsets[logOffset] != 0xFFFF)
+					continue;
+
+				// if not, we'll use it since it's the most recent.
+				pLog[i].wPageOffsets[logOffset] = page;
+				++pLog[i].pagesCurrent;
+
+				if(logOffset != page)
+					pLog[i].isSequential = 0;
+			}
 
-			if(logOffset != page)
-				pLog[i].isSequential = 0;
 		}
 
 		if(pLog[i].pagesUsed != pLog[i].pagesCurrent)
@@ -853,14 +1306,22 @@ static bool FTL_Restore(void)
 				i, pLog[i].wLbn, pLog[i].wVbn, pLog[i].pagesUsed, pLog[i].pagesCurrent, pLog[i].isSequential);
 	}
 
-	pstFTLCxt->nextblockusn = highest_usn + 1;
+	// The context's own value is a lower bound, and the only one for logs we didn't read.
+	if((highest_usn + 1) > pstFTLCxt->nextblockusn)
+		pstFTLCxt->nextblockusn = highest_usn + 1;
 
 	for(i = 0; i < numLogs; ++i)
 	{
 		pLog[i].usn = pstFTLCxt->nextblockusn - 1;
 	}
 
-	LOG("ftl: restore successful!\n");
+	FTLRestoreStats.restored = true;
+	FTLRestoreStats.incremental = incremental;
+	FTLRestoreStats.blocksScanned = blocksScanned;
+	FTLRestoreStats.time = iphone_microtime() - startTime;
+
+	LOG("ftl: restore successful! (%s, %u blocks scanned in %llu us)\n",
+			incremental ? "incremental" : "full", blocksScanned, FTLRestoreStats.time);
 
 	kfree(usnA);
 	kfree(usnB);
@@ -869,6 +1330,12 @@ static bool FTL_Restore(void)
 	kfree(blockMap);
 	kfree(nonSequential);
 	kfree(isEmpty);
+	kfree(firstCandidate);
+	kfree(nextCandidate);
+	kfree(toScan);
+	kfree(lbnScanned);
+	kfree(ckptLog);
+	kfree(ckptOffsets);
 
 	return true;
 
@@ -880,6 +1347,12 @@ error_release:
 	kfree(blockMap);
 	kfree(nonSequential);
 	kfree(isEmpty);
+	kfree(firstCandidate);
+	kfree(nextCandidate);
+	kfree(toScan);
+	kfree(lbnScanned);
+	kfree(ckptLog);
+	kfree(ckptOffsets);
 
 	return false;
 }
@@ -922,6 +1395,49 @@ static bool sum_data(u8* pageBuffer) {
 	return true;
 }
 
+// Reads back the map and log page offset tables of the context in pstFTLCxt.
+static bool ftl_open_read_map_tables(void)
+{
+	int i;
+	int pagesToRead;
+
+	pagesToRead = (NANDGeometry->userSuBlksTotal * sizeof(u16)) / NANDGeometry->bytesPerPage;
+	if(((NANDGeometry->userSuBlksTotal * sizeof(u16)) % NANDGeometry->bytesPerPage) != 0)
+		pagesToRead++;
+
+	for(i = 0; i < pagesToRead; i++) {
+		int toRead;
+		if(VFL_Read(pstFTLCxt->pages_for_pawMapTable[i], PageBuffer, (u8*) FTLSpareBuffer, true) != 0)
+			return false;
+
+		toRead = NANDGeometry->bytesPerPage;
+		if(toRead > ((NANDGeometry->userSuBlksTotal * sizeof(u16)) - (i * NANDGeometry->bytesPerPage))) {
+			toRead = (NANDGeometry->userSuBlksTotal * sizeof(u16)) - (i * NANDGeometry->bytesPerPage);
+		}
+
+		memcpy(((u8*)pstFTLCxt->pawMapTable) + (i * NANDGeometry->bytesPerPage), PageBuffer, toRead);
+	}
+
+	pagesToRead = (NANDGeometry->pagesPerSuBlk * (17 * sizeof(u16))) / NANDGeometry->bytesPerPage;
+	if(((NANDGeometry->pagesPerSuBlk * (17 * sizeof(u16))) % NANDGeometry->bytesPerPage) != 0)
+		pagesToRead++;
+
+	for(i = 0; i < pagesToRead; i++) {
+		int toRead;
+		if(VFL_Read(pstFTLCxt->pages_for_wPageOffsets[i], PageBuffer, (u8*) FTLSpareBuffer, true) != 0)
+			return false;
+
+		toRead = NANDGeometry->bytesPerPage;
+		if(toRead > ((NANDGeometry->pagesPerSuBlk * (17 * sizeof(u16))) - (i * NANDGeometry->bytesPerPage))) {
+			toRead = (NANDGeometry->pagesPerSuBlk * (17 * sizeof(u16))) - (i * NANDGeometry->bytesPerPage);
+		}
+
+		memcpy(((u8*)pstFTLCxt->wPageOffsets) + (i * NANDGeometry->bytesPerPage), PageBuffer, toRead);
+	}
+
+	return true;
+}
+
 static bool ftl_open_read_counter_tables(void)
 {
 	int i;
@@ -1098,39 +1614,8 @@ static int FTL_Open(int* pagesAvailable, int* bytesPerPage) {
 		pstFTLCxt->pLog[i].wPageOffsets = pstFTLCxt->wPageOffsets + (i * NANDGeometry->pagesPerSuBlk);
 	}
 
-	pagesToRead = (NANDGeometry->userSuBlksTotal * sizeof(u16)) / NANDGeometry->bytesPerPage;
-	if(((NANDGeometry->userSuBlksTotal * sizeof(u16)) % NANDGeometry->bytesPerPage) != 0)
-		pagesToRead++;
-
-	for(i = 0; i < pagesToRead; i++) {
-		int toRead;
-		if(VFL_Read(pstFTLCxt->pages_for_pawMapTable[i], PageBuffer, (u8*) FTLSpareBuffer, true) != 0)
-			goto FTL_Open_Error_Release;
-
-		toRead = NANDGeometry->bytesPerPage;
-		if(toRead > ((NANDGeometry->userSuBlksTotal * sizeof(u16)) - (i * NANDGeometry->bytesPerPage))) {
-			toRead = (NANDGeometry->userSuBlksTotal * sizeof(u16)) - (i * NANDGeometry->bytesPerPage);
-		}
-
-		memcpy(((u8*)pstFTLCxt->pawMapTable) + (i * NANDGeometry->bytesPerPage), PageBuffer, toRead);
-	}
-
-	pagesToRead = (NANDGeometry->pagesPerSuBlk * (17 * sizeof(u16))) / NANDGeometry->bytesPerPage;
-	if(((NANDGeometry->pagesPerSuBlk * (17 * sizeof(u16))) % NANDGeometry->bytesPerPage) != 0)
-		pagesToRead++;
-
-	for(i = 0; i < pagesToRead; i++) {
-		int toRead;
-		if(VFL_Read(pstFTLCxt->pages_for_wPageOffsets[i], PageBuffer, (u8*) FTLSpareBuffer, true) != 0)
-			goto FTL_Open_Error_Release;
-
-		toRead = NANDGeometry->bytesPerPage;
-		if(toRead > ((NANDGeometry->pagesPerSuBlk * (17 * sizeof(u16))) - (i * NANDGeometry->bytesPerPage))) {
-			toRead = (NANDGeometry->pagesPerSuBlk * (17 * sizeof(u16))) - (i * NANDGeometry->bytesPerPage);
-		}
-
-		memcpy(((u8*)pstFTLCxt->wPageOffsets) + (i * NANDGeometry->bytesPerPage), PageBuffer, toRead);
-	}
+	if(!ftl_open_read_map_tables())
+		goto FTL_Open_Error_Release;
 
 	pagesToRead = ((NANDGeometry->userSuBlksTotal + 23) * sizeof(u16)) / NANDGeometry->bytesPerPage;
 	if((((NANDGeometry->userSuBlksTotal + 23) * sizeof(u16)) % NANDGeometry->bytesPerPage) != 0)
@@ -1151,6 +1636,7 @@ static int FTL_Open(int* pagesAvailable, int* bytesPerPage) {
 
 	if(ftl_open_read_counter_tables()) {
 		CleanFreeVb = true;
+		ftl_journal_reset();
 		LOG("ftl: FTL successfully opened!\n");
 		*pagesAvailable = NANDGeometry->userPagesTotal;
 		*bytesPerPage = NANDGeometry->bytesPerPage;
@@ -1162,7 +1648,16 @@ FTL_Open_Error_Release:
 FTL_Open_Error:
 	LOG("ftl: FTL_Open cannot load FTLCxt!\n");
 	CleanFreeVb = false;
-	if(FTL_Restore() != false) {
+	if(FTL_Restore(true) || FTL_Restore(false)) {
+		// Start a journal from the restored state. If that doesn't work, make
+		// sure another restore can't trust the old one.
+		if(!ftl_checkpoint())
+		{
+			LOG("ftl: FTL_Open could not commit the restored context!\n");
+			FTLJournalOverflow = true;
+			FTLJournalOverflowFlushed = false;
+		}
+
 		*pagesAvailable = NANDGeometry->userPagesTotal;
 		*bytesPerPage = NANDGeometry->bytesPerPage;
 		return 0;
@@ -1171,29 +1666,135 @@ FTL_Open_Error:
 	}
 }
 
-u32 FTL_map_page(FTLCxtLog* pLog, int lbn, int offset) {
-	if(pLog && pLog->wPageOffsets[offset] != 0xFFFF) {
-		if(((pLog->wVbn * NANDGeometry->pagesPerSuBlk) + pLog->wPageOffsets[offset] + 1) != 0)
+u32 FTL_map_page(FTLCxtLog* pLog, int lbn, int offset) {
+	if(pLog && pLog->wPageOffsets[offset] != 0xFFFF) {
+		if(((pLog->wVbn * NANDGeometry->pagesPerSuBlk) + pLog->wPageOffsets[offset] + 1) != 0)
+		{
+			return (pLog->wVbn * NANDGeometry->pagesPerSuBlk) + pLog->wPageOffsets[offset];
+		}
+	}
+
+	return (pstFTLCxt->pawMapTable[lbn] * NANDGeometry->pagesPerSuBlk) + offset;
+}
+
+static inline FTLCxtLog* ftl_get_log(u16 lbn)
+{
+	int i;
+	for(i = 0; i < 17; i++) {
+		if(pstFTLCxt->pLog[i].wVbn == 0xFFFF)
+			continue;
+
+		if(pstFTLCxt->pLog[i].wLbn == lbn) {
+			return &pstFTLCxt->pLog[i];
+		}
+	}
+	return NULL;
+}
+
+static inline void ftl_extent_invalidate(u16 lbn)
+{
+	FTLExtentCacheEntry* entry = &FTLExtentCache[lbn % FTL_EXTENT_CACHE_SIZE];
+	if(entry->lbn == lbn)
+		entry->lbn = 0xFFFF;
+}
+
+// Returns the runs backing lbn, or NULL if it's too scattered to be worth caching.
+static FTLExtentCacheEntry* ftl_extent_lookup(u16 lbn)
+{
+	FTLExtentCacheEntry* entry = &FTLExtentCache[lbn % FTL_EXTENT_CACHE_SIZE];
+	FTLCxtLog* pLog;
+	int page;
+
+	if(entry->lbn == lbn)
+	{
+		++FTLExtentStats.hits;
+		return entry;
+	}
+
+	++FTLExtentStats.misses;
+
+	entry->lbn = 0xFFFF;
+	entry->numExtents = 0;
+
+	pLog = ftl_get_log(lbn);
+	if(pLog == NULL)
+	{
+		entry->extents[0].offset = 0;
+		entry->extents[0].count = NANDGeometry->pagesPerSuBlk;
+		entry->extents[0].vpn = pstFTLCxt->pawMapTable[lbn] * NANDGeometry->pagesPerSuBlk;
+		entry->numExtents = 1;
+		entry->lbn = lbn;
+		return entry;
+	}
+
+	for(page = 0; page < NANDGeometry->pagesPerSuBlk; ++page)
+	{
+		u32 vpn = FTL_map_page(pLog, lbn, page);
+
+		if(entry->numExtents > 0)
 		{
-			return (pLog->wVbn * NANDGeometry->pagesPerSuBlk) + pLog->wPageOffsets[offset];
+			FTLExtent* last = &entry->extents[entry->numExtents - 1];
+			if((last->vpn + last->count) == vpn)
+			{
+				++last->count;
+				continue;
+			}
 		}
+
+		if(entry->numExtents == FTL_EXTENT_MAX)
+		{
+			++FTLExtentStats.fragmented;
+			return NULL;
+		}
+
+		entry->extents[entry->numExtents].offset = page;
+		entry->extents[entry->numExtents].count = 1;
+		entry->extents[entry->numExtents].vpn = vpn;
+		++entry->numExtents;
 	}
 
-	return (pstFTLCxt->pawMapTable[lbn] * NANDGeometry->pagesPerSuBlk) + offset;
+	entry->lbn = lbn;
+	return entry;
 }
 
-static inline FTLCxtLog* ftl_get_log(u16 lbn)
+// Reads count pages from offset within a logical block described by entry. Read
+// counters are charged once per run rather than once per page.
+static bool ftl_read_extents(FTLExtentCacheEntry* entry, int offset, int count, u8* pBuf)
 {
 	int i;
-	for(i = 0; i < 17; i++) {
-		if(pstFTLCxt->pLog[i].wVbn == 0xFFFF)
+	int pages = 0;
+	bool single = false;
+
+	for(i = 0; i < entry->numExtents && pages < count; ++i)
+	{
+		FTLExtent* extent = &entry->extents[i];
+		int start;
+		int end;
+
+		if((extent->offset + extent->count) <= offset)
 			continue;
 
-		if(pstFTLCxt->pLog[i].wLbn == lbn) {
-			return &pstFTLCxt->pLog[i];
-		}
+		start = offset + pages;
+		end = extent->offset + extent->count;
+		if(end > offset + count)
+			end = offset + count;
+
+		if(pages == 0 && end == (offset + count))
+			single = true;
+
+		pstFTLCxt->pawReadCounterTable[extent->vpn / NANDGeometry->pagesPerSuBlk] += end - start;
+
+		for(; start < end; ++start)
+			ScatteredVirtualPageNumberBuffer[pages++] = extent->vpn + (start - extent->offset);
 	}
-	return NULL;
+
+	if(single)
+	{
+		u32 vpn = ScatteredVirtualPageNumberBuffer[0];
+		return VFL_ReadMultiplePagesInVb(vpn / NANDGeometry->pagesPerSuBlk, vpn % NANDGeometry->pagesPerSuBlk, count, pBuf, FTLSpareBuffer);
+	}
+
+	return VFL_ReadScatteredPagesInVb(ScatteredVirtualPageNumberBuffer, count, pBuf, FTLSpareBuffer);
 }
 
 int FTL_Read_private(u32 logicalPageNumber, int totalPagesToRead, u8* pBuf)
@@ -1207,6 +1808,7 @@ int FTL_Read_private(u32 logicalPageNumber, int totalPagesToRead, u8* pBuf)
 	int pagesToRead;
 	int currentLogicalPageNumber;
 	FTLCxtLog* pLog;
+	FTLExtentCacheEntry* extents;
 
 	FTLCountsTable.totalPagesRead += totalPagesToRead;
 	++FTLCountsTable.totalReads;
@@ -1241,7 +1843,10 @@ int FTL_Read_private(u32 logicalPageNumber, int totalPagesToRead, u8* pBuf)
 		if(pagesToRead >= (totalPagesToRead - pagesRead))
 			pagesToRead = totalPagesToRead - pagesRead;
 
-		if(pLog != NULL) {
+		extents = ftl_extent_lookup(lbn);
+		if(extents != NULL) {
+			readSuccessful = ftl_read_extents(extents, offset, pagesToRead, pBuf + (pagesRead * NANDGeometry->bytesPerPage));
+		} else if(pLog != NULL) {
 			// we have a scatter entry for this logical block, so we use it
 			for(i = 0; i < pagesToRead; i++) {
 				ScatteredVirtualPageNumberBuffer[i] = FTL_map_page(pLog, lbn, offset + i);
@@ -1256,8 +1861,7 @@ int FTL_Read_private(u32 logicalPageNumber, int totalPagesToRead, u8* pBuf)
 
 			readSuccessful = VFL_ReadScatteredPagesInVb(ScatteredVirtualPageNumberBuffer, pagesToRead, pBuf + (pagesRead * NANDGeometry->bytesPerPage), FTLSpareBuffer);
 		} else {
-			// VFL_ReadMultiplePagesInVb has a different calling convention and implementation than the equivalent iBoot function.
-			// Ours is a bit less optimized, and just calls VFL_Read for each page.
+			// VFL_ReadMultiplePagesInVb has a different calling convention than the equivalent iBoot function.
 			pstFTLCxt->pawReadCounterTable[pstFTLCxt->pawMapTable[lbn]] += pagesToRead;
 			readSuccessful = VFL_ReadMultiplePagesInVb(pstFTLCxt->pawMapTable[lbn], offset, pagesToRead, pBuf + (pagesRead * NANDGeometry->bytesPerPage), FTLSpareBuffer);
 		}
@@ -1356,6 +1960,7 @@ int FTL_Read(u32 logicalPageNumber, int totalPagesToRead, u8* pBuf)
 {
 	int ret;
 	mutex_lock(&ftl_mutex);
+	FTLLastIO = jiffies;
 	ret = FTL_Read_private(logicalPageNumber, totalPagesToRead, pBuf);
 	mutex_unlock(&ftl_mutex);
 	return ret;
@@ -1611,24 +2216,11 @@ void check_for_dirty_free_vb(u8* pageBuffer, SpareData* spareData)
 	CleanFreeVb = true;
 }
 
-static bool ftl_mark_unclean(void)
+// Writes an unclean mark carrying the current journal.
+static bool ftl_write_journal(u8* pageBuffer, SpareData* spareBuffer)
 {
 	int i;
-	u8* pageBuffer;
-	u8* spareBuffer;
-
-	if(!pstFTLCxt->clean)
-		return true;
-
-	pageBuffer = (u8*) kmalloc(NANDGeometry->bytesPerPage, GFP_KERNEL | GFP_DMA);
-	spareBuffer = (u8*) kmalloc(NANDGeometry->bytesPerSpare, GFP_KERNEL | GFP_DMA);
-	if(!pageBuffer || !spareBuffer)
-	{
-		LOG("ftl: ftl_mark_unclean: out of memory\n");
-		return false;
-	}
-
-	check_for_dirty_free_vb(pageBuffer, (SpareData*) spareBuffer);
+	FTLJournal* journal = (FTLJournal*) pageBuffer;
 
 	for(i = 0; i < 3; ++i)
 	{
@@ -1636,18 +2228,31 @@ static bool ftl_mark_unclean(void)
 
 		if(!ftl_next_ctrl_page())
 		{
-			LOG("ftl: ftl_mark_unclean: could not get a ctrl page\n");
-			goto error_release;
+			LOG("ftl: ftl_write_journal: could not get a ctrl page\n");
+			return false;
 		}
 
+		// filled in after ftl_next_ctrl_page, which may have released a block
 		memset(pageBuffer, 0xFF, NANDGeometry->bytesPerPage);
-		((SpareData*)spareBuffer)->type1 = 0x4F;
+		journal->magic = FTL_JOURNAL_MAGIC;
+		journal->cxtUsnDec = FTLJournalCxtUsnDec;
+		if(FTLJournalOverflow)
+		{
+			journal->count = FTL_JOURNAL_OVERFLOW;
+		} else
+		{
+			journal->count = FTLJournalCount;
+			memcpy(journal->blocks, FTLJournalBlocks, FTLJournalCount * sizeof(u16));
+		}
 
-		if(VFL_Write(pstFTLCxt->FTLCtrlPage, pageBuffer, spareBuffer) == 0)
+		memset(spareBuffer, 0xFF, NANDGeometry->bytesPerSpare);
+		spareBuffer->meta.usnDec = pstFTLCxt->usnDec;
+		spareBuffer->type1 = 0x4F;
+
+		if(VFL_Write(pstFTLCxt->FTLCtrlPage, pageBuffer, (u8*) spareBuffer) == 0)
 		{
-			pstFTLCxt->clean = 0;
-			kfree(pageBuffer);
-			kfree(spareBuffer);
+			FTLJournalFlushed = FTLJournalCount;
+			FTLJournalOverflowFlushed = FTLJournalOverflow;
 			return true;
 		}
 
@@ -1656,9 +2261,60 @@ static bool ftl_mark_unclean(void)
 		pstFTLCxt->FTLCtrlPage = (block * NANDGeometry->pagesPerSuBlk) + NANDGeometry->pagesPerSuBlk - 1;
 	}
 
+	return false;
+}
+
+static bool ftl_journal_flush(void)
+{
+	bool ret;
+	u8* pageBuffer = (u8*) kmalloc(NANDGeometry->bytesPerPage, GFP_KERNEL | GFP_DMA);
+	u8* spareBuffer = (u8*) kmalloc(NANDGeometry->bytesPerSpare, GFP_KERNEL | GFP_DMA);
+
+	if(!pageBuffer || !spareBuffer)
+	{
+		LOG("ftl: ftl_journal_flush: out of memory\n");
+		kfree(pageBuffer);
+		kfree(spareBuffer);
+		return false;
+	}
+
+	ret = ftl_write_journal(pageBuffer, (SpareData*) spareBuffer);
+	if(!ret)
+		LOG("ftl: ftl_journal_flush failed!\n");
+
+	kfree(pageBuffer);
+	kfree(spareBuffer);
+	return ret;
+}
+
+static bool ftl_mark_unclean(void)
+{
+	u8* pageBuffer;
+	u8* spareBuffer;
+
+	if(!pstFTLCxt->clean)
+		return true;
+
+	pageBuffer = (u8*) kmalloc(NANDGeometry->bytesPerPage, GFP_KERNEL | GFP_DMA);
+	spareBuffer = (u8*) kmalloc(NANDGeometry->bytesPerSpare, GFP_KERNEL | GFP_DMA);
+	if(!pageBuffer || !spareBuffer)
+	{
+		LOG("ftl: ftl_mark_unclean: out of memory\n");
+		return false;
+	}
+
+	check_for_dirty_free_vb(pageBuffer, (SpareData*) spareBuffer);
+
+	if(ftl_write_journal(pageBuffer, (SpareData*) spareBuffer))
+	{
+		pstFTLCxt->clean = 0;
+		kfree(pageBuffer);
+		kfree(spareBuffer);
+		return true;
+	}
+
 	LOG("ftl: ftl_mark_unclean failed!\n");
 
-error_release:
 	kfree(pageBuffer);
 	kfree(spareBuffer);
 	return false;
@@ -1688,7 +2344,7 @@ static FTLCxtLog* ftl_prepare_log(u16 lbn)
 				return NULL;
 			} else if(pstFTLCxt->wNumOfFreeVb == 3)
 			{
-				if(!ftl_merge(NULL))
+				if(!ftl_stall_merge(NULL))
 				{
 					LOG("ftl: block merged failed!\n");
 					return NULL;
@@ -1712,6 +2368,7 @@ static FTLCxtLog* ftl_prepare_log(u16 lbn)
 
 		memset(pLog->wPageOffsets, 0xFF, NANDGeometry->pagesPerSuBlk * sizeof(u16));
 		pLog->wLbn = lbn;
+		ftl_extent_invalidate(lbn);
 		pLog->pagesUsed = 0;
 		pLog->pagesCurrent = 0;
 		pLog->isSequential = 1;
@@ -1836,6 +2493,7 @@ static bool ftl_compact_scattered(FTLCxtLog* pLog)
 	LOG("ftl: ftl_compact_scattered\n");
 
 	++FTLCountsTable.compactScatteredCount;
+	ftl_extent_invalidate(pLog->wLbn);
 
 	if(pLog->pagesCurrent == 0)
 	{
@@ -1939,6 +2597,7 @@ static bool ftl_simple_merge(FTLCxtLog* pLog)
 	LOG("ftl: ftl_simple_merge\n");
 
 	++FTLCountsTable.simpleMergeCount;
+	ftl_extent_invalidate(pLog->wLbn);
 
 	for(i = 0; i < 4; ++i)
 	{
@@ -1997,6 +2656,8 @@ static bool ftl_copy_merge(FTLCxtLog* pLog)
 		return false;
 	}
 
+	ftl_extent_invalidate(pLog->wLbn);
+
 	if(pLog->pagesUsed >= NANDGeometry->pagesPerSuBlk)
 		++FTLCountsTable.copyMergeWhileFullCount;
 	else
@@ -2155,6 +2816,10 @@ bool ftl_auto_wearlevel(void)
 	if((largestEraseCount - smallestEraseCount) < 5)
 		return true;
 
+	// this takes a free block without ftl_get_free_vb
+	if(ftl_journal_needs_flush(mostErasedFreeBlock) && !ftl_journal_flush())
+		return false;
+
 	++pstFTLCxt->pawEraseCounterTable[mostErasedFreeBlock];
 	pstFTLCxt->pawReadCounterTable[mostErasedFreeBlock] = 0;
 
@@ -2173,6 +2838,7 @@ bool ftl_auto_wearlevel(void)
 	}
 
 	pstFTLCxt->pawMapTable[leastErasedBlockLbn] = mostErasedFreeBlock;
+	ftl_extent_invalidate(leastErasedBlockLbn);
 
 	++pstFTLCxt->pawEraseCounterTable[leastErasedBlock];
 	pstFTLCxt->pawReadCounterTable[leastErasedBlock] = 0;
@@ -2184,10 +2850,170 @@ bool ftl_auto_wearlevel(void)
 	}
 
 	pstFTLCxt->awFreeVb[mostErasedFreeBlockIdx] = leastErasedBlock;
+	ftl_journal_release(leastErasedBlock);
 
 	return true;
 }
 
+static void ftl_gc_account(FTLGCCounter* counter, u64 startTime)
+{
+	++counter->count;
+	counter->time += iphone_microtime() - startTime;
+}
+
+// A merge the write path can't go on without.
+static bool ftl_stall_merge(FTLCxtLog* pLog)
+{
+	u64 startTime = iphone_microtime();
+	bool ret = ftl_merge(pLog);
+	ftl_gc_account(&FTLGCStats.stalls, startTime);
+	return ret;
+}
+
+// Commits the context, which starts a new journal.
+static bool ftl_checkpoint(void)
+{
+	u64 startTime = iphone_microtime();
+	int tries;
+
+	for(tries = 0; tries < 4; ++ tries)
+	{
+		if(ftl_commit_cxt())
+		{
+			ftl_journal_reset();
+			ftl_gc_account(&FTLGCStats.checkpoints, startTime);
+			return true;
+		} else
+		{
+			// have some kind of error, try again on a new block
+			u16 block = pstFTLCxt->FTLCtrlPage / NANDGeometry->pagesPerSuBlk;
+			pstFTLCxt->FTLCtrlPage = (block * NANDGeometry->pagesPerSuBlk) + NANDGeometry->pagesPerSuBlk - 1;
+		}
+	}
+
+	return false;
+}
+
+// Does one unit of background work. Returns 1 if there may be more to do,
+// 0 if there's nothing left and -1 on failure.
+static int ftl_gc_step(void)
+{
+	FTLGCCounter* counter;
+	FTLCxtLog* pLog;
+	u64 startTime;
+	int i;
+
+	// Full logs get merged by the next write to their block anyway.
+	for(i = 0; i < 17; ++i)
+	{
+		pLog = &pstFTLCxt->pLog[i];
+		if(pLog->wVbn == 0xFFFF || pLog->pagesUsed != NANDGeometry->pagesPerSuBlk)
+			continue;
+
+		// ftl_merge compacts logs that are mostly stale instead
+		if(pLog->pagesCurrent < (NANDGeometry->pagesPerSuBlk / 2))
+			counter = &FTLGCStats.compactions;
+		else
+			counter = &FTLGCStats.merges;
+
+		startTime = iphone_microtime();
+		if(!ftl_merge(pLog))
+			return -1;
+
+		ftl_gc_account(counter, startTime);
+		return 1;
+	}
+
+	// Retire the oldest log while the pool is below target. ftl_merge(NULL)
+	// refuses to run while some log is still empty, and then a new block
+	// doesn't need a merge anyway.
+	if(pstFTLCxt->wNumOfFreeVb < FTLGCFreeTarget)
+	{
+		bool haveLogs = false;
+
+		for(i = 0; i < 17; ++i)
+		{
+			pLog = &pstFTLCxt->pLog[i];
+			if(pLog->wVbn == 0xFFFF)
+				continue;
+
+			if(pLog->pagesUsed == 0 || pLog->pagesCurrent == 0)
+				break;
+
+			haveLogs = true;
+		}
+
+		if(i == 17 && haveLogs)
+		{
+			startTime = iphone_microtime();
+			if(!ftl_merge(NULL))
+				return -1;
+
+			ftl_gc_account(&FTLGCStats.merges, startTime);
+			return 1;
+		}
+	}
+
+	if(pstFTLCxt->swapCounter >= 20)
+	{
+		startTime = iphone_microtime();
+		if(!ftl_auto_wearlevel())
+			return -1;
+
+		pstFTLCxt->swapCounter -= 20;
+		ftl_gc_account(&FTLGCStats.wearlevels, startTime);
+		return 1;
+	}
+
+	// Committing while idle keeps unclean restores short.
+	if(!pstFTLCxt->clean && (FTLJournalOverflow || FTLJournalCount >= FTL_CHECKPOINT_IDLE_BLOCKS))
+		return ftl_checkpoint() ? 1 : -1;
+
+	return 0;
+}
+
+static int ftl_gc_thread(void* data)
+{
+	set_freezable();
+
+	while(!kthread_should_stop())
+	{
+		long delay;
+		int ret;
+
+		wait_event_freezable(ftl_gc_wait, FTLGCPending || kthread_should_stop());
+		if(kthread_should_stop())
+			break;
+
+		// wait until nobody has used the FTL for a while
+		delay = (long)(FTLLastIO + msecs_to_jiffies(FTLGCIdleMs) - jiffies);
+		if(delay > 0)
+		{
+			schedule_timeout_interruptible(delay);
+			continue;
+		}
+
+		mutex_lock(&ftl_mutex);
+
+		if(time_before(jiffies, FTLLastIO + msecs_to_jiffies(FTLGCIdleMs)))
+		{
+			mutex_unlock(&ftl_mutex);
+			continue;
+		}
+
+		ret = ftl_gc_step();
+		if(ret <= 0)
+			FTLGCPending = false;
+
+		mutex_unlock(&ftl_mutex);
+
+		if(ret < 0)
+			LOG("ftl: background GC failed, waiting for more writes\n");
+	}
+
+	return 0;
+}
+
 static int FTL_Write_private(u32 logicalPageNumber, int totalPagesToWrite, u8* pBuf)
 {
 	int i;
@@ -2228,6 +3054,8 @@ static int FTL_Write_private(u32 logicalPageNumber, int totalPagesToWrite, u8* p
 			goto error_release;
 		}
 
+		ftl_extent_invalidate(lbn);
+
 		if(offset == 0 && (totalPagesToWrite - i) >= NANDGeometry->pagesPerSuBlk)
 		{
 			// we are replacing an entire block
@@ -2311,7 +3139,7 @@ static int FTL_Write_private(u32 logicalPageNumber, int totalPagesToWrite, u8* p
 #endif
 
 				// oh no, this log is full. we have to commit it
-				if(!ftl_merge(pLog))
+				if(!ftl_stall_merge(pLog))
 				{
 					LOG("ftl: write failed to merge in the log!\n");
 					goto error_release;
@@ -2395,6 +3223,8 @@ static int FTL_Write_private(u32 logicalPageNumber, int totalPagesToWrite, u8* p
 
 	if(pstFTLCxt->swapCounter >= 300)
 	{
+		// the GC thread never got an idle moment to do this
+		u64 startTime = iphone_microtime();
 		int tries;
 		for(tries = 0; tries < 4; ++tries)
 		{
@@ -2404,8 +3234,16 @@ static int FTL_Write_private(u32 logicalPageNumber, int totalPagesToWrite, u8* p
 				break;
 			}
 		}
+		ftl_gc_account(&FTLGCStats.stalls, startTime);
 	}
 
+	// keep the work an unclean restore has to do bounded
+	if(FTLJournalOverflow || FTLJournalCount >= FTL_CHECKPOINT_BLOCKS)
+		ftl_checkpoint();
+
+	FTLGCPending = true;
+	wake_up(&ftl_gc_wait);
+
 	//LOG("FTL_Write end\n");
 	return 0;
 
@@ -2423,6 +3261,7 @@ int FTL_Write(u32 logicalPageNumber, int totalPagesToWrite, u8* pBuf)
 #endif
 
 	mutex_lock(&ftl_mutex);
+	FTLLastIO = jiffies;
 
 #ifdef FTL_PROFILE
 	Time_wait_for_ecc_interrupt = 0;
@@ -2495,23 +3334,15 @@ bool ftl_sync(void)
 		}
 	}
 
-	for(tries = 0; tries < 4; ++ tries)
+	if(ftl_checkpoint())
 	{
-		if(ftl_commit_cxt())
-		{
-			//LOG("ftl_sync end\n");
+		//LOG("ftl_sync end\n");
 
 #ifdef FTL_PROFILE
-			TotalSyncTime += iphone_microtime() - startTime;
+		TotalSyncTime += iphone_microtime() - startTime;
 #endif
-			mutex_unlock(&ftl_mutex);
-			return true;
-		} else
-		{
-			// have some kind of error, try again on a new block
-			u16 block = pstFTLCxt->FTLCtrlPage / NANDGeometry->pagesPerSuBlk;
-			pstFTLCxt->FTLCtrlPage = (block * NANDGeometry->pagesPerSuBlk) + NANDGeometry->pagesPerSuBlk - 1;
-		}
+		mutex_unlock(&ftl_mutex);
+		return true;
 	}
 
 	//LOG("ftl_sync end\n");
@@ -2563,7 +3394,132 @@ int ftl_setup(void)
 		return -1;
 	}
 
+	FTLLastIO = jiffies;
+	FTLGCPending = true;
+
 	mutex_unlock(&ftl_mutex);
 
+	ftl_gc_task = kthread_run(ftl_gc_thread, NULL, "ftl_gc");
+	if(IS_ERR(ftl_gc_task))
+	{
+		LOG("ftl: could not start the GC thread, merging in the foreground only\n");
+		ftl_gc_task = NULL;
+	}
+
 	return 0;
 }
+
+void ftl_shutdown(void)
+{
+	if(ftl_gc_task)
+	{
+		kthread_stop(ftl_gc_task);
+		ftl_gc_task = NULL;
+	}
+}
+
+static ssize_t ftl_show_gc_stats(struct device* dev, struct device_attribute* attr, char* buf)
+{
+	ssize_t ret;
+
+	mutex_lock(&ftl_mutex);
+	ret = sprintf(buf, "merges %llu %llu\ncompactions %llu %llu\nwearlevels %llu %llu\nstalls %llu %llu\ncheckpoints %llu %llu\nfree_vb %u\njournal %d\n",
+			FTLGCStats.merges.count, FTLGCStats.merges.time,
+			FTLGCStats.compactions.count, FTLGCStats.compactions.time,
+			FTLGCStats.wearlevels.count, FTLGCStats.wearlevels.time,
+			FTLGCStats.stalls.count, FTLGCStats.stalls.time,
+			FTLGCStats.checkpoints.count, FTLGCStats.checkpoints.time,
+			pstFTLCxt->wNumOfFreeVb,
+			FTLJournalOverflow ? -1 : FTLJournalCount);
+	mutex_unlock(&ftl_mutex);
+
+	return ret;
+}
+
+static ssize_t ftl_show_extent_cache(struct device* dev, struct device_attribute* attr, char* buf)
+{
+	return sprintf(buf, "hits %llu\nmisses %llu\nfragmented %llu\n",
+			FTLExtentStats.hits, FTLExtentStats.misses, FTLExtentStats.fragmented);
+}
+
+// How the last mount recovered from an unclean shutdown, if it had to.
+static ssize_t ftl_show_restore(struct device* dev, struct device_attribute* attr, char* buf)
+{
+	const char* mode = "none";
+
+	if(FTLRestoreStats.restored)
+		mode = FTLRestoreStats.incremental ? "incremental" : "full";
+
+	return sprintf(buf, "%s %u %llu\n", mode, FTLRestoreStats.blocksScanned, FTLRestoreStats.time);
+}
+
+static ssize_t ftl_show_gc_target(struct device* dev, struct device_attribute* attr, char* buf)
+{
+	return sprintf(buf, "%d\n", FTLGCFreeTarget);
+}
+
+static ssize_t ftl_store_gc_target(struct device* dev, struct device_attribute* attr, const char* buf, size_t count)
+{
+	unsigned long val;
+
+	// 3 is where the write path merges by itself, 20 is all of the pool
+	if(strict_strtoul(buf, 0, &val) || val > 20)
+		return -EINVAL;
+
+	mutex_lock(&ftl_mutex);
+	FTLGCFreeTarget = val;
+	FTLGCPending = true;
+	mutex_unlock(&ftl_mutex);
+	wake_up(&ftl_gc_wait);
+
+	return count;
+}
+
+static ssize_t ftl_show_gc_idle_ms(struct device* dev, struct device_attribute* attr, char* buf)
+{
+	return sprintf(buf, "%d\n", FTLGCIdleMs);
+}
+
+static ssize_t ftl_store_gc_idle_ms(struct device* dev, struct device_attribute* attr, const char* buf, size_t count)
+{
+	unsigned long val;
+
+	if(strict_strtoul(buf, 0, &val) || val > 60000)
+		return -EINVAL;
+
+	mutex_lock(&ftl_mutex);
+	FTLGCIdleMs = val;
+	mutex_unlock(&ftl_mutex);
+
+	return count;
+}
+
+static DEVICE_ATTR(gc_stats, S_IRUGO, ftl_show_gc_stats, NULL);
+static DEVICE_ATTR(gc_target, S_IRUGO | S_IWUSR, ftl_show_gc_target, ftl_store_gc_target);
+static DEVICE_ATTR(gc_idle_ms, S_IRUGO | S_IWUSR, ftl_show_gc_idle_ms, ftl_store_gc_idle_ms);
+static DEVICE_ATTR(restore, S_IRUGO, ftl_show_restore, NULL);
+static DEVICE_ATTR(extent_cache, S_IRUGO, ftl_show_extent_cache, NULL);
+
+static struct attribute* ftl_attrs[] = {
+	&dev_attr_gc_stats.attr,
+	&dev_attr_gc_target.attr,
+	&dev_attr_gc_idle_ms.attr,
+	&dev_attr_restore.attr,
+	&dev_attr_extent_cache.attr,
+	NULL,
+};
+
+static struct attribute_group ftl_attr_group = {
+	.name = "ftl",
+	.attrs = ftl_attrs,
+};
+
+int ftl_sysfs_register(struct device* dev)
+{
+	return sysfs_create_group(&dev->kobj, &ftl_attr_group);
+}
+
+void ftl_sysfs_unregister(struct device* dev)
+{
+	sysfs_remove_group(&dev->kobj, &ftl_attr_group);
+}
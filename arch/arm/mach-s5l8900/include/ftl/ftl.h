@@ -1,7 +1,12 @@
 #ifndef IPHONE_FTL_H
 #define IPHONE_FTL_H
 
+struct device;
+
 int ftl_setup(void);
+void ftl_shutdown(void);
+int ftl_sysfs_register(struct device* dev);
+void ftl_sysfs_unregister(struct device* dev);
 bool ftl_sync(void);
 int FTL_Write(u32 logicalPageNumber, int totalPagesToWrite, u8* pBuf);
 int FTL_Read(u32 logicalPageNumber, int totalPagesToRead, u8* pBuf);
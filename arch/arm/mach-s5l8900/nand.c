@@ -129,6 +129,17 @@ static int banksTable[NAND_NUM_BANKS];
 static u8* aTemporaryReadEccBuf;
 static u8* aTemporarySBuf;
 
+// Spares of the page being transferred and of the one being checked
+static u8* aMultipleSBuf[2];
+
+// A DMA from the FIFO that is still running
+typedef struct NANDTransfer {
+	dma_addr_t dma;
+	int size;
+	int controller;
+	int channel;
+} NANDTransfer;
+
 // Linux stuff
 
 static struct device *nand_dev;
@@ -491,34 +502,36 @@ static int wait_for_nand_bank_ready(int bank)
 	return 0;
 }
 
-static int transferFromFlash(void* buffer, int size) {
-	int controller = 0;
-	int channel = 0;
-	dma_addr_t dma;
-
-#ifdef FTL_PROFILE
-	u64 startTime;
-#endif
-
+// Starts moving size bytes from the FIFO into buffer. The CPU is free to
+// do other work, like running the ECC engine, until transferFromFlashFinish.
+static int transferFromFlashStart(void* buffer, int size, NANDTransfer* transfer) {
 	if((((u32)buffer) & 0x3) != 0) {
 		// the buffer needs to be aligned for DMA, last two bits have to be clear
 		return -EINVAL;
 	}
 
+	transfer->size = size;
+	transfer->controller = 0;
+	transfer->channel = 0;
+
 	writel(readl(NAND + FMCTRL0) | (1 << FMCTRL0_DMASETTINGSHIFT), NAND + FMCTRL0);
 	writel(size - 1, NAND + FMDNUM);
 	writel(FMCTRL1_DOREADDATA, NAND + FMCTRL1);
 
-	dma = dma_map_single(nand_dev, buffer, size, DMA_FROM_DEVICE);
+	transfer->dma = dma_map_single(nand_dev, buffer, size, DMA_FROM_DEVICE);
 
-	iphone_dma_request(IPHONE_DMA_NAND, 4, 4, IPHONE_DMA_MEMORY, 4, 4, &controller, &channel);
-	iphone_dma_perform(IPHONE_DMA_NAND, (u32)dma, size, 0, &controller, &channel);
+	iphone_dma_request(IPHONE_DMA_NAND, 4, 4, IPHONE_DMA_MEMORY, 4, 4, &transfer->controller, &transfer->channel);
+	iphone_dma_perform(IPHONE_DMA_NAND, (u32)transfer->dma, size, 0, &transfer->controller, &transfer->channel);
 
+	return 0;
+}
+
+static int transferFromFlashFinish(NANDTransfer* transfer) {
 #ifdef FTL_PROFILE
-	startTime = iphone_microtime();
+	u64 startTime = iphone_microtime();
 #endif
 
-	if(iphone_dma_finish(controller, channel, 500) != 0) {
+	if(iphone_dma_finish(transfer->controller, transfer->channel, 500) != 0) {
 		LOG("nand: dma timed out\n");
 		return -ETIMEDOUT;
 	}
@@ -534,11 +547,21 @@ static int transferFromFlash(void* buffer, int size) {
 
 	writel(FMCTRL1_FLUSHFIFOS, NAND + FMCTRL1);
 
-	dma_unmap_single(nand_dev, dma, size, DMA_FROM_DEVICE);
+	dma_unmap_single(nand_dev, transfer->dma, transfer->size, DMA_FROM_DEVICE);
 
 	return 0;
 }
 
+static int transferFromFlash(void* buffer, int size) {
+	NANDTransfer transfer;
+	int ret;
+
+	if((ret = transferFromFlashStart(buffer, size, &transfer)) != 0)
+		return ret;
+
+	return transferFromFlashFinish(&transfer);
+}
+
 static int transferToFlash(void* buffer, int size) {
 	int controller = 0;
 	int channel = 0;
@@ -602,35 +625,22 @@ static bool isEmptyBlock(u8* buffer, int size) {
 		return false;
 }
 
-int nand_read(int bank, int page, u8* buffer, u8* spare, bool doECC, bool checkBlank)
+// Has the bank load a page into its page register. The data can be
+// transferred out once wait_for_nand_bank_ready says the bank is done.
+static int nand_send_read(int bank, int page, bool spareOnly)
 {
-	bool eccFailed;
-
-	if(bank >= Geometry.banksTotal)
-		return -EINVAL;
-
-	if(page >= Geometry.pagesPerBank)
-		return -EINVAL;
-
-	if(buffer == NULL && spare == NULL)
-		return -EINVAL;
-
-#ifdef FTL_PROFILE
-	InWrite = true;
-#endif
-
 	writel(((WEHighHoldTime & FMCTRL_TWH_MASK) << FMCTRL_TWH_SHIFT) | ((WPPulseTime & FMCTRL_TWP_MASK) << FMCTRL_TWP_SHIFT)
 		| (1 << (banksTable[bank] + 1)) | FMCTRL0_ON | FMCTRL0_WPB, NAND + FMCTRL0);
 
 	writel(0, NAND + NAND_CMD);
 	if(wait_for_ready(500) != 0) {
 		LOG("nand: bank setting failed\n");
-		goto FIL_read_error;
+		return -EIO;
 	}
 
 	writel(FMANUM_TRANSFERSETTING, NAND + FMANUM);
 
-	if(buffer) {
+	if(!spareOnly) {
 		writel(page << 16, NAND + FMADDR0); // lower bits of the page number to the upper bits of CONFIG3
 		writel((page >> 16) & 0xFF, NAND + FMADDR1); // upper bits of the page number
 
@@ -642,40 +652,31 @@ int nand_read(int bank, int page, u8* buffer, u8* spare, bool doECC, bool checkB
 	writel(FMCTRL1_DOTRANSADDR, NAND + FMCTRL1);
 	if(wait_for_address_done(500) != 0) {
 		LOG("nand: sending address failed\n");
-		goto FIL_read_error;
+		return -EIO;
 	}
 
 	writel(NAND_CMD_READ, NAND + NAND_CMD);
 	if(wait_for_ready(500) != 0) {
 		LOG("nand: sending read command failed\n");
-		goto FIL_read_error;
-	}
-
-	if(wait_for_nand_bank_ready(bank) != 0) {
-		LOG("nand: nand bank not ready after a long time\n");
-		goto FIL_read_error;
+		return -EIO;
 	}
 
-	if(buffer) {
-		if(transferFromFlash(buffer, Geometry.bytesPerPage) != 0) {
-			LOG("nand: transferFromFlash failed\n");
-			goto FIL_read_error;
-		}
-	}
+	return 0;
+}
 
-	if(transferFromFlash(aTemporarySBuf, Geometry.bytesPerSpare) != 0) {
-		LOG("nand: transferFromFlash for spare failed\n");
-		goto FIL_read_error;
-	}
+// Checks the ECC of a page and its spare that have been transferred
+// into buffer and sBuf, and copies the spare out.
+static int nand_check_page(u8* buffer, u8* sBuf, u8* spare, bool doECC, bool checkBlank)
+{
+	bool eccFailed = false;
 
-	eccFailed = false;
 	if(doECC) {
 		if(buffer) {
-			eccFailed = (checkECC(ECCType, buffer, aTemporarySBuf + sizeof(SpareData)) != 0);
+			eccFailed = (checkECC(ECCType, buffer, sBuf + sizeof(SpareData)) != 0);
 		}
 
-		memcpy(aTemporaryReadEccBuf, aTemporarySBuf, sizeof(SpareData));
-		if(ecc_perform(ECCType, 1, aTemporaryReadEccBuf, aTemporarySBuf + sizeof(SpareData) + TotalECCDataSize) != 0)
+		memcpy(aTemporaryReadEccBuf, sBuf, sizeof(SpareData));
+		if(ecc_perform(ECCType, 1, aTemporaryReadEccBuf, sBuf + sizeof(SpareData) + TotalECCDataSize) != 0)
 		{
 			memset(aTemporaryReadEccBuf, 0xFF, SECTOR_SIZE);
 			eccFailed |= 1;
@@ -687,28 +688,64 @@ int nand_read(int bank, int page, u8* buffer, u8* spare, bool doECC, bool checkB
 			// We can only copy the first 12 bytes because the rest is probably changed by the ECC check routine
 			memcpy(spare, aTemporaryReadEccBuf, sizeof(SpareData));
 		} else {
-			memcpy(spare, aTemporarySBuf, Geometry.bytesPerSpare);
+			memcpy(spare, sBuf, Geometry.bytesPerSpare);
 		}
 	}
 
 	if(eccFailed || checkBlank) {
-		if(isEmptyBlock(aTemporarySBuf, Geometry.bytesPerSpare) != 0) {
-#ifdef FTL_PROFILE
-			InWrite = false;
-#endif
+		if(isEmptyBlock(sBuf, Geometry.bytesPerSpare) != 0) {
 			return ERROR_EMPTYBLOCK;
 		} else if(eccFailed) {
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+int nand_read(int bank, int page, u8* buffer, u8* spare, bool doECC, bool checkBlank)
+{
+	int ret;
+
+	if(bank >= Geometry.banksTotal)
+		return -EINVAL;
+
+	if(page >= Geometry.pagesPerBank)
+		return -EINVAL;
+
+	if(buffer == NULL && spare == NULL)
+		return -EINVAL;
+
 #ifdef FTL_PROFILE
-			InWrite = false;
+	InWrite = true;
 #endif
-			return -EIO;
+
+	if(nand_send_read(bank, page, buffer == NULL) != 0)
+		goto FIL_read_error;
+
+	if(wait_for_nand_bank_ready(bank) != 0) {
+		LOG("nand: nand bank not ready after a long time\n");
+		goto FIL_read_error;
+	}
+
+	if(buffer) {
+		if(transferFromFlash(buffer, Geometry.bytesPerPage) != 0) {
+			LOG("nand: transferFromFlash failed\n");
+			goto FIL_read_error;
 		}
 	}
 
+	if(transferFromFlash(aTemporarySBuf, Geometry.bytesPerSpare) != 0) {
+		LOG("nand: transferFromFlash for spare failed\n");
+		goto FIL_read_error;
+	}
+
+	ret = nand_check_page(buffer, aTemporarySBuf, spare, doECC, checkBlank);
+
 #ifdef FTL_PROFILE
 	InWrite = false;
 #endif
-	return 0;
+	return ret;
 
 FIL_read_error:
 	nand_bank_reset(bank, 100);
@@ -718,19 +755,91 @@ FIL_read_error:
 	return -EIO;
 }
 
+// Reads pagesCount pages with ECC. Every bank involved keeps a read in
+// flight, so banks load their next page while earlier ones are being
+// transferred, and the ECC of each page is checked while the next one is
+// coming in over DMA. Blank pages are fine, anything else that fails
+// stops the whole read.
 int nand_read_multiple(u16* bank, u32* pages, u8* main, SpareData* spare, int pagesCount)
 {
+	NANDTransfer transfer;
+	u32 banksStarted = 0;
+	int pending = -1;	// page whose ECC hasn't been checked yet
+	int ret = 0;
 	int i;
-	unsigned int ret;
+	int j;
+
 	for(i = 0; i < pagesCount; i++) {
-		ret = nand_read(bank[i], pages[i], main, (u8*) &spare[i], true, true);
-		if(ret > 1)
+		if(bank[i] >= Geometry.banksTotal || pages[i] >= Geometry.pagesPerBank)
+			return -EINVAL;
+	}
+
+	// start off the first page of every bank
+	for(i = 0; i < pagesCount; i++) {
+		if(banksStarted & (1 << bank[i]))
+			continue;
+
+		if(nand_send_read(bank[i], pages[i], false) != 0)
+			goto FIL_read_error;
+
+		banksStarted |= 1 << bank[i];
+	}
+
+	for(i = 0; i < pagesCount; i++) {
+		u8* buffer = main + (i * Geometry.bytesPerPage);
+
+		if(wait_for_nand_bank_ready(bank[i]) != 0) {
+			LOG("nand: nand bank not ready after a long time\n");
+			goto FIL_read_error;
+		}
+
+		if(transferFromFlashStart(buffer, Geometry.bytesPerPage, &transfer) != 0) {
+			LOG("nand: transferFromFlash failed\n");
+			goto FIL_read_error;
+		}
+
+		if(pending >= 0) {
+			ret = nand_check_page(main + (pending * Geometry.bytesPerPage), aMultipleSBuf[pending & 1], (u8*) &spare[pending], true, true);
+			if(ret == ERROR_EMPTYBLOCK)
+				ret = 0;
+		}
+
+		if(transferFromFlashFinish(&transfer) != 0) {
+			LOG("nand: transferFromFlash failed\n");
+			goto FIL_read_error;
+		}
+
+		if(ret != 0)
 			return ret;
 
-		main += Geometry.bytesPerPage;
+		if(transferFromFlash(aMultipleSBuf[i & 1], Geometry.bytesPerSpare) != 0) {
+			LOG("nand: transferFromFlash for spare failed\n");
+			goto FIL_read_error;
+		}
+
+		pending = i;
+
+		// the page register is free again, start on the bank's next page
+		for(j = i + 1; j < pagesCount; j++) {
+			if(bank[j] == bank[i])
+				break;
+		}
+
+		if(j < pagesCount && nand_send_read(bank[j], pages[j], false) != 0)
+			goto FIL_read_error;
 	}
 
-	return 0;
+	if(pending >= 0) {
+		ret = nand_check_page(main + (pending * Geometry.bytesPerPage), aMultipleSBuf[pending & 1], (u8*) &spare[pending], true, true);
+		if(ret == ERROR_EMPTYBLOCK)
+			ret = 0;
+	}
+
+	return ret;
+
+FIL_read_error:
+	nand_bank_reset(bank[i], 100);
+	return -EIO;
 }
 
 int nand_read_alternate_ecc(int bank, int page, u8* buffer) {
@@ -1086,6 +1195,9 @@ int nand_setup(void)
 
 	aTemporarySBuf = (uint8_t*) kmalloc(Geometry.bytesPerSpare, GFP_KERNEL | GFP_DMA);
 
+	aMultipleSBuf[0] = (uint8_t*) kmalloc(Geometry.bytesPerSpare, GFP_KERNEL | GFP_DMA);
+	aMultipleSBuf[1] = (uint8_t*) kmalloc(Geometry.bytesPerSpare, GFP_KERNEL | GFP_DMA);
+
 	return 0;
 }
 
@@ -1097,6 +1209,8 @@ static int __devinit iphone_nand_probe(struct platform_device *pdev)
 
 static int __devexit iphone_nand_remove(struct platform_device *pdev)
 {
+	kfree(aMultipleSBuf[0]);
+	kfree(aMultipleSBuf[1]);
 	kfree(aTemporarySBuf);
 	kfree(aTemporaryReadEccBuf);
 	return 0;
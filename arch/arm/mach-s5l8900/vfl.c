@@ -547,6 +547,28 @@ bool VFL_ReadMultiplePagesInVb(int logicalBlock, int logicalPage, int count, u8*
 {
 	int i;
 	int currentPage = logicalPage;
+
+	// Consecutive pages of a superblock rotate through the banks, so
+	// nand_read_multiple can keep all of them busy at once.
+	for(i = 0; i < count; i++) {
+		u32 dwVpn = (logicalBlock * NANDGeometry->pagesPerSuBlk) + logicalPage + i + (NANDGeometry->pagesPerSuBlk * FTLData->field_4);
+		u16 virtualBlock;
+		u16 virtualPage;
+		u16 physicalBlock;
+
+		virtual_page_number_to_virtual_address(dwVpn, &ScatteredBankNumberBuffer[i], &virtualBlock, &virtualPage);
+		physicalBlock = virtual_block_to_physical_block(ScatteredBankNumberBuffer[i], virtualBlock);
+		ScatteredPageNumberBuffer[i] = physicalBlock * NANDGeometry->pagesPerBlock + virtualPage;
+	}
+
+	if(nand_read_multiple(ScatteredBankNumberBuffer, ScatteredPageNumberBuffer, main, spare, count) == 0) {
+		VFLData1.field_8 += count;
+		VFLData1.field_20++;
+		return true;
+	}
+
+	// Go page by page so VFL_Read can reset the bank and retry. It
+	// counts its own reads, the failed batch isn't counted.
 	for(i = 0; i < count; i++) {
 		int ret = VFL_Read((logicalBlock * NANDGeometry->pagesPerSuBlk) + currentPage, main + (NANDGeometry->bytesPerPage * i), (u8*) &spare[i], true);
 		currentPage++;
@@ -12,6 +12,7 @@
 #define  __S5L_CDMA__
 
 #include <linux/scatterlist.h>
+#include <linux/list.h>
 
 #define CDMA_AES_128	(0 << 28)
 #define CDMA_AES_192	(1 << 28)
@@ -37,6 +38,33 @@ struct cdma_aes
 	void *iv_param;
 };
 
+// A queued transfer. The caller owns it until the callback has run, so
+// submitting doesn't allocate. Transfers on a channel run back to back
+// in the order they were submitted, using the channel's AES settings
+// at the time they start.
+struct cdma_xfer
+{
+	cdma_dir_t dir;
+	struct scatterlist *sg;
+	size_t sg_count;
+	size_t size;
+	dma_addr_t reg;
+	size_t burst;
+	size_t busw;
+	u32 pid;
+
+	// Called from interrupt context with 0, -EIO or -ECANCELED.
+	// It may submit more transfers.
+	void (*callback)(struct cdma_xfer *_xfer, int _result);
+	void *callback_param;
+
+	int result;
+	struct list_head list;
+};
+
+int cdma_submit(u32 _channel, struct cdma_xfer *_xfer);
+
+// Synchronous wrappers, cdma_wait returns the result of the cdma_begin transfer.
 int cdma_begin(u32 _channel, cdma_dir_t _dir, struct scatterlist *_sg, size_t _sg_count, size_t _size, dma_addr_t _reg, size_t _burst, size_t _busw, u32 _pid);
 int cdma_cancel(u32 _channel);
 
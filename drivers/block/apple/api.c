@@ -1,5 +1,7 @@
 #include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
 #include <linux/apple_flash.h>
 
 //
@@ -176,6 +178,171 @@ void apple_nand_unregister(struct apple_nand *_nd)
 }
 EXPORT_SYMBOL_GPL(apple_nand_unregister);
 
+//
+// Scatterlists
+//
+
+void apple_sg_cursor_init(struct apple_sg_cursor *_cur,
+		struct scatterlist *_src, size_t _src_num)
+{
+	_cur->sg = _src;
+	_cur->num = _src_num;
+	_cur->base = 0;
+}
+EXPORT_SYMBOL_GPL(apple_sg_cursor_init);
+
+int apple_sg_cursor_copy(struct scatterlist *_dst, size_t _dst_max, size_t *_dst_num,
+		struct apple_sg_cursor *_cur, size_t _offset, size_t _len)
+{
+	struct scatterlist *sg;
+	size_t num = *_dst_num;
+	size_t left;
+
+	if(_offset < _cur->base)
+		return -EINVAL;
+
+	// Skip the entries that lie wholly before _offset for good, so
+	// that walking a list unit by unit stays linear.
+	while(_cur->num && _cur->sg
+			&& _offset - _cur->base >= _cur->sg->length)
+	{
+		_cur->base += _cur->sg->length;
+		_cur->sg = sg_next(_cur->sg);
+		_cur->num--;
+	}
+
+	sg = _cur->sg;
+	_offset -= _cur->base;
+
+	for(left = _cur->num; left && _len; left--, sg = sg_next(sg))
+	{
+		size_t amt;
+
+		if(!sg)
+			break;
+
+		if(_offset >= sg->length)
+		{
+			_offset -= sg->length;
+			continue;
+		}
+
+		amt = min(_len, (size_t)(sg->length - _offset));
+
+		if(num)
+		{
+			struct scatterlist *prev = &_dst[num-1];
+
+			// Glue the piece onto the last entry if it carries on from it.
+			if(sg_page(prev) == sg_page(sg)
+					&& prev->offset + prev->length == sg->offset + _offset)
+			{
+				prev->length += amt;
+				goto next;
+			}
+		}
+
+		if(num >= _dst_max)
+			return -ENOSPC;
+
+		sg_set_page(&_dst[num], sg_page(sg), amt, sg->offset + _offset);
+		num++;
+
+next:
+		_len -= amt;
+		_offset = 0;
+	}
+
+	if(_len)
+		return -EINVAL;
+
+	*_dst_num = num;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(apple_sg_cursor_copy);
+
+int apple_sg_copy_range(struct scatterlist *_dst, size_t _dst_max, size_t *_dst_num,
+		struct scatterlist *_src, size_t _src_num, size_t _offset, size_t _len)
+{
+	struct apple_sg_cursor cur;
+
+	apple_sg_cursor_init(&cur, _src, _src_num);
+	return apple_sg_cursor_copy(_dst, _dst_max, _dst_num, &cur, _offset, _len);
+}
+EXPORT_SYMBOL_GPL(apple_sg_copy_range);
+
+int apple_sg_split(struct scatterlist *_src, size_t _src_num, size_t _unit,
+		size_t _count, const int *_part, int _num_parts,
+		struct scatterlist **_dst, size_t *_dst_num)
+{
+	size_t max = _src_num + _count;
+	struct apple_sg_cursor cur;
+	size_t i;
+	int p, ret;
+
+	for(p = 0; p < _num_parts; p++)
+	{
+		_dst[p] = NULL;
+		_dst_num[p] = 0;
+	}
+
+	apple_sg_cursor_init(&cur, _src, _src_num);
+
+	for(i = 0; i < _count; i++)
+	{
+		p = _part[i];
+		if(p < 0 || p >= _num_parts)
+		{
+			ret = -EINVAL;
+			goto error;
+		}
+
+		if(!_dst[p])
+		{
+			// A unit boundary can split at most one source entry, so
+			// this is enough however the source is laid out.
+			_dst[p] = kmalloc(sizeof(*_dst[p])*max, GFP_KERNEL);
+			if(!_dst[p])
+			{
+				ret = -ENOMEM;
+				goto error;
+			}
+
+			sg_init_table(_dst[p], max);
+		}
+
+		ret = apple_sg_cursor_copy(_dst[p], max, &_dst_num[p],
+				&cur, i*_unit, _unit);
+		if(ret < 0)
+			goto error;
+	}
+
+	for(p = 0; p < _num_parts; p++)
+	{
+		if(_dst_num[p])
+			sg_mark_end(&_dst[p][_dst_num[p]-1]);
+	}
+
+	return 0;
+
+error:
+	apple_sg_split_free(_dst, _num_parts);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(apple_sg_split);
+
+void apple_sg_split_free(struct scatterlist **_dst, int _num_parts)
+{
+	int p;
+
+	for(p = 0; p < _num_parts; p++)
+	{
+		kfree(_dst[p]);
+		_dst[p] = NULL;
+	}
+}
+EXPORT_SYMBOL_GPL(apple_sg_split_free);
+
 //
 // VFL
 //
@@ -190,6 +357,195 @@ int apple_vfl_special_page(struct apple_vfl *_vfl,
 								   _page, _buffer, _amt);
 }
 
+struct apple_vfl_bus_op
+{
+	struct work_struct work;
+	struct apple_nand *nand;
+	int write;
+
+	size_t count;
+	u16 *chips;
+	page_t *pages;
+
+	struct scatterlist *sg_data;
+	size_t sg_num_data;
+	struct scatterlist *sg_oob;
+	size_t sg_num_oob;
+
+	int ret;
+};
+
+static void apple_vfl_bus_op_run(struct apple_vfl_bus_op *_op)
+{
+	struct apple_nand *nand = _op->nand;
+
+	if(_op->write)
+		_op->ret = nand->write(nand, _op->count, _op->chips, _op->pages,
+				_op->sg_data, _op->sg_num_data,
+				_op->sg_oob, _op->sg_num_oob);
+	else
+		_op->ret = nand->read(nand, _op->count, _op->chips, _op->pages,
+				_op->sg_data, _op->sg_num_data,
+				_op->sg_oob, _op->sg_num_oob);
+}
+
+static void apple_vfl_bus_op_work(struct work_struct *_work)
+{
+	apple_vfl_bus_op_run(container_of(_work, struct apple_vfl_bus_op, work));
+}
+
+static int apple_vfl_nand_pages(struct apple_vfl *_vfl, int _write,
+		size_t _count, u16 *_ces, page_t *_pages,
+		struct scatterlist *_sg_data, size_t _sg_num_data,
+		struct scatterlist *_sg_oob, size_t _sg_num_oob)
+{
+	int nd = _vfl->num_devices;
+	size_t pagesz = _vfl->get(_vfl, NAND_PAGE_SIZE);
+	size_t oobsz = _vfl->get(_vfl, NAND_OOB_ALLOC);
+	struct apple_vfl_bus_op *ops;
+	struct scatterlist **sg_data, **sg_oob;
+	size_t *num_data, *num_oob;
+	u16 *chips;
+	page_t *pages;
+	int *bus;
+	int ret, i, last = -1;
+	size_t j;
+
+	if(!_count)
+		return 0;
+
+	bus = kmalloc(sizeof(*bus)*_count, GFP_KERNEL);
+	chips = kmalloc(sizeof(*chips)*_count, GFP_KERNEL);
+	pages = kmalloc(sizeof(*pages)*_count, GFP_KERNEL);
+	ops = kzalloc(sizeof(*ops)*nd, GFP_KERNEL);
+	sg_data = kzalloc(sizeof(*sg_data)*nd*2, GFP_KERNEL);
+	num_data = kzalloc(sizeof(*num_data)*nd*2, GFP_KERNEL);
+	sg_oob = sg_data + nd;
+	num_oob = num_data + nd;
+	if(!bus || !chips || !pages || !ops || !sg_data || !num_data)
+	{
+		ret = -ENOMEM;
+		goto exit;
+	}
+
+	for(j = 0; j < _count; j++)
+	{
+		struct apple_chip_map *map = &_vfl->chips[_ces[j]];
+		bus[j] = map->bus;
+		ops[map->bus].count++;
+	}
+
+	// Each bus gets a contiguous slice of the chip and page arrays,
+	// in the order the pages were given to us.
+	for(i = 0, j = 0; i < nd; i++)
+	{
+		ops[i].chips = &chips[j];
+		ops[i].pages = &pages[j];
+		j += ops[i].count;
+		ops[i].count = 0;
+	}
+
+	for(j = 0; j < _count; j++)
+	{
+		struct apple_vfl_bus_op *op = &ops[bus[j]];
+		op->chips[op->count] = _vfl->chips[_ces[j]].chip;
+		op->pages[op->count] = _pages[j];
+		op->count++;
+	}
+
+	if(_sg_num_data)
+	{
+		ret = apple_sg_split(_sg_data, _sg_num_data, pagesz,
+				_count, bus, nd, sg_data, num_data);
+		if(ret < 0)
+			goto exit;
+	}
+
+	if(_sg_num_oob)
+	{
+		ret = apple_sg_split(_sg_oob, _sg_num_oob, oobsz,
+				_count, bus, nd, sg_oob, num_oob);
+		if(ret < 0)
+			goto exit;
+	}
+
+	for(i = 0; i < nd; i++)
+	{
+		struct apple_vfl_bus_op *op = &ops[i];
+
+		if(!op->count)
+			continue;
+
+		op->nand = _vfl->devices[i];
+		op->write = _write;
+		op->sg_data = sg_data[i];
+		op->sg_num_data = num_data[i];
+		op->sg_oob = sg_oob[i];
+		op->sg_num_oob = num_oob[i];
+
+		if((_write && !op->nand->write) || (!_write && !op->nand->read))
+		{
+			ret = -EPERM;
+			goto exit;
+		}
+
+		last = i;
+	}
+
+	if(last < 0)
+	{
+		ret = 0;
+		goto exit;
+	}
+
+	// Kick off every bus but the last in the background,
+	// run the last one here and then wait for the rest.
+	for(i = 0; i < last; i++)
+	{
+		if(!ops[i].count)
+			continue;
+
+		INIT_WORK(&ops[i].work, apple_vfl_bus_op_work);
+		queue_work(system_unbound_wq, &ops[i].work);
+	}
+
+	apple_vfl_bus_op_run(&ops[last]);
+
+	ret = 0;
+	for(i = 0; i <= last; i++)
+	{
+		if(!ops[i].count)
+			continue;
+
+		if(i != last)
+			flush_work(&ops[i].work);
+
+		// Report the first error, otherwise the worst status.
+		if(ops[i].ret < 0)
+		{
+			if(ret >= 0)
+				ret = ops[i].ret;
+		}
+		else if(ret >= 0 && ops[i].ret > ret)
+			ret = ops[i].ret;
+	}
+
+exit:
+	if(sg_data)
+	{
+		apple_sg_split_free(sg_data, nd);
+		apple_sg_split_free(sg_oob, nd);
+	}
+
+	kfree(num_data);
+	kfree(sg_data);
+	kfree(ops);
+	kfree(pages);
+	kfree(chips);
+	kfree(bus);
+	return ret;
+}
+
 int apple_vfl_read_nand_pages(struct apple_vfl *_vfl,
 		size_t _count, u16 *_ces, page_t *_pages,
 		struct scatterlist *_sg_data, size_t _sg_num_data,
@@ -222,6 +578,9 @@ int apple_vfl_read_nand_pages(struct apple_vfl *_vfl,
 		if(!chips)
 			return -ENOMEM;
 
+		for(i = 0; i < _count; i++)
+			chips[i] = _vfl->chips[_ces[i]].chip;
+
 		ret = nand->read(nand, _count, chips, _pages,
 						 _sg_data, _sg_num_data,
 						 _sg_oob, _sg_num_oob);
@@ -229,50 +588,8 @@ int apple_vfl_read_nand_pages(struct apple_vfl *_vfl,
 		return ret;
 	}
 	else
-	{
-/*
-		int nd = _vfl->num_devices;
-		u16 *chips = kmalloc(sizeof(*chips)*_count*nd, GFP_KERNEL);
-		page_t *pages = kmalloc(sizeof(*pages)*_count*nd, GFP_KERNEL);
-		int *count = kzalloc(sizeof(*count)*nd, GFP_KERNEL);
-		int num_bus = 0;
-
-		if(!chips || !pages || !count)
-		{
-			kfree(chips);
-			kfree(pages);
-			kfree(count);
-			return -ENOMEM;
-		}
-
-		for(i = 0; i < _count; i++)
-		{
-			int ce = _ces[i];
-			int bus = _vfl->chips[ce].bus;
-			int realCE = _vfl->chips[ce].chip;
-			
-			int idx = count[bus]++;
-			chips[bus*_count + idx] = realCE;
-			pages[bus*_count + idx] = _pages[i];
-		}
-
-		ret = 0;
-		for(i = 0; i < nd; i++)
-		{
-			struct apple_nand *nand = _vfl->devices[i];
-
-			if(!count[i])
-				continue;
-			
-			ret = nand->read(nand, count[i],
-							 &chips[i*_count],
-							 &pages[i*_count],
-							 
-							 // ARGH, NEED TO SPLIT SGs!
-		}
-*/
-		panic("apple-flash: SG splitting not yet implemented!\n");
-	}
+		return apple_vfl_nand_pages(_vfl, 0, _count, _ces, _pages,
+				_sg_data, _sg_num_data, _sg_oob, _sg_num_oob);
 }
 EXPORT_SYMBOL_GPL(apple_vfl_read_nand_pages);
 
@@ -308,6 +625,9 @@ int apple_vfl_write_nand_pages(struct apple_vfl *_vfl,
 		if(!chips)
 			return -ENOMEM;
 
+		for(i = 0; i < _count; i++)
+			chips[i] = _vfl->chips[_ces[i]].chip;
+
 		ret = nand->write(nand, _count, chips, _pages,
 						 _sg_data, _sg_num_data,
 						 _sg_oob, _sg_num_oob);
@@ -315,7 +635,8 @@ int apple_vfl_write_nand_pages(struct apple_vfl *_vfl,
 		return ret;
 	}
 	else
-		panic("apple-flash: SG splitting not implemented!\n");
+		return apple_vfl_nand_pages(_vfl, 1, _count, _ces, _pages,
+				_sg_data, _sg_num_data, _sg_oob, _sg_num_oob);
 }
 EXPORT_SYMBOL_GPL(apple_vfl_write_nand_pages);
 
@@ -347,6 +668,19 @@ int apple_vfl_write_nand_page(struct apple_vfl *_vfl, u16 _ce,
 }
 EXPORT_SYMBOL_GPL(apple_vfl_write_nand_page);
 
+int apple_vfl_erase_nand_block(struct apple_vfl *_vfl, u16 _ce,
+		page_t _page)
+{
+	struct apple_chip_map *map;
+
+	if(_ce >= _vfl->num_chips)
+		return -EINVAL;
+
+	map = &_vfl->chips[_ce];
+	return apple_nand_erase_block(_vfl->devices[map->bus], map->chip, _page);
+}
+EXPORT_SYMBOL_GPL(apple_vfl_erase_nand_block);
+
 int apple_vfl_read_page(struct apple_vfl *_vfl, page_t _page,
 		uint8_t *_data, uint8_t *_oob)
 {
@@ -379,32 +713,47 @@ int apple_vfl_write_page(struct apple_vfl *_vfl, page_t _page,
 }
 EXPORT_SYMBOL_GPL(apple_vfl_write_page);
 
+static LIST_HEAD(apple_vfl_list);
+static LIST_HEAD(apple_vfl_users);
+static DEFINE_MUTEX(apple_vfl_mutex);
+
 void apple_vfl_init(struct apple_vfl *_vfl)
 {
-	_vfl->devices = kzalloc(GFP_KERNEL, sizeof(*_vfl->devices)*_vfl->max_devices);
+	_vfl->devices = kzalloc(sizeof(*_vfl->devices)*_vfl->max_devices, GFP_KERNEL);
 
 	if(!_vfl->max_chips)
 		_vfl->max_chips = _vfl->max_devices*8;
 
-	_vfl->chips = kzalloc(GFP_KERNEL, sizeof(*_vfl->chips)*_vfl->max_chips);
+	_vfl->chips = kzalloc(sizeof(*_vfl->chips)*_vfl->max_chips, GFP_KERNEL);
+	INIT_LIST_HEAD(&_vfl->list);
 }
 EXPORT_SYMBOL_GPL(apple_vfl_init);
 
-int apple_vfl_register(struct apple_vfl *_vfl, enum apple_vfl_detection _detect)
+static void apple_vfl_announce(struct apple_vfl *_vfl)
 {
-	int i, ret;
-	u8 sigbuf[264];
-	u32 flags;
-	struct apple_chip_map *dc = &_vfl->chips[0];
+	struct apple_vfl_user *user;
+
+	mutex_lock(&apple_vfl_mutex);
+	list_add_tail(&_vfl->list, &apple_vfl_list);
+	list_for_each_entry(user, &apple_vfl_users, list)
+		user->add(_vfl);
+	mutex_unlock(&apple_vfl_mutex);
+}
+
+static int apple_vfl_map_chips(struct apple_vfl *_vfl)
+{
+	int i;
 
-	// Setup Chip Map
 	if(!_vfl->num_devices)
 	{
 		printk(KERN_WARNING "apple-flash: no devices!\n");
 		return -ENOENT;
 	}
-	
-	// This algo is wrong, fix it.
+
+	_vfl->num_chips = 0;
+
+	// Chips are numbered in bus order, then in the order of the
+	// bits set in each bus's chip-enable bitmap.
 	for(i = 0; i < _vfl->num_devices; i++)
 	{
 		struct apple_nand *nand = _vfl->devices[i];
@@ -428,11 +777,29 @@ int apple_vfl_register(struct apple_vfl *_vfl, enum apple_vfl_detection _detect)
 
 			map->bus = i;
 			map->chip = idx;
+
+			idx++;
+			bmap >>= 1;
 		}
 
 		_vfl->num_chips += count;
 	}
 
+	return 0;
+}
+
+int apple_vfl_register(struct apple_vfl *_vfl, enum apple_vfl_detection _detect)
+{
+	int ret;
+	u8 sigbuf[264];
+	u32 flags;
+	struct apple_chip_map *dc = &_vfl->chips[0];
+
+	// Setup Chip Map
+	ret = apple_vfl_map_chips(_vfl);
+	if(ret < 0)
+		return ret;
+
 	printk(KERN_INFO "%s: detecting VFL on (%d, %u)...\n", __func__, dc->bus, dc->chip);
 
 	// Detect VFL type
@@ -505,20 +872,83 @@ int apple_vfl_register(struct apple_vfl *_vfl, enum apple_vfl_detection _detect)
 		return ret;
 	}
 
+	apple_vfl_announce(_vfl);
 	return 0;
 }
 EXPORT_SYMBOL_GPL(apple_vfl_register);
 
+int apple_vfl_add(struct apple_vfl *_vfl)
+{
+	int ret;
+
+	if(!_vfl->read || !_vfl->write || !_vfl->get)
+		return -EINVAL;
+
+	ret = apple_vfl_map_chips(_vfl);
+	if(ret < 0)
+		return ret;
+
+	apple_vfl_announce(_vfl);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(apple_vfl_add);
+
 void apple_vfl_unregister(struct apple_vfl *_vfl)
 {
+	struct apple_vfl_user *user;
+	int i;
+
+	mutex_lock(&apple_vfl_mutex);
+	if(!list_empty(&_vfl->list))
+	{
+		list_for_each_entry(user, &apple_vfl_users, list)
+			user->remove(_vfl);
+		list_del_init(&_vfl->list);
+	}
+	mutex_unlock(&apple_vfl_mutex);
+
+	if(_vfl->cleanup)
+		_vfl->cleanup(_vfl);
+
+	// Let go of the NAND devices, so they can be registered again.
+	for(i = 0; i < _vfl->num_devices; i++)
+	{
+		if(_vfl->devices[i])
+			apple_nand_unregister(_vfl->devices[i]);
+	}
+
 	kfree(_vfl->chips);
 	kfree(_vfl->devices);
+	_vfl->chips = NULL;
+	_vfl->devices = NULL;
+	_vfl->num_devices = 0;
+	_vfl->num_chips = 0;
 }
 EXPORT_SYMBOL_GPL(apple_vfl_unregister);
 
-//
-// FTL
-//
+void apple_vfl_register_user(struct apple_vfl_user *_user)
+{
+	struct apple_vfl *vfl;
+
+	mutex_lock(&apple_vfl_mutex);
+	list_add_tail(&_user->list, &apple_vfl_users);
+	list_for_each_entry(vfl, &apple_vfl_list, list)
+		_user->add(vfl);
+	mutex_unlock(&apple_vfl_mutex);
+}
+EXPORT_SYMBOL_GPL(apple_vfl_register_user);
+
+void apple_vfl_unregister_user(struct apple_vfl_user *_user)
+{
+	struct apple_vfl *vfl;
+
+	mutex_lock(&apple_vfl_mutex);
+	list_for_each_entry(vfl, &apple_vfl_list, list)
+		_user->remove(vfl);
+	list_del(&_user->list);
+	mutex_unlock(&apple_vfl_mutex);
+}
+EXPORT_SYMBOL_GPL(apple_vfl_unregister_user);
 
 MODULE_AUTHOR("Ricky Taylor <rickytaylor26@gmail.com>");
 MODULE_DESCRIPTION("API for Apple Mobile Device NAND.");
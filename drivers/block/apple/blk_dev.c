@@ -0,0 +1,445 @@
+#include <linux/module.h>
+#include <linux/blkdev.h>
+#include <linux/hdreg.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/apple_flash.h>
+
+#define APPLE_FTL_BLK_MINORS 16
+
+// Requests we pull off the elevator before the worker has to catch up.
+#define APPLE_FTL_BLK_MAX_INFLIGHT 16
+
+// Largest request, in FTL pages. Requests that don't start and end on a
+// page boundary are bounced, so this also sizes the bounce buffer.
+#define APPLE_FTL_BLK_MAX_PAGES 64
+
+#define APPLE_FTL_BLK_MAX_SEGMENTS 128
+
+struct apple_ftl_blk
+{
+	struct apple_ftl *ftl;
+	int index;
+
+	spinlock_t lock;
+	struct request_queue *queue;
+	struct gendisk *disk;
+	struct workqueue_struct *wq;
+	struct work_struct work;
+	struct list_head pending;
+	int inflight;
+
+	size_t page_size;
+	size_t num_pages;
+
+	page_t *pages;
+	struct scatterlist *sg;
+	size_t sg_max;
+
+	struct page **bounce;
+	struct scatterlist *bounce_sg;
+	size_t bounce_num;
+};
+
+static int apple_ftl_blk_major;
+static atomic_t apple_ftl_blk_count = ATOMIC_INIT(0);
+
+// Copies between the request's segments and the bounce buffer,
+// starting _offset bytes into the bounce buffer.
+static void apple_ftl_blk_bounce(struct apple_ftl_blk *_blk,
+		struct request *_req, size_t _offset, int _gather)
+{
+	struct req_iterator iter;
+	struct bio_vec *bvec;
+
+	rq_for_each_segment(bvec, _req, iter) {
+		unsigned long flags;
+		char *buf = bvec_kmap_irq(bvec, &flags);
+		size_t done = 0;
+
+		while(done < bvec->bv_len)
+		{
+			size_t off = _offset % PAGE_SIZE;
+			size_t amt = min_t(size_t, bvec->bv_len - done, PAGE_SIZE - off);
+			u8 *bounce = page_address(_blk->bounce[_offset / PAGE_SIZE]) + off;
+
+			if(_gather)
+				memcpy(bounce, buf + done, amt);
+			else
+				memcpy(buf + done, bounce, amt);
+
+			done += amt;
+			_offset += amt;
+		}
+
+		flush_kernel_dcache_page(bvec->bv_page);
+		bvec_kunmap_irq(buf, &flags);
+	}
+}
+
+// Moves _count pages between the FTL and the bounce buffer, starting
+// _skip pages into the request.
+static int apple_ftl_blk_bounce_io(struct apple_ftl_blk *_blk, int _write,
+		size_t _skip, size_t _count)
+{
+	size_t used = 0;
+	int ret;
+
+	sg_init_table(_blk->sg, _blk->sg_max);
+	ret = apple_sg_copy_range(_blk->sg, _blk->sg_max, &used,
+			_blk->bounce_sg, _blk->bounce_num,
+			_skip * _blk->page_size, _count * _blk->page_size);
+	if(ret)
+		return ret;
+
+	sg_mark_end(&_blk->sg[used-1]);
+
+	if(_write)
+		return _blk->ftl->write(_blk->ftl, _count, _blk->pages + _skip,
+				_blk->sg, used);
+	else
+		return _blk->ftl->read(_blk->ftl, _count, _blk->pages + _skip,
+				_blk->sg, used);
+}
+
+static int apple_ftl_blk_transfer(struct apple_ftl_blk *_blk, struct request *_req)
+{
+	u64 start = (u64)blk_rq_pos(_req) << 9;
+	size_t len = blk_rq_bytes(_req);
+	int write = rq_data_dir(_req);
+	size_t offset, count, i;
+	page_t first;
+	int ret;
+
+	if(_req->cmd_flags & REQ_FLUSH)
+	{
+		if(_blk->ftl->sync)
+		{
+			ret = _blk->ftl->sync(_blk->ftl);
+			if(ret < 0)
+				return ret;
+		}
+
+		if(!len)
+			return 0;
+	}
+
+	offset = do_div(start, _blk->page_size);
+	first = start;
+	count = DIV_ROUND_UP(offset + len, _blk->page_size);
+
+	if(first + count > _blk->num_pages || count > APPLE_FTL_BLK_MAX_PAGES + 1)
+		return -EIO;
+
+	for(i = 0; i < count; i++)
+		_blk->pages[i] = first + i;
+
+	// Whole pages go straight to the FTL.
+	if(!offset && !(len % _blk->page_size))
+	{
+		int num;
+
+		sg_init_table(_blk->sg, _blk->sg_max);
+		num = blk_rq_map_sg(_blk->queue, _req, _blk->sg);
+		if(!num)
+			return -EIO;
+
+		if(write)
+			ret = _blk->ftl->write(_blk->ftl, count, _blk->pages, _blk->sg, num);
+		else
+			ret = _blk->ftl->read(_blk->ftl, count, _blk->pages, _blk->sg, num);
+
+		return ret < 0 ? ret : 0;
+	}
+
+	if(!write)
+	{
+		ret = apple_ftl_blk_bounce_io(_blk, 0, 0, count);
+		if(ret < 0)
+			return ret;
+
+		apple_ftl_blk_bounce(_blk, _req, offset, 0);
+		return 0;
+	}
+
+	// Partial pages at either end have to be read back first.
+	if(offset)
+	{
+		ret = apple_ftl_blk_bounce_io(_blk, 0, 0, 1);
+		if(ret < 0)
+			return ret;
+	}
+
+	if((offset + len) % _blk->page_size && (count > 1 || !offset))
+	{
+		ret = apple_ftl_blk_bounce_io(_blk, 0, count - 1, 1);
+		if(ret < 0)
+			return ret;
+	}
+
+	apple_ftl_blk_bounce(_blk, _req, offset, 1);
+	ret = apple_ftl_blk_bounce_io(_blk, 1, 0, count);
+	return ret < 0 ? ret : 0;
+}
+
+// Pulls requests off the elevator into our pending list. Must be called
+// with the queue lock held.
+static void apple_ftl_blk_fetch(struct apple_ftl_blk *_blk)
+{
+	struct request *req;
+
+	while(_blk->inflight < APPLE_FTL_BLK_MAX_INFLIGHT)
+	{
+		req = blk_fetch_request(_blk->queue);
+		if(!req)
+			break;
+
+		if(req->cmd_type != REQ_TYPE_FS)
+		{
+			__blk_end_request_all(req, -EIO);
+			continue;
+		}
+
+		list_add_tail(&req->queuelist, &_blk->pending);
+		_blk->inflight++;
+	}
+}
+
+static void apple_ftl_blk_work(struct work_struct *_work)
+{
+	struct apple_ftl_blk *blk = container_of(_work, struct apple_ftl_blk, work);
+	unsigned long flags;
+
+	while(true)
+	{
+		struct request *req;
+		int ret;
+
+		spin_lock_irqsave(&blk->lock, flags);
+		if(list_empty(&blk->pending))
+		{
+			spin_unlock_irqrestore(&blk->lock, flags);
+			return;
+		}
+
+		req = list_first_entry(&blk->pending, struct request, queuelist);
+		list_del_init(&req->queuelist);
+		spin_unlock_irqrestore(&blk->lock, flags);
+
+		ret = apple_ftl_blk_transfer(blk, req);
+		blk_end_request_all(req, ret);
+
+		spin_lock_irqsave(&blk->lock, flags);
+		blk->inflight--;
+		apple_ftl_blk_fetch(blk);
+		spin_unlock_irqrestore(&blk->lock, flags);
+	}
+}
+
+static void apple_ftl_blk_request(struct request_queue *_q)
+{
+	struct apple_ftl_blk *blk = _q->queuedata;
+
+	apple_ftl_blk_fetch(blk);
+
+	if(!list_empty(&blk->pending))
+		queue_work(blk->wq, &blk->work);
+}
+
+static int apple_ftl_blk_busy(struct request_queue *_q)
+{
+	struct apple_ftl_blk *blk = _q->queuedata;
+	return blk->inflight >= APPLE_FTL_BLK_MAX_INFLIGHT;
+}
+
+static int apple_ftl_blk_getgeo(struct block_device *_bdev, struct hd_geometry *_geo)
+{
+	_geo->heads = 64;
+	_geo->sectors = 32;
+	_geo->cylinders = get_capacity(_bdev->bd_disk) / (_geo->heads * _geo->sectors);
+	return 0;
+}
+
+static int apple_ftl_blk_release(struct gendisk *_disk, fmode_t _mode)
+{
+	struct apple_ftl_blk *blk = _disk->private_data;
+
+	if(blk->ftl->sync)
+		blk->ftl->sync(blk->ftl);
+
+	return 0;
+}
+
+static struct block_device_operations apple_ftl_blk_fops =
+{
+	.owner		= THIS_MODULE,
+	.getgeo		= apple_ftl_blk_getgeo,
+	.release	= apple_ftl_blk_release,
+};
+
+static void apple_ftl_blk_free(struct apple_ftl_blk *_blk)
+{
+	size_t i;
+
+	if(_blk->bounce)
+	{
+		for(i = 0; i < _blk->bounce_num; i++)
+		{
+			if(_blk->bounce[i])
+				__free_page(_blk->bounce[i]);
+		}
+	}
+
+	if(_blk->wq)
+		destroy_workqueue(_blk->wq);
+
+	kfree(_blk->bounce);
+	kfree(_blk->bounce_sg);
+	kfree(_blk->sg);
+	kfree(_blk->pages);
+	kfree(_blk);
+}
+
+int apple_ftl_register(struct apple_ftl *_ftl)
+{
+	struct apple_ftl_blk *blk;
+	size_t i;
+	int ret;
+
+	if(_ftl->blk)
+		panic("apple_ftl: tried to register an FTL more than once.\n");
+
+	blk = kzalloc(sizeof(*blk), GFP_KERNEL);
+	if(!blk)
+		return -ENOMEM;
+
+	blk->ftl = _ftl;
+	blk->index = atomic_inc_return(&apple_ftl_blk_count) - 1;
+	blk->page_size = apple_ftl_get(_ftl, NAND_PAGE_SIZE);
+	blk->num_pages = apple_ftl_get(_ftl, FTL_NUM_PAGES);
+	if(!blk->page_size || (blk->page_size & 511) || !blk->num_pages)
+	{
+		printk(KERN_ERR "apple_ftl: bad geometry, %zu pages of %zu bytes.\n",
+				blk->num_pages, blk->page_size);
+		kfree(blk);
+		return -EINVAL;
+	}
+
+	spin_lock_init(&blk->lock);
+	INIT_LIST_HEAD(&blk->pending);
+	INIT_WORK(&blk->work, apple_ftl_blk_work);
+
+	// An unaligned request can touch one page more than it is long.
+	blk->bounce_num = DIV_ROUND_UP((APPLE_FTL_BLK_MAX_PAGES + 1) * blk->page_size, PAGE_SIZE);
+	blk->sg_max = max_t(size_t, APPLE_FTL_BLK_MAX_SEGMENTS, blk->bounce_num);
+	blk->pages = kmalloc(sizeof(*blk->pages) * (APPLE_FTL_BLK_MAX_PAGES + 1), GFP_KERNEL);
+	blk->sg = kmalloc(sizeof(*blk->sg) * blk->sg_max, GFP_KERNEL);
+	blk->bounce_sg = kmalloc(sizeof(*blk->bounce_sg) * blk->bounce_num, GFP_KERNEL);
+	blk->bounce = kzalloc(sizeof(*blk->bounce) * blk->bounce_num, GFP_KERNEL);
+	blk->wq = create_singlethread_workqueue("apple_ftl_blk");
+	if(!blk->pages || !blk->sg || !blk->bounce_sg || !blk->bounce || !blk->wq)
+	{
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	sg_init_table(blk->bounce_sg, blk->bounce_num);
+	for(i = 0; i < blk->bounce_num; i++)
+	{
+		blk->bounce[i] = alloc_page(GFP_KERNEL);
+		if(!blk->bounce[i])
+		{
+			ret = -ENOMEM;
+			goto err_free;
+		}
+
+		sg_set_page(&blk->bounce_sg[i], blk->bounce[i], PAGE_SIZE, 0);
+	}
+
+	blk->queue = blk_init_queue(apple_ftl_blk_request, &blk->lock);
+	if(!blk->queue)
+	{
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	blk->queue->queuedata = blk;
+	blk_queue_lld_busy(blk->queue, apple_ftl_blk_busy);
+	blk_queue_flush(blk->queue, REQ_FLUSH);
+	blk_queue_bounce_limit(blk->queue, BLK_BOUNCE_ANY);
+	blk_queue_max_hw_sectors(blk->queue, (APPLE_FTL_BLK_MAX_PAGES * blk->page_size) >> 9);
+	blk_queue_max_segments(blk->queue, APPLE_FTL_BLK_MAX_SEGMENTS);
+	blk_queue_logical_block_size(blk->queue, min_t(size_t, blk->page_size, PAGE_SIZE));
+	blk_queue_physical_block_size(blk->queue, blk->page_size);
+	blk_queue_io_min(blk->queue, blk->page_size);
+	blk_queue_io_opt(blk->queue, APPLE_FTL_BLK_MAX_PAGES * blk->page_size);
+	// the NAND DMA engine needs word aligned buffers
+	blk_queue_dma_alignment(blk->queue, 3);
+
+	blk->disk = alloc_disk(APPLE_FTL_BLK_MINORS);
+	if(!blk->disk)
+	{
+		ret = -ENOMEM;
+		goto err_queue;
+	}
+
+	blk->disk->major = apple_ftl_blk_major;
+	blk->disk->first_minor = blk->index * APPLE_FTL_BLK_MINORS;
+	blk->disk->fops = &apple_ftl_blk_fops;
+	blk->disk->private_data = blk;
+	blk->disk->queue = blk->queue;
+	snprintf(blk->disk->disk_name, sizeof(blk->disk->disk_name), "nand%d", blk->index);
+	set_capacity(blk->disk, ((sector_t)blk->num_pages * blk->page_size) >> 9);
+
+	_ftl->blk = blk;
+	add_disk(blk->disk);
+
+	printk(KERN_INFO "apple_ftl: %s, %zu pages of %zu bytes.\n",
+			blk->disk->disk_name, blk->num_pages, blk->page_size);
+	return 0;
+
+err_queue:
+	blk_cleanup_queue(blk->queue);
+
+err_free:
+	apple_ftl_blk_free(blk);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(apple_ftl_register);
+
+void apple_ftl_unregister(struct apple_ftl *_ftl)
+{
+	struct apple_ftl_blk *blk = _ftl->blk;
+
+	if(!blk)
+		return;
+
+	del_gendisk(blk->disk);
+	put_disk(blk->disk);
+	blk_cleanup_queue(blk->queue);
+	flush_workqueue(blk->wq);
+
+	if(_ftl->sync)
+		_ftl->sync(_ftl);
+
+	apple_ftl_blk_free(blk);
+	_ftl->blk = NULL;
+}
+EXPORT_SYMBOL_GPL(apple_ftl_unregister);
+
+static int __init apple_ftl_blk_init(void)
+{
+	apple_ftl_blk_major = register_blkdev(0, "apple-nand");
+	if(apple_ftl_blk_major < 0)
+		return apple_ftl_blk_major;
+
+	return 0;
+}
+module_init(apple_ftl_blk_init);
+
+static void __exit apple_ftl_blk_exit(void)
+{
+	unregister_blkdev(apple_ftl_blk_major, "apple-nand");
+}
+module_exit(apple_ftl_blk_exit);
@@ -19,6 +19,10 @@
 #include <linux/log2.h>
 #include <linux/kernel.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
 #include <linux/apple_flash.h>
 
 #include <plat/h2fmi.h>
@@ -28,6 +32,13 @@
 
 #define H2FMI_MAX_CHIPS			8
 
+// Queued transactions of the same kind are run through the
+// controller together, up to this many pages at a time.
+#define H2FMI_MAX_BATCH			64
+
+#define H2FMI_TIMEOUT			(HZ)
+#define H2FMI_POLL_INTERVAL		(1)
+
 static struct h2fmi_chip_info h2fmi_chip_info[] = {
     /* A4 */
 	// Micron
@@ -94,6 +105,14 @@ enum h2fmi_write_state
 	H2FMI_WRITE_COMPLETE
 };
 
+enum h2fmi_erase_state
+{
+	H2FMI_ERASE_BEGIN=0,
+	H2FMI_ERASE_ISSUE,
+	H2FMI_ERASE_WAIT,
+	H2FMI_ERASE_COMPLETE
+};
+
 enum h2fmi_write_mode
 {
 	H2FMI_WRITE_NORMAL=0,
@@ -104,8 +123,18 @@ enum h2fmi_write_mode
 	H2FMI_WRITE_MODE_5,
 };
 
+struct h2fmi_state;
+
 struct h2fmi_transaction
 {
+	enum h2fmi_status type;
+	struct list_head list;
+
+	// Called from the engine once the transaction has finished,
+	// result and the counters below are valid by then.
+	void (*done)(struct h2fmi_state *, struct h2fmi_transaction *);
+	void *done_data;
+
 	size_t count;
 
 	u16 *chips;
@@ -193,9 +222,35 @@ struct h2fmi_state
 	enum h2fmi_status state;
 	enum h2fmi_read_state read_state;
 	enum h2fmi_write_state write_state;
+	enum h2fmi_erase_state erase_state;
 	struct h2fmi_transaction transaction;
+	unsigned long deadline;
+
+	// Data and OOB transfers, the engine holds off on finishing the
+	// transaction until both have called back.
+	struct cdma_xfer dma_xfer[2];
+	atomic_t dma_pending;
+	int dma_result;
 
 	spinlock_t lock;
+	struct list_head queue;
+	struct list_head batch;
+
+	struct mutex engine_lock;
+	struct delayed_work work;
+
+	u32 irq_creq, irq_nirq;
+	unsigned irq_masked: 1;
+
+	// Sources h2fmi_wait is sleeping on, the IRQ handler completes
+	// wait_done rather than waking the thread for these.
+	spinlock_t irq_lock;
+	u32 wait_creq, wait_nirq;
+	struct completion wait_done;
+
+	u16 *batch_chips;
+	u32 *batch_pages;
+	struct scatterlist *batch_sg_data, *batch_sg_oob;
 
 	void *__iomem base_regs;
 	void *__iomem flash_regs;
@@ -300,17 +355,57 @@ static inline void h2fmi_disable_bus(struct h2fmi_state *_state)
 	writel(0, _state->flash_regs + H2FMI_CHIP_MASK);
 }
 
+static inline int h2fmi_wait_done(void *__iomem _reg, uint32_t _mask, uint32_t _val)
+{
+	return (readl(_reg) & _mask) == _val;
+}
+
 static int h2fmi_wait(struct h2fmi_state *_state, void *__iomem _reg,
 		uint32_t _mask, uint32_t _val)
 {
+	void *__iomem en_reg;
+	unsigned long flags;
+	u32 *wait;
 	int i;
 
-	for(i = 0; i < 10 && ((readl(_reg) & _mask) != _val); i++)
-		msleep(10);
+	// Command and address phases mostly finish within a few
+	// microseconds, so spin briefly before arming the IRQ.
+	for(i = 0; i < 10; i++)
+	{
+		if(h2fmi_wait_done(_reg, _mask, _val))
+			goto done;
+
+		udelay(1);
+	}
+
+	if(_reg == _state->flash_regs + H2FMI_NSTS)
+	{
+		en_reg = _state->flash_regs + H2FMI_UNK440;
+		wait = &_state->wait_nirq;
+	}
+	else
+	{
+		en_reg = _state->base_regs + H2FMI_CREQ;
+		wait = &_state->wait_creq;
+	}
+
+	spin_lock_irqsave(&_state->irq_lock, flags);
+	INIT_COMPLETION(_state->wait_done);
+	*wait = _mask;
+	writel(readl(en_reg) | _mask, en_reg);
+	spin_unlock_irqrestore(&_state->irq_lock, flags);
 
-	if(i == 10)
+	wait_for_completion_timeout(&_state->wait_done, msecs_to_jiffies(100));
+
+	spin_lock_irqsave(&_state->irq_lock, flags);
+	*wait = 0;
+	writel(readl(en_reg) &~ _mask, en_reg);
+	spin_unlock_irqrestore(&_state->irq_lock, flags);
+
+	if(!h2fmi_wait_done(_reg, _mask, _val))
 		return -ETIMEDOUT;
 
+done:
 	writel(_val, _reg);
 	return 0;
 }
@@ -607,8 +702,52 @@ static int h2fmi_transfer_ready(struct h2fmi_state *_state)
 static irqreturn_t h2fmi_irq_handler(int _irq, void *_dev)
 {
 	struct h2fmi_state *state = _dev;
-	dev_info(&state->dev->dev, "irq!\n");
-	return IRQ_HANDLED;
+	irqreturn_t ret = IRQ_NONE;
+	u32 creq, nirq, cpend, npend;
+
+	spin_lock(&state->irq_lock);
+
+	// CREQ and UNK440 only say which sources are enabled, the line is
+	// shared so only claim it if one of those is actually raised.
+	creq = readl(state->base_regs + H2FMI_CREQ);
+	nirq = readl(state->flash_regs + H2FMI_UNK440);
+	cpend = readl(state->base_regs + H2FMI_CSTS) & creq;
+	npend = readl(state->flash_regs + H2FMI_NSTS) & nirq;
+
+	if(!cpend && !npend)
+		goto out;
+
+	if((cpend & state->wait_creq) || (npend & state->wait_nirq))
+	{
+		creq &=~ state->wait_creq;
+		nirq &=~ state->wait_nirq;
+		cpend &=~ state->wait_creq;
+		npend &=~ state->wait_nirq;
+		state->wait_creq = 0;
+		state->wait_nirq = 0;
+
+		writel(creq, state->base_regs + H2FMI_CREQ);
+		writel(nirq, state->flash_regs + H2FMI_UNK440);
+		complete(&state->wait_done);
+		ret = IRQ_HANDLED;
+
+		if(!cpend && !npend)
+			goto out;
+	}
+
+	// Mask the sources until the thread has advanced the state
+	// machine, it re-arms whatever is still being waited for.
+	// Anything h2fmi_wait is sleeping on stays enabled.
+	state->irq_creq = creq &~ state->wait_creq;
+	state->irq_nirq = nirq &~ state->wait_nirq;
+	state->irq_masked = 1;
+	writel(state->wait_creq, state->base_regs + H2FMI_CREQ);
+	writel(state->wait_nirq, state->flash_regs + H2FMI_UNK440);
+	ret = IRQ_WAKE_THREAD;
+
+out:
+	spin_unlock(&state->irq_lock);
+	return ret;
 }
 
 static u8 h2fmi_calculate_ecc_bits(struct h2fmi_state *_state)
@@ -742,25 +881,66 @@ static void h2fmi_mark_block_bad(struct h2fmi_state *_state, int _ce,
 		_state->bbt[_ce][bb] |= (1 << bi);
 }
 
+static void h2fmi_dma_done(struct cdma_xfer *_xfer, int _result)
+{
+	struct h2fmi_state *state = _xfer->callback_param;
+
+	if(_result && _result != -ECANCELED)
+		state->dma_result = _result;
+
+	if(atomic_dec_and_test(&state->dma_pending))
+		schedule_delayed_work(&state->work, 0);
+}
+
+static void h2fmi_setup_dma(struct h2fmi_state *_state, struct cdma_xfer *_xfer,
+		cdma_dir_t _dir, struct scatterlist *_sg, size_t _sg_num, size_t _size,
+		dma_addr_t _reg, size_t _burst, size_t _busw, u32 _pid)
+{
+	_xfer->dir = _dir;
+	_xfer->sg = _sg;
+	_xfer->sg_count = _sg_num;
+	_xfer->size = _size;
+	_xfer->reg = _reg;
+	_xfer->burst = _burst;
+	_xfer->busw = _busw;
+	_xfer->pid = _pid;
+	_xfer->callback = h2fmi_dma_done;
+	_xfer->callback_param = _state;
+}
+
 static int h2fmi_rw_large_page(struct h2fmi_state *_state)
 {
 	int ret;
 
 	cdma_dir_t dir = (_state->state != H2FMI_READ) ? CDMA_FROM_MEM: CDMA_TO_MEM;
 
-	ret = cdma_begin(_state->pdata->dma0, dir,
+	h2fmi_setup_dma(_state, &_state->dma_xfer[0], dir,
 			_state->transaction.sg_data, _state->transaction.sg_num_data,
 			_state->geo.bytes_per_page*_state->transaction.count,
 			_state->base_dma + H2FMI_DATA0, 4, 8, _state->pdata->pid0);
-	if(ret)
-		return ret;
 
-	ret = cdma_begin(_state->pdata->dma1, dir,
+	h2fmi_setup_dma(_state, &_state->dma_xfer[1], dir,
 			_state->transaction.sg_oob, _state->transaction.sg_num_oob,
 			_state->geo.oob_size*_state->transaction.count,
 			_state->base_dma + H2FMI_DATA1, 1, 1, _state->pdata->pid1);
+
+	_state->dma_result = 0;
+	atomic_set(&_state->dma_pending, 2);
+
+	ret = cdma_submit(_state->pdata->dma0, &_state->dma_xfer[0]);
+	if(ret)
+	{
+		atomic_set(&_state->dma_pending, 0);
+		_state->dma_result = ret;
+		return ret;
+	}
+
+	ret = cdma_submit(_state->pdata->dma1, &_state->dma_xfer[1]);
 	if(ret)
 	{
+		// The cancel calls back for dma0.
+		atomic_dec(&_state->dma_pending);
+		_state->dma_result = ret;
 		cdma_cancel(_state->pdata->dma0);
 		return ret;
 	}
@@ -934,7 +1114,7 @@ static int h2fmi_read_state_machine(struct h2fmi_state *_state)
 		return -EINVAL;
 	}
 
-	if(_state->read_state > ARRAY_SIZE(fns))
+	if(_state->read_state >= ARRAY_SIZE(fns))
 	{
 		dev_err(&_state->dev->dev, "invalid read state %d.\n", _state->read_state);
 		return -EINVAL;
@@ -943,128 +1123,58 @@ static int h2fmi_read_state_machine(struct h2fmi_state *_state)
 	return fns[_state->read_state](_state);
 }
 
-// TODO: convert to scatterlist
-static int h2fmi_read_pages(struct h2fmi_state *_state, int _count,
-		u16 *_ces, u32 *_pages,
-		struct scatterlist *_sg_data, size_t _sg_num_data,
-		struct scatterlist *_sg_oob, size_t _sg_num_oob,
-		u8 *_eccres, u8 *_eccbuf)
+static void h2fmi_read_unwhiten(struct h2fmi_state *_state)
 {
+	struct scatterlist *sg = _state->transaction.sg_oob;
+	int count = _state->transaction.sg_num_oob;
+	size_t sg_off = 0;
 	int i, j;
 
-	if(_state->state != H2FMI_IDLE)
-		return -EBUSY;
-
-	memset(&_state->transaction, 0, sizeof(_state->transaction));
-
-	_state->transaction.count = _count;
-	_state->transaction.chips = _ces;
-	_state->transaction.pages = _pages;
-
-	_state->transaction.sg_data = _sg_data;
-	_state->transaction.sg_num_data = _sg_num_data;
-
-	_state->transaction.sg_oob = _sg_oob;
-	_state->transaction.sg_num_oob = _sg_num_oob;
-
-	_state->transaction.eccres = _eccres;
-	_state->transaction.eccbuf = _eccbuf;
-
-	spin_lock(&_state->lock);
-	_state->state = H2FMI_READ;
-	_state->read_state = H2FMI_READ_BEGIN;
-
-	h2fmi_reset(_state);
-	h2fmi_clear_ecc_buf(_state);
-
-	while(_state->read_state != H2FMI_READ_COMPLETE)
-		h2fmi_read_state_machine(_state);
-
-	if(_state->transaction.busy)
+	for(i = 0; i < _state->transaction.count; i++)
 	{
-		if(cdma_wait(_state->pdata->dma0)
-				|| cdma_wait(_state->pdata->dma1))
+		u8 *sg_ptr, *ptr;
+		u32 *p;
+
+		if(!count || !sg)
 		{
-			dev_err(&_state->dev->dev, "failed to wait for DMA completion.\n");
-			_state->transaction.result = -ETIMEDOUT;
+			printk(KERN_WARNING "h2fmi: not enough SGs for metadata!\n");
+			break;
 		}
-		else
-			_state->transaction.result = 0;
-	}
-
-	cdma_cancel(_state->pdata->dma0);
-	cdma_cancel(_state->pdata->dma1);
-
-	_state->state = H2FMI_IDLE;
-	spin_unlock(&_state->lock);
-	h2fmi_clear_interrupt(_state);
 
-	// metadata whitening
-	{
-		struct scatterlist *sg = _state->transaction.sg_oob;
-		int count = _state->transaction.sg_num_oob;
-		size_t sg_off = 0;
+		sg_ptr = sg_virt(sg);
+		ptr = sg_ptr + sg_off;
+		p = (u32*)ptr;
 
-		for(i = 0; i < _count; i++)
+		if(!sg_ptr)
 		{
-			u8 *sg_ptr, *ptr;
-			u32 *p;
-
-			if(!count || !sg)
-			{
-				printk(KERN_WARNING "h2fmi: not enough SGs for metadata!\n");
+			if(!i)
 				break;
-			}
 
-			sg_ptr = sg_virt(sg);
-			ptr = sg_ptr + sg_off;
-			p = (u32*)ptr;
+			panic("Not enough SGs for metadata! Not caught earlier!\n");
+		}
 
-			if(!sg_ptr)
-			{
-				if(!i)
-					break;
-				
-				panic("Not enough SGs for metadata! Not caught earlier!\n");
-			}
+		if(sg->length - sg_off < _state->geo.oob_alloc_size)
+			panic("SG too small for metadata whitening. %d-%d.\n", sg->length, sg_off);
 
-			if(sg->length - sg_off < _state->geo.oob_alloc_size)
-				panic("SG too small for metadata whitening. %d-%d.\n", sg->length, sg_off);
+		if(!_state->whitening_disabled)
+			for(j = 0; j < 4; j++)
+				p[j] ^= h2fmi_hash_table[(j + _state->transaction.pages[i])
+					% ARRAY_SIZE(h2fmi_hash_table)];
 
-			if(!_state->whitening_disabled)
-				for(j = 0; j < 4; j++)
-					p[i] ^= h2fmi_hash_table[(j + _pages[i])
-						% ARRAY_SIZE(h2fmi_hash_table)];
-			
-			for(j = _state->geo.oob_size; j < _state->geo.oob_alloc_size; j++)
-				ptr[j] = 0xFF;
+		for(j = _state->geo.oob_size; j < _state->geo.oob_alloc_size; j++)
+			ptr[j] = 0xFF;
 
-			sg_off += _state->geo.oob_alloc_size;
-			if(sg_off >= sg->length)
-			{
-				if(count == 0)
-					continue;
+		sg_off += _state->geo.oob_alloc_size;
+		if(sg_off >= sg->length)
+		{
+			if(count == 0)
+				continue;
 
-				sg = sg_next(sg);
-				sg_off = 0;
-				count--;
-			}
+			sg = sg_next(sg);
+			sg_off = 0;
+			count--;
 		}
 	}
-
-	if(_state->transaction.result)
-		return _state->transaction.result;
-
-	if(_state->transaction.num_failed)
-		return -EIO;
-
-	if(_state->transaction.num_ecc)
-		return -EUCLEAN;
-
-	if(_state->transaction.num_empty)
-		return -ENOENT;
-
-	return 0;
 }
 
 static int h2fmi_write_prepare_ce(struct h2fmi_state *_state)
@@ -1098,24 +1208,6 @@ static int h2fmi_write_ready(struct h2fmi_state *_state)
 	return 0;
 }
 
-static int h2fmi_erase_prepare(struct h2fmi_state *_state)
-{
-	int ret = h2fmi_prepare_transfer(_state);
-	if(ret)
-		return ret;
-
-	while(1) // TODO: use the interrupts for this? : <
-	{
-		ret = h2fmi_write_ready(_state);
-		if(ret == 0)
-			continue;
-
-		break;
-	}
-
-	return ret;
-}
-
 static inline int h2fmi_write_seqin(struct h2fmi_state *_state, int _page)
 {
 	h2fmi_set_address(_state, _page);
@@ -1181,8 +1273,8 @@ static int h2fmi_write_state_5(struct h2fmi_state *_state)
 		_state->transaction.result = rdy;
 		_state->transaction.chip_mask &=~ (1 <<
 				_state->transaction.chips[_state->transaction.curr]);
-		_state->write_state = H2FMI_WRITE_5;
-		return rdy;
+		_state->write_state = H2FMI_WRITE_4;
+		return h2fmi_write_state_4(_state);
 	}
 	else
 	{
@@ -1222,8 +1314,8 @@ static int h2fmi_write_state_2(struct h2fmi_state *_state)
 		_state->transaction.result = rdy;
 		_state->transaction.chip_mask &=~ (1 <<
 				_state->transaction.chips[_state->transaction.curr]);
-		_state->write_state = H2FMI_WRITE_5;
-		return rdy;
+		_state->write_state = H2FMI_WRITE_4;
+		return h2fmi_write_state_4(_state);
 	}
 	else
 	{
@@ -1330,13 +1422,13 @@ static int h2fmi_write_state_machine(struct h2fmi_state *_state)
 		h2fmi_write_complete,
 	};
 
-	if(_state->state != H2FMI_READ)
+	if(_state->state != H2FMI_WRITE)
 	{
 		dev_err(&_state->dev->dev, "write_state_machine called whilst not writeing!\n");
 		return -EINVAL;
 	}
 
-	if(_state->write_state > ARRAY_SIZE(fns))
+	if(_state->write_state >= ARRAY_SIZE(fns))
 	{
 		dev_err(&_state->dev->dev, "invalid write state %d.\n", _state->write_state);
 		return -EINVAL;
@@ -1345,181 +1437,628 @@ static int h2fmi_write_state_machine(struct h2fmi_state *_state)
 	return fns[_state->write_state](_state);
 }
 
-static int h2fmi_write_pages(struct h2fmi_state *_state, int _count,
-		u16 *_chips, u32 *_pages,
-		struct scatterlist *_sg_data, size_t _sg_num_data,
-		struct scatterlist *_sg_oob, size_t _sg_num_oob,
-		enum h2fmi_write_mode _mode)
+static int h2fmi_erase_issue(struct h2fmi_state *_state)
 {
-	if(_state->state != H2FMI_IDLE)
-		return -EBUSY;
+	// Start an erase on every CE that isn't busy yet, stopping
+	// at the first block whose CE is still erasing.
+	while(_state->transaction.curr < _state->transaction.count)
+	{
+		int chip = _state->transaction.chips[_state->transaction.curr];
+		if(_state->transaction.chip_mask & (1 << chip))
+			break;
 
-	memset(&_state->transaction, 0, sizeof(_state->transaction));
+		h2fmi_disable_bus(_state);
+		h2fmi_enable_chip(_state, chip);
+		h2fmi_set_block_address(_state,
+				_state->transaction.pages[_state->transaction.curr]);
+		h2fmi_send_cmd(_state,
+				NAND_CMD_ERASE1
+				| (NAND_CMD_ERASE2 << 8), 0xb);
+
+		_state->transaction.chip_mask |= (1 << chip);
+		_state->transaction.curr++;
+	}
+
+	if(!_state->transaction.chip_mask)
+	{
+		_state->erase_state = H2FMI_ERASE_COMPLETE;
+		return 0;
+	}
 
-	_state->transaction.count = _count;
-	_state->transaction.chips = _chips;
-	_state->transaction.pages = _pages;
+	// Wait for the first busy CE to come back.
+	h2fmi_disable_bus(_state);
+	h2fmi_enable_chip(_state, ffs(_state->transaction.chip_mask)-1);
 
-	_state->transaction.sg_data = _sg_data;
-	_state->transaction.sg_num_data = _sg_num_data;
+	_state->erase_state = H2FMI_ERASE_WAIT;
+	return h2fmi_prepare_transfer(_state);
+}
 
-	_state->transaction.sg_oob = _sg_oob;
-	_state->transaction.sg_num_oob = _sg_num_oob;
+static int h2fmi_erase_wait(struct h2fmi_state *_state)
+{
+	int chip = ffs(_state->transaction.chip_mask)-1;
+	int rdy = h2fmi_write_ready(_state);
 
-	_state->transaction.write_mode = _mode;
+	if(!rdy)
+		return 0;
 
-	spin_lock(&_state->lock);
-	_state->state = H2FMI_WRITE;
-	_state->write_state = H2FMI_WRITE_BEGIN;
+	h2fmi_clear_interrupt(_state);
+	writel(0, _state->flash_regs + H2FMI_NREQ);
 
-	// TODO: data whitening?
+	if(rdy < 0)
+	{
+		dev_err(&_state->dev->dev,
+				"failed to erase block on ce%d, err %d.\n",
+				chip, rdy);
 
-	h2fmi_reset(_state);
-	h2fmi_set_timing_mode(_state, 1);
+		// TODO: store which chip failed?
 
-	while(_state->write_state != H2FMI_WRITE_COMPLETE)
-		h2fmi_write_state_machine(_state);
+		_state->transaction.result = -EIO;
+	}
 
-	if(_state->transaction.busy)
+	_state->transaction.chip_mask &=~ (1 << chip);
+
+	_state->erase_state = H2FMI_ERASE_ISSUE;
+	return h2fmi_erase_issue(_state);
+}
+
+static int h2fmi_erase_begin(struct h2fmi_state *_state)
+{
+	_state->transaction.curr = 0;
+	_state->transaction.chip_mask = 0;
+
+	_state->erase_state = H2FMI_ERASE_ISSUE;
+	return h2fmi_erase_issue(_state);
+}
+
+static int h2fmi_erase_state_machine(struct h2fmi_state *_state)
+{
+	static int (*fns[])(struct h2fmi_state*) = {
+		h2fmi_erase_begin,
+		h2fmi_erase_issue,
+		h2fmi_erase_wait,
+	};
+
+	if(_state->state != H2FMI_ERASE)
 	{
-		if(cdma_wait(_state->pdata->dma0)
-				|| cdma_wait(_state->pdata->dma1))
+		dev_err(&_state->dev->dev, "erase_state_machine called whilst not erasing!\n");
+		return -EINVAL;
+	}
+
+	if(_state->erase_state >= ARRAY_SIZE(fns))
+	{
+		dev_err(&_state->dev->dev, "invalid erase state %d.\n", _state->erase_state);
+		return -EINVAL;
+	}
+
+	return fns[_state->erase_state](_state);
+}
+
+//
+// Transaction engine
+//
+// Transactions are queued with h2fmi_submit and run one batch at a time.
+// The state machines only ever return when they are waiting on the
+// hardware, at which point the IRQ (or, failing that, the poll work)
+// brings us back into h2fmi_advance to carry on.
+//
+
+static int h2fmi_substate(struct h2fmi_state *_state)
+{
+	switch(_state->state)
+	{
+	case H2FMI_READ:
+		return _state->read_state;
+
+	case H2FMI_WRITE:
+		return _state->write_state;
+
+	case H2FMI_ERASE:
+		return _state->erase_state;
+
+	default:
+		return 0;
+	}
+}
+
+static int h2fmi_is_complete(struct h2fmi_state *_state)
+{
+	switch(_state->state)
+	{
+	case H2FMI_READ:
+		return _state->read_state == H2FMI_READ_COMPLETE;
+
+	case H2FMI_WRITE:
+		return _state->write_state == H2FMI_WRITE_COMPLETE;
+
+	case H2FMI_ERASE:
+		return _state->erase_state == H2FMI_ERASE_COMPLETE;
+
+	default:
+		return 1;
+	}
+}
+
+// Runs the state machine for as long as it makes progress.
+// Returns 1 once the transaction is done, 0 if it's waiting.
+static int h2fmi_step(struct h2fmi_state *_state)
+{
+	while(!h2fmi_is_complete(_state))
+	{
+		int sub = h2fmi_substate(_state);
+		size_t curr = _state->transaction.curr;
+		unsigned chip_mask = _state->transaction.chip_mask;
+
+		if(time_after(jiffies, _state->deadline))
 		{
-			dev_err(&_state->dev->dev, "failed to wait for DMA completion.\n");
+			dev_err(&_state->dev->dev, "transaction timed out in state %d-%d.\n",
+					_state->state, sub);
 			_state->transaction.result = -ETIMEDOUT;
+			return 1;
 		}
-		else
-			_state->transaction.result = 0;
+
+		switch(_state->state)
+		{
+		case H2FMI_READ:
+			h2fmi_read_state_machine(_state);
+			break;
+
+		case H2FMI_WRITE:
+			h2fmi_write_state_machine(_state);
+			break;
+
+		case H2FMI_ERASE:
+			h2fmi_erase_state_machine(_state);
+			break;
+
+		default:
+			return 1;
+		}
+
+		if(sub == h2fmi_substate(_state)
+				&& curr == _state->transaction.curr
+				&& chip_mask == _state->transaction.chip_mask)
+			return h2fmi_is_complete(_state);
 	}
 
-	cdma_cancel(_state->pdata->dma0);
-	cdma_cancel(_state->pdata->dma1);
+	return 1;
+}
 
-	h2fmi_reset_timing(_state);
+static int h2fmi_can_batch(struct h2fmi_transaction *_a,
+		struct h2fmi_transaction *_b)
+{
+	if(_a->type != _b->type)
+		return 0;
 
-	_state->state = H2FMI_IDLE;
-	spin_unlock(&_state->lock);
-	h2fmi_clear_interrupt(_state);
-	
+	if(_a->type == H2FMI_ERASE)
+		return 1;
+
+	if(_a->eccres || _a->eccbuf || _b->eccres || _b->eccbuf)
+		return 0;
+
+	if(_a->write_mode != _b->write_mode)
+		return 0;
+
+	return _a->sg_num_data && _a->sg_num_oob
+		&& _b->sg_num_data && _b->sg_num_oob;
+}
+
+static size_t h2fmi_sg_length(struct scatterlist *_sg, int _num)
+{
+	size_t ret = 0;
+
+	for(; _sg && _num > 0; _num--, _sg = sg_next(_sg))
+		ret += _sg->length;
+
+	return ret;
+}
+
+static void h2fmi_free_batch(struct h2fmi_state *_state)
+{
+	kfree(_state->batch_chips);
+	kfree(_state->batch_pages);
+	kfree(_state->batch_sg_data);
+	kfree(_state->batch_sg_oob);
+
+	_state->batch_chips = NULL;
+	_state->batch_pages = NULL;
+	_state->batch_sg_data = NULL;
+	_state->batch_sg_oob = NULL;
+}
+
+// Glues the transactions on the batch list into _state->transaction.
+static int h2fmi_merge_batch(struct h2fmi_state *_state)
+{
+	struct h2fmi_transaction *tr;
+	size_t count = 0, num_data = 0, num_oob = 0;
+	size_t used_data = 0, used_oob = 0;
+	int ret;
+
+	list_for_each_entry(tr, &_state->batch, list)
+	{
+		count += tr->count;
+		num_data += tr->sg_num_data;
+		num_oob += tr->sg_num_oob;
+	}
+
+	_state->batch_chips = kmalloc(sizeof(*_state->batch_chips)*count, GFP_KERNEL);
+	_state->batch_pages = kmalloc(sizeof(*_state->batch_pages)*count, GFP_KERNEL);
+	if(!_state->batch_chips || !_state->batch_pages)
+		goto nomem;
+
+	if(_state->transaction.type != H2FMI_ERASE)
+	{
+		_state->batch_sg_data = kmalloc(sizeof(struct scatterlist)*num_data, GFP_KERNEL);
+		_state->batch_sg_oob = kmalloc(sizeof(struct scatterlist)*num_oob, GFP_KERNEL);
+		if(!_state->batch_sg_data || !_state->batch_sg_oob)
+			goto nomem;
+
+		sg_init_table(_state->batch_sg_data, num_data);
+		sg_init_table(_state->batch_sg_oob, num_oob);
+	}
+
+	count = 0;
+	list_for_each_entry(tr, &_state->batch, list)
+	{
+		memcpy(&_state->batch_chips[count], tr->chips, sizeof(*tr->chips)*tr->count);
+		memcpy(&_state->batch_pages[count], tr->pages, sizeof(*tr->pages)*tr->count);
+		count += tr->count;
+
+		if(_state->transaction.type == H2FMI_ERASE)
+			continue;
+
+		ret = apple_sg_copy_range(_state->batch_sg_data, num_data, &used_data,
+				tr->sg_data, tr->sg_num_data,
+				0, h2fmi_sg_length(tr->sg_data, tr->sg_num_data));
+		if(ret < 0)
+			goto error;
+
+		ret = apple_sg_copy_range(_state->batch_sg_oob, num_oob, &used_oob,
+				tr->sg_oob, tr->sg_num_oob,
+				0, h2fmi_sg_length(tr->sg_oob, tr->sg_num_oob));
+		if(ret < 0)
+			goto error;
+	}
+
+	_state->transaction.count = count;
+	_state->transaction.chips = _state->batch_chips;
+	_state->transaction.pages = _state->batch_pages;
+
+	if(_state->transaction.type != H2FMI_ERASE)
+	{
+		sg_mark_end(&_state->batch_sg_data[used_data-1]);
+		sg_mark_end(&_state->batch_sg_oob[used_oob-1]);
+
+		_state->transaction.sg_data = _state->batch_sg_data;
+		_state->transaction.sg_num_data = used_data;
+		_state->transaction.sg_oob = _state->batch_sg_oob;
+		_state->transaction.sg_num_oob = used_oob;
+	}
+
+	return 0;
+
+nomem:
+	ret = -ENOMEM;
+
+error:
+	h2fmi_free_batch(_state);
+	return ret;
+}
+
+// Takes the next transaction off the queue, along with any that
+// directly follow it and can share a pass through the controller.
+static int h2fmi_next_batch(struct h2fmi_state *_state)
+{
+	struct h2fmi_transaction *first, *tr, *next;
+	unsigned long flags;
+	size_t count;
+
+	spin_lock_irqsave(&_state->lock, flags);
+	if(list_empty(&_state->queue))
+	{
+		spin_unlock_irqrestore(&_state->lock, flags);
+		return 0;
+	}
+
+	first = list_first_entry(&_state->queue, struct h2fmi_transaction, list);
+	list_move_tail(&first->list, &_state->batch);
+	count = first->count;
+
+	list_for_each_entry_safe(tr, next, &_state->queue, list)
+	{
+		if(!h2fmi_can_batch(first, tr)
+				|| count + tr->count > H2FMI_MAX_BATCH)
+			break;
+
+		list_move_tail(&tr->list, &_state->batch);
+		count += tr->count;
+	}
+	spin_unlock_irqrestore(&_state->lock, flags);
+
+	_state->transaction = *first;
+
+	if(count != first->count && h2fmi_merge_batch(_state) < 0)
+	{
+		// Couldn't glue them together, just run the first one.
+		spin_lock_irqsave(&_state->lock, flags);
+		list_for_each_entry_safe_reverse(tr, next, &_state->batch, list)
+		{
+			if(tr != first)
+				list_move(&tr->list, &_state->queue);
+		}
+		spin_unlock_irqrestore(&_state->lock, flags);
+	}
+
+	_state->transaction.curr = 0;
+	_state->transaction.result = 0;
+	_state->transaction.num_failed = 0;
+	_state->transaction.num_ecc = 0;
+	_state->transaction.num_empty = 0;
+	_state->transaction.chip_mask = 0;
+	_state->transaction.busy = 0;
+	_state->transaction.new_chip = 0;
+	_state->dma_result = 0;
+
+	_state->state = _state->transaction.type;
+	_state->deadline = jiffies + H2FMI_TIMEOUT;
+
+	h2fmi_reset(_state);
+
+	switch(_state->state)
+	{
+	case H2FMI_READ:
+		_state->read_state = H2FMI_READ_BEGIN;
+		h2fmi_clear_ecc_buf(_state);
+		break;
+
+	case H2FMI_WRITE:
+		// TODO: data whitening?
+		_state->write_state = H2FMI_WRITE_BEGIN;
+		h2fmi_set_timing_mode(_state, 1);
+		break;
+
+	case H2FMI_ERASE:
+		_state->erase_state = H2FMI_ERASE_BEGIN;
+		h2fmi_set_timing_mode(_state, 1);
+		break;
+
+	default:
+		break;
+	}
+
+	return 1;
+}
+
+static int h2fmi_transaction_result(struct h2fmi_state *_state)
+{
 	if(_state->transaction.result)
 		return _state->transaction.result;
 
 	if(_state->transaction.num_failed)
 		return -EIO;
 
+	if(_state->transaction.num_ecc)
+		return -EUCLEAN;
+
+	if(_state->transaction.num_empty)
+		return -ENOENT;
+
 	return 0;
 }
 
-static int h2fmi_erase_blocks(struct h2fmi_state *_state,
-		int _num, u16 *_ces, u32 *_pages)
+static void h2fmi_finish(struct h2fmi_state *_state)
 {
-	int i;
-	int eraseOK = 1;
+	struct h2fmi_transaction *tr, *next;
+	int result;
 
-	if(_state->state != H2FMI_IDLE)
-		return -EBUSY;
+	if(_state->state != H2FMI_ERASE)
+	{
+		if(_state->transaction.busy && _state->dma_result
+				&& !_state->transaction.result)
+		{
+			dev_err(&_state->dev->dev, "DMA failed with %d.\n", _state->dma_result);
+			_state->transaction.result = _state->dma_result;
+		}
 
-	memset(&_state->transaction, 0, sizeof(_state->transaction));
+		// Only does anything if the transaction bailed out early.
+		cdma_cancel(_state->pdata->dma0);
+		cdma_cancel(_state->pdata->dma1);
+		atomic_set(&_state->dma_pending, 0);
+	}
 
-	_state->transaction.count = _num;
-	_state->transaction.chips = _ces;
-	_state->transaction.pages = _pages;
+	if(_state->state != H2FMI_READ)
+		h2fmi_reset_timing(_state);
 
-	spin_lock(&_state->lock);
-	_state->state = H2FMI_ERASE;
+	h2fmi_disable_bus(_state);
+	h2fmi_clear_interrupt(_state);
 
-	h2fmi_reset(_state);
-	h2fmi_set_timing_mode(_state, 1);
+	if(_state->state == H2FMI_READ)
+		h2fmi_read_unwhiten(_state);
 
-	while(_state->transaction.curr < _state->transaction.count)
+	result = h2fmi_transaction_result(_state);
+	_state->state = H2FMI_IDLE;
+
+	list_for_each_entry_safe(tr, next, &_state->batch, list)
 	{
-		int chip = _state->transaction.chips[_state->transaction.curr];
-		int ret;
+		list_del(&tr->list);
 
-		if(_state->transaction.chip_mask & (1 << chip))
+		tr->result = result;
+		tr->num_failed = _state->transaction.num_failed;
+		tr->num_ecc = _state->transaction.num_ecc;
+		tr->num_empty = _state->transaction.num_empty;
+
+		if(tr->done)
+			tr->done(_state, tr);
+	}
+
+	h2fmi_free_batch(_state);
+}
+
+static void h2fmi_advance(struct h2fmi_state *_state)
+{
+	mutex_lock(&_state->engine_lock);
+
+	if(_state->irq_masked)
+	{
+		_state->irq_masked = 0;
+		if(_state->state != H2FMI_IDLE)
 		{
-			h2fmi_enable_chip(_state, chip);
-			_state->transaction.curr++;
+			writel(_state->irq_creq, _state->base_regs + H2FMI_CREQ);
+			writel(_state->irq_nirq, _state->flash_regs + H2FMI_UNK440);
+		}
+	}
+
+	while(1)
+	{
+		if(_state->state == H2FMI_IDLE && !h2fmi_next_batch(_state))
+			break;
 
-			ret = h2fmi_erase_prepare(_state);
+		if(!h2fmi_step(_state))
+		{
+			// The IRQ should get us going again,
+			// the poll is only there as a backstop.
+			schedule_delayed_work(&_state->work, H2FMI_POLL_INTERVAL);
+			break;
+		}
 
-			if(ret < 0)
+		// The DMA callbacks bring us back here once the last
+		// transfer is done, rather than us sleeping on them.
+		if(_state->state != H2FMI_ERASE && _state->transaction.busy
+				&& !_state->transaction.result
+				&& atomic_read(&_state->dma_pending))
+		{
+			if(!time_after(jiffies, _state->deadline))
 			{
-				dev_err(&_state->dev->dev, 
-						"failed to erase block at %d, err %d.\n",
-						_state->transaction.pages[_state->transaction.curr],
-						ret);
-
-				// TODO: store which chip failed?
-				
-				eraseOK = 0;
+				schedule_delayed_work(&_state->work, H2FMI_POLL_INTERVAL);
 				break;
 			}
-			else
-				_state->transaction.chip_mask &=~ (1 << chip);
+
+			dev_err(&_state->dev->dev, "timed out waiting for DMA.\n");
+			_state->transaction.result = -ETIMEDOUT;
 		}
-		else
-		{
-			int i;
-			for(i = _state->transaction.curr;
-					i < _state->transaction.count; i++)
-			{
-				int page;
-				int chip = _state->transaction.chips[i];
-				if(_state->transaction.chip_mask & (1 << chip))
-					break;
 
-				page = _state->transaction.pages[i];
+		h2fmi_finish(_state);
+	}
 
-				h2fmi_enable_chip(_state, chip);
-				h2fmi_set_block_address(_state, page);
-				h2fmi_send_cmd(_state, 
-						NAND_CMD_ERASE1
-						| (NAND_CMD_ERASE2 << 8), 0xb);
+	mutex_unlock(&_state->engine_lock);
+}
 
-				_state->transaction.chip_mask |= (1 << chip);
-			}
-		}
-	}
+static void h2fmi_work(struct work_struct *_work)
+{
+	struct h2fmi_state *state = container_of(_work, struct h2fmi_state, work.work);
+	h2fmi_advance(state);
+}
 
-	// flush all of the chips used.
-	for(i = 0; i < _state->transaction.count; i++)
+static irqreturn_t h2fmi_irq_thread(int _irq, void *_dev)
+{
+	h2fmi_advance(_dev);
+	return IRQ_HANDLED;
+}
+
+static void h2fmi_submit(struct h2fmi_state *_state, struct h2fmi_transaction *_tr)
+{
+	unsigned long flags;
+
+	if(!_tr->count)
 	{
-		int chip = _state->transaction.chips[i];
-		int ret;
+		_tr->result = 0;
+		if(_tr->done)
+			_tr->done(_state, _tr);
+		return;
+	}
 
-		if(!(_state->transaction.chip_mask & (1 << chip)))
-			continue;
+	spin_lock_irqsave(&_state->lock, flags);
+	list_add_tail(&_tr->list, &_state->queue);
+	spin_unlock_irqrestore(&_state->lock, flags);
 
-		h2fmi_enable_chip(_state, chip);
+	schedule_delayed_work(&_state->work, 0);
+}
 
-		ret = h2fmi_erase_prepare(_state);
+static void h2fmi_run_done(struct h2fmi_state *_state, struct h2fmi_transaction *_tr)
+{
+	complete(_tr->done_data);
+}
 
-		if(ret < 0)
-		{
-			dev_err(&_state->dev->dev, 
-					"failed to erase block at %d, err %d.\n",
-					_state->transaction.pages[_state->transaction.curr],
-					ret);
+// Submits a transaction and sleeps until it's done.
+static int h2fmi_run(struct h2fmi_state *_state, struct h2fmi_transaction *_tr)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
 
-			// TODO: store which chip failed?
+	_tr->done = h2fmi_run_done;
+	_tr->done_data = &done;
 
-			eraseOK = 0;
-		}
-		else
-			_state->transaction.chip_mask &=~ (1 << chip);
-	}
+	h2fmi_submit(_state, _tr);
+	h2fmi_advance(_state);
 
-	h2fmi_reset_timing(_state);
-	h2fmi_disable_bus(_state);
+	wait_for_completion(&done);
+	return _tr->result;
+}
 
-	_state->state = H2FMI_IDLE;
-	spin_unlock(&_state->lock);
+static int h2fmi_read_pages(struct h2fmi_state *_state, int _count,
+		u16 *_ces, u32 *_pages,
+		struct scatterlist *_sg_data, size_t _sg_num_data,
+		struct scatterlist *_sg_oob, size_t _sg_num_oob,
+		u8 *_eccres, u8 *_eccbuf)
+{
+	struct h2fmi_transaction tr;
 
-	if(!eraseOK)
-		return -EIO;
+	memset(&tr, 0, sizeof(tr));
 
-	return 0;
+	tr.type = H2FMI_READ;
+	tr.count = _count;
+	tr.chips = _ces;
+	tr.pages = _pages;
+
+	tr.sg_data = _sg_data;
+	tr.sg_num_data = _sg_num_data;
+
+	tr.sg_oob = _sg_oob;
+	tr.sg_num_oob = _sg_num_oob;
+
+	tr.eccres = _eccres;
+	tr.eccbuf = _eccbuf;
+
+	return h2fmi_run(_state, &tr);
+}
+
+static int h2fmi_write_pages(struct h2fmi_state *_state, int _count,
+		u16 *_chips, u32 *_pages,
+		struct scatterlist *_sg_data, size_t _sg_num_data,
+		struct scatterlist *_sg_oob, size_t _sg_num_oob,
+		enum h2fmi_write_mode _mode)
+{
+	struct h2fmi_transaction tr;
+
+	memset(&tr, 0, sizeof(tr));
+
+	tr.type = H2FMI_WRITE;
+	tr.count = _count;
+	tr.chips = _chips;
+	tr.pages = _pages;
+
+	tr.sg_data = _sg_data;
+	tr.sg_num_data = _sg_num_data;
+
+	tr.sg_oob = _sg_oob;
+	tr.sg_num_oob = _sg_num_oob;
+
+	tr.write_mode = _mode;
+
+	return h2fmi_run(_state, &tr);
+}
+
+static int h2fmi_erase_blocks(struct h2fmi_state *_state,
+		int _num, u16 *_ces, u32 *_pages)
+{
+	struct h2fmi_transaction tr;
+
+	memset(&tr, 0, sizeof(tr));
+
+	tr.type = H2FMI_ERASE;
+	tr.count = _num;
+	tr.chips = _ces;
+	tr.pages = _pages;
+
+	return h2fmi_run(_state, &tr);
 }
 
 static int h2fmi_read_single_page(struct h2fmi_state *_state, u16 _ce, int _page,
@@ -1890,6 +2429,12 @@ int h2fmi_probe(struct platform_device *_dev)
 	state->dev = _dev;
 	state->pdata = _dev->dev.platform_data;
 	spin_lock_init(&state->lock);
+	spin_lock_init(&state->irq_lock);
+	init_completion(&state->wait_done);
+	INIT_LIST_HEAD(&state->queue);
+	INIT_LIST_HEAD(&state->batch);
+	mutex_init(&state->engine_lock);
+	INIT_DELAYED_WORK(&state->work, h2fmi_work);
 
 	// Setup interface
 	{
@@ -1971,13 +2516,13 @@ int h2fmi_probe(struct platform_device *_dev)
 	}
 
 	state->irq = res->start;
-	/*if(request_irq(state->irq, h2fmi_irq_handler,
+	if(request_threaded_irq(state->irq, h2fmi_irq_handler, h2fmi_irq_thread,
 				IRQF_SHARED, "h2fmi", state) < 0)
 	{
 		dev_err(&_dev->dev, "failed to request IRQ.\n");
 		goto err_ecc_regs;
-	}*/
-	
+	}
+
 	clk_enable(state->clk);
 	clk_enable(state->clk_bch);
 
@@ -2014,6 +2559,7 @@ int h2fmi_remove(struct platform_device *_dev)
 	struct h2fmi_state *state = platform_get_drvdata(_dev);
 
 	free_irq(state->irq, state);
+	cancel_delayed_work_sync(&state->work);
 
 	clk_disable(state->clk_bch);
 	clk_put(state->clk_bch);
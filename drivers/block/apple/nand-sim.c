@@ -0,0 +1,1216 @@
+/*
+ * A NAND simulator for the Apple flash stack.
+ *
+ * Registers one or more apple_nand buses backed by memory or by an image
+ * file, so the VFLs and FTLs can be run, benchmarked and broken without
+ * an H2FMI. Pages are stored raw, the page data followed by
+ * NANDSIM_OOB_ALLOC bytes of spare, of which the first NANDSIM_OOB_SIZE
+ * are what the VFL gets back, as on H2FMI. The two bytes after that hold
+ * a CRC standing in for the ECC, so torn pages read back as
+ * uncorrectable.
+ *
+ * By default the buses are put behind a flat VFL that stripes virtual
+ * blocks over every chip, which is all an FTL needs. With detect=1 the
+ * usual VFL detection is run instead, which needs an image of a
+ * formatted device.
+ *
+ * Faults can be injected with the *_errors and bitflips parameters and
+ * by arming power_cut in sysfs, and writing to restart power-cycles the
+ * simulated device, reattaching the VFL and whatever sits on top of it.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/random.h>
+#include <linux/delay.h>
+#include <linux/crc16.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/platform_device.h>
+#include <linux/apple_flash.h>
+#include <asm/unaligned.h>
+
+#define NANDSIM_OOB_SIZE	0xA
+#define NANDSIM_OOB_ALLOC	0xC
+#define NANDSIM_MAX_CHIPS	8
+#define NANDSIM_CTRL_BLOCKS	3
+
+static unsigned int nandsim_buses = 1;
+module_param_named(buses, nandsim_buses, uint, S_IRUGO);
+MODULE_PARM_DESC(buses, "Number of NAND buses");
+
+static unsigned int nandsim_chips = 2;
+module_param_named(chips, nandsim_chips, uint, S_IRUGO);
+MODULE_PARM_DESC(chips, "Chips on each bus");
+
+static unsigned int nandsim_blocks = 256;
+module_param_named(blocks, nandsim_blocks, uint, S_IRUGO);
+MODULE_PARM_DESC(blocks, "Blocks per chip");
+
+static unsigned int nandsim_pages = 64;
+module_param_named(pages, nandsim_pages, uint, S_IRUGO);
+MODULE_PARM_DESC(pages, "Pages per block, a power of two");
+
+static unsigned int nandsim_page_size = 2048;
+module_param_named(page_size, nandsim_page_size, uint, S_IRUGO);
+MODULE_PARM_DESC(page_size, "Bytes per page, a multiple of 1024");
+
+static char *nandsim_image;
+module_param_named(image, nandsim_image, charp, S_IRUGO);
+MODULE_PARM_DESC(image, "Keep the flash in this file instead of in memory, "
+		"every page followed by its 12 spare bytes");
+
+static bool nandsim_detect;
+module_param_named(detect, nandsim_detect, bool, S_IRUGO);
+MODULE_PARM_DESC(detect, "Detect the VFL on the flash instead of using a flat one");
+
+static char *nandsim_badblocks;
+module_param_named(badblocks, nandsim_badblocks, charp, S_IRUGO);
+MODULE_PARM_DESC(badblocks, "Factory bad blocks as chip:block, separated by commas");
+
+static unsigned int nandsim_ecc_errors;
+module_param_named(ecc_errors, nandsim_ecc_errors, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(ecc_errors, "Chance per million that a page read is uncorrectable");
+
+static unsigned int nandsim_bitflips;
+module_param_named(bitflips, nandsim_bitflips, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(bitflips, "Chance per million that a page read needs correcting");
+
+static unsigned int nandsim_write_errors;
+module_param_named(write_errors, nandsim_write_errors, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(write_errors, "Chance per million that a page program fails");
+
+static unsigned int nandsim_erase_errors;
+module_param_named(erase_errors, nandsim_erase_errors, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(erase_errors, "Chance per million that a block erase fails");
+
+static unsigned int nandsim_read_us;
+module_param_named(read_us, nandsim_read_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(read_us, "Time a chip takes to read a page (us)");
+
+static unsigned int nandsim_program_us;
+module_param_named(program_us, nandsim_program_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(program_us, "Time a chip takes to program a page (us)");
+
+static unsigned int nandsim_erase_us;
+module_param_named(erase_us, nandsim_erase_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(erase_us, "Time a chip takes to erase a block (us)");
+
+static unsigned int nandsim_transfer_ns;
+module_param_named(transfer_ns, nandsim_transfer_ns, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(transfer_ns, "Time the bus takes to move one byte (ns)");
+
+struct nandsim_block
+{
+	u8 *mem;			// NULL while erased, only used without an image
+	u32 erase_count;
+	u8 bad;
+};
+
+struct nandsim_stats
+{
+	u64 reads;
+	u64 programs;
+	u64 erases;
+	u64 corrected;
+	u64 uncorrectable;
+	u64 failed;
+};
+
+struct nandsim;
+
+struct nandsim_bus
+{
+	struct apple_nand nand;
+	struct nandsim *sim;
+	int index;
+
+	// Held for whole operations, the bus does one thing at a time.
+	struct mutex lock;
+	u8 *page_buf;
+	u8 *check_buf;
+	struct nandsim_stats stats;
+};
+
+struct nandsim
+{
+	struct platform_device *pdev;
+	struct mutex lock;
+	struct apple_vfl vfl;
+	int attached;
+
+	struct nandsim_bus *buses;
+	struct nandsim_block *blocks;
+	struct file *file;
+	size_t raw_size;
+	u8 *blank;
+
+	spinlock_t power_lock;
+	unsigned int power_left;	// operations until the power cut, 0 if none
+	int dead;
+};
+
+static struct nandsim *nandsim;
+
+static inline struct nandsim_bus *nandsim_get_bus(struct apple_nand *_nd)
+{
+	return container_of(_nd, struct nandsim_bus, nand);
+}
+
+static inline struct nandsim_block *nandsim_block(struct nandsim_bus *_bus,
+		u16 _chip, page_t _page)
+{
+	u32 chip = _bus->index*nandsim_chips + _chip;
+	return &_bus->sim->blocks[chip*nandsim_blocks + _page/nandsim_pages];
+}
+
+static inline int nandsim_valid(u16 _chip, page_t _page)
+{
+	return _chip < nandsim_chips && _page < nandsim_blocks*nandsim_pages;
+}
+
+static inline int nandsim_chance(unsigned int _ppm)
+{
+	return _ppm && (random32() % 1000000) < _ppm;
+}
+
+// Returns 1 for the operation the armed power cut interrupts.
+static int nandsim_power_cut(struct nandsim *_sim)
+{
+	int ret = 0;
+
+	spin_lock(&_sim->power_lock);
+	if(_sim->power_left && !--_sim->power_left)
+	{
+		_sim->dead = 1;
+		ret = 1;
+	}
+	spin_unlock(&_sim->power_lock);
+
+	if(ret)
+		printk(KERN_WARNING "apple-nandsim: power cut!\n");
+
+	return ret;
+}
+
+// Chips work in parallel, but everything crosses the bus one at a time.
+static void nandsim_delay(u32 *_busy, u64 _transfer_ns)
+{
+	unsigned long us = 0;
+	int i;
+
+	for(i = 0; i < nandsim_chips; i++)
+		us = max_t(unsigned long, us, _busy[i]);
+
+	us += div_u64(_transfer_ns, 1000);
+	if(!us)
+		return;
+
+	if(us < 20)
+		udelay(us);
+	else
+		usleep_range(us, us + us/8);
+}
+
+//
+// Backing store
+//
+
+static ssize_t nandsim_file_io(struct nandsim *_sim, int _write,
+		void *_buf, size_t _len, loff_t _pos)
+{
+	mm_segment_t old_fs = get_fs();
+	ssize_t ret;
+
+	set_fs(get_ds());
+	if(_write)
+		ret = vfs_write(_sim->file, (const char __user*)_buf, _len, &_pos);
+	else
+		ret = vfs_read(_sim->file, (char __user*)_buf, _len, &_pos);
+	set_fs(old_fs);
+
+	return ret;
+}
+
+static inline loff_t nandsim_offset(struct nandsim_bus *_bus, u16 _chip, page_t _page)
+{
+	u32 chip = _bus->index*nandsim_chips + _chip;
+	return ((loff_t)chip*nandsim_blocks*nandsim_pages + _page)*_bus->sim->raw_size;
+}
+
+static int nandsim_load(struct nandsim_bus *_bus, u16 _chip, page_t _page, u8 *_buf)
+{
+	struct nandsim *sim = _bus->sim;
+	struct nandsim_block *blk = nandsim_block(_bus, _chip, _page);
+	ssize_t ret;
+
+	if(!sim->file)
+	{
+		if(blk->mem)
+			memcpy(_buf, blk->mem + (_page % nandsim_pages)*sim->raw_size, sim->raw_size);
+		else
+			memset(_buf, 0xFF, sim->raw_size);
+
+		return 0;
+	}
+
+	ret = nandsim_file_io(sim, 0, _buf, sim->raw_size,
+			nandsim_offset(_bus, _chip, _page));
+	if(ret < 0)
+		return ret;
+
+	// Past the end of the image is blank flash.
+	if(ret < sim->raw_size)
+		memset(_buf + ret, 0xFF, sim->raw_size - ret);
+
+	return 0;
+}
+
+static int nandsim_store(struct nandsim_bus *_bus, u16 _chip, page_t _page, u8 *_buf)
+{
+	struct nandsim *sim = _bus->sim;
+	struct nandsim_block *blk = nandsim_block(_bus, _chip, _page);
+	ssize_t ret;
+
+	if(!sim->file)
+	{
+		if(!blk->mem)
+		{
+			blk->mem = vmalloc(nandsim_pages*sim->raw_size);
+			if(!blk->mem)
+				return -ENOMEM;
+
+			memset(blk->mem, 0xFF, nandsim_pages*sim->raw_size);
+		}
+
+		memcpy(blk->mem + (_page % nandsim_pages)*sim->raw_size, _buf, sim->raw_size);
+		return 0;
+	}
+
+	ret = nandsim_file_io(sim, 1, _buf, sim->raw_size,
+			nandsim_offset(_bus, _chip, _page));
+	if(ret < 0)
+		return ret;
+
+	return ret == sim->raw_size ? 0 : -EIO;
+}
+
+// Erases the first _count pages of a block.
+static int nandsim_wipe(struct nandsim_bus *_bus, u16 _chip, page_t _block, u32 _count)
+{
+	struct nandsim *sim = _bus->sim;
+	struct nandsim_block *blk = nandsim_block(_bus, _chip, _block*nandsim_pages);
+	u32 i;
+
+	if(!sim->file)
+	{
+		if(_count == nandsim_pages)
+		{
+			vfree(blk->mem);
+			blk->mem = NULL;
+		}
+		else if(blk->mem)
+			memset(blk->mem, 0xFF, _count*sim->raw_size);
+
+		return 0;
+	}
+
+	for(i = 0; i < _count; i++)
+	{
+		int ret = nandsim_store(_bus, _chip, _block*nandsim_pages + i, sim->blank);
+		if(ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+static inline u16 nandsim_crc(u8 *_raw)
+{
+	return crc16(0, _raw, nandsim_page_size + NANDSIM_OOB_SIZE);
+}
+
+//
+// Pages
+//
+
+static int nandsim_read_page(struct nandsim_bus *_bus, u16 _chip, page_t _page, u8 *_buf)
+{
+	struct nandsim *sim = _bus->sim;
+	u8 *oob = _buf + nandsim_page_size;
+	int ret;
+
+	if(!nandsim_valid(_chip, _page))
+		return -EINVAL;
+
+	if(sim->dead)
+		return -EIO;
+
+	_bus->stats.reads++;
+
+	if(nandsim_block(_bus, _chip, _page)->bad)
+	{
+		memset(_buf, 0, sim->raw_size);
+		return -EIO;
+	}
+
+	ret = nandsim_load(_bus, _chip, _page, _buf);
+	if(ret < 0)
+		return ret;
+
+	if(!memcmp(_buf, sim->blank, sim->raw_size))
+		return -ENOENT;
+
+	if(get_unaligned_le16(oob + NANDSIM_OOB_SIZE) != nandsim_crc(_buf)
+			|| nandsim_chance(nandsim_ecc_errors))
+	{
+		_bus->stats.uncorrectable++;
+		return -EIO;
+	}
+
+	memset(oob + NANDSIM_OOB_SIZE, 0xFF, NANDSIM_OOB_ALLOC - NANDSIM_OOB_SIZE);
+
+	// The data is fine, but the caller is told it took some fixing.
+	if(nandsim_chance(nandsim_bitflips))
+	{
+		_bus->stats.corrected++;
+		return -EUCLEAN;
+	}
+
+	return 0;
+}
+
+static int nandsim_write_page(struct nandsim_bus *_bus, u16 _chip, page_t _page, u8 *_buf)
+{
+	struct nandsim *sim = _bus->sim;
+	u8 *oob = _buf + nandsim_page_size;
+	int ret;
+
+	if(!nandsim_valid(_chip, _page))
+		return -EINVAL;
+
+	if(sim->dead)
+		return -EIO;
+
+	_bus->stats.programs++;
+
+	if(nandsim_block(_bus, _chip, _page)->bad)
+		return -EIO;
+
+	ret = nandsim_load(_bus, _chip, _page, _bus->check_buf);
+	if(ret < 0)
+		return ret;
+
+	if(memcmp(_bus->check_buf, sim->blank, sim->raw_size))
+	{
+		printk(KERN_WARNING "apple-nandsim: program of used page %u on chip %u.\n",
+				_page, _bus->index*nandsim_chips + _chip);
+		_bus->stats.failed++;
+		return -EIO;
+	}
+
+	memset(oob + NANDSIM_OOB_SIZE, 0xFF, NANDSIM_OOB_ALLOC - NANDSIM_OOB_SIZE);
+	put_unaligned_le16(nandsim_crc(_buf), oob + NANDSIM_OOB_SIZE);
+
+	if(nandsim_power_cut(sim) || nandsim_chance(nandsim_write_errors))
+	{
+		// Only get half way, the CRC won't match any more.
+		memset(_buf + nandsim_page_size/2, 0xFF, sim->raw_size - nandsim_page_size/2);
+		put_unaligned_le16(~nandsim_crc(_buf), oob + NANDSIM_OOB_SIZE);
+		nandsim_store(_bus, _chip, _page, _buf);
+
+		_bus->stats.failed++;
+		return -EIO;
+	}
+
+	return nandsim_store(_bus, _chip, _page, _buf);
+}
+
+static int nandsim_erase_block(struct nandsim_bus *_bus, u16 _chip, page_t _block)
+{
+	struct nandsim *sim = _bus->sim;
+	struct nandsim_block *blk;
+
+	if(!nandsim_valid(_chip, _block*nandsim_pages))
+		return -EINVAL;
+
+	if(sim->dead)
+		return -EIO;
+
+	_bus->stats.erases++;
+
+	blk = nandsim_block(_bus, _chip, _block*nandsim_pages);
+	if(blk->bad)
+		return -EIO;
+
+	blk->erase_count++;
+
+	if(nandsim_power_cut(sim) || nandsim_chance(nandsim_erase_errors))
+	{
+		nandsim_wipe(_bus, _chip, _block, nandsim_pages/2);
+		_bus->stats.failed++;
+		return -EIO;
+	}
+
+	return nandsim_wipe(_bus, _chip, _block, nandsim_pages);
+}
+
+//
+// Scatterlists
+//
+
+struct nandsim_cursor
+{
+	struct sg_mapping_iter miter;
+	size_t used;
+	int mapped;
+};
+
+static void nandsim_cursor_start(struct nandsim_cursor *_cur,
+		struct scatterlist *_sg, size_t _num, int _to_sg)
+{
+	sg_miter_start(&_cur->miter, _sg, _num,
+			_to_sg ? SG_MITER_TO_SG : SG_MITER_FROM_SG);
+	_cur->used = 0;
+	_cur->mapped = 0;
+}
+
+// Copies the next _len bytes of the list to or from _buf.
+static void nandsim_cursor_copy(struct nandsim_cursor *_cur, u8 *_buf,
+		size_t _len, int _to_sg)
+{
+	while(_len)
+	{
+		size_t amt;
+
+		if(!_cur->mapped || _cur->used == _cur->miter.length)
+		{
+			if(!sg_miter_next(&_cur->miter))
+				break;
+
+			_cur->mapped = 1;
+			_cur->used = 0;
+		}
+
+		amt = min(_len, _cur->miter.length - _cur->used);
+		if(_to_sg)
+			memcpy(_cur->miter.addr + _cur->used, _buf, amt);
+		else
+			memcpy(_buf, _cur->miter.addr + _cur->used, amt);
+
+		_cur->used += amt;
+		_buf += amt;
+		_len -= amt;
+	}
+}
+
+//
+// NAND interface implementation
+//
+
+static int nandsim_nand_default_aes(struct apple_nand *_nd, struct cdma_aes *_aes, int _dec)
+{
+	return -ENOSYS;
+}
+
+static int nandsim_nand_aes(struct apple_nand *_nd, struct cdma_aes *_aes)
+{
+	return 0;
+}
+
+static int nandsim_nand_read(struct apple_nand *_nd, size_t _count,
+		u16 *_chips, page_t *_pages,
+		struct scatterlist *_sg_data, size_t _sg_num_data,
+		struct scatterlist *_sg_oob, size_t _sg_num_oob)
+{
+	struct nandsim_bus *bus = nandsim_get_bus(_nd);
+	struct nandsim_cursor data, oob;
+	u32 busy[NANDSIM_MAX_CHIPS] = { 0 };
+	int failed = 0, ecc = 0, empty = 0;
+	u64 transfer = 0;
+	size_t i;
+
+	mutex_lock(&bus->lock);
+
+	nandsim_cursor_start(&data, _sg_data, _sg_num_data, 1);
+	nandsim_cursor_start(&oob, _sg_oob, _sg_num_oob, 1);
+
+	for(i = 0; i < _count; i++)
+	{
+		int ret = nandsim_read_page(bus, _chips[i], _pages[i], bus->page_buf);
+
+		if(ret == -EINVAL)
+		{
+			failed = -EINVAL;
+			break;
+		}
+
+		if(ret == -ENOENT)
+			empty++;
+		else if(ret == -EUCLEAN)
+			ecc++;
+		else if(ret < 0)
+			failed = -EIO;
+
+		busy[_chips[i]] += nandsim_read_us;
+		transfer += (u64)nandsim_transfer_ns*bus->sim->raw_size;
+
+		if(_sg_num_data)
+			nandsim_cursor_copy(&data, bus->page_buf, nandsim_page_size, 1);
+
+		if(_sg_num_oob)
+			nandsim_cursor_copy(&oob, bus->page_buf + nandsim_page_size,
+					NANDSIM_OOB_ALLOC, 1);
+	}
+
+	sg_miter_stop(&data.miter);
+	sg_miter_stop(&oob.miter);
+
+	nandsim_delay(busy, transfer);
+	mutex_unlock(&bus->lock);
+
+	// The same order of precedence as H2FMI.
+	if(failed)
+		return failed;
+
+	if(ecc)
+		return -EUCLEAN;
+
+	if(empty)
+		return -ENOENT;
+
+	return 0;
+}
+
+static int nandsim_nand_write(struct apple_nand *_nd, size_t _count,
+		u16 *_chips, page_t *_pages,
+		struct scatterlist *_sg_data, size_t _sg_num_data,
+		struct scatterlist *_sg_oob, size_t _sg_num_oob)
+{
+	struct nandsim_bus *bus = nandsim_get_bus(_nd);
+	struct nandsim_cursor data, oob;
+	u32 busy[NANDSIM_MAX_CHIPS] = { 0 };
+	u64 transfer = 0;
+	int ret = 0;
+	size_t i;
+
+	mutex_lock(&bus->lock);
+
+	nandsim_cursor_start(&data, _sg_data, _sg_num_data, 0);
+	nandsim_cursor_start(&oob, _sg_oob, _sg_num_oob, 0);
+
+	for(i = 0; i < _count; i++)
+	{
+		u8 *buf = bus->page_buf;
+		int status;
+
+		memset(buf, 0xFF, bus->sim->raw_size);
+
+		if(_sg_num_data)
+			nandsim_cursor_copy(&data, buf, nandsim_page_size, 0);
+
+		if(_sg_num_oob)
+			nandsim_cursor_copy(&oob, buf + nandsim_page_size, NANDSIM_OOB_ALLOC, 0);
+
+		if(_chips[i] < nandsim_chips)
+			busy[_chips[i]] += nandsim_program_us;
+
+		transfer += (u64)nandsim_transfer_ns*bus->sim->raw_size;
+
+		status = nandsim_write_page(bus, _chips[i], _pages[i], buf);
+		if(status < 0 && !ret)
+			ret = status;
+	}
+
+	sg_miter_stop(&data.miter);
+	sg_miter_stop(&oob.miter);
+
+	nandsim_delay(busy, transfer);
+	mutex_unlock(&bus->lock);
+	return ret;
+}
+
+static int nandsim_nand_erase(struct apple_nand *_nd, size_t _count,
+		u16 *_chips, page_t *_blocks)
+{
+	struct nandsim_bus *bus = nandsim_get_bus(_nd);
+	u32 busy[NANDSIM_MAX_CHIPS] = { 0 };
+	int ret = 0;
+	size_t i;
+
+	mutex_lock(&bus->lock);
+
+	for(i = 0; i < _count; i++)
+	{
+		int status = nandsim_erase_block(bus, _chips[i], _blocks[i]);
+		if(status < 0 && !ret)
+			ret = status;
+
+		if(_chips[i] < nandsim_chips)
+			busy[_chips[i]] += nandsim_erase_us;
+	}
+
+	nandsim_delay(busy, 0);
+	mutex_unlock(&bus->lock);
+	return ret;
+}
+
+static int nandsim_nand_get(struct apple_nand *_nd, int _info)
+{
+	switch(_info)
+	{
+	case NAND_NUM_CE:
+		return nandsim_chips;
+
+	case NAND_BITMAP:
+		return (1 << nandsim_chips) - 1;
+
+	case NAND_BLOCKS_PER_CE:
+	case NAND_BLOCKS_PER_BANK:
+	case NAND_BANK_ADDRESS_SPACE:
+	case NAND_TOTAL_BLOCK_SPACE:
+		return nandsim_blocks;
+
+	case NAND_PAGES_PER_CE:
+		return nandsim_blocks*nandsim_pages;
+
+	case NAND_PAGES_PER_BLOCK:
+	case NAND_BLOCK_ADDRESS_SPACE:
+		return nandsim_pages;
+
+	case NAND_ECC_STEPS:
+		return nandsim_page_size >> 10;
+
+	case NAND_ECC_BITS:
+		return 8;
+
+	case NAND_BYTES_PER_SPARE:
+		return nandsim_page_size/32;
+
+	case NAND_BANKS_PER_CE_VFL:
+	case NAND_BANKS_PER_CE:
+		return 1;
+
+	case NAND_PAGE_SIZE:
+		return nandsim_page_size;
+
+	case NAND_OOB_SIZE:
+		return NANDSIM_OOB_SIZE;
+
+	case NAND_OOB_ALLOC:
+		return NANDSIM_OOB_ALLOC;
+
+	default:
+		return 0;
+	}
+}
+
+static int nandsim_nand_set(struct apple_nand *_nd, int _info, int _val)
+{
+	return -EPERM;
+}
+
+static int nandsim_nand_is_bad(struct apple_nand *_nd, u16 _ce, page_t _page)
+{
+	struct nandsim_bus *bus = nandsim_get_bus(_nd);
+
+	if(!nandsim_valid(_ce, _page))
+		return 1;
+
+	return nandsim_block(bus, _ce, _page)->bad;
+}
+
+static void nandsim_nand_set_bad(struct apple_nand *_nd, u16 _ce, page_t _page)
+{
+	struct nandsim_bus *bus = nandsim_get_bus(_nd);
+
+	if(nandsim_valid(_ce, _page))
+		nandsim_block(bus, _ce, _page)->bad = 1;
+}
+
+//
+// Flat VFL
+//
+
+// Consecutive virtual pages go to consecutive chips, so a virtual block
+// is the same block on every chip.
+static void nandsim_vfl_map(struct apple_vfl *_vfl, page_t _vpn, u16 *_ce, page_t *_page)
+{
+	u32 per_block = _vfl->num_chips*nandsim_pages;
+
+	*_ce = _vpn % _vfl->num_chips;
+	*_page = (_vpn / per_block)*nandsim_pages + (_vpn % per_block)/_vfl->num_chips;
+}
+
+static int nandsim_vfl_transfer(struct apple_vfl *_vfl, int _write, int _count,
+		page_t *_pages,
+		struct scatterlist *_sg_data, size_t _sg_num_data,
+		struct scatterlist *_sg_oob, size_t _sg_num_oob)
+{
+	u16 *ces = kmalloc(_count * sizeof(*ces), GFP_KERNEL);
+	page_t *pages = kmalloc(_count * sizeof(*pages), GFP_KERNEL);
+	int ret, i;
+
+	if(!ces || !pages)
+	{
+		ret = -ENOMEM;
+		goto exit;
+	}
+
+	for(i = 0; i < _count; i++)
+	{
+		if(_pages[i] >= _vfl->num_chips*nandsim_blocks*nandsim_pages)
+		{
+			ret = -EINVAL;
+			goto exit;
+		}
+
+		nandsim_vfl_map(_vfl, _pages[i], &ces[i], &pages[i]);
+	}
+
+	if(_write)
+		ret = apple_vfl_write_nand_pages(_vfl, _count, ces, pages,
+				_sg_data, _sg_num_data, _sg_oob, _sg_num_oob);
+	else
+		ret = apple_vfl_read_nand_pages(_vfl, _count, ces, pages,
+				_sg_data, _sg_num_data, _sg_oob, _sg_num_oob);
+
+exit:
+	kfree(ces);
+	kfree(pages);
+	return ret;
+}
+
+static int nandsim_vfl_read(struct apple_vfl *_vfl, int _count, page_t *_pages,
+		struct scatterlist *_sg_data, size_t _sg_num_data,
+		struct scatterlist *_sg_oob, size_t _sg_num_oob)
+{
+	return nandsim_vfl_transfer(_vfl, 0, _count, _pages,
+			_sg_data, _sg_num_data, _sg_oob, _sg_num_oob);
+}
+
+static int nandsim_vfl_write(struct apple_vfl *_vfl, int _count, page_t *_pages,
+		struct scatterlist *_sg_data, size_t _sg_num_data,
+		struct scatterlist *_sg_oob, size_t _sg_num_oob)
+{
+	return nandsim_vfl_transfer(_vfl, 1, _count, _pages,
+			_sg_data, _sg_num_data, _sg_oob, _sg_num_oob);
+}
+
+// There's no remapping, a virtual block with a bad block in it fails to
+// erase and it's up to the FTL to stop using it.
+static int nandsim_vfl_erase(struct apple_vfl *_vfl, int _count, page_t *_blocks)
+{
+	int ret = 0, i, ce;
+
+	for(i = 0; i < _count; i++)
+	{
+		if(_blocks[i] >= nandsim_blocks)
+			return -EINVAL;
+
+		for(ce = 0; ce < _vfl->num_chips; ce++)
+		{
+			int status = apple_vfl_erase_nand_block(_vfl, ce, _blocks[i]);
+			if(status < 0 && !ret)
+				ret = status;
+		}
+	}
+
+	return ret;
+}
+
+static int nandsim_vfl_get(struct apple_vfl *_vfl, int _item)
+{
+	switch(_item)
+	{
+	case VFL_PAGES_PER_BLOCK:
+		return _vfl->num_chips*nandsim_pages;
+
+	case VFL_USABLE_BLOCKS_PER_BANK:
+		return nandsim_blocks;
+
+	case VFL_FTL_CTRL_BLOCK_0:
+	case VFL_FTL_CTRL_BLOCK_1:
+	case VFL_FTL_CTRL_BLOCK_2:
+		return _item - VFL_FTL_CTRL_BLOCK_0;
+
+	default:
+		return apple_nand_get(_vfl->devices[0], _item);
+	}
+}
+
+//
+// Setup
+//
+
+static int nandsim_attach(struct nandsim *_sim)
+{
+	int i, ret;
+
+	_sim->vfl.max_devices = nandsim_buses;
+	apple_vfl_init(&_sim->vfl);
+	if(!_sim->vfl.devices || !_sim->vfl.chips)
+	{
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	for(i = 0; i < nandsim_buses; i++)
+	{
+		ret = apple_nand_register(&_sim->buses[i].nand, &_sim->vfl, &_sim->pdev->dev);
+		if(ret < 0)
+			goto err;
+	}
+
+	if(nandsim_detect)
+		ret = apple_vfl_register(&_sim->vfl, APPLE_VFL_NEW_STYLE);
+	else
+	{
+		_sim->vfl.read = nandsim_vfl_read;
+		_sim->vfl.write = nandsim_vfl_write;
+		_sim->vfl.erase = nandsim_vfl_erase;
+		_sim->vfl.get = nandsim_vfl_get;
+		ret = apple_vfl_add(&_sim->vfl);
+	}
+
+	if(ret < 0)
+		goto err;
+
+	_sim->attached = 1;
+	return 0;
+
+err:
+	apple_vfl_unregister(&_sim->vfl);
+	memset(&_sim->vfl, 0, sizeof(_sim->vfl));
+	return ret;
+}
+
+static void nandsim_detach(struct nandsim *_sim)
+{
+	if(!_sim->attached)
+		return;
+
+	apple_vfl_unregister(&_sim->vfl);
+	memset(&_sim->vfl, 0, sizeof(_sim->vfl));
+	_sim->attached = 0;
+}
+
+static int nandsim_parse_badblocks(struct nandsim *_sim)
+{
+	char *w = nandsim_badblocks;
+
+	while(w && *w)
+	{
+		unsigned long chip, block;
+
+		chip = simple_strtoul(w, &w, 0);
+		if(*w != ':')
+			goto bad;
+
+		block = simple_strtoul(w + 1, &w, 0);
+		if(chip >= nandsim_buses*nandsim_chips || block >= nandsim_blocks)
+			goto bad;
+
+		_sim->blocks[chip*nandsim_blocks + block].bad = 1;
+
+		if(*w == ',')
+			w++;
+		else if(*w)
+			goto bad;
+	}
+
+	return 0;
+
+bad:
+	printk(KERN_ERR "apple-nandsim: invalid badblocks.\n");
+	return -EINVAL;
+}
+
+//
+// sysfs
+//
+
+static ssize_t nandsim_show_stats(struct device *_dev,
+		struct device_attribute *_attr, char *_buf)
+{
+	struct nandsim *sim = dev_get_drvdata(_dev);
+	struct nandsim_stats total;
+	int i;
+
+	memset(&total, 0, sizeof(total));
+	for(i = 0; i < nandsim_buses; i++)
+	{
+		struct nandsim_bus *bus = &sim->buses[i];
+
+		mutex_lock(&bus->lock);
+		total.reads += bus->stats.reads;
+		total.programs += bus->stats.programs;
+		total.erases += bus->stats.erases;
+		total.corrected += bus->stats.corrected;
+		total.uncorrectable += bus->stats.uncorrectable;
+		total.failed += bus->stats.failed;
+		mutex_unlock(&bus->lock);
+	}
+
+	// Laid out like a block device's stat file.
+	return sprintf(_buf, "%8llu %8llu %8llu %8llu %8llu %8llu\n",
+			(unsigned long long)total.reads,
+			(unsigned long long)total.programs,
+			(unsigned long long)total.erases,
+			(unsigned long long)total.corrected,
+			(unsigned long long)total.uncorrectable,
+			(unsigned long long)total.failed);
+}
+
+static ssize_t nandsim_show_wear(struct device *_dev,
+		struct device_attribute *_attr, char *_buf)
+{
+	struct nandsim *sim = dev_get_drvdata(_dev);
+	u32 count = nandsim_buses*nandsim_chips*nandsim_blocks;
+	u32 lo = ~0, hi = 0, i;
+	u64 sum = 0;
+
+	for(i = 0; i < count; i++)
+	{
+		u32 ec = sim->blocks[i].erase_count;
+
+		lo = min(lo, ec);
+		hi = max(hi, ec);
+		sum += ec;
+	}
+
+	// Least, average and most erased blocks.
+	return sprintf(_buf, "%u %u %u\n", lo, (u32)div_u64(sum, count), hi);
+}
+
+static ssize_t nandsim_show_power_cut(struct device *_dev,
+		struct device_attribute *_attr, char *_buf)
+{
+	struct nandsim *sim = dev_get_drvdata(_dev);
+	return sprintf(_buf, "%u\n", sim->power_left);
+}
+
+// Cuts the power after this many more programs and erases.
+static ssize_t nandsim_store_power_cut(struct device *_dev,
+		struct device_attribute *_attr, const char *_buf, size_t _count)
+{
+	struct nandsim *sim = dev_get_drvdata(_dev);
+	unsigned long val;
+
+	if(strict_strtoul(_buf, 0, &val))
+		return -EINVAL;
+
+	spin_lock(&sim->power_lock);
+	sim->power_left = val;
+	spin_unlock(&sim->power_lock);
+	return _count;
+}
+
+// Takes everything on top of the simulator down, powers it back up and
+// attaches the VFL again, which is where recovery gets exercised.
+static ssize_t nandsim_store_restart(struct device *_dev,
+		struct device_attribute *_attr, const char *_buf, size_t _count)
+{
+	struct nandsim *sim = dev_get_drvdata(_dev);
+	int ret;
+
+	mutex_lock(&sim->lock);
+	nandsim_detach(sim);
+
+	spin_lock(&sim->power_lock);
+	sim->power_left = 0;
+	sim->dead = 0;
+	spin_unlock(&sim->power_lock);
+
+	ret = nandsim_attach(sim);
+	mutex_unlock(&sim->lock);
+
+	return ret < 0 ? ret : _count;
+}
+
+static DEVICE_ATTR(stats, S_IRUGO, nandsim_show_stats, NULL);
+static DEVICE_ATTR(wear, S_IRUGO, nandsim_show_wear, NULL);
+static DEVICE_ATTR(power_cut, S_IRUGO | S_IWUSR,
+		nandsim_show_power_cut, nandsim_store_power_cut);
+static DEVICE_ATTR(restart, S_IWUSR, NULL, nandsim_store_restart);
+
+static struct attribute *nandsim_attrs[] = {
+	&dev_attr_stats.attr,
+	&dev_attr_wear.attr,
+	&dev_attr_power_cut.attr,
+	&dev_attr_restart.attr,
+	NULL,
+};
+
+static struct attribute_group nandsim_attr_group = {
+	.attrs = nandsim_attrs,
+};
+
+//
+// Module
+//
+
+static void nandsim_free(struct nandsim *_sim)
+{
+	int i;
+
+	if(_sim->blocks)
+	{
+		for(i = 0; i < nandsim_buses*nandsim_chips*nandsim_blocks; i++)
+			vfree(_sim->blocks[i].mem);
+
+		vfree(_sim->blocks);
+	}
+
+	if(_sim->buses)
+	{
+		for(i = 0; i < nandsim_buses; i++)
+		{
+			kfree(_sim->buses[i].page_buf);
+			kfree(_sim->buses[i].check_buf);
+		}
+
+		kfree(_sim->buses);
+	}
+
+	if(_sim->file)
+		filp_close(_sim->file, NULL);
+
+	if(_sim->pdev)
+		platform_device_unregister(_sim->pdev);
+
+	kfree(_sim->blank);
+	kfree(_sim);
+}
+
+static int __init nandsim_init(void)
+{
+	struct nandsim *sim;
+	int i, ret;
+
+	if(!nandsim_buses || !nandsim_chips || nandsim_chips > NANDSIM_MAX_CHIPS
+			|| nandsim_blocks <= NANDSIM_CTRL_BLOCKS
+			|| !nandsim_pages || (nandsim_pages & (nandsim_pages-1))
+			|| !nandsim_page_size || (nandsim_page_size & 1023))
+	{
+		printk(KERN_ERR "apple-nandsim: invalid geometry.\n");
+		return -EINVAL;
+	}
+
+	sim = kzalloc(sizeof(*sim), GFP_KERNEL);
+	if(!sim)
+		return -ENOMEM;
+
+	mutex_init(&sim->lock);
+	spin_lock_init(&sim->power_lock);
+	sim->raw_size = nandsim_page_size + NANDSIM_OOB_ALLOC;
+
+	sim->blank = kmalloc(sim->raw_size, GFP_KERNEL);
+	sim->blocks = vzalloc(nandsim_buses*nandsim_chips*nandsim_blocks*sizeof(*sim->blocks));
+	sim->buses = kzalloc(nandsim_buses*sizeof(*sim->buses), GFP_KERNEL);
+	if(!sim->blank || !sim->blocks || !sim->buses)
+	{
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	memset(sim->blank, 0xFF, sim->raw_size);
+
+	for(i = 0; i < nandsim_buses; i++)
+	{
+		struct nandsim_bus *bus = &sim->buses[i];
+
+		bus->sim = sim;
+		bus->index = i;
+		mutex_init(&bus->lock);
+
+		bus->page_buf = kmalloc(sim->raw_size, GFP_KERNEL);
+		bus->check_buf = kmalloc(sim->raw_size, GFP_KERNEL);
+		if(!bus->page_buf || !bus->check_buf)
+		{
+			ret = -ENOMEM;
+			goto err;
+		}
+
+		bus->nand.default_aes = nandsim_nand_default_aes;
+		bus->nand.aes = nandsim_nand_aes;
+		bus->nand.read = nandsim_nand_read;
+		bus->nand.write = nandsim_nand_write;
+		bus->nand.erase = nandsim_nand_erase;
+		bus->nand.get = nandsim_nand_get;
+		bus->nand.set = nandsim_nand_set;
+		bus->nand.is_bad = nandsim_nand_is_bad;
+		bus->nand.set_bad = nandsim_nand_set_bad;
+	}
+
+	ret = nandsim_parse_badblocks(sim);
+	if(ret < 0)
+		goto err;
+
+	if(nandsim_image)
+	{
+		struct file *file = filp_open(nandsim_image, O_CREAT | O_RDWR | O_LARGEFILE, 0600);
+		if(IS_ERR(file))
+		{
+			printk(KERN_ERR "apple-nandsim: failed to open %s.\n", nandsim_image);
+			ret = PTR_ERR(file);
+			goto err;
+		}
+
+		sim->file = file;
+	}
+
+	sim->pdev = platform_device_register_simple("apple-nandsim", -1, NULL, 0);
+	if(IS_ERR(sim->pdev))
+	{
+		ret = PTR_ERR(sim->pdev);
+		sim->pdev = NULL;
+		goto err;
+	}
+
+	dev_set_drvdata(&sim->pdev->dev, sim);
+
+	ret = sysfs_create_group(&sim->pdev->dev.kobj, &nandsim_attr_group);
+	if(ret < 0)
+		goto err;
+
+	mutex_lock(&sim->lock);
+	ret = nandsim_attach(sim);
+	mutex_unlock(&sim->lock);
+	if(ret < 0)
+	{
+		sysfs_remove_group(&sim->pdev->dev.kobj, &nandsim_attr_group);
+		goto err;
+	}
+
+	printk(KERN_INFO "apple-nandsim: %u buses of %u chips, %u blocks of %u %u byte pages%s%s.\n",
+			nandsim_buses, nandsim_chips, nandsim_blocks, nandsim_pages,
+			nandsim_page_size, sim->file ? " in " : "",
+			sim->file ? nandsim_image : "");
+
+	nandsim = sim;
+	return 0;
+
+err:
+	nandsim_free(sim);
+	return ret;
+}
+module_init(nandsim_init);
+
+static void __exit nandsim_exit(void)
+{
+	sysfs_remove_group(&nandsim->pdev->dev.kobj, &nandsim_attr_group);
+
+	mutex_lock(&nandsim->lock);
+	nandsim_detach(nandsim);
+	mutex_unlock(&nandsim->lock);
+
+	nandsim_free(nandsim);
+}
+module_exit(nandsim_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Apple NAND simulator");
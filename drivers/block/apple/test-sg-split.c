@@ -0,0 +1,168 @@
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/apple_flash.h>
+
+#define UNIT 512
+#define UNITS 4
+
+static u8 *test_buf;
+
+// Checks that list _part of a split holds exactly the units assigned
+// to it, in order, and uses _entries entries to do so.
+static int __init test_sg_part(const char *_name, struct scatterlist *_sg,
+		size_t _num, const int *_parts, int _part, size_t _entries)
+{
+	struct scatterlist *sg = _sg;
+	size_t sg_off = 0, i, j;
+
+	if(_num != _entries)
+	{
+		WARN(1, "%s: part %d has %zu entries, expected %zu\n",
+				_name, _part, _num, _entries);
+		return -EINVAL;
+	}
+
+	for(i = 0; i < UNITS; i++)
+	{
+		if(_parts[i] != _part)
+			continue;
+
+		for(j = 0; j < UNIT; j++)
+		{
+			if(!sg)
+			{
+				WARN(1, "%s: part %d ran out at unit %zu\n", _name, _part, i);
+				return -EINVAL;
+			}
+
+			if(((u8*)sg_virt(sg))[sg_off] != test_buf[i*UNIT + j])
+			{
+				WARN(1, "%s: part %d has wrong data for unit %zu\n", _name, _part, i);
+				return -EINVAL;
+			}
+
+			sg_off++;
+			if(sg_off >= sg->length)
+			{
+				sg = sg_next(sg);
+				sg_off = 0;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void __init test_sg_split(const char *_name, struct scatterlist *_src,
+		size_t _src_num, const int *_parts, const size_t *_entries)
+{
+	struct scatterlist *dst[2];
+	size_t num[2];
+	int ret, p;
+
+	ret = apple_sg_split(_src, _src_num, UNIT, UNITS, _parts, 2, dst, num);
+	if(ret < 0)
+	{
+		WARN(1, "%s: split failed with %d\n", _name, ret);
+		return;
+	}
+
+	for(p = 0; p < 2; p++)
+		test_sg_part(_name, dst[p], num[p], _parts, p, _entries[p]);
+
+	apple_sg_split_free(dst, 2);
+}
+
+static void __init test_sg_split_one_buffer(void)
+{
+	static const int interleaved[UNITS] __initconst = { 0, 1, 0, 1 };
+	static const size_t interleaved_entries[2] __initconst = { 2, 2 };
+	static const int grouped[UNITS] __initconst = { 0, 0, 1, 1 };
+	static const size_t grouped_entries[2] __initconst = { 1, 1 };
+	struct scatterlist sg;
+
+	sg_init_one(&sg, test_buf, UNIT*UNITS);
+	test_sg_split("interleaved", &sg, 1, interleaved, interleaved_entries);
+	test_sg_split("grouped", &sg, 1, grouped, grouped_entries);
+}
+
+static void __init test_sg_split_straddle(void)
+{
+	static const int parts[UNITS] __initconst = { 0, 1, 0, 1 };
+	static const size_t entries[2] __initconst = { 2, 3 };
+	struct scatterlist sg[2];
+	u8 *tail;
+
+	// Unit 1 straddles both source entries, which live in
+	// separate buffers so they can't be glued back together.
+	tail = kmalloc(2*UNIT + UNIT/2, GFP_KERNEL);
+	if(!tail)
+		return;
+
+	memcpy(tail, test_buf + UNIT + UNIT/2, 2*UNIT + UNIT/2);
+
+	sg_init_table(sg, 2);
+	sg_set_buf(&sg[0], test_buf, UNIT + UNIT/2);
+	sg_set_buf(&sg[1], tail, 2*UNIT + UNIT/2);
+	test_sg_split("straddle", sg, 2, parts, entries);
+
+	kfree(tail);
+}
+
+static void __init test_sg_split_many(void)
+{
+	static const int parts[UNITS] __initconst = { 0, 1, 0, 1 };
+	static const size_t entries[2] __initconst = { 2, 2 };
+	struct scatterlist sg[UNITS*4];
+	int i;
+
+	// Every unit spans four source entries, so the split has to carry
+	// its position in the source from one unit to the next.
+	sg_init_table(sg, UNITS*4);
+	for(i = 0; i < UNITS*4; i++)
+		sg_set_buf(&sg[i], test_buf + i*(UNIT/4), UNIT/4);
+
+	test_sg_split("many", sg, UNITS*4, parts, entries);
+}
+
+static void __init test_sg_split_fail(void)
+{
+	static const int parts[UNITS] __initconst = { 0, 1, 0, 1 };
+	static const int bad_parts[UNITS] __initconst = { 0, 1, 2, 1 };
+	struct scatterlist *dst[2];
+	struct scatterlist sg;
+	size_t num[2];
+	int ret;
+
+	sg_init_one(&sg, test_buf, UNIT*UNITS - 1);
+	ret = apple_sg_split(&sg, 1, UNIT, UNITS, parts, 2, dst, num);
+	WARN(ret != -EINVAL, "short source: expected -EINVAL, got %d\n", ret);
+
+	sg_init_one(&sg, test_buf, UNIT*UNITS);
+	ret = apple_sg_split(&sg, 1, UNIT, UNITS, bad_parts, 2, dst, num);
+	WARN(ret != -EINVAL, "bad part: expected -EINVAL, got %d\n", ret);
+}
+
+static int __init test_sg_split_init(void)
+{
+	int i;
+
+	test_buf = kmalloc(UNIT*UNITS, GFP_KERNEL);
+	if(!test_buf)
+		return -ENOMEM;
+
+	for(i = 0; i < UNIT*UNITS; i++)
+		test_buf[i] = i ^ (i / UNIT);
+
+	test_sg_split_one_buffer();
+	test_sg_split_straddle();
+	test_sg_split_many();
+	test_sg_split_fail();
+
+	kfree(test_buf);
+	return -EINVAL;
+}
+module_init(test_sg_split_init);
+MODULE_LICENSE("GPL");
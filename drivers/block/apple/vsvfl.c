@@ -394,7 +394,7 @@ static error_t vfl_vsvfl_write_single_page(struct apple_vfl *_vfl, uint32_t dwVp
 
 	// TODO: use SGs?
 	//ret = nand_device_write_single_page(vfl->device, pCE, 0, pPage, buffer, spare);
-	ret = apple_vfl_read_nand_page(_vfl, pCE, pPage, buffer, spare);
+	ret = apple_vfl_write_nand_page(_vfl, pCE, pPage, buffer, spare);
 
 	if(ret < 0)
 	{
@@ -877,15 +877,11 @@ static inline error_t vfl_vsvfl_setup_geometry(struct apple_vfl *_vfl)
 
 static error_t vfl_vsvfl_open(struct apple_vfl *_vfl)
 {
-	struct VSVFL *vfl = kzalloc(sizeof(struct VSVFL), GFP_KERNEL);
+	struct VSVFL *vfl = get_vsvfl(_vfl);
 	error_t ret;
 	uint32_t ce = 0;
 	int vendorType;
 
-	if(!vfl)
-		return -ENOMEM;
-	_vfl->private = vfl;
-
 	ret = vfl_vsvfl_setup_geometry(_vfl);
 	if(FAILED(ret))
 	{
@@ -1158,11 +1154,98 @@ static int vsvfl_get(struct apple_vfl *_vfl, int _item)
 	case VFL_FTL_TYPE:
 		return ctx->ftl_type;
 
+	case VFL_FTL_CTRL_BLOCK_0:
+	case VFL_FTL_CTRL_BLOCK_1:
+	case VFL_FTL_CTRL_BLOCK_2:
+		{
+			uint16_t *ctrl = VFL_get_FTLCtrlBlock(_vfl);
+			if(!ctrl)
+				return -ENOENT;
+
+			return ctrl[_item - VFL_FTL_CTRL_BLOCK_0];
+		}
+
 	default:
 		return apple_nand_get(nand, _item);
 	}
 }
 
+// Translates a batch of virtual pages and hands it to the NAND layer in one
+// call, which spreads it over the buses itself.
+static int vsvfl_transfer(struct apple_vfl *_vfl, int _write, int _count,
+		page_t *_pages,
+		struct scatterlist *_sg_data, size_t _sg_num_data,
+		struct scatterlist *_sg_oob, size_t _sg_num_oob)
+{
+	u16 *ces = kmalloc(_count * sizeof(*ces), GFP_KERNEL);
+	page_t *pages = kmalloc(_count * sizeof(*pages), GFP_KERNEL);
+	error_t ret = SUCCESS;
+	int i;
+
+	if(!ces || !pages)
+	{
+		ret = -ENOMEM;
+		goto exit;
+	}
+
+	for(i = 0; i < _count; i++)
+	{
+		uint32_t ce, page;
+
+		ret = virtual_page_number_to_physical(_vfl, _pages[i], &ce, &page);
+		if(FAILED(ret))
+		{
+			printk("vsvfl_transfer: virtual_page_number_to_physical returned an error (dwVpn %d)!\r\n", _pages[i]);
+			goto exit;
+		}
+
+		ces[i] = ce;
+		pages[i] = page;
+	}
+
+	if(_write)
+		ret = apple_vfl_write_nand_pages(_vfl, _count, ces, pages,
+				_sg_data, _sg_num_data, _sg_oob, _sg_num_oob);
+	else
+		ret = apple_vfl_read_nand_pages(_vfl, _count, ces, pages,
+				_sg_data, _sg_num_data, _sg_oob, _sg_num_oob);
+
+exit:
+	kfree(ces);
+	kfree(pages);
+	return ret;
+}
+
+static int vsvfl_read(struct apple_vfl *_vfl, int _count, page_t *_pages,
+		struct scatterlist *_sg_data, size_t _sg_num_data,
+		struct scatterlist *_sg_oob, size_t _sg_num_oob)
+{
+	return vsvfl_transfer(_vfl, 0, _count, _pages,
+			_sg_data, _sg_num_data, _sg_oob, _sg_num_oob);
+}
+
+static int vsvfl_write(struct apple_vfl *_vfl, int _count, page_t *_pages,
+		struct scatterlist *_sg_data, size_t _sg_num_data,
+		struct scatterlist *_sg_oob, size_t _sg_num_oob)
+{
+	return vsvfl_transfer(_vfl, 1, _count, _pages,
+			_sg_data, _sg_num_data, _sg_oob, _sg_num_oob);
+}
+
+static int vsvfl_erase(struct apple_vfl *_vfl, int _count, page_t *_blocks)
+{
+	int i;
+
+	for(i = 0; i < _count; i++)
+	{
+		error_t ret = vfl_vsvfl_erase_single_block(_vfl, _blocks[i], 1);
+		if(FAILED(ret))
+			return ret;
+	}
+
+	return SUCCESS;
+}
+
 /*static void* *vfl_vsvfl_get_stats(vfl_device_t *_vfl, uint32_t *size)
 {
 	struct apple_vfl *vfl = CONTAINER_OF(struct apple_vfl, vfl, _vfl);
@@ -1193,12 +1276,16 @@ static void vsvfl_cleanup(struct apple_vfl *_vfl)
 	if(vfl->blockBuffer)
 		kfree(vfl->blockBuffer);
 
-	memset(vfl, 0, sizeof(*vfl));
+	kfree(vfl->stats);
+	kfree(vfl);
+	_vfl->private = NULL;
 }
 
 int apple_vsvfl_detect(struct apple_vfl *_vfl)
 {
 	struct VSVFL *vfl = kzalloc(sizeof(*vfl), GFP_KERNEL);
+	error_t ret;
+
 	if(!vfl)
 		return -ENOMEM;
 
@@ -1206,8 +1293,9 @@ int apple_vsvfl_detect(struct apple_vfl *_vfl)
 
 	_vfl->private = vfl;
 	_vfl->cleanup = vsvfl_cleanup;
-	//_vfl->read = vsvfl_read;
-	//_vfl->write = vsvfl_write;
+	_vfl->read = vsvfl_read;
+	_vfl->write = vsvfl_write;
+	_vfl->erase = vsvfl_erase;
 	_vfl->get = vsvfl_get;
 	//_vfl->set = vsvf_set;
 
@@ -1220,5 +1308,12 @@ int apple_vsvfl_detect(struct apple_vfl *_vfl)
 	vfl->geometry.reserved_blocks = 1;
 #endif
 
-	return vfl_vsvfl_open(_vfl);
+	ret = vfl_vsvfl_open(_vfl);
+	if(FAILED(ret))
+	{
+		_vfl->private = NULL;
+		_vfl->cleanup = NULL;
+	}
+
+	return ret;
 }
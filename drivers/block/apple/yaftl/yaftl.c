@@ -0,0 +1,1596 @@
+/*
+ * YAFTL, the FTL that goes with VSVFL.
+ *
+ * Apart from the three control blocks the VFL hands us, which hold the
+ * context, every virtual block is either free, holds user data or holds
+ * index pages. The last pages of a data or index block are its table of
+ * contents (BTOC), the logical page of every page before them, so a block
+ * can be cleaned up without looking at every spare.
+ *
+ * The logical to virtual map is itself paged: index page i holds the
+ * virtual pages of logical pages [i*n, (i+1)*n), n being the number of
+ * u32s in a page, and the context records where each index page lives.
+ * Only a few index pages are kept in memory at once.
+ *
+ * The layout is our own and not the one iOS writes, see yaftl.h. A
+ * device that doesn't carry one of our contexts is left alone unless
+ * the format parameter asks for it to be erased.
+ */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/err.h>
+#include "yaftl.h"
+
+static int yaftl_index_cache = 64;
+module_param_named(index_cache, yaftl_index_cache, int, S_IRUGO);
+MODULE_PARM_DESC(index_cache, "Number of index pages cached per FTL");
+
+static bool yaftl_format_empty;
+module_param_named(format, yaftl_format_empty, bool, S_IRUGO);
+MODULE_PARM_DESC(format, "Erase the whole flash, iOS included, if no Linux YAFTL context is found");
+
+// Protected by the VFL user lock, add and remove are called under it.
+static LIST_HEAD(yaftl_list);
+
+static inline struct yaftl_spare *yaftl_spare(struct yaftl *_yaftl, int _idx)
+{
+	return (struct yaftl_spare*)(_yaftl->spare_buf + _idx*_yaftl->spare_size);
+}
+
+static inline int yaftl_spare_is(struct yaftl_spare *_spare, u8 _type)
+{
+	return _spare->magic == YAFTL_SPARE_MAGIC && (_spare->type & _type);
+}
+
+static inline u32 yaftl_room(struct yaftl *_yaftl, struct yaftl_open_block *_ob)
+{
+	if(_ob->block == YAFTL_NONE)
+		return _yaftl->user_pages;
+
+	return _yaftl->user_pages - _ob->page;
+}
+
+// Reads that needed ECC to correct some bits still return good data.
+static int yaftl_read_pages(struct yaftl *_yaftl, size_t _count, page_t *_vpns,
+		struct scatterlist *_sg_data, size_t _sg_num_data,
+		struct scatterlist *_sg_oob, size_t _sg_num_oob)
+{
+	int ret = _yaftl->vfl->read(_yaftl->vfl, _count, _vpns,
+			_sg_data, _sg_num_data, _sg_oob, _sg_num_oob);
+
+	return ret == -EUCLEAN ? 0 : ret;
+}
+
+static int yaftl_read_page(struct yaftl *_yaftl, page_t _vpn, u8 *_data, u8 *_spare)
+{
+	int ret = apple_vfl_read_page(_yaftl->vfl, _vpn, _data, _spare);
+
+	return ret == -EUCLEAN ? 0 : ret;
+}
+
+static void yaftl_sg_zero(struct scatterlist *_sg, size_t _num,
+		size_t _offset, size_t _len)
+{
+	struct sg_mapping_iter miter;
+
+	sg_miter_start(&miter, _sg, _num, SG_MITER_ATOMIC | SG_MITER_TO_SG);
+	while(_len && sg_miter_next(&miter))
+	{
+		size_t amt;
+
+		if(_offset >= miter.length)
+		{
+			_offset -= miter.length;
+			continue;
+		}
+
+		amt = min(miter.length - _offset, _len);
+		memset(miter.addr + _offset, 0, amt);
+		_offset = 0;
+		_len -= amt;
+	}
+	sg_miter_stop(&miter);
+}
+
+//
+// Blocks
+//
+
+static inline u32 yaftl_list_block(struct yaftl *_yaftl, struct list_head *_l)
+{
+	return _l - _yaftl->block_list;
+}
+
+// Puts _block on the free list behind the blocks that aren't more worn.
+// Freed blocks tend to be the most worn, so look from the back.
+static void yaftl_free_block(struct yaftl *_yaftl, u32 _block)
+{
+	u32 count = _yaftl->blocks[_block].erase_count;
+	struct list_head *pos;
+
+	list_for_each_prev(pos, &_yaftl->free_list)
+	{
+		if(_yaftl->blocks[yaftl_list_block(_yaftl, pos)].erase_count <= count)
+			break;
+	}
+
+	list_move(&_yaftl->block_list[_block], pos);
+	_yaftl->blocks[_block].type = YAFTL_BLOCK_FREE;
+	_yaftl->num_free++;
+}
+
+// Files a full data or index block under its valid count for GC.
+static void yaftl_file_block(struct yaftl *_yaftl, u32 _block)
+{
+	u16 valid = min_t(u32, _yaftl->blocks[_block].valid, _yaftl->user_pages);
+
+	list_move(&_yaftl->block_list[_block], &_yaftl->victims[valid]);
+}
+
+// Refiles _block after its valid count changed. Open blocks aren't filed.
+static inline void yaftl_refile_block(struct yaftl *_yaftl, u32 _block)
+{
+	if(!list_empty(&_yaftl->block_list[_block])
+			&& _yaftl->blocks[_block].type != YAFTL_BLOCK_FREE)
+		yaftl_file_block(_yaftl, _block);
+}
+
+struct yaftl_wear_entry
+{
+	u32 block;
+	u32 erase_count;
+};
+
+static int yaftl_wear_cmp(const void *_a, const void *_b)
+{
+	const struct yaftl_wear_entry *a = _a, *b = _b;
+
+	if(a->erase_count != b->erase_count)
+		return a->erase_count < b->erase_count ? -1 : 1;
+
+	return 0;
+}
+
+// Sets up the free list and the GC buckets from the block table.
+static int yaftl_rebuild_lists(struct yaftl *_yaftl)
+{
+	struct yaftl_wear_entry *order;
+	u32 num = 0, i;
+
+	order = vmalloc(_yaftl->total_blocks*sizeof(*order));
+	if(!order)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&_yaftl->free_list);
+	for(i = 0; i <= _yaftl->user_pages; i++)
+		INIT_LIST_HEAD(&_yaftl->victims[i]);
+
+	for(i = 0; i < _yaftl->total_blocks; i++)
+	{
+		struct yaftl_block_info *info = &_yaftl->blocks[i];
+
+		INIT_LIST_HEAD(&_yaftl->block_list[i]);
+
+		if(info->type == YAFTL_BLOCK_FREE)
+		{
+			order[num].block = i;
+			order[num].erase_count = info->erase_count;
+			num++;
+		}
+		else if((info->type == YAFTL_BLOCK_DATA || info->type == YAFTL_BLOCK_INDEX)
+				&& i != _yaftl->data.block && i != _yaftl->index.block)
+			yaftl_file_block(_yaftl, i);
+	}
+
+	sort(order, num, sizeof(*order), yaftl_wear_cmp, NULL);
+
+	for(i = 0; i < num; i++)
+		list_add_tail(&_yaftl->block_list[order[i].block], &_yaftl->free_list);
+
+	_yaftl->num_free = num;
+	vfree(order);
+	return 0;
+}
+
+static int yaftl_open_block(struct yaftl *_yaftl, struct yaftl_open_block *_ob, int _type)
+{
+	while(true)
+	{
+		u32 best;
+		page_t block;
+		int ret;
+
+		// Least worn free block.
+		if(list_empty(&_yaftl->free_list))
+		{
+			printk(KERN_ERR "yaftl: out of free blocks!\n");
+			return -ENOSPC;
+		}
+
+		best = yaftl_list_block(_yaftl, _yaftl->free_list.next);
+		list_del_init(&_yaftl->block_list[best]);
+
+		block = best;
+		_yaftl->num_free--;
+		_yaftl->blocks[best].erase_count++;
+		_yaftl->stats.erases++;
+
+		ret = _yaftl->vfl->erase(_yaftl->vfl, 1, &block);
+		if(ret < 0)
+		{
+			printk(KERN_WARNING "yaftl: failed to erase block %u (%d).\n", best, ret);
+			_yaftl->blocks[best].type = YAFTL_BLOCK_BAD;
+			continue;
+		}
+
+		_yaftl->blocks[best].type = _type;
+		_yaftl->blocks[best].valid = 0;
+
+		_ob->block = best;
+		_ob->page = 0;
+		_ob->usn = ++_yaftl->usn;
+		memset(_ob->btoc, 0xFF, _yaftl->btoc_pages*_yaftl->page_size);
+		return 0;
+	}
+}
+
+// Writes the BTOC of a full block.
+static void yaftl_close_block(struct yaftl *_yaftl, struct yaftl_open_block *_ob, int _type)
+{
+	struct scatterlist sg_data, sg_oob;
+	u32 base = _ob->block*_yaftl->pages_per_block + _yaftl->user_pages;
+	u32 i;
+	int ret;
+
+	memset(_yaftl->spare_buf, 0xFF, _yaftl->btoc_pages*_yaftl->spare_size);
+	for(i = 0; i < _yaftl->btoc_pages; i++)
+	{
+		struct yaftl_spare *spare = yaftl_spare(_yaftl, i);
+
+		spare->lpn = _ob->block;
+		spare->usn = _ob->usn;
+		spare->magic = YAFTL_SPARE_MAGIC;
+		spare->type = YAFTL_PAGE_CLOSED
+			| (_type == YAFTL_BLOCK_INDEX ? YAFTL_PAGE_INDEX : YAFTL_PAGE_DATA);
+		_yaftl->vpns[i] = base + i;
+	}
+
+	sg_init_one(&sg_data, _ob->btoc, _yaftl->btoc_pages*_yaftl->page_size);
+	sg_init_one(&sg_oob, _yaftl->spare_buf, _yaftl->btoc_pages*_yaftl->spare_size);
+
+	// Not fatal, without a BTOC the block is read back from its spares.
+	ret = _yaftl->vfl->write(_yaftl->vfl, _yaftl->btoc_pages, _yaftl->vpns,
+			&sg_data, 1, &sg_oob, 1);
+	if(ret < 0)
+		printk(KERN_WARNING "yaftl: failed to write BTOC of block %u (%d).\n",
+				_ob->block, ret);
+
+	yaftl_file_block(_yaftl, _ob->block);
+	_ob->block = YAFTL_NONE;
+}
+
+// Fills _btoc with the logical page of every user page in _block.
+static int yaftl_read_btoc(struct yaftl *_yaftl, u32 _block, u32 *_btoc)
+{
+	struct scatterlist sg_data, sg_oob;
+	u32 base = _block*_yaftl->pages_per_block;
+	u32 i;
+	int ret;
+
+	for(i = 0; i < _yaftl->btoc_pages; i++)
+		_yaftl->vpns[i] = base + _yaftl->user_pages + i;
+
+	sg_init_one(&sg_data, _btoc, _yaftl->btoc_pages*_yaftl->page_size);
+	sg_init_one(&sg_oob, _yaftl->spare_buf, _yaftl->btoc_pages*_yaftl->spare_size);
+
+	ret = yaftl_read_pages(_yaftl, _yaftl->btoc_pages, _yaftl->vpns,
+			&sg_data, 1, &sg_oob, 1);
+	if(ret >= 0 && yaftl_spare_is(yaftl_spare(_yaftl, 0), YAFTL_PAGE_CLOSED))
+		return 0;
+
+	// The block was never closed, go by the spares.
+	memset(_btoc, 0xFF, _yaftl->btoc_pages*_yaftl->page_size);
+	for(i = 0; i < _yaftl->user_pages; i++)
+	{
+		ret = yaftl_read_page(_yaftl, base + i,
+				_yaftl->page_buf, _yaftl->spare_buf);
+		if(ret == -ENOENT)
+			break;
+
+		if(ret < 0 || yaftl_spare(_yaftl, 0)->magic != YAFTL_SPARE_MAGIC)
+			continue;
+
+		_btoc[i] = yaftl_spare(_yaftl, 0)->lpn;
+	}
+
+	return 0;
+}
+
+//
+// Index
+//
+
+static int yaftl_program(struct yaftl *_yaftl, struct yaftl_open_block *_ob,
+		int _type, u32 *_lpns, size_t _count,
+		struct scatterlist *_sg, size_t _sg_num, size_t _offset);
+
+static int yaftl_cache_flush(struct yaftl *_yaftl, struct yaftl_cache_entry *_e)
+{
+	struct scatterlist sg;
+	int ret;
+
+	if(!_e->dirty)
+		return 0;
+
+	sg_init_one(&sg, _e->data, _yaftl->page_size);
+	ret = yaftl_program(_yaftl, &_yaftl->index, YAFTL_BLOCK_INDEX,
+			&_e->index_page, 1, &sg, 1, 0);
+	if(ret < 0)
+		return ret;
+
+	_e->dirty = 0;
+	return 0;
+}
+
+static struct yaftl_cache_entry *yaftl_cache_get(struct yaftl *_yaftl, u32 _idx)
+{
+	struct yaftl_cache_entry *e;
+	int ret;
+
+	if(_yaftl->cache_slot[_idx] != YAFTL_NO_SLOT)
+	{
+		e = &_yaftl->cache[_yaftl->cache_slot[_idx]];
+		list_move(&e->lru, &_yaftl->cache_lru);
+		_yaftl->stats.cache_hits++;
+		return e;
+	}
+
+	_yaftl->stats.cache_misses++;
+
+	e = list_entry(_yaftl->cache_lru.prev, struct yaftl_cache_entry, lru);
+	if(e->index_page != YAFTL_NONE)
+	{
+		ret = yaftl_cache_flush(_yaftl, e);
+		if(ret < 0)
+			return ERR_PTR(ret);
+
+		_yaftl->cache_slot[e->index_page] = YAFTL_NO_SLOT;
+		e->index_page = YAFTL_NONE;
+	}
+
+	if(_yaftl->index_map[_idx] == YAFTL_NONE)
+		memset(e->data, 0xFF, _yaftl->page_size);
+	else
+	{
+		struct yaftl_spare *spare = yaftl_spare(_yaftl, 0);
+
+		ret = yaftl_read_page(_yaftl, _yaftl->index_map[_idx],
+				(u8*)e->data, _yaftl->spare_buf);
+		if(ret < 0)
+		{
+			printk(KERN_ERR "yaftl: failed to read index page %u (%d).\n", _idx, ret);
+			return ERR_PTR(ret);
+		}
+
+		if(!yaftl_spare_is(spare, YAFTL_PAGE_INDEX) || spare->lpn != _idx)
+		{
+			printk(KERN_ERR "yaftl: page 0x%08x isn't index page %u.\n",
+					_yaftl->index_map[_idx], _idx);
+			return ERR_PTR(-EIO);
+		}
+	}
+
+	e->index_page = _idx;
+	e->dirty = 0;
+	_yaftl->cache_slot[_idx] = e - _yaftl->cache;
+	list_move(&e->lru, &_yaftl->cache_lru);
+	return e;
+}
+
+static int yaftl_cache_flush_all(struct yaftl *_yaftl)
+{
+	int i, ret;
+
+	for(i = 0; i < _yaftl->cache_size; i++)
+	{
+		ret = yaftl_cache_flush(_yaftl, &_yaftl->cache[i]);
+		if(ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void yaftl_cache_reset(struct yaftl *_yaftl)
+{
+	int i;
+
+	INIT_LIST_HEAD(&_yaftl->cache_lru);
+	memset(_yaftl->cache_slot, 0xFF, _yaftl->num_index_pages*sizeof(*_yaftl->cache_slot));
+
+	for(i = 0; i < _yaftl->cache_size; i++)
+	{
+		_yaftl->cache[i].index_page = YAFTL_NONE;
+		_yaftl->cache[i].dirty = 0;
+		list_add_tail(&_yaftl->cache[i].lru, &_yaftl->cache_lru);
+	}
+}
+
+static int yaftl_lookup(struct yaftl *_yaftl, u32 _lpn, u32 *_vpn)
+{
+	struct yaftl_cache_entry *e;
+
+	if(_lpn >= _yaftl->total_pages)
+		return -EINVAL;
+
+	e = yaftl_cache_get(_yaftl, _lpn / _yaftl->entries_per_page);
+	if(IS_ERR(e))
+		return PTR_ERR(e);
+
+	*_vpn = e->data[_lpn % _yaftl->entries_per_page];
+	return 0;
+}
+
+// Points _lpn (an index page for index blocks) at _vpn, keeping the
+// valid counts of the old and new blocks up to date.
+static int yaftl_set_location(struct yaftl *_yaftl, int _type, u32 _lpn, u32 _vpn)
+{
+	u32 old;
+
+	if(_type == YAFTL_BLOCK_INDEX)
+	{
+		old = _yaftl->index_map[_lpn];
+		_yaftl->index_map[_lpn] = _vpn;
+	}
+	else
+	{
+		struct yaftl_cache_entry *e = yaftl_cache_get(_yaftl,
+				_lpn / _yaftl->entries_per_page);
+		if(IS_ERR(e))
+			return PTR_ERR(e);
+
+		old = e->data[_lpn % _yaftl->entries_per_page];
+		e->data[_lpn % _yaftl->entries_per_page] = _vpn;
+		e->dirty = 1;
+	}
+
+	if(old != YAFTL_NONE)
+	{
+		_yaftl->blocks[old / _yaftl->pages_per_block].valid--;
+		yaftl_refile_block(_yaftl, old / _yaftl->pages_per_block);
+	}
+
+	_yaftl->blocks[_vpn / _yaftl->pages_per_block].valid++;
+	return 0;
+}
+
+// Writes _count pages, starting _offset bytes into _sg, to the open block
+// in one VFL call and maps them. The pages must fit in the block.
+static int yaftl_program(struct yaftl *_yaftl, struct yaftl_open_block *_ob,
+		int _type, u32 *_lpns, size_t _count,
+		struct scatterlist *_sg, size_t _sg_num, size_t _offset)
+{
+	size_t max = _sg_num + _count;
+	size_t used = 0;
+	struct scatterlist *sg, sg_oob;
+	u32 base, i;
+	int ret;
+
+	if(_ob->block == YAFTL_NONE)
+	{
+		ret = yaftl_open_block(_yaftl, _ob, _type);
+		if(ret < 0)
+			return ret;
+	}
+
+	if(_count > yaftl_room(_yaftl, _ob))
+		return -EINVAL;
+
+	sg = kmalloc(sizeof(*sg)*max, GFP_KERNEL);
+	if(!sg)
+		return -ENOMEM;
+
+	sg_init_table(sg, max);
+	ret = apple_sg_copy_range(sg, max, &used, _sg, _sg_num,
+			_offset, _count*_yaftl->page_size);
+	if(ret)
+	{
+		kfree(sg);
+		return ret;
+	}
+
+	sg_mark_end(&sg[used-1]);
+
+	base = _ob->block*_yaftl->pages_per_block + _ob->page;
+	memset(_yaftl->spare_buf, 0xFF, _count*_yaftl->spare_size);
+	for(i = 0; i < _count; i++)
+	{
+		struct yaftl_spare *spare = yaftl_spare(_yaftl, i);
+
+		spare->lpn = _lpns[i];
+		spare->usn = _ob->usn;
+		spare->magic = YAFTL_SPARE_MAGIC;
+		spare->type = (_type == YAFTL_BLOCK_INDEX) ? YAFTL_PAGE_INDEX : YAFTL_PAGE_DATA;
+		_yaftl->vpns[i] = base + i;
+	}
+
+	sg_init_one(&sg_oob, _yaftl->spare_buf, _count*_yaftl->spare_size);
+	ret = _yaftl->vfl->write(_yaftl->vfl, _count, _yaftl->vpns,
+			sg, used, &sg_oob, 1);
+	kfree(sg);
+
+	if(ret < 0)
+	{
+		// Give up on the block, GC picks up what made it so far.
+		printk(KERN_ERR "yaftl: failed to write block %u (%d), abandoning it.\n",
+				_ob->block, ret);
+		yaftl_file_block(_yaftl, _ob->block);
+		_ob->block = YAFTL_NONE;
+		return ret;
+	}
+
+	for(i = 0; i < _count; i++)
+		_ob->btoc[_ob->page + i] = _lpns[i];
+
+	_ob->page += _count;
+
+	for(i = 0; i < _count; i++)
+	{
+		ret = yaftl_set_location(_yaftl, _type, _lpns[i], base + i);
+		if(ret < 0)
+			return ret;
+	}
+
+	if(_ob->block != YAFTL_NONE && _ob->page == _yaftl->user_pages)
+		yaftl_close_block(_yaftl, _ob, _type);
+
+	return 0;
+}
+
+//
+// Garbage collection
+//
+
+static int yaftl_copy(struct yaftl *_yaftl, size_t _count)
+{
+	size_t done, n;
+	int ret;
+
+	ret = yaftl_read_pages(_yaftl, _count, _yaftl->copy_vpns,
+			_yaftl->copy_sg, _count, NULL, 0);
+	if(ret < 0)
+	{
+		printk(KERN_ERR "yaftl: failed to read pages to move (%d).\n", ret);
+		return ret;
+	}
+
+	for(done = 0; done < _count; done += n)
+	{
+		n = min_t(size_t, _count - done, yaftl_room(_yaftl, &_yaftl->data));
+		ret = yaftl_program(_yaftl, &_yaftl->data, YAFTL_BLOCK_DATA,
+				_yaftl->copy_lpns + done, n, _yaftl->copy_sg, _count,
+				done*_yaftl->page_size);
+		if(ret < 0)
+			return ret;
+	}
+
+	_yaftl->stats.gc_copies += _count;
+	return 0;
+}
+
+// Moves the valid pages out of _block and frees it.
+static int yaftl_reclaim(struct yaftl *_yaftl, u32 _block)
+{
+	u32 *btoc = _yaftl->btoc_buf;
+	int type = _yaftl->blocks[_block].type;
+	size_t count = 0;
+	u32 i;
+	int ret;
+
+	ret = yaftl_read_btoc(_yaftl, _block, btoc);
+	if(ret < 0)
+		return ret;
+
+	for(i = 0; i < _yaftl->user_pages && _yaftl->blocks[_block].valid; i++)
+	{
+		u32 vpn = _block*_yaftl->pages_per_block + i;
+		u32 lpn = btoc[i];
+		u32 cur;
+
+		if(lpn == YAFTL_NONE)
+			continue;
+
+		if(type == YAFTL_BLOCK_INDEX)
+		{
+			struct yaftl_cache_entry *e;
+
+			if(lpn >= _yaftl->num_index_pages || _yaftl->index_map[lpn] != vpn)
+				continue;
+
+			e = yaftl_cache_get(_yaftl, lpn);
+			if(IS_ERR(e))
+				return PTR_ERR(e);
+
+			e->dirty = 1;
+			ret = yaftl_cache_flush(_yaftl, e);
+			if(ret < 0)
+				return ret;
+
+			continue;
+		}
+
+		if(lpn >= _yaftl->total_pages)
+			continue;
+
+		ret = yaftl_lookup(_yaftl, lpn, &cur);
+		if(ret < 0)
+			return ret;
+
+		if(cur != vpn)
+			continue;
+
+		_yaftl->copy_lpns[count] = lpn;
+		_yaftl->copy_vpns[count] = vpn;
+		count++;
+
+		if(count == YAFTL_COPY_PAGES)
+		{
+			ret = yaftl_copy(_yaftl, count);
+			if(ret < 0)
+				return ret;
+
+			count = 0;
+		}
+	}
+
+	if(count)
+	{
+		ret = yaftl_copy(_yaftl, count);
+		if(ret < 0)
+			return ret;
+	}
+
+	if(_yaftl->blocks[_block].valid)
+	{
+		printk(KERN_ERR "yaftl: block %u still has %u valid pages after GC.\n",
+				_block, _yaftl->blocks[_block].valid);
+		return -EIO;
+	}
+
+	// It is erased when it gets used again.
+	yaftl_free_block(_yaftl, _block);
+	_yaftl->stats.gc_blocks++;
+	return 0;
+}
+
+// Frees blocks until there are more than the reserve. Only called
+// between writes, when every page written so far is mapped.
+static int yaftl_gc(struct yaftl *_yaftl)
+{
+	while(_yaftl->num_free <= YAFTL_GC_RESERVE)
+	{
+		u32 victim = YAFTL_NONE;
+		u32 v;
+		int ret;
+
+		// A block with every page valid isn't worth moving.
+		for(v = 0; v < _yaftl->user_pages; v++)
+		{
+			if(!list_empty(&_yaftl->victims[v]))
+			{
+				victim = yaftl_list_block(_yaftl, _yaftl->victims[v].next);
+				break;
+			}
+		}
+
+		if(victim == YAFTL_NONE)
+		{
+			printk(KERN_ERR "yaftl: nothing left to collect!\n");
+			return -ENOSPC;
+		}
+
+		ret = yaftl_reclaim(_yaftl, victim);
+		if(ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+//
+// Context
+//
+
+static size_t yaftl_context_size(struct yaftl *_yaftl)
+{
+	return sizeof(struct yaftl_context)
+		+ _yaftl->num_index_pages*sizeof(u32)
+		+ _yaftl->total_blocks*sizeof(struct yaftl_block_info)
+		+ 2*_yaftl->user_pages*sizeof(u32);
+}
+
+static int yaftl_write_context(struct yaftl *_yaftl, int _clean)
+{
+	size_t size = _clean ? yaftl_context_size(_yaftl) : sizeof(struct yaftl_context);
+	u32 num = DIV_ROUND_UP(size, _yaftl->page_size);
+	struct yaftl_context *ctx;
+	u8 *buf, *p;
+	u32 i;
+	int ret = 0;
+
+	buf = vmalloc(num*_yaftl->page_size);
+	if(!buf)
+		return -ENOMEM;
+
+	memset(buf, 0xFF, num*_yaftl->page_size);
+
+	ctx = (struct yaftl_context*)buf;
+	memcpy(ctx->version, YAFTL_CONTEXT_VERSION, sizeof(ctx->version));
+	ctx->usn = ++_yaftl->usn;
+	ctx->clean = _clean;
+	ctx->num_pages = num;
+	ctx->total_pages = _yaftl->total_pages;
+	ctx->total_blocks = _yaftl->total_blocks;
+	ctx->pages_per_block = _yaftl->pages_per_block;
+	ctx->num_index_pages = _yaftl->num_index_pages;
+	ctx->data_block = _yaftl->data.block;
+	ctx->data_page = _yaftl->data.page;
+	ctx->index_block = _yaftl->index.block;
+	ctx->index_page = _yaftl->index.page;
+
+	if(_clean)
+	{
+		p = buf + sizeof(*ctx);
+		memcpy(p, _yaftl->index_map, _yaftl->num_index_pages*sizeof(u32));
+		p += _yaftl->num_index_pages*sizeof(u32);
+		memcpy(p, _yaftl->blocks, _yaftl->total_blocks*sizeof(struct yaftl_block_info));
+		p += _yaftl->total_blocks*sizeof(struct yaftl_block_info);
+		memcpy(p, _yaftl->data.btoc, _yaftl->user_pages*sizeof(u32));
+		p += _yaftl->user_pages*sizeof(u32);
+		memcpy(p, _yaftl->index.btoc, _yaftl->user_pages*sizeof(u32));
+	}
+
+	// The control blocks are a ring, move on when this one is full.
+	if(_yaftl->ctx_page + num > _yaftl->pages_per_block)
+	{
+		page_t block;
+
+		_yaftl->ctx_block = (_yaftl->ctx_block + 1) % YAFTL_CTRL_BLOCKS;
+		_yaftl->ctx_page = 0;
+
+		block = _yaftl->ctrl_block[_yaftl->ctx_block];
+		ret = _yaftl->vfl->erase(_yaftl->vfl, 1, &block);
+		if(ret < 0)
+		{
+			printk(KERN_ERR "yaftl: failed to erase control block %u (%d).\n",
+					block, ret);
+			goto exit;
+		}
+	}
+
+	for(i = 0; i < num; i++)
+	{
+		struct yaftl_spare *spare = yaftl_spare(_yaftl, 0);
+		u32 vpn = _yaftl->ctrl_block[_yaftl->ctx_block]*_yaftl->pages_per_block
+			+ _yaftl->ctx_page + i;
+
+		memset(spare, 0xFF, _yaftl->spare_size);
+		spare->lpn = i;
+		spare->usn = ctx->usn;
+		spare->magic = YAFTL_SPARE_MAGIC;
+		spare->type = YAFTL_PAGE_CONTEXT;
+
+		ret = apple_vfl_write_page(_yaftl->vfl, vpn,
+				buf + i*_yaftl->page_size, _yaftl->spare_buf);
+		if(ret < 0)
+		{
+			printk(KERN_ERR "yaftl: failed to write context (%d).\n", ret);
+
+			// Start the next one on a fresh block.
+			_yaftl->ctx_page = _yaftl->pages_per_block;
+			goto exit;
+		}
+	}
+
+	_yaftl->ctx_page += num;
+	ret = 0;
+
+exit:
+	vfree(buf);
+	return ret;
+}
+
+// Records that the flash is about to change under the last clean context.
+static int yaftl_mark_dirty(struct yaftl *_yaftl)
+{
+	int ret;
+
+	if(!_yaftl->clean)
+		return 0;
+
+	ret = yaftl_write_context(_yaftl, 0);
+	if(ret < 0)
+		return ret;
+
+	_yaftl->clean = 0;
+	return 0;
+}
+
+struct yaftl_context_pos
+{
+	u32 block;
+	u32 page;
+	u32 usn;
+};
+
+// Finds the newest context, and the newest clean one, in the control
+// blocks. Also works out where the next context goes.
+static int yaftl_find_context(struct yaftl *_yaftl,
+		struct yaftl_context_pos *_latest, struct yaftl_context_pos *_clean)
+{
+	struct yaftl_context *ctx = (struct yaftl_context*)_yaftl->page_buf;
+	struct yaftl_spare *spare = yaftl_spare(_yaftl, 0);
+	u32 end[YAFTL_CTRL_BLOCKS];
+	int found = 0, foreign = 0;
+	u32 c, p;
+
+	_latest->block = _clean->block = YAFTL_NONE;
+	_latest->usn = _clean->usn = 0;
+
+	for(c = 0; c < YAFTL_CTRL_BLOCKS; c++)
+	{
+		u32 base = _yaftl->ctrl_block[c]*_yaftl->pages_per_block;
+
+		for(p = 0; p < _yaftl->pages_per_block; p++)
+		{
+			int ret = yaftl_read_page(_yaftl, base + p,
+					_yaftl->page_buf, _yaftl->spare_buf);
+			if(ret == -ENOENT)
+				break;
+
+			if(ret < 0)
+				continue;
+
+			if(spare->magic != YAFTL_SPARE_MAGIC || spare->type != YAFTL_PAGE_CONTEXT)
+			{
+				foreign = 1;
+				continue;
+			}
+
+			if(spare->lpn != 0
+					|| memcmp(ctx->version, YAFTL_CONTEXT_VERSION, sizeof(ctx->version)))
+				continue;
+
+			if(!found || ctx->usn > _latest->usn)
+			{
+				_latest->block = c;
+				_latest->page = p;
+				_latest->usn = ctx->usn;
+			}
+
+			if(ctx->clean && (_clean->block == YAFTL_NONE || ctx->usn > _clean->usn))
+			{
+				_clean->block = c;
+				_clean->page = p;
+				_clean->usn = ctx->usn;
+			}
+
+			found = 1;
+		}
+
+		end[c] = p;
+	}
+
+	if(!found)
+	{
+		if(foreign)
+			printk(KERN_WARNING "yaftl: control blocks hold pages we didn't write, "
+					"probably iOS's own YAFTL.\n");
+		return -ENOENT;
+	}
+
+	_yaftl->ctx_block = _latest->block;
+	_yaftl->ctx_page = end[_latest->block];
+	return 0;
+}
+
+static int yaftl_load_context(struct yaftl *_yaftl, struct yaftl_context_pos *_pos)
+{
+	u32 base = _yaftl->ctrl_block[_pos->block]*_yaftl->pages_per_block + _pos->page;
+	struct yaftl_context *ctx;
+	u8 *buf, *p;
+	u32 num = DIV_ROUND_UP(yaftl_context_size(_yaftl), _yaftl->page_size);
+	u32 i;
+	int ret = 0;
+
+	buf = vmalloc(num*_yaftl->page_size);
+	if(!buf)
+		return -ENOMEM;
+
+	for(i = 0; i < num; i++)
+	{
+		ret = yaftl_read_page(_yaftl, base + i,
+				buf + i*_yaftl->page_size, _yaftl->spare_buf);
+		if(ret < 0)
+		{
+			printk(KERN_ERR "yaftl: failed to read context page %u (%d).\n", i, ret);
+			goto exit;
+		}
+	}
+
+	ctx = (struct yaftl_context*)buf;
+	if(ctx->num_pages != num
+			|| ctx->total_pages != _yaftl->total_pages
+			|| ctx->total_blocks != _yaftl->total_blocks
+			|| ctx->pages_per_block != _yaftl->pages_per_block
+			|| ctx->num_index_pages != _yaftl->num_index_pages)
+	{
+		printk(KERN_ERR "yaftl: context doesn't match the geometry!\n");
+		ret = -EINVAL;
+		goto exit;
+	}
+
+	p = buf + sizeof(*ctx);
+	memcpy(_yaftl->index_map, p, _yaftl->num_index_pages*sizeof(u32));
+	p += _yaftl->num_index_pages*sizeof(u32);
+	memcpy(_yaftl->blocks, p, _yaftl->total_blocks*sizeof(struct yaftl_block_info));
+	p += _yaftl->total_blocks*sizeof(struct yaftl_block_info);
+
+	memset(_yaftl->data.btoc, 0xFF, _yaftl->btoc_pages*_yaftl->page_size);
+	memset(_yaftl->index.btoc, 0xFF, _yaftl->btoc_pages*_yaftl->page_size);
+	memcpy(_yaftl->data.btoc, p, _yaftl->user_pages*sizeof(u32));
+	p += _yaftl->user_pages*sizeof(u32);
+	memcpy(_yaftl->index.btoc, p, _yaftl->user_pages*sizeof(u32));
+
+	_yaftl->data.block = ctx->data_block;
+	_yaftl->data.page = ctx->data_page;
+	_yaftl->index.block = ctx->index_block;
+	_yaftl->index.page = ctx->index_page;
+
+	if(_yaftl->data.block != YAFTL_NONE)
+		_yaftl->data.usn = _yaftl->usn;
+	if(_yaftl->index.block != YAFTL_NONE)
+		_yaftl->index.usn = _yaftl->usn;
+
+	ret = yaftl_rebuild_lists(_yaftl);
+
+exit:
+	vfree(buf);
+	return ret;
+}
+
+struct yaftl_restore_entry
+{
+	u32 block;
+	u32 usn;
+};
+
+static int yaftl_restore_cmp(const void *_a, const void *_b)
+{
+	const struct yaftl_restore_entry *a = _a, *b = _b;
+
+	if(a->usn != b->usn)
+		return a->usn < b->usn ? -1 : 1;
+
+	return 0;
+}
+
+// Rebuilds the map from the data blocks after an unclean shutdown. Later
+// blocks win, the index blocks are thrown away and written out afresh.
+static int yaftl_restore(struct yaftl *_yaftl)
+{
+	struct yaftl_spare *spare = yaftl_spare(_yaftl, 0);
+	struct yaftl_restore_entry *order;
+	u32 num = 0;
+	u32 *l2p;
+	u32 i, j;
+	int ret = 0;
+
+	printk(KERN_INFO "yaftl: unclean shutdown, rebuilding the index.\n");
+
+	l2p = vmalloc(_yaftl->total_pages*sizeof(u32));
+	order = vmalloc(_yaftl->total_blocks*sizeof(*order));
+	if(!l2p || !order)
+	{
+		ret = -ENOMEM;
+		goto exit;
+	}
+
+	memset(l2p, 0xFF, _yaftl->total_pages*sizeof(u32));
+
+	for(i = 0; i < _yaftl->total_blocks; i++)
+	{
+		struct yaftl_block_info *info = &_yaftl->blocks[i];
+
+		if(info->type == YAFTL_BLOCK_CTRL || info->type == YAFTL_BLOCK_BAD)
+			continue;
+
+		info->type = YAFTL_BLOCK_FREE;
+		info->valid = 0;
+
+		if(yaftl_read_page(_yaftl, i*_yaftl->pages_per_block,
+					_yaftl->page_buf, _yaftl->spare_buf) < 0
+				|| spare->magic != YAFTL_SPARE_MAGIC)
+			continue;
+
+		if(spare->usn != YAFTL_NONE && spare->usn > _yaftl->usn)
+			_yaftl->usn = spare->usn;
+
+		if(!yaftl_spare_is(spare, YAFTL_PAGE_DATA))
+			continue;
+
+		info->type = YAFTL_BLOCK_DATA;
+		order[num].block = i;
+		order[num].usn = spare->usn;
+		num++;
+	}
+
+	sort(order, num, sizeof(*order), yaftl_restore_cmp, NULL);
+
+	for(i = 0; i < num; i++)
+	{
+		u32 base = order[i].block*_yaftl->pages_per_block;
+
+		ret = yaftl_read_btoc(_yaftl, order[i].block, _yaftl->btoc_buf);
+		if(ret < 0)
+			goto exit;
+
+		for(j = 0; j < _yaftl->user_pages; j++)
+		{
+			u32 lpn = _yaftl->btoc_buf[j];
+
+			if(lpn < _yaftl->total_pages)
+				l2p[lpn] = base + j;
+		}
+	}
+
+	for(i = 0; i < _yaftl->total_pages; i++)
+	{
+		if(l2p[i] != YAFTL_NONE)
+			_yaftl->blocks[l2p[i] / _yaftl->pages_per_block].valid++;
+	}
+
+	for(i = 0; i < _yaftl->total_blocks; i++)
+	{
+		struct yaftl_block_info *info = &_yaftl->blocks[i];
+
+		if(info->type == YAFTL_BLOCK_DATA && !info->valid)
+			info->type = YAFTL_BLOCK_FREE;
+	}
+
+	_yaftl->data.block = YAFTL_NONE;
+	_yaftl->index.block = YAFTL_NONE;
+
+	ret = yaftl_rebuild_lists(_yaftl);
+	if(ret < 0)
+		goto exit;
+	memset(_yaftl->index_map, 0xFF, _yaftl->num_index_pages*sizeof(u32));
+	yaftl_cache_reset(_yaftl);
+
+	for(i = 0; i < _yaftl->num_index_pages; i++)
+	{
+		u32 first = i*_yaftl->entries_per_page;
+		u32 count = min(_yaftl->entries_per_page, _yaftl->total_pages - first);
+		struct yaftl_cache_entry *e;
+
+		for(j = 0; j < count; j++)
+		{
+			if(l2p[first + j] != YAFTL_NONE)
+				break;
+		}
+
+		if(j == count)
+			continue;
+
+		e = yaftl_cache_get(_yaftl, i);
+		if(IS_ERR(e))
+		{
+			ret = PTR_ERR(e);
+			goto exit;
+		}
+
+		memcpy(e->data, l2p + first, count*sizeof(u32));
+		e->dirty = 1;
+
+		ret = yaftl_cache_flush(_yaftl, e);
+		if(ret < 0)
+			goto exit;
+	}
+
+	ret = yaftl_write_context(_yaftl, 1);
+	if(ret >= 0)
+		_yaftl->clean = 1;
+
+exit:
+	vfree(order);
+	vfree(l2p);
+	return ret;
+}
+
+static int yaftl_format(struct yaftl *_yaftl)
+{
+	u32 i;
+	int ret;
+
+	printk(KERN_WARNING "yaftl: no context found, erasing the flash and formatting.\n");
+
+	// Erase everything up front, restore and the context search would
+	// pick up stale pages otherwise.
+	for(i = 0; i < _yaftl->total_blocks; i++)
+	{
+		struct yaftl_block_info *info = &_yaftl->blocks[i];
+
+		ret = _yaftl->vfl->erase(_yaftl->vfl, 1, &i);
+
+		info->valid = 0;
+		info->erase_count = 1;
+		if(info->type == YAFTL_BLOCK_CTRL)
+		{
+			if(ret < 0)
+				return ret;
+
+			continue;
+		}
+
+		info->type = (ret < 0) ? YAFTL_BLOCK_BAD : YAFTL_BLOCK_FREE;
+	}
+
+	memset(_yaftl->index_map, 0xFF, _yaftl->num_index_pages*sizeof(u32));
+
+	ret = yaftl_rebuild_lists(_yaftl);
+	if(ret < 0)
+		return ret;
+
+	_yaftl->usn = 0;
+	_yaftl->ctx_block = 0;
+	_yaftl->ctx_page = 0;
+
+	ret = yaftl_write_context(_yaftl, 1);
+	if(ret >= 0)
+		_yaftl->clean = 1;
+
+	return ret;
+}
+
+//
+// FTL
+//
+
+static int yaftl_read(struct apple_ftl *_ftl, size_t _count, page_t *_pages,
+		struct scatterlist *_sg_data, size_t _sg_num_data)
+{
+	struct yaftl *yaftl = get_yaftl(_ftl);
+	size_t max = _sg_num_data + _count;
+	size_t used = 0, num = 0, i;
+	struct apple_sg_cursor cur;
+	struct scatterlist *sg;
+	page_t *vpns;
+	int ret = 0;
+
+	sg = kmalloc(sizeof(*sg)*max, GFP_KERNEL);
+	vpns = kmalloc(sizeof(*vpns)*_count, GFP_KERNEL);
+	if(!sg || !vpns)
+	{
+		ret = -ENOMEM;
+		goto exit;
+	}
+
+	sg_init_table(sg, max);
+	apple_sg_cursor_init(&cur, _sg_data, _sg_num_data);
+
+	mutex_lock(&yaftl->lock);
+
+	for(i = 0; i < _count; i++)
+	{
+		u32 vpn;
+
+		ret = yaftl_lookup(yaftl, _pages[i], &vpn);
+		if(ret < 0)
+			goto unlock;
+
+		if(vpn == YAFTL_NONE)
+		{
+			// Never written.
+			yaftl_sg_zero(_sg_data, _sg_num_data,
+					i*yaftl->page_size, yaftl->page_size);
+			continue;
+		}
+
+		ret = apple_sg_cursor_copy(sg, max, &used, &cur,
+				i*yaftl->page_size, yaftl->page_size);
+		if(ret)
+			goto unlock;
+
+		vpns[num++] = vpn;
+	}
+
+	if(num)
+	{
+		sg_mark_end(&sg[used-1]);
+		ret = yaftl_read_pages(yaftl, num, vpns, sg, used, NULL, 0);
+		if(ret < 0)
+			printk(KERN_ERR "yaftl: read of %zu pages failed (%d).\n", num, ret);
+		else
+			ret = 0;
+	}
+
+	yaftl->stats.reads += _count;
+
+unlock:
+	mutex_unlock(&yaftl->lock);
+
+exit:
+	kfree(sg);
+	kfree(vpns);
+	return ret;
+}
+
+static int yaftl_write(struct apple_ftl *_ftl, size_t _count, page_t *_pages,
+		struct scatterlist *_sg_data, size_t _sg_num_data)
+{
+	struct yaftl *yaftl = get_yaftl(_ftl);
+	size_t done, n, i;
+	int ret;
+
+	for(i = 0; i < _count; i++)
+	{
+		if(_pages[i] >= yaftl->total_pages)
+			return -EINVAL;
+	}
+
+	mutex_lock(&yaftl->lock);
+
+	ret = yaftl_mark_dirty(yaftl);
+	if(ret < 0)
+		goto exit;
+
+	for(done = 0; done < _count; done += n)
+	{
+		ret = yaftl_gc(yaftl);
+		if(ret < 0)
+			goto exit;
+
+		n = min_t(size_t, _count - done, yaftl_room(yaftl, &yaftl->data));
+		ret = yaftl_program(yaftl, &yaftl->data, YAFTL_BLOCK_DATA,
+				_pages + done, n, _sg_data, _sg_num_data,
+				done*yaftl->page_size);
+		if(ret < 0)
+			goto exit;
+
+		yaftl->stats.writes += n;
+	}
+
+exit:
+	mutex_unlock(&yaftl->lock);
+	return ret;
+}
+
+static int yaftl_sync(struct apple_ftl *_ftl)
+{
+	struct yaftl *yaftl = get_yaftl(_ftl);
+	int ret = 0;
+
+	mutex_lock(&yaftl->lock);
+
+	if(yaftl->clean)
+		goto exit;
+
+	ret = yaftl_cache_flush_all(yaftl);
+	if(ret < 0)
+		goto exit;
+
+	ret = yaftl_write_context(yaftl, 1);
+	if(ret < 0)
+		goto exit;
+
+	yaftl->clean = 1;
+
+exit:
+	mutex_unlock(&yaftl->lock);
+	return ret;
+}
+
+static int yaftl_get(struct apple_ftl *_ftl, int _item)
+{
+	struct yaftl *yaftl = get_yaftl(_ftl);
+
+	switch(_item)
+	{
+	case FTL_NUM_PAGES:
+		return yaftl->total_pages;
+
+	case NAND_PAGE_SIZE:
+		return yaftl->page_size;
+
+	default:
+		return apple_vfl_get(yaftl->vfl, _item);
+	}
+}
+
+static int yaftl_set(struct apple_ftl *_ftl, int _item, int _val)
+{
+	return -EINVAL;
+}
+
+static int yaftl_setup_geometry(struct yaftl *_yaftl)
+{
+	struct apple_vfl *vfl = _yaftl->vfl;
+	u32 avail, index_blocks;
+	int i;
+
+	_yaftl->page_size = apple_vfl_get(vfl, NAND_PAGE_SIZE);
+	_yaftl->spare_size = apple_vfl_get(vfl, NAND_OOB_ALLOC);
+	_yaftl->pages_per_block = apple_vfl_get(vfl, VFL_PAGES_PER_BLOCK);
+	_yaftl->total_blocks = apple_vfl_get(vfl, VFL_USABLE_BLOCKS_PER_BANK);
+
+	if(!_yaftl->page_size || !_yaftl->pages_per_block
+			|| _yaftl->spare_size < sizeof(struct yaftl_spare)
+			|| _yaftl->total_blocks <= YAFTL_CTRL_BLOCKS + YAFTL_SPARE_BLOCKS)
+	{
+		printk(KERN_ERR "yaftl: unusable VFL geometry.\n");
+		return -EINVAL;
+	}
+
+	_yaftl->entries_per_page = _yaftl->page_size / sizeof(u32);
+	_yaftl->btoc_pages = DIV_ROUND_UP(_yaftl->pages_per_block*sizeof(u32), _yaftl->page_size);
+	_yaftl->user_pages = _yaftl->pages_per_block - _yaftl->btoc_pages;
+
+	for(i = 0; i < YAFTL_CTRL_BLOCKS; i++)
+	{
+		int block = apple_vfl_get(vfl, VFL_FTL_CTRL_BLOCK_0 + i);
+		if(block < 0 || block >= _yaftl->total_blocks)
+		{
+			printk(KERN_ERR "yaftl: VFL has no FTL control blocks.\n");
+			return -ENOENT;
+		}
+
+		_yaftl->ctrl_block[i] = block;
+	}
+
+	// Room for one copy of the index, the rest is exported.
+	avail = _yaftl->total_blocks - YAFTL_CTRL_BLOCKS - YAFTL_SPARE_BLOCKS;
+	index_blocks = DIV_ROUND_UP(DIV_ROUND_UP(avail*_yaftl->user_pages,
+				_yaftl->entries_per_page), _yaftl->user_pages);
+
+	_yaftl->total_pages = (avail - index_blocks)*_yaftl->user_pages;
+	_yaftl->num_index_pages = DIV_ROUND_UP(_yaftl->total_pages, _yaftl->entries_per_page);
+
+	if(DIV_ROUND_UP(yaftl_context_size(_yaftl), _yaftl->page_size) > _yaftl->pages_per_block)
+	{
+		printk(KERN_ERR "yaftl: context doesn't fit in a block.\n");
+		return -EINVAL;
+	}
+
+	printk(KERN_INFO "yaftl: %u blocks of %u pages, %u user pages, %u index pages.\n",
+			_yaftl->total_blocks, _yaftl->pages_per_block,
+			_yaftl->total_pages, _yaftl->num_index_pages);
+
+	return 0;
+}
+
+static void yaftl_free(struct yaftl *_yaftl)
+{
+	int i;
+
+	if(_yaftl->cache)
+	{
+		for(i = 0; i < _yaftl->cache_size; i++)
+			kfree(_yaftl->cache[i].data);
+	}
+
+	for(i = 0; i < YAFTL_COPY_PAGES; i++)
+		kfree(_yaftl->copy_buf[i]);
+
+	kfree(_yaftl->cache);
+	vfree(_yaftl->cache_slot);
+	vfree(_yaftl->index_map);
+	vfree(_yaftl->blocks);
+	vfree(_yaftl->block_list);
+	kfree(_yaftl->victims);
+	kfree(_yaftl->data.btoc);
+	kfree(_yaftl->index.btoc);
+	kfree(_yaftl->btoc_buf);
+	kfree(_yaftl->page_buf);
+	kfree(_yaftl->spare_buf);
+	kfree(_yaftl->vpns);
+	kfree(_yaftl);
+}
+
+static int yaftl_alloc(struct yaftl *_yaftl)
+{
+	size_t btoc_size = _yaftl->btoc_pages*_yaftl->page_size;
+	int i;
+
+	_yaftl->cache_size = clamp_t(int, yaftl_index_cache, 1,
+			min_t(u32, _yaftl->num_index_pages, YAFTL_NO_SLOT - 1));
+
+	_yaftl->index_map = vmalloc(_yaftl->num_index_pages*sizeof(u32));
+	_yaftl->cache_slot = vmalloc(_yaftl->num_index_pages*sizeof(u16));
+	_yaftl->blocks = vmalloc(_yaftl->total_blocks*sizeof(struct yaftl_block_info));
+	_yaftl->block_list = vmalloc(_yaftl->total_blocks*sizeof(struct list_head));
+	_yaftl->victims = kmalloc((_yaftl->user_pages+1)*sizeof(struct list_head), GFP_KERNEL);
+	_yaftl->cache = kzalloc(_yaftl->cache_size*sizeof(*_yaftl->cache), GFP_KERNEL);
+	_yaftl->data.btoc = kmalloc(btoc_size, GFP_KERNEL);
+	_yaftl->index.btoc = kmalloc(btoc_size, GFP_KERNEL);
+	_yaftl->btoc_buf = kmalloc(btoc_size, GFP_KERNEL);
+	_yaftl->page_buf = kmalloc(_yaftl->page_size, GFP_KERNEL);
+	_yaftl->spare_buf = kmalloc(_yaftl->pages_per_block*_yaftl->spare_size, GFP_KERNEL);
+	_yaftl->vpns = kmalloc(_yaftl->pages_per_block*sizeof(page_t), GFP_KERNEL);
+
+	if(!_yaftl->index_map || !_yaftl->cache_slot || !_yaftl->blocks
+			|| !_yaftl->block_list || !_yaftl->victims
+			|| !_yaftl->cache || !_yaftl->data.btoc || !_yaftl->index.btoc
+			|| !_yaftl->btoc_buf || !_yaftl->page_buf || !_yaftl->spare_buf
+			|| !_yaftl->vpns)
+		return -ENOMEM;
+
+	for(i = 0; i < _yaftl->cache_size; i++)
+	{
+		_yaftl->cache[i].data = kmalloc(_yaftl->page_size, GFP_KERNEL);
+		if(!_yaftl->cache[i].data)
+			return -ENOMEM;
+	}
+
+	sg_init_table(_yaftl->copy_sg, YAFTL_COPY_PAGES);
+	for(i = 0; i < YAFTL_COPY_PAGES; i++)
+	{
+		_yaftl->copy_buf[i] = kmalloc(_yaftl->page_size, GFP_KERNEL);
+		if(!_yaftl->copy_buf[i])
+			return -ENOMEM;
+
+		sg_set_buf(&_yaftl->copy_sg[i], _yaftl->copy_buf[i], _yaftl->page_size);
+	}
+
+	memset(_yaftl->blocks, 0, _yaftl->total_blocks*sizeof(struct yaftl_block_info));
+	for(i = 0; i < YAFTL_CTRL_BLOCKS; i++)
+		_yaftl->blocks[_yaftl->ctrl_block[i]].type = YAFTL_BLOCK_CTRL;
+
+	memset(_yaftl->index_map, 0xFF, _yaftl->num_index_pages*sizeof(u32));
+	_yaftl->data.block = YAFTL_NONE;
+	_yaftl->index.block = YAFTL_NONE;
+	yaftl_cache_reset(_yaftl);
+	return yaftl_rebuild_lists(_yaftl);
+}
+
+static struct yaftl *yaftl_open(struct apple_vfl *_vfl)
+{
+	struct yaftl_context_pos latest, clean;
+	struct yaftl *yaftl;
+	int ret;
+
+	yaftl = kzalloc(sizeof(*yaftl), GFP_KERNEL);
+	if(!yaftl)
+		return ERR_PTR(-ENOMEM);
+
+	yaftl->vfl = _vfl;
+	mutex_init(&yaftl->lock);
+
+	ret = yaftl_setup_geometry(yaftl);
+	if(ret < 0)
+		goto err;
+
+	ret = yaftl_alloc(yaftl);
+	if(ret < 0)
+		goto err;
+
+	ret = yaftl_find_context(yaftl, &latest, &clean);
+	if(ret == -ENOENT && yaftl_format_empty)
+		ret = yaftl_format(yaftl);
+	else if(ret == 0)
+	{
+		yaftl->usn = latest.usn;
+
+		if(clean.block != YAFTL_NONE)
+		{
+			ret = yaftl_load_context(yaftl, &clean);
+			if(ret < 0)
+				goto err;
+		}
+
+		if(clean.block != YAFTL_NONE && latest.usn == clean.usn)
+			yaftl->clean = 1;
+		else
+			ret = yaftl_restore(yaftl);
+	}
+	else
+		printk(KERN_ERR "yaftl: no Linux YAFTL context found, leaving the flash alone "
+				"(format=1 erases it).\n");
+
+	if(ret < 0)
+		goto err;
+
+	yaftl->ftl.vfl = _vfl;
+	yaftl->ftl.private = yaftl;
+	yaftl->ftl.read = yaftl_read;
+	yaftl->ftl.write = yaftl_write;
+	yaftl->ftl.sync = yaftl_sync;
+	yaftl->ftl.get = yaftl_get;
+	yaftl->ftl.set = yaftl_set;
+	return yaftl;
+
+err:
+	yaftl_free(yaftl);
+	return ERR_PTR(ret);
+}
+
+static void yaftl_close(struct yaftl *_yaftl)
+{
+	yaftl_sync(&_yaftl->ftl);
+
+	printk(KERN_INFO "yaftl: %llu pages read, %llu written, index cache %llu hits, %llu misses, "
+			"GC freed %llu blocks moving %llu pages, %llu erases.\n",
+			_yaftl->stats.reads, _yaftl->stats.writes,
+			_yaftl->stats.cache_hits, _yaftl->stats.cache_misses,
+			_yaftl->stats.gc_blocks, _yaftl->stats.gc_copies,
+			_yaftl->stats.erases);
+
+	yaftl_free(_yaftl);
+}
+
+static void yaftl_add(struct apple_vfl *_vfl)
+{
+	struct yaftl *yaftl;
+	int ret;
+
+	if(!_vfl->read || !_vfl->write || !_vfl->erase)
+		return;
+
+	printk(KERN_INFO "yaftl: opening VFL %p, FTL type 0x%08x.\n",
+			_vfl, apple_vfl_get(_vfl, VFL_FTL_TYPE));
+
+	yaftl = yaftl_open(_vfl);
+	if(IS_ERR(yaftl))
+	{
+		printk(KERN_ERR "yaftl: failed to open FTL (%ld).\n", PTR_ERR(yaftl));
+		return;
+	}
+
+	ret = apple_ftl_register(&yaftl->ftl);
+	if(ret < 0)
+	{
+		printk(KERN_ERR "yaftl: failed to register block device (%d).\n", ret);
+		yaftl_close(yaftl);
+		return;
+	}
+
+	list_add_tail(&yaftl->list, &yaftl_list);
+}
+
+static void yaftl_remove(struct apple_vfl *_vfl)
+{
+	struct yaftl *yaftl, *next;
+
+	list_for_each_entry_safe(yaftl, next, &yaftl_list, list)
+	{
+		if(yaftl->vfl != _vfl)
+			continue;
+
+		list_del(&yaftl->list);
+		apple_ftl_unregister(&yaftl->ftl);
+		yaftl_close(yaftl);
+	}
+}
+
+static struct apple_vfl_user yaftl_user = {
+	.add = yaftl_add,
+	.remove = yaftl_remove,
+};
+
+static int __init yaftl_init(void)
+{
+	apple_vfl_register_user(&yaftl_user);
+	return 0;
+}
+module_init(yaftl_init);
+
+static void __exit yaftl_exit(void)
+{
+	apple_vfl_unregister_user(&yaftl_user);
+}
+module_exit(yaftl_exit);
+
+MODULE_DESCRIPTION("YAFTL for Apple Mobile Device NAND.");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,166 @@
+#ifndef _APPLE_YAFTL_H
+#define _APPLE_YAFTL_H
+
+#include <linux/apple_flash.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+
+#define YAFTL_NONE 0xFFFFFFFF
+#define YAFTL_NO_SLOT 0xFFFF
+
+#define YAFTL_CTRL_BLOCKS 3
+
+// Free blocks that only GC, index writes and context writes may use.
+#define YAFTL_GC_RESERVE 4
+
+// Blocks kept out of the exported size: the GC reserve, the two open
+// blocks and some slack so GC always finds a victim with stale pages.
+#define YAFTL_SPARE_BLOCKS 8
+
+// Pages GC moves per VFL call.
+#define YAFTL_COPY_PAGES 16
+
+// This is not Apple's on-flash format, iOS's YAFTL can't read it and we
+// don't read iOS's. Every spare we write carries YAFTL_SPARE_MAGIC and one
+// of our own types, so that pages written by iOS never get taken for ours.
+#define YAFTL_SPARE_MAGIC	0x4C	// 'L'
+
+// Spare types
+#define YAFTL_PAGE_INDEX	0x01
+#define YAFTL_PAGE_CLOSED	0x02	// Block TOC, the block is full
+#define YAFTL_PAGE_DATA		0x40
+#define YAFTL_PAGE_CONTEXT	0x80
+
+struct yaftl_spare
+{
+	u32 lpn;		// index page for index pages, block for BTOC pages
+	u32 usn;
+	u8 magic;		// YAFTL_SPARE_MAGIC
+	u8 type;
+	u16 field_A;	// not stored, only 10 bytes of the spare survive
+} __attribute__((packed));
+
+enum yaftl_block_type
+{
+	YAFTL_BLOCK_FREE,
+	YAFTL_BLOCK_DATA,
+	YAFTL_BLOCK_INDEX,
+	YAFTL_BLOCK_CTRL,
+	YAFTL_BLOCK_BAD,
+};
+
+struct yaftl_block_info
+{
+	u32 erase_count;
+	u16 valid;
+	u8 type;
+	u8 pad;
+} __attribute__((packed));
+
+#define YAFTL_CONTEXT_VERSION "LYF1"
+
+// The first page of a context. A clean context is followed by
+// u32 index_map[num_index_pages], struct yaftl_block_info[total_blocks]
+// and the BTOCs of the open data and index blocks, u32[user_pages] each.
+// A context that isn't clean is just this header and marks the start of
+// writes that the last clean context doesn't know about.
+struct yaftl_context
+{
+	char version[4];
+	u32 usn;
+	u32 clean;
+	u32 num_pages;
+	u32 total_pages;
+	u32 total_blocks;
+	u32 pages_per_block;
+	u32 num_index_pages;
+	u32 data_block;
+	u32 data_page;
+	u32 index_block;
+	u32 index_page;
+} __attribute__((packed));
+
+struct yaftl_open_block
+{
+	u32 block;		// YAFTL_NONE if there isn't one
+	u32 page;		// next page to write
+	u32 usn;
+	u32 *btoc;
+};
+
+struct yaftl_cache_entry
+{
+	struct list_head lru;
+	u32 index_page;
+	int dirty;
+	u32 *data;
+};
+
+struct yaftl_stats
+{
+	u64 reads;
+	u64 writes;
+	u64 cache_hits;
+	u64 cache_misses;
+	u64 gc_blocks;
+	u64 gc_copies;
+	u64 erases;
+};
+
+struct yaftl
+{
+	struct apple_ftl ftl;
+	struct apple_vfl *vfl;
+	struct list_head list;
+	struct mutex lock;
+
+	u32 page_size;
+	u32 spare_size;
+	u32 pages_per_block;
+	u32 total_blocks;
+	u32 btoc_pages;			// BTOC pages at the end of each block
+	u32 user_pages;			// pages per block before the BTOC
+	u32 entries_per_page;	// map entries per index page
+	u32 total_pages;
+	u32 num_index_pages;
+	u32 ctrl_block[YAFTL_CTRL_BLOCKS];
+
+	u32 usn;
+	u32 num_free;
+	u32 *index_map;
+	struct yaftl_block_info *blocks;
+
+	// Every free block sits on free_list, least worn first. Every full
+	// data or index block sits on victims[valid], so GC finds the one
+	// with the fewest valid pages without looking at every block.
+	struct list_head *block_list;
+	struct list_head free_list;
+	struct list_head *victims;	// user_pages+1 buckets
+	struct yaftl_open_block data;
+	struct yaftl_open_block index;
+
+	u32 ctx_block;			// control block the context goes into
+	u32 ctx_page;			// next free page in it
+	int clean;				// last context on flash is up to date
+
+	struct yaftl_cache_entry *cache;
+	u16 *cache_slot;		// cache entry of every index page
+	int cache_size;
+	struct list_head cache_lru;
+
+	u8 *page_buf;
+	u8 *spare_buf;
+	u32 *btoc_buf;
+	page_t *vpns;
+
+	u8 *copy_buf[YAFTL_COPY_PAGES];
+	struct scatterlist copy_sg[YAFTL_COPY_PAGES];
+	u32 copy_lpns[YAFTL_COPY_PAGES];
+	page_t copy_vpns[YAFTL_COPY_PAGES];
+
+	struct yaftl_stats stats;
+};
+
+#define get_yaftl(x) ((struct yaftl*)((x)->private))
+
+#endif //_APPLE_YAFTL_H
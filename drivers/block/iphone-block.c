@@ -7,10 +7,15 @@
 #include <linux/delay.h>
 #include <linux/platform_device.h>
 #include <linux/slab.h>
+#include <linux/highmem.h>
 
 // 2^9 = 512
 #define SECTOR_SHIFT 9
 
+// Number of requests we pull off the elevator before the FTL worker has
+// to catch up. Adjacent requests in this window are merged into one FTL call.
+#define IPHONE_BLOCK_MAX_INFLIGHT 16
+
 extern NANDData* NANDGeometry;
 
 static struct
@@ -23,8 +28,9 @@ static struct
 	int pageShift;
 	int majorNum;
 
-	struct request* req;
-	bool processing;
+	struct list_head pending;
+	int inflight;
+	u32 maxBatchBytes;
 	u8* bounceBuffer;
 } iphone_block_device;
 
@@ -33,20 +39,15 @@ static void ftl_workqueue_handler(struct work_struct* work);
 DECLARE_WORK(ftl_workqueue, &ftl_workqueue_handler);
 static struct workqueue_struct* ftl_wq;
 
-static void iphone_block_scatter_gather(struct request* req, bool gather)
+static unsigned int iphone_block_scatter_gather(struct request* req, unsigned int offset, bool gather)
 {
-	unsigned int offset = 0;
 	struct req_iterator iter;
 	struct bio_vec *bvec;
-	unsigned int i = 0;
 	size_t size;
 	void *buf;
 
 	rq_for_each_segment(bvec, req, iter) {
 		unsigned long flags;
-		//printk("%s:%u: bio %u: %u segs %u sectors from %lu\n",
-		//		__func__, __LINE__, i, bio_segments(iter.bio),
-		//		bio_sectors(iter.bio), (unsigned long) iter.bio->bi_sector);
 
 		size = bvec->bv_len;
 		buf = bvec_kmap_irq(bvec, &flags);
@@ -57,97 +58,222 @@ static void iphone_block_scatter_gather(struct request* req, bool gather)
 		offset += size;
 		flush_kernel_dcache_page(bvec->bv_page);
 		bvec_kunmap_irq(bvec, &flags);
-		i++;
 	}
 
-	//printk("scatter_gather total: %d / %d\n", offset, NANDGeometry->pagesPerSuBlk * NANDGeometry->bytesPerPage);
+	return offset;
+}
 
+static int iphone_block_ftl_transfer(u32 lpn, u32 numPages, u8* buf, bool write)
+{
+	if(write)
+		return FTL_Write(lpn, numPages, buf);
+	else
+		return FTL_Read(lpn, numPages, buf);
 }
 
-static void ftl_workqueue_handler(struct work_struct* work)
+// Walks the segments of a batch and hands every virtually contiguous run of
+// lowmem pages to the FTL directly, so no bounce copy is needed. With dryRun
+// set nothing is transferred; it only checks that every run is DMA-able and
+// covers whole NAND pages. Returns -EAGAIN if the batch has to be bounced.
+static int iphone_block_map_runs(struct list_head* batch, u32 lpn, bool write, bool dryRun)
 {
-	unsigned long flags;
-	bool dir_out;
+	struct request* req;
+	struct req_iterator iter;
+	struct bio_vec *bvec;
+	u8* runStart = NULL;
+	u32 runLen = 0;
 	int ret;
 
-	//printk("ftl_workqueue_handler enter\n");
+	list_for_each_entry(req, batch, queuelist)
+	{
+		rq_for_each_segment(bvec, req, iter) {
+			u8* buf;
+
+			if(PageHighMem(bvec->bv_page) || ((bvec->bv_offset | bvec->bv_len) & 3))
+				return -EAGAIN;
+
+			buf = page_address(bvec->bv_page) + bvec->bv_offset;
+			if(runStart && runStart + runLen == buf)
+			{
+				runLen += bvec->bv_len;
+				continue;
+			}
+
+			if(runStart)
+			{
+				if(runLen & (iphone_block_device.sectorSize - 1))
+					return -EAGAIN;
+
+				if(!dryRun)
+				{
+					ret = iphone_block_ftl_transfer(lpn, runLen >> iphone_block_device.pageShift, runStart, write);
+					if(ret)
+						return ret;
+				}
+
+				lpn += runLen >> iphone_block_device.pageShift;
+			}
+
+			runStart = buf;
+			runLen = bvec->bv_len;
+		}
+	}
+
+	if(!runStart)
+		return 0;
+
+	if(runLen & (iphone_block_device.sectorSize - 1))
+		return -EAGAIN;
+
+	if(dryRun)
+		return 0;
+
+	ret = iphone_block_ftl_transfer(lpn, runLen >> iphone_block_device.pageShift, runStart, write);
+	if(ret)
+		return ret;
+
+	if(!write)
+	{
+		// the pages were filled by DMA behind the kernel mapping's back
+		list_for_each_entry(req, batch, queuelist)
+		{
+			rq_for_each_segment(bvec, req, iter) {
+				flush_kernel_dcache_page(bvec->bv_page);
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int iphone_block_transfer(struct list_head* batch, u32 lpn, u32 numPages, bool write)
+{
+	struct request* req;
+	unsigned int offset;
+	int ret;
+
+	if(iphone_block_map_runs(batch, lpn, write, true) == 0)
+		return iphone_block_map_runs(batch, lpn, write, false);
+
+	// Highmem or oddly split segments, fall back to the bounce buffer.
+	if(write)
+	{
+		offset = 0;
+		list_for_each_entry(req, batch, queuelist)
+			offset = iphone_block_scatter_gather(req, offset, true);
+	}
+
+	ret = iphone_block_ftl_transfer(lpn, numPages, iphone_block_device.bounceBuffer, write);
+
+	if(!write && ret == 0)
+	{
+		offset = 0;
+		list_for_each_entry(req, batch, queuelist)
+			offset = iphone_block_scatter_gather(req, offset, false);
+	}
+
+	return ret;
+}
+
+// Pulls requests off the elevator into our pending list. Must be called
+// with the queue lock held.
+static void iphone_block_fetch(struct request_queue* q)
+{
+	struct request* req;
+
+	while(iphone_block_device.inflight < IPHONE_BLOCK_MAX_INFLIGHT)
+	{
+		req = blk_fetch_request(q);
+		if(!req)
+			break;
+
+		if(req->cmd_type != REQ_TYPE_FS)
+		{
+			__blk_end_request_all(req, -EINVAL);
+			continue;
+		}
+
+		if(blk_rq_bytes(req) & (iphone_block_device.sectorSize - 1))
+		{
+			printk("iphone_block: requested not page aligned number of bytes (%d bytes)\n", blk_rq_bytes(req));
+			__blk_end_request_all(req, -EINVAL);
+			continue;
+		}
+
+		list_add_tail(&req->queuelist, &iphone_block_device.pending);
+		iphone_block_device.inflight++;
+	}
+}
+
+static void ftl_workqueue_handler(struct work_struct* work)
+{
+	unsigned long flags;
+	LIST_HEAD(work_list);
 
 	while(true)
 	{
+		struct request* req;
+		struct request* next;
+		LIST_HEAD(batch);
 		u32 lpn;
 		u32 numPages;
-		u32 remainder;
+		u32 batchBytes;
+		int batchCount;
+		bool write;
+		int ret;
 
-		//printk("ftl_workqueue_handler loop\n");
-
-		spin_lock_irqsave(&iphone_block_device.lock, flags);
-		if(iphone_block_device.req == NULL || iphone_block_device.processing)
+		if(list_empty(&work_list))
 		{
+			spin_lock_irqsave(&iphone_block_device.lock, flags);
+			list_splice_init(&iphone_block_device.pending, &work_list);
 			spin_unlock_irqrestore(&iphone_block_device.lock, flags);
-			//printk("ftl_workqueue_handler exit\n");
-			return;
+
+			if(list_empty(&work_list))
+				return;
 		}
 
-		iphone_block_device.processing = true;
-		spin_unlock_irqrestore(&iphone_block_device.lock, flags);
+		// Merge every following request that continues where the previous
+		// one ended into a single FTL call.
+		req = list_first_entry(&work_list, struct request, queuelist);
+		write = rq_data_dir(req);
+		lpn = blk_rq_pos(req) >> (iphone_block_device.pageShift - SECTOR_SHIFT);
+		batchBytes = blk_rq_bytes(req);
+		batchCount = 1;
+		list_move_tail(&req->queuelist, &batch);
 
-		if(iphone_block_device.req->cmd_type == REQ_TYPE_FS)
+		list_for_each_entry_safe(req, next, &work_list, queuelist)
 		{
-			lpn = blk_rq_pos(iphone_block_device.req) >> (iphone_block_device.pageShift - SECTOR_SHIFT);
-			numPages = blk_rq_bytes(iphone_block_device.req) / iphone_block_device.sectorSize;
-			remainder = numPages * iphone_block_device.sectorSize - blk_rq_bytes(iphone_block_device.req);
-
-			if(remainder)
-			{
-				printk("iphone_block: requested not page aligned number of bytes (%d bytes)\n", blk_rq_bytes(iphone_block_device.req));
-				blk_end_request_all(iphone_block_device.req, -EINVAL);
-			} else
-			{
-				if(rq_data_dir(iphone_block_device.req))
-				{
-					dir_out = true;
-					iphone_block_scatter_gather(iphone_block_device.req, true);
-				} else
-				{
-					dir_out = false;
-				}
+			struct request* last = list_entry(batch.prev, struct request, queuelist);
 
+			if(rq_data_dir(req) != write
+					|| blk_rq_pos(req) != blk_rq_pos(last) + blk_rq_sectors(last)
+					|| batchBytes + blk_rq_bytes(req) > iphone_block_device.maxBatchBytes)
+				break;
 
-				if(dir_out)
-				{
-					//printk("FTL_Write enter: %p\n", iphone_block_device.req);
-					ret = FTL_Write(lpn, numPages, iphone_block_device.bounceBuffer);
-					//printk("FTL_Write exit: %p\n", iphone_block_device.req);
-				} else
-				{
-					//printk("FTL_Read enter: %p\n", iphone_block_device.req);
-					ret = FTL_Read(lpn, numPages, iphone_block_device.bounceBuffer);
-					//printk("FTL_Read exit: %p\n", iphone_block_device.req);
-				}
+			batchBytes += blk_rq_bytes(req);
+			batchCount++;
+			list_move_tail(&req->queuelist, &batch);
+		}
 
-				if(!dir_out)
-				{
-					iphone_block_scatter_gather(iphone_block_device.req, false);
-				}
+		numPages = batchBytes >> iphone_block_device.pageShift;
+		ret = iphone_block_transfer(&batch, lpn, numPages, write);
 
-				blk_end_request_all(iphone_block_device.req, ret);
-			}
-		} else
+		list_for_each_entry_safe(req, next, &batch, queuelist)
 		{
-			blk_end_request_all(iphone_block_device.req, -EINVAL);
+			list_del_init(&req->queuelist);
+			blk_end_request_all(req, ret);
 		}
+
 		spin_lock_irqsave(&iphone_block_device.lock, flags);
-		iphone_block_device.processing = false;
-		iphone_block_device.req = blk_fetch_request(iphone_block_device.queue);
+		iphone_block_device.inflight -= batchCount;
+		iphone_block_fetch(iphone_block_device.queue);
 		spin_unlock_irqrestore(&iphone_block_device.lock, flags);
 	}
 }
 
 static int iphone_block_busy(struct request_queue *q)
 {
-	int ret = (iphone_block_device.req == NULL) ? 0 : 1;
-	printk("iphone_block_busy: %d\n", ret);
-	return ret;
+	return iphone_block_device.inflight >= IPHONE_BLOCK_MAX_INFLIGHT;
 }
 
 static int iphone_block_getgeo(struct block_device* bdev, struct hd_geometry* geo)
@@ -186,16 +312,10 @@ static int iphone_block_ioctl(struct block_device *bdev, fmode_t mode, unsigned
 
 static void iphone_block_request(struct request_queue* q)
 {
-	if(iphone_block_device.req)
-	{
-		//printk("not queueing request due to busy\n");
-		return;
-	}
+	iphone_block_fetch(q);
 
-	iphone_block_device.req = blk_fetch_request(q);
-
-	//printk("scheduling work: %p\n", iphone_block_device.req);
-	queue_work(ftl_wq, &ftl_workqueue);
+	if(!list_empty(&iphone_block_device.pending))
+		queue_work(ftl_wq, &ftl_workqueue);
 }
 
 static struct block_device_operations iphone_block_fops =
@@ -211,7 +331,7 @@ static int iphone_block_probe(struct platform_device *pdev)
 {
 	int i;
 
-	ftl_wq = create_workqueue("iphone_ftl_worker");
+	ftl_wq = create_singlethread_workqueue("iphone_ftl_worker");
 
 	if(ftl_setup() != 0)
 		return -EIO;
@@ -227,10 +347,13 @@ static int iphone_block_probe(struct platform_device *pdev)
 
 	spin_lock_init(&iphone_block_device.lock);
 
-	iphone_block_device.processing = false;
-	iphone_block_device.req = NULL;
+	INIT_LIST_HEAD(&iphone_block_device.pending);
+	iphone_block_device.inflight = 0;
 
-	iphone_block_device.bounceBuffer = (u8*) kmalloc(NANDGeometry->pagesPerSuBlk * NANDGeometry->bytesPerPage, GFP_KERNEL | GFP_DMA);
+	// Batches are capped at one superblock so the bounce buffer can always
+	// take them when the segments can't be handed to the FTL directly.
+	iphone_block_device.maxBatchBytes = NANDGeometry->pagesPerSuBlk * NANDGeometry->bytesPerPage;
+	iphone_block_device.bounceBuffer = (u8*) kmalloc(iphone_block_device.maxBatchBytes, GFP_KERNEL | GFP_DMA);
 	if(!iphone_block_device.bounceBuffer)
 		return -EIO;
 
@@ -255,13 +378,21 @@ static int iphone_block_probe(struct platform_device *pdev)
 	blk_queue_bounce_limit(iphone_block_device.queue, BLK_BOUNCE_ANY);
 	blk_queue_max_hw_sectors(iphone_block_device.queue, NANDGeometry->pagesPerSuBlk * (iphone_block_device.sectorSize >> SECTOR_SHIFT));
 	blk_queue_max_segment_size(iphone_block_device.queue, NANDGeometry->pagesPerSuBlk * iphone_block_device.sectorSize);
+	blk_queue_max_segments(iphone_block_device.queue, NANDGeometry->pagesPerSuBlk);
 	blk_queue_physical_block_size(iphone_block_device.queue, iphone_block_device.sectorSize);
 	blk_queue_logical_block_size(iphone_block_device.queue, iphone_block_device.sectorSize);
+	blk_queue_io_min(iphone_block_device.queue, iphone_block_device.sectorSize);
+	blk_queue_io_opt(iphone_block_device.queue, iphone_block_device.maxBatchBytes);
+	// the NAND DMA engine needs word aligned buffers
+	blk_queue_dma_alignment(iphone_block_device.queue, 3);
 	iphone_block_device.gd->queue = iphone_block_device.queue;
 
 	set_capacity(iphone_block_device.gd, (NANDGeometry->pagesPerSuBlk * NANDGeometry->userSuBlksTotal) * (iphone_block_device.sectorSize >> SECTOR_SHIFT));
 	add_disk(iphone_block_device.gd);
 
+	if(ftl_sysfs_register(&pdev->dev) != 0)
+		printk("iphone-block: could not create the FTL sysfs files\n");
+
 	printk("iphone-block: block device registered with major num %d\n", iphone_block_device.majorNum);
 
 	return 0;
@@ -284,6 +415,8 @@ static int iphone_block_remove(struct platform_device *pdev)
 	unregister_blkdev(iphone_block_device.majorNum, "nand");
 	flush_workqueue(ftl_wq);
 	kfree(iphone_block_device.bounceBuffer);
+	ftl_sysfs_unregister(&pdev->dev);
+	ftl_shutdown();
 	ftl_sync();
 	printk("iphone-block: block device unregistered\n");
 	return 0;
@@ -291,6 +424,7 @@ static int iphone_block_remove(struct platform_device *pdev)
 
 static void iphone_block_shutdown(struct platform_device *pdev)
 {
+	ftl_shutdown();
 	ftl_sync();
 }
 
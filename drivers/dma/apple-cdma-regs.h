@@ -0,0 +1,102 @@
+/**
+ * Copyright (c) 2011 Richard Ian Taylor.
+ *
+ * This file is part of the iDroid Project. (http://www.idroidproject.org).
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef  __APPLE_CDMA_REGS__
+#define  __APPLE_CDMA_REGS__
+
+#include <linux/types.h>
+
+typedef struct _cmda_segment
+{
+	u32 next;	// Should be a DMA address
+	u32 flags;
+	u32 data;			// Should be a DMA address
+	u32 length;
+	u32 iv[4];
+} __attribute__((packed)) __attribute__((aligned(4))) cdma_segment_t;
+
+// These first 3 are 32-bit blocks.
+#define CDMA_ENABLE(x)			(0x0 + ((x)*0x4))
+#define CDMA_DISABLE(x)			(0x8 + ((x)*0x4))
+#define CDMA_STATUS(x)			(0x10 + ((x)*0x4))
+
+#define CDMA_CHAN(x)			(0x1000*((x)+1))
+#define CDMA_CSTATUS(x)			(CDMA_CHAN(x) + 0x0)
+#define CDMA_CCONFIG(x)			(CDMA_CHAN(x) + 0x4)
+#define CDMA_CREG(x)			(CDMA_CHAN(x) + 0x8)
+#define CDMA_CSIZE(x)			(CDMA_CHAN(x) + 0xC)
+#define CDMA_CSEGPTR(x)			(CDMA_CHAN(x) + 0x14)
+
+#define CDMA_AES(x)				((x)*0x1000)
+#define CDMA_AES_CONFIG(x)		(CDMA_AES(x) + 0x0)
+#define CDMA_AES_KEY(x, y)		(CDMA_AES(x) + 0x20 + ((y)*4))
+
+#define CSTATUS_ACTIVE			(1 << 0)
+#define CSTATUS_SETUP			(1 << 1)
+#define CSTATUS_CONT			(1 << 3)
+#define CSTATUS_TXRDY			((1 << 17) | (1 << 16))
+#define CSTATUS_INTERR			(1 << 18)
+#define CSTATUS_INTCLR			(1 << 19)
+#define CSTATUS_SPURCIR			(1 << 20)
+#define CSTATUS_AES_SHIFT		(8)
+#define CSTATUS_AES_MASK		(0xFF) // This is a guess
+#define CSTATUS_AES(x)			(((x) & CSTATUS_AES_MASK) << CSTATUS_AES_SHIFT)
+
+#define CCONFIG_DIR				(1 << 1)
+#define CCONFIG_BURST_SHIFT		(2)
+#define CCONFIG_BURST_MASK		(0x3)
+#define CCONFIG_BURST(x)		(((x) & CCONFIG_BURST_MASK) << CCONFIG_BURST_SHIFT)
+#define CCONFIG_WORDSIZE_SHIFT	(4)
+#define CCONFIG_WORDSIZE_MASK	(0x7)
+#define CCONFIG_WORDSIZE(x)		(((x) & CCONFIG_WORDSIZE_MASK) << CCONFIG_WORDSIZE_SHIFT)
+#define CCONFIG_PERI_SHIFT		(16)
+#define CCONFIG_PERI_MASK		(0x3F)
+#define CCONFIG_PERIPHERAL(x)	(((x) & CCONFIG_PERI_MASK) << CCONFIG_PERI_SHIFT)
+
+#define FLAG_DATA				(1 << 0)
+#define FLAG_ENABLE				(1 << 1)
+#define FLAG_LAST				(1 << 8)
+#define FLAG_AES				(1 << 16)
+#define FLAG_AES_START			(1 << 17)
+
+#define AES_ENCRYPT			(1 << 16)
+#define AES_ENABLED				(1 << 17)
+#define AES_128					(0 << 18)
+#define AES_192					(1 << 18)
+#define AES_256					(2 << 18)
+#define AES_KEY					(1 << 20)
+#define AES_GID					(2 << 20)
+#define AES_UID					(4 << 20)
+
+#ifdef CONFIG_S5L_CDMA_MOCK
+
+struct platform_device;
+
+// Stands in for the controller so the driver can be tested without one.
+// Registers go through these instead of MMIO, _aes selects the AES block.
+// The mock raises interrupts with cdma_mock_interrupt, which must not be
+// called from inside the ops.
+struct cdma_mock_ops
+{
+	u32 (*read)(void *_priv, int _aes, u32 _reg);
+	void (*write)(void *_priv, int _aes, u32 _reg, u32 _val);
+	void *priv;
+};
+
+int cdma_mock_register(struct platform_device *_dev, int _num_channels, const struct cdma_mock_ops *_ops);
+void cdma_mock_unregister(void);
+void cdma_mock_interrupt(u32 _channel);
+
+// Returns the descriptor at a DMA address handed to the controller.
+cdma_segment_t *cdma_mock_segment(u32 _addr);
+
+#endif //CONFIG_S5L_CDMA_MOCK
+
+#endif //__APPLE_CDMA_REGS__
@@ -0,0 +1,440 @@
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/interrupt.h>
+#include <linux/completion.h>
+#include <linux/platform_device.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
+#include <plat/cdma.h>
+
+#include "apple-cdma-regs.h"
+
+#define CHANNELS 4
+#define FIFO_SIZE 4096
+#define TIMEOUT (HZ)
+
+struct mock_channel
+{
+	u32 cstatus;
+	u32 cconfig;
+	u32 csize;
+	u32 csegptr;
+
+	u8 fifo[FIFO_SIZE];
+	size_t pos;
+	int passes;
+};
+
+struct mock_state
+{
+	u32 status[2];
+	struct mock_channel channels[CHANNELS];
+
+	int fail_next;
+	int hold;
+	unsigned long pending;
+	struct tasklet_struct tasklet;
+};
+
+static struct mock_state *mock;
+
+static inline u8 mock_pattern(size_t _pos)
+{
+	return (_pos * 7 + 1) & 0xFF;
+}
+
+// Walks the descriptors like the controller would for one pass.
+static void mock_run(struct mock_state *_mock, int _chan)
+{
+	struct mock_channel *mc = &_mock->channels[_chan];
+	cdma_segment_t *seg = cdma_mock_segment(mc->csegptr);
+
+	mc->passes++;
+
+	if(_mock->fail_next)
+	{
+		_mock->fail_next = 0;
+		mc->cstatus |= CSTATUS_INTERR;
+		goto done;
+	}
+
+	while(seg && (seg->flags & FLAG_ENABLE))
+	{
+		if(seg->flags & FLAG_DATA)
+		{
+			u8 *buf = phys_to_virt(seg->data);
+			size_t len = min_t(size_t, seg->length, mc->csize);
+			size_t i;
+
+			for(i = 0; i < len; i++, mc->pos++)
+			{
+				if(mc->cconfig & CCONFIG_DIR)
+				{
+					if(mc->pos < FIFO_SIZE)
+						mc->fifo[mc->pos] = buf[i];
+				}
+				else
+					buf[i] = mock_pattern(mc->pos);
+			}
+
+			mc->csize -= len;
+		}
+
+		if(seg->flags & FLAG_LAST)
+			break;
+
+		seg = cdma_mock_segment(seg->next);
+	}
+
+done:
+	set_bit(_chan, &_mock->pending);
+	if(!_mock->hold)
+		tasklet_schedule(&_mock->tasklet);
+}
+
+static u32 mock_read(void *_priv, int _aes, u32 _reg)
+{
+	struct mock_state *m = _priv;
+	struct mock_channel *mc;
+
+	if(_aes)
+		return 0;
+
+	if(_reg < CDMA_CHAN(0))
+		return (_reg == CDMA_STATUS(0) || _reg == CDMA_STATUS(1))?
+			m->status[(_reg - CDMA_STATUS(0)) / 4] : 0;
+
+	mc = &m->channels[(_reg / 0x1000) - 1];
+	switch(_reg & 0xFFF)
+	{
+	case 0x0:
+		return mc->cstatus;
+
+	case 0xC:
+		return mc->csize;
+	}
+
+	return 0;
+}
+
+static void mock_write(void *_priv, int _aes, u32 _reg, u32 _val)
+{
+	struct mock_state *m = _priv;
+	struct mock_channel *mc;
+	int chan;
+
+	if(_aes)
+		return;
+
+	if(_reg < CDMA_CHAN(0))
+	{
+		if(_reg == CDMA_ENABLE(0) || _reg == CDMA_ENABLE(1))
+			m->status[(_reg - CDMA_ENABLE(0)) / 4] |= _val;
+		else if(_reg == CDMA_DISABLE(0) || _reg == CDMA_DISABLE(1))
+			m->status[(_reg - CDMA_DISABLE(0)) / 4] &=~ _val;
+		return;
+	}
+
+	chan = (_reg / 0x1000) - 1;
+	mc = &m->channels[chan];
+	switch(_reg & 0xFFF)
+	{
+	case 0x0:
+		if(_val == CSTATUS_INTCLR)
+			mc->cstatus &=~ CSTATUS_INTERR;
+		else if(_val & CSTATUS_ACTIVE)
+		{
+			mc->cstatus = _val;
+			mock_run(m, chan);
+		}
+		break;
+
+	case 0x4:
+		mc->cconfig = _val;
+		break;
+
+	case 0xC:
+		mc->csize = _val;
+		mc->pos = 0;
+		mc->passes = 0;
+		break;
+
+	case 0x14:
+		mc->csegptr = _val;
+		break;
+	}
+}
+
+static void mock_tasklet(unsigned long _data)
+{
+	struct mock_state *m = (struct mock_state*)_data;
+	int i;
+
+	for(i = 0; i < CHANNELS; i++)
+	{
+		if(test_and_clear_bit(i, &m->pending))
+			cdma_mock_interrupt(i);
+	}
+}
+
+static struct cdma_mock_ops mock_ops = {
+	.read = mock_read,
+	.write = mock_write,
+};
+
+struct test_xfer
+{
+	struct cdma_xfer xfer;
+	struct scatterlist sg;
+	int id;
+};
+
+static int test_order[8];
+static int test_done;
+static DECLARE_COMPLETION(test_completion);
+
+static void test_callback(struct cdma_xfer *_xfer, int _result)
+{
+	struct test_xfer *tx = container_of(_xfer, struct test_xfer, xfer);
+
+	test_order[test_done++] = tx->id;
+	if(test_done == (int)(long)_xfer->callback_param)
+		complete(&test_completion);
+}
+
+static void __init test_init_xfer(struct test_xfer *_tx, int _id, int _expected,
+		cdma_dir_t _dir, void *_buf, size_t _len)
+{
+	memset(_tx, 0, sizeof(*_tx));
+	sg_init_one(&_tx->sg, _buf, _len);
+
+	_tx->id = _id;
+	_tx->xfer.dir = _dir;
+	_tx->xfer.sg = &_tx->sg;
+	_tx->xfer.sg_count = 1;
+	_tx->xfer.size = _len;
+	_tx->xfer.burst = 4;
+	_tx->xfer.busw = 4;
+	_tx->xfer.callback = test_callback;
+	_tx->xfer.callback_param = (void*)(long)_expected;
+}
+
+static void __init test_reset(void)
+{
+	test_done = 0;
+	memset(test_order, 0xFF, sizeof(test_order));
+	INIT_COMPLETION(test_completion);
+}
+
+static int __init test_wait(const char *_name)
+{
+	if(!wait_for_completion_timeout(&test_completion, TIMEOUT))
+	{
+		WARN(1, "%s: timed out with %d transfers done\n", _name, test_done);
+		return -ETIMEDOUT;
+	}
+
+	return 0;
+}
+
+static void __init test_sync(u8 *_buf)
+{
+	struct scatterlist sg;
+	int ret;
+
+	sg_init_one(&sg, _buf, 512);
+	ret = cdma_begin(0, CDMA_FROM_MEM, &sg, 1, 512, 0, 4, 4, 0);
+	if(ret)
+	{
+		WARN(1, "sync: begin failed with %d\n", ret);
+		return;
+	}
+
+	ret = cdma_wait(0);
+	WARN(ret, "sync: wait returned %d\n", ret);
+	WARN(memcmp(mock->channels[0].fifo, _buf, 512), "sync: wrong data\n");
+}
+
+static void __init test_queue(u8 *_buf)
+{
+	struct test_xfer tx[3];
+	int i, ret;
+
+	test_reset();
+	for(i = 0; i < 3; i++)
+	{
+		test_init_xfer(&tx[i], i, 3, CDMA_FROM_MEM, _buf + i*256, 256);
+
+		ret = cdma_submit(1, &tx[i].xfer);
+		if(ret)
+		{
+			WARN(1, "queue: submit %d failed with %d\n", i, ret);
+			return;
+		}
+	}
+
+	if(test_wait("queue"))
+		return;
+
+	for(i = 0; i < 3; i++)
+	{
+		WARN(test_order[i] != i, "queue: transfer %d finished %dth\n", test_order[i], i);
+		WARN(tx[i].xfer.result, "queue: transfer %d returned %d\n", i, tx[i].xfer.result);
+	}
+
+	// Each transfer restarts the FIFO, so only the last one is left.
+	WARN(memcmp(mock->channels[1].fifo, _buf + 512, 256), "queue: wrong data\n");
+}
+
+static void __init test_multi_pass(u8 *_buf)
+{
+	struct scatterlist sg[40];
+	int i, ret;
+
+	memset(_buf, 0, 40*64);
+
+	sg_init_table(sg, 40);
+	for(i = 0; i < 40; i++)
+		sg_set_buf(&sg[i], _buf + i*64, 64);
+
+	ret = cdma_begin(2, CDMA_TO_MEM, sg, 40, 40*64, 0, 4, 4, 0);
+	if(ret)
+	{
+		WARN(1, "multi-pass: begin failed with %d\n", ret);
+		return;
+	}
+
+	ret = cdma_wait(2);
+	WARN(ret, "multi-pass: wait returned %d\n", ret);
+	WARN(mock->channels[2].passes != 2, "multi-pass: took %d passes\n",
+			mock->channels[2].passes);
+
+	for(i = 0; i < 40*64; i++)
+	{
+		if(_buf[i] != mock_pattern(i))
+		{
+			WARN(1, "multi-pass: wrong data at %d\n", i);
+			break;
+		}
+	}
+}
+
+static void __init test_error(u8 *_buf)
+{
+	struct test_xfer tx[2];
+	int i;
+
+	test_reset();
+	mock->fail_next = 1;
+
+	for(i = 0; i < 2; i++)
+	{
+		test_init_xfer(&tx[i], i, 2, CDMA_FROM_MEM, _buf, 128);
+		cdma_submit(3, &tx[i].xfer);
+	}
+
+	if(test_wait("error"))
+		return;
+
+	WARN(tx[0].xfer.result != -EIO, "error: expected -EIO, got %d\n", tx[0].xfer.result);
+	WARN(tx[1].xfer.result, "error: next transfer returned %d\n", tx[1].xfer.result);
+}
+
+static void __init test_cancel(u8 *_buf)
+{
+	struct test_xfer tx[2];
+	int i, ret;
+
+	test_reset();
+	mock->hold = 1;
+
+	for(i = 0; i < 2; i++)
+	{
+		test_init_xfer(&tx[i], i, 2, CDMA_FROM_MEM, _buf, 128);
+		cdma_submit(3, &tx[i].xfer);
+	}
+
+	ret = cdma_cancel(3);
+	WARN(ret, "cancel: returned %d\n", ret);
+	WARN(test_done != 2, "cancel: %d callbacks ran\n", test_done);
+
+	for(i = 0; i < 2; i++)
+		WARN(tx[i].xfer.result != -ECANCELED, "cancel: transfer %d returned %d\n",
+				i, tx[i].xfer.result);
+
+	// The interrupt for the cancelled pass must be ignored.
+	mock->hold = 0;
+	tasklet_schedule(&mock->tasklet);
+	tasklet_kill(&mock->tasklet);
+	WARN(test_done != 2, "cancel: callbacks ran again\n");
+}
+
+static void __init test_bad_params(u8 *_buf)
+{
+	struct test_xfer tx;
+	int ret;
+
+	test_init_xfer(&tx, 0, 1, CDMA_FROM_MEM, _buf, 128);
+	tx.xfer.burst = 3;
+	ret = cdma_submit(0, &tx.xfer);
+	WARN(ret != -EINVAL, "bad burst: expected -EINVAL, got %d\n", ret);
+
+	tx.xfer.burst = 4;
+	ret = cdma_submit(CHANNELS, &tx.xfer);
+	WARN(ret != -ENOENT, "bad channel: expected -ENOENT, got %d\n", ret);
+}
+
+static int __init test_cdma_init(void)
+{
+	struct platform_device *pdev;
+	u8 *buf;
+	int i, ret;
+
+	pdev = platform_device_register_simple("apple-cdma-test", -1, NULL, 0);
+	if(IS_ERR(pdev))
+		return PTR_ERR(pdev);
+
+	pdev->dev.coherent_dma_mask = DMA_BIT_MASK(32);
+
+	mock = kzalloc(sizeof(*mock), GFP_KERNEL);
+	buf = kmalloc(4096, GFP_KERNEL);
+	if(!mock || !buf)
+	{
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	tasklet_init(&mock->tasklet, mock_tasklet, (unsigned long)mock);
+	mock_ops.priv = mock;
+
+	ret = cdma_mock_register(pdev, CHANNELS, &mock_ops);
+	if(ret)
+	{
+		printk(KERN_INFO "apple-cdma-test: controller present, not testing.\n");
+		goto err;
+	}
+
+	for(i = 0; i < 4096; i++)
+		buf[i] = i ^ (i >> 8);
+
+	test_sync(buf);
+	test_queue(buf);
+	test_error(buf);
+	test_cancel(buf);
+	test_multi_pass(buf);
+	test_bad_params(buf);
+
+	tasklet_kill(&mock->tasklet);
+	cdma_mock_unregister();
+	ret = -EINVAL;
+
+err:
+	kfree(buf);
+	kfree(mock);
+	platform_device_unregister(pdev);
+	return ret;
+}
+module_init(test_cdma_init);
+MODULE_LICENSE("GPL");
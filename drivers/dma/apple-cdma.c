@@ -10,8 +10,8 @@
 
 #include <linux/platform_device.h>
 #include <linux/dma-mapping.h>
-#include <linux/dmapool.h>
 #include <linux/completion.h>
+#include <linux/spinlock.h>
 #include <linux/slab.h>
 #include <linux/delay.h>
 #include <linux/interrupt.h>
@@ -20,6 +20,8 @@
 
 #include <plat/cdma.h>
 
+#include "apple-cdma-regs.h"
+
 //#define CDMA_DEBUG
 
 #ifdef CDMA_DEBUG
@@ -28,83 +30,21 @@
 #define cdma_dbg(state, args...)
 #endif
 
-typedef struct _cmda_segment
-{
-	u32 next;	// Should be a DMA address
-	u32 flags;
-	u32 data;			// Should be a DMA address
-	u32 length;
-	u32 iv[4];
-} __attribute__((packed)) __attribute__((aligned(4))) cdma_segment_t;
-
-struct cdma_segment_tag
-{
-	cdma_segment_t *seg;
-	dma_addr_t addr;
-
-	struct list_head list;
-};
-
-// These first 3 are 32-bit blocks.
-#define CDMA_ENABLE(x)			(0x0 + ((x)*0x4))
-#define CDMA_DISABLE(x)			(0x8 + ((x)*0x4))
-#define CDMA_STATUS(x)			(0x10 + ((x)*0x4))
-
-#define CDMA_CHAN(x)			(0x1000*((x)+1))
-#define CDMA_CSTATUS(x)			(CDMA_CHAN(x) + 0x0)
-#define CDMA_CCONFIG(x)			(CDMA_CHAN(x) + 0x4)
-#define CDMA_CREG(x)			(CDMA_CHAN(x) + 0x8)
-#define CDMA_CSIZE(x)			(CDMA_CHAN(x) + 0xC)
-#define CDMA_CSEGPTR(x)			(CDMA_CHAN(x) + 0x14)
-
-#define CDMA_AES(x)				((x)*0x1000)
-#define CDMA_AES_CONFIG(x)		(CDMA_AES(x) + 0x0)
-#define CDMA_AES_KEY(x, y)		(CDMA_AES(x) + 0x20 + ((y)*4))
-
-#define CSTATUS_ACTIVE			(1 << 0)
-#define CSTATUS_SETUP			(1 << 1)
-#define CSTATUS_CONT			(1 << 3)
-#define CSTATUS_TXRDY			((1 << 17) | (1 << 16))
-#define CSTATUS_INTERR			(1 << 18)
-#define CSTATUS_INTCLR			(1 << 19)
-#define CSTATUS_SPURCIR			(1 << 20)
-#define CSTATUS_AES_SHIFT		(8)
-#define CSTATUS_AES_MASK		(0xFF) // This is a guess
-#define CSTATUS_AES(x)			(((x) & CSTATUS_AES_MASK) << CSTATUS_AES_SHIFT)
-
-#define CCONFIG_DIR				(1 << 1)
-#define CCONFIG_BURST_SHIFT		(2)
-#define CCONFIG_BURST_MASK		(0x3)
-#define CCONFIG_BURST(x)		(((x) & CCONFIG_BURST_MASK) << CCONFIG_BURST_SHIFT)
-#define CCONFIG_WORDSIZE_SHIFT	(4)
-#define CCONFIG_WORDSIZE_MASK	(0x7)
-#define CCONFIG_WORDSIZE(x)		(((x) & CCONFIG_WORDSIZE_MASK) << CCONFIG_WORDSIZE_SHIFT)
-#define CCONFIG_PERI_SHIFT		(16)
-#define CCONFIG_PERI_MASK		(0x3F)
-#define CCONFIG_PERIPHERAL(x)	(((x) & CCONFIG_PERI_MASK) << CCONFIG_PERI_SHIFT)
-
-#define FLAG_DATA				(1 << 0)
-#define FLAG_ENABLE				(1 << 1)
-#define FLAG_LAST				(1 << 8)
-#define FLAG_AES				(1 << 16)
-#define FLAG_AES_START			(1 << 17)
-
-#define AES_ENCRYPT			(1 << 16)
-#define AES_ENABLED				(1 << 17)
-#define AES_128					(0 << 18)
-#define AES_192					(1 << 18)
-#define AES_256					(2 << 18)
-#define AES_KEY					(1 << 20)
-#define AES_GID					(2 << 20)
-#define AES_UID					(4 << 20)
-
 #define CDMA_MAX_CHANNELS	37
 
+// Descriptors per channel. One pass of cdma_continue uses at most 32
+// plus the terminating ones, AES transfers can overshoot by a block.
+#define CDMA_RING_SIZE		64
+
 struct cdma_channel_state
 {
 	unsigned active: 1;
 	unsigned in_use: 1;
 
+	spinlock_t lock;
+	struct cdma_xfer *xfer;
+	struct list_head queue;
+
 	struct scatterlist *sg;
 	size_t sg_count;
 	size_t sg_offset;
@@ -116,7 +56,14 @@ struct cdma_channel_state
 	struct cdma_aes *aes;
 	int aes_channel;
 
-	struct list_head segments;
+	// Preallocated descriptors. A pass only starts once the controller
+	// is done with the previous one, so every pass reuses them from the
+	// start.
+	cdma_segment_t *ring;
+	dma_addr_t ring_dma;
+	int ring_used;
+
+	struct cdma_xfer sync_xfer;
 	struct completion completion;
 };
 
@@ -125,10 +72,16 @@ struct cdma_state
 	struct platform_device *dev;
 	void *__iomem regs, *__iomem aes_regs;
 	struct clk *clk;
-	struct dma_pool *pool;
 	int irq;
 	int num_channels;
 
+	cdma_segment_t *ring;
+	dma_addr_t ring_dma;
+
+#ifdef CONFIG_S5L_CDMA_MOCK
+	const struct cdma_mock_ops *mock;
+#endif
+
 	u32 aes_bitmap;
 	struct cdma_channel_state channels[CDMA_MAX_CHANNELS];
 };
@@ -136,31 +89,64 @@ struct cdma_state
 static struct cdma_state *cdma_state = NULL;
 static DECLARE_COMPLETION(cdma_completion);
 
-static cdma_segment_t *cdma_alloc_segment(struct cdma_state *_state, struct cdma_channel_state *_cstate, dma_addr_t *_addr)
+static inline struct cdma_state *cdma_get_state(void)
 {
-	cdma_segment_t *ret = dma_pool_alloc(_state->pool, GFP_KERNEL, _addr);
-	struct cdma_segment_tag *tag = kzalloc(sizeof(*tag), GFP_KERNEL);
+	// Only clients that come up before the controller have to wait.
+	if(unlikely(!cdma_state))
+		wait_for_completion(&cdma_completion);
 
-	memset(ret, 0, sizeof(*ret));
-	tag->seg = ret;
-	tag->addr = *_addr;
+	return cdma_state;
+}
 
-	list_add_tail(&tag->list, &_cstate->segments);
-	return ret;
+static inline u32 cdma_readl(struct cdma_state *_state, u32 _reg)
+{
+#ifdef CONFIG_S5L_CDMA_MOCK
+	if(_state->mock)
+		return _state->mock->read(_state->mock->priv, 0, _reg);
+#endif
+
+	return readl(_state->regs + _reg);
 }
 
-static void cdma_free_segments(struct cdma_state *_state, struct cdma_channel_state *_cstate)
+static inline void cdma_writel(struct cdma_state *_state, u32 _val, u32 _reg)
 {
-	struct list_head *pos;
+#ifdef CONFIG_S5L_CDMA_MOCK
+	if(_state->mock)
+	{
+		_state->mock->write(_state->mock->priv, 0, _reg, _val);
+		return;
+	}
+#endif
+
+	writel(_val, _state->regs + _reg);
+}
 
-	list_for_each(pos, &_cstate->segments)
+static inline void cdma_aes_writel(struct cdma_state *_state, u32 _val, u32 _reg)
+{
+#ifdef CONFIG_S5L_CDMA_MOCK
+	if(_state->mock)
 	{
-		struct cdma_segment_tag *tag = container_of(pos, struct cdma_segment_tag, list);
-		dma_pool_free(_state->pool, tag->seg, tag->addr);
-		kfree(tag);
+		_state->mock->write(_state->mock->priv, 1, _reg, _val);
+		return;
 	}
+#endif
 
-	INIT_LIST_HEAD(&_cstate->segments);
+	writel(_val, _state->aes_regs + _reg);
+}
+
+static cdma_segment_t *cdma_alloc_segment(struct cdma_state *_state, struct cdma_channel_state *_cstate, dma_addr_t *_addr)
+{
+	cdma_segment_t *ret;
+
+	if(_cstate->ring_used >= CDMA_RING_SIZE)
+		return NULL;
+
+	ret = &_cstate->ring[_cstate->ring_used];
+	*_addr = _cstate->ring_dma + (_cstate->ring_used * sizeof(cdma_segment_t));
+	_cstate->ring_used++;
+
+	memset(ret, 0, sizeof(*ret));
+	return ret;
 }
 
 static inline void cdma_next_sg(struct cdma_channel_state *_cstate)
@@ -178,19 +164,19 @@ static int cdma_activate(struct cdma_state *_state, int _chan, int _enable)
 
 	cdma_dbg(_state, "%s: %d %d -> %d %d.\n", __func__, _chan, _enable, block, mask);
 
-	status = readl(_state->regs + CDMA_STATUS(block));
+	status = cdma_readl(_state, CDMA_STATUS(block));
 	if((status & mask) && !_enable)
 	{
 		// disable
-		writel(mask, _state->regs + CDMA_DISABLE(block));
+		cdma_writel(_state, mask, CDMA_DISABLE(block));
 	}
 	else if(!(status & mask) && _enable)
 	{
 		// enable
-		writel(mask, _state->regs + CDMA_ENABLE(block));
+		cdma_writel(_state, mask, CDMA_ENABLE(block));
 	}
 
-	cdma_dbg(_state, "%s: 0x%08x.\n", __func__, readl(_state->regs + CDMA_STATUS(block)));
+	cdma_dbg(_state, "%s: 0x%08x.\n", __func__, cdma_readl(_state, CDMA_STATUS(block)));
 	
 	_state->channels[_chan].active = _enable;
 	return (status & mask)? 1 : 0;
@@ -210,6 +196,8 @@ static int cdma_continue(struct cdma_state *_state, int _chan)
 		return -EINVAL;
 	}
 
+	cstate->ring_used = 0;
+
 	if(cstate->aes)
 	{
 		struct cdma_aes *aes = cstate->aes;
@@ -220,6 +208,12 @@ static int cdma_continue(struct cdma_state *_state, int _chan)
 			int aes_seg_size = aes->data_size;
 			int aes_seg_offset = 0;
 
+			if(!seg)
+			{
+				dev_err(&_state->dev->dev, "failed to allocate segment!\n");
+				return -ENOMEM;
+			}
+
 			seg->flags = FLAG_ENABLE;
 			cstate->aes->gen_iv(cstate->aes->iv_param, cstate->current_transfer++, seg->iv);
 			segsleft--;
@@ -265,6 +259,12 @@ static int cdma_continue(struct cdma_state *_state, int _chan)
 			// Empty last seg OR next seg.
 			seg = cdma_alloc_segment(_state, cstate, &seg->next);
 		}
+
+		if(!seg)
+		{
+			dev_err(&_state->dev->dev, "failed to allocate segment!\n");
+			return -ENOMEM;
+		}
 	}
 	else
 	{
@@ -293,7 +293,7 @@ static int cdma_continue(struct cdma_state *_state, int _chan)
 	}
 
 	cstate->done += amt_done;
-	writel(addr, _state->regs + CDMA_CSEGPTR(_chan));
+	cdma_writel(_state, addr, CDMA_CSEGPTR(_chan));
 
 	flags = 0x1C0009;
 	if(cstate->aes_channel)
@@ -302,29 +302,17 @@ static int cdma_continue(struct cdma_state *_state, int _chan)
 		flags |= (cstate->aes_channel << 8);
 	}
 
-	writel(flags, _state->regs + CDMA_CSTATUS(_chan));
+	cdma_writel(_state, flags, CDMA_CSTATUS(_chan));
 
-	cdma_dbg(_state, "%s: %d 0x%08x.\n", __func__, _chan, readl(_state->regs + CDMA_CSTATUS(_chan)));
+	cdma_dbg(_state, "%s: %d 0x%08x.\n", __func__, _chan, cdma_readl(_state, CDMA_CSTATUS(_chan)));
 	return 0;
 }
 
-int cdma_begin(u32 _channel, cdma_dir_t _dir, struct scatterlist *_sg, size_t _sg_count, size_t _size, dma_addr_t _reg, size_t _burst, size_t _busw, u32 _pid)
+static int cdma_config(struct cdma_state *_state, struct cdma_xfer *_xfer, u32 *_flags)
 {
-	struct cdma_state *state;
-	struct cdma_channel_state *cstate;
 	u32 flags = 0;
 
-	wait_for_completion(&cdma_completion);
-	state = cdma_state; // TODO: somewhat hacky.
-	cstate = &state->channels[_channel];
-
-	if(_channel > state->num_channels)
-	{
-		dev_err(&state->dev->dev, "no such channel %d.\n", _channel);
-		return -ENOENT;
-	}
-
-	switch(_burst)
+	switch(_xfer->burst)
 	{
 	case 1:
 		flags |= (0 << 2);
@@ -339,11 +327,11 @@ int cdma_begin(u32 _channel, cdma_dir_t _dir, struct scatterlist *_sg, size_t _s
 		break;
 
 	default:
-		dev_err(&state->dev->dev, "invalid burst size %d.\n", _burst);
+		dev_err(&_state->dev->dev, "invalid burst size %d.\n", _xfer->burst);
 		return -EINVAL;
 	}
 
-	switch(_busw)
+	switch(_xfer->busw)
 	{
 	case 1:
 		flags |= (0 << 4);
@@ -370,52 +358,174 @@ int cdma_begin(u32 _channel, cdma_dir_t _dir, struct scatterlist *_sg, size_t _s
 		break;
 
 	default:
-		dev_err(&state->dev->dev, "invalid bus width %d.\n", _busw);
+		dev_err(&_state->dev->dev, "invalid bus width %d.\n", _xfer->busw);
 		return -EINVAL;
 	}
 
-	flags |= ((_pid & 0x3f) << 16) | ((_dir & 1) << 1);
+	flags |= ((_xfer->pid & 0x3f) << 16) | ((_xfer->dir & 1) << 1);
 
-	INIT_COMPLETION(cstate->completion);
+	*_flags = flags;
+	return 0;
+}
 
-	cstate->sg = _sg;
-	cstate->sg_count = _sg_count;
+// Called with the channel lock held.
+static int cdma_start(struct cdma_state *_state, int _chan, struct cdma_xfer *_xfer)
+{
+	struct cdma_channel_state *cstate = &_state->channels[_chan];
+	u32 flags;
+	int ret;
+
+	ret = cdma_config(_state, _xfer, &flags);
+	if(ret)
+		return ret;
+
+	cstate->xfer = _xfer;
+
+	cstate->sg = _xfer->sg;
+	cstate->sg_count = _xfer->sg_count;
 	cstate->sg_offset = 0;
 
-	cstate->count = _size;
+	cstate->count = _xfer->size;
 	cstate->done = 0;
 	cstate->current_transfer = 0;
 
-	cdma_activate(state, _channel, 1);
-	writel(2, state->regs + CDMA_CSTATUS(_channel));
-	writel(flags, state->regs + CDMA_CCONFIG(_channel));
-	writel(_reg, state->regs + CDMA_CREG(_channel));
-	writel(_size, state->regs + CDMA_CSIZE(_channel));
+	cdma_activate(_state, _chan, 1);
+	cdma_writel(_state, 2, CDMA_CSTATUS(_chan));
+	cdma_writel(_state, flags, CDMA_CCONFIG(_chan));
+	cdma_writel(_state, _xfer->reg, CDMA_CREG(_chan));
+	cdma_writel(_state, _xfer->size, CDMA_CSIZE(_chan));
+
+	ret = cdma_continue(_state, _chan);
+	if(ret)
+	{
+		cstate->xfer = NULL;
+		cdma_activate(_state, _chan, 0);
+	}
+
+	return ret;
+}
+
+// Runs the callbacks of the transfers on _done, without any locks held.
+static void cdma_complete_list(struct list_head *_done)
+{
+	struct cdma_xfer *xfer, *next;
+
+	list_for_each_entry_safe(xfer, next, _done, list)
+	{
+		list_del(&xfer->list);
+		if(xfer->callback)
+			xfer->callback(xfer, xfer->result);
+	}
+}
+
+int cdma_submit(u32 _channel, struct cdma_xfer *_xfer)
+{
+	struct cdma_state *state = cdma_get_state();
+	struct cdma_channel_state *cstate;
+	unsigned long irqflags;
+	u32 flags;
+	int ret = 0;
+
+	if(_channel >= state->num_channels)
+	{
+		dev_err(&state->dev->dev, "no such channel %d.\n", _channel);
+		return -ENOENT;
+	}
+
+	// Catch bad parameters now rather than when the transfer comes up.
+	ret = cdma_config(state, _xfer, &flags);
+	if(ret)
+		return ret;
+
+	cstate = &state->channels[_channel];
+	_xfer->result = -EINPROGRESS;
+
+	spin_lock_irqsave(&cstate->lock, irqflags);
+
+	if(cstate->xfer)
+		list_add_tail(&_xfer->list, &cstate->queue);
+	else
+		ret = cdma_start(state, _channel, _xfer);
 
-	return cdma_continue(state, _channel);
+	spin_unlock_irqrestore(&cstate->lock, irqflags);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(cdma_submit);
+
+static void cdma_sync_done(struct cdma_xfer *_xfer, int _result)
+{
+	struct cdma_channel_state *cstate = _xfer->callback_param;
+	complete(&cstate->completion);
+}
+
+int cdma_begin(u32 _channel, cdma_dir_t _dir, struct scatterlist *_sg, size_t _sg_count, size_t _size, dma_addr_t _reg, size_t _burst, size_t _busw, u32 _pid)
+{
+	struct cdma_state *state = cdma_get_state();
+	struct cdma_channel_state *cstate;
+	struct cdma_xfer *xfer;
+
+	if(_channel >= state->num_channels)
+	{
+		dev_err(&state->dev->dev, "no such channel %d.\n", _channel);
+		return -ENOENT;
+	}
+
+	cstate = &state->channels[_channel];
+	xfer = &cstate->sync_xfer;
+
+	INIT_COMPLETION(cstate->completion);
+
+	xfer->dir = _dir;
+	xfer->sg = _sg;
+	xfer->sg_count = _sg_count;
+	xfer->size = _size;
+	xfer->reg = _reg;
+	xfer->burst = _burst;
+	xfer->busw = _busw;
+	xfer->pid = _pid;
+	xfer->callback = cdma_sync_done;
+	xfer->callback_param = cstate;
+
+	return cdma_submit(_channel, xfer);
 }
 EXPORT_SYMBOL_GPL(cdma_begin);
 
+// Stops the channel. The running transfer and everything queued behind it
+// complete with -ECANCELED.
 int cdma_cancel(u32 _channel)
 {
-	struct cdma_state *state;
+	struct cdma_state *state = cdma_get_state();
 	struct cdma_channel_state *cstate;
+	struct cdma_xfer *xfer;
+	unsigned long flags;
+	LIST_HEAD(done);
+	int ret = 0;
+
+	if(_channel >= state->num_channels)
+		return -ENOENT;
 
-	wait_for_completion(&cdma_completion);
-	state = cdma_state; // TODO: somewhat hacky.
 	cstate = &state->channels[_channel];
 
-	if(_channel > state->num_channels)
-		return -ENOENT;
+	spin_lock_irqsave(&cstate->lock, flags);
+
+	if(cstate->xfer)
+	{
+		list_add_tail(&cstate->xfer->list, &done);
+		cstate->xfer = NULL;
+	}
+
+	list_splice_tail_init(&cstate->queue, &done);
+
+	spin_unlock_irqrestore(&cstate->lock, flags);
 
 	cdma_activate(state, _channel, 1);
 
-	if(((readl(state->regs + CDMA_CSTATUS(_channel)) >> 16) & 3) == 1)
+	if(((cdma_readl(state, CDMA_CSTATUS(_channel)) >> 16) & 3) == 1)
 	{
 		int i;
-		writel(2, state->regs + CDMA_STATUS(_channel));
+		cdma_writel(state, 2, CDMA_STATUS(_channel));
 
-		for(i = 0; (((readl(state->regs + CDMA_STATUS(_channel)) >> 16) & 3) == 1)
+		for(i = 0; (((cdma_readl(state, CDMA_STATUS(_channel)) >> 16) & 3) == 1)
 				&& i < 1000; i++)
 		{
 			udelay(10);
@@ -424,11 +534,18 @@ int cdma_cancel(u32 _channel)
 		if(i == 1000)
 		{
 			dev_err(&state->dev->dev, "failed to cancel transaction\n");
-			return -ETIMEDOUT;
+			ret = -ETIMEDOUT;
 		}
 	}
 
-	complete(&cstate->completion);
+	list_for_each_entry(xfer, &done, list)
+		xfer->result = -ECANCELED;
+
+	cdma_complete_list(&done);
+
+	if(ret)
+		return ret;
+
 	cdma_aes(_channel, NULL);
 
 	cdma_activate(state, _channel, 0);
@@ -438,36 +555,32 @@ EXPORT_SYMBOL_GPL(cdma_cancel);
 
 int cdma_wait(u32 _channel)
 {
-	struct cdma_state *state;
+	struct cdma_state *state = cdma_get_state();
 	struct cdma_channel_state *cstate;
 
-	wait_for_completion(&cdma_completion);
-	state = cdma_state; // TODO: somewhat hacky.
-	cstate = &state->channels[_channel];
-
-	if(_channel > state->num_channels)
+	if(_channel >= state->num_channels)
 		return -ENOENT;
 
+	cstate = &state->channels[_channel];
+
 	wait_for_completion(&cstate->completion);
-	return 0;
+	return cstate->sync_xfer.result;
 }
 EXPORT_SYMBOL_GPL(cdma_wait);
 
 int cdma_aes(u32 _channel, struct cdma_aes *_aes)
 {
-	struct cdma_state *state;
+	struct cdma_state *state = cdma_get_state();
 	struct cdma_channel_state *cstate;
 	int status;
 	u32 cfg;
 	u32 type, keytype;
 
-	wait_for_completion(&cdma_completion);
-	state = cdma_state; // TODO: somewhat hacky.
-	cstate = &state->channels[_channel];
-
-	if(_channel > state->num_channels)
+	if(_channel >= state->num_channels)
 		return -ENOENT;
 
+	cstate = &state->channels[_channel];
+
 	if(cstate->aes && !_aes)
 	{
 		state->aes_bitmap &=~ (1 << cstate->aes_channel);
@@ -544,18 +657,18 @@ int cdma_aes(u32 _channel, struct cdma_aes *_aes)
 		switch(keytype)
 		{
 		case 2: // AES-256
-			writel(_aes->key[7], state->aes_regs + CDMA_AES_KEY(cstate->aes_channel, 7));
-			writel(_aes->key[6], state->aes_regs + CDMA_AES_KEY(cstate->aes_channel, 6));
+			cdma_aes_writel(state, _aes->key[7], CDMA_AES_KEY(cstate->aes_channel, 7));
+			cdma_aes_writel(state, _aes->key[6], CDMA_AES_KEY(cstate->aes_channel, 6));
 
 		case 1: // AES-192
-			writel(_aes->key[5], state->aes_regs + CDMA_AES_KEY(cstate->aes_channel, 5));
-			writel(_aes->key[4], state->aes_regs + CDMA_AES_KEY(cstate->aes_channel, 4));
+			cdma_aes_writel(state, _aes->key[5], CDMA_AES_KEY(cstate->aes_channel, 5));
+			cdma_aes_writel(state, _aes->key[4], CDMA_AES_KEY(cstate->aes_channel, 4));
 
 		default: // AES-128
-			writel(_aes->key[3], state->aes_regs + CDMA_AES_KEY(cstate->aes_channel, 3));
-			writel(_aes->key[2], state->aes_regs + CDMA_AES_KEY(cstate->aes_channel, 2));
-			writel(_aes->key[1], state->aes_regs + CDMA_AES_KEY(cstate->aes_channel, 1));
-			writel(_aes->key[0], state->aes_regs + CDMA_AES_KEY(cstate->aes_channel, 0));
+			cdma_aes_writel(state, _aes->key[3], CDMA_AES_KEY(cstate->aes_channel, 3));
+			cdma_aes_writel(state, _aes->key[2], CDMA_AES_KEY(cstate->aes_channel, 2));
+			cdma_aes_writel(state, _aes->key[1], CDMA_AES_KEY(cstate->aes_channel, 1));
+			cdma_aes_writel(state, _aes->key[0], CDMA_AES_KEY(cstate->aes_channel, 0));
 			break;
 		}
 		break;
@@ -566,7 +679,7 @@ int cdma_aes(u32 _channel, struct cdma_aes *_aes)
 		return -EINVAL;
 	}
 
-	writel(cfg, state->aes_regs + CDMA_AES_CONFIG(cstate->aes_channel));
+	cdma_aes_writel(state, cfg, CDMA_AES_CONFIG(cstate->aes_channel));
 	cdma_activate(state, _channel, status);
 	return 0;
 }
@@ -577,10 +690,15 @@ static irqreturn_t cdma_irq_handler(int _irq, void *_token)
 	struct cdma_state *state = _token;
 	int chan = _irq - state->irq;
 	struct cdma_channel_state *cstate = &state->channels[chan];
+	struct cdma_xfer *xfer;
+	LIST_HEAD(done);
 	u32 sz;
+	u32 status;
 	int res = 0;
 
-	u32 status = readl(state->regs + CDMA_CSTATUS(chan));
+	spin_lock(&cstate->lock);
+
+	status = cdma_readl(state, CDMA_CSTATUS(chan));
 
 	cdma_dbg(state, "%s!\n", __func__);
 
@@ -593,26 +711,104 @@ static irqreturn_t cdma_irq_handler(int _irq, void *_token)
 	if(status & CSTATUS_SPURCIR)
 		dev_err(&state->dev->dev, "channel %d: spurious CIR.\n", chan);
 
-	writel(CSTATUS_INTCLR, state->regs + CDMA_CSTATUS(chan));
+	cdma_writel(state, CSTATUS_INTCLR, CDMA_CSTATUS(chan));
+
+	xfer = cstate->xfer;
+	if(!xfer)
+	{
+		// Raced with cdma_cancel.
+		spin_unlock(&cstate->lock);
+		return IRQ_HANDLED;
+	}
 
-	sz = readl(state->regs + CDMA_CSIZE(chan));
+	sz = cdma_readl(state, CDMA_CSIZE(chan));
 	if(!res && (cstate->count < cstate->done || sz))
 	{
 		if(status & CSTATUS_TXRDY)
 			panic("TODO: %s, incomplete transfers.\n", __func__);
 		
-		cdma_continue(state, chan);
+		res = cdma_continue(state, chan);
+		if(!res)
+		{
+			spin_unlock(&cstate->lock);
+			return IRQ_HANDLED;
+		}
 	}
-	else
+
+	xfer->result = res;
+	list_add_tail(&xfer->list, &done);
+	cstate->xfer = NULL;
+
+	// Keep the channel busy with whatever queued up behind this one.
+	while(!list_empty(&cstate->queue))
 	{
-		complete(&cstate->completion);
-		cdma_activate(state, chan, 0);
-		cdma_free_segments(state, cstate);
+		xfer = list_first_entry(&cstate->queue, struct cdma_xfer, list);
+		list_del(&xfer->list);
+
+		xfer->result = cdma_start(state, chan, xfer);
+		if(!xfer->result)
+			break;
+
+		list_add_tail(&xfer->list, &done);
 	}
 
+	if(!cstate->xfer)
+		cdma_activate(state, chan, 0);
+
+	spin_unlock(&cstate->lock);
+
+	cdma_complete_list(&done);
 	return IRQ_HANDLED;
 }
 
+static int cdma_setup(struct cdma_state *_state, struct platform_device *_dev)
+{
+	int i;
+
+	_state->dev = _dev;
+
+	_state->ring = dma_alloc_coherent(&_dev->dev,
+			_state->num_channels * CDMA_RING_SIZE * sizeof(cdma_segment_t),
+			&_state->ring_dma, GFP_KERNEL);
+	if(!_state->ring)
+	{
+		dev_err(&_dev->dev, "failed to allocate descriptors.\n");
+		return -ENOMEM;
+	}
+
+	for(i = 0; i < _state->num_channels; i++)
+	{
+		struct cdma_channel_state *cstate = &_state->channels[i];
+		spin_lock_init(&cstate->lock);
+		INIT_LIST_HEAD(&cstate->queue);
+		init_completion(&cstate->completion);
+
+		cstate->ring = _state->ring + (i * CDMA_RING_SIZE);
+		cstate->ring_dma = _state->ring_dma + (i * CDMA_RING_SIZE * sizeof(cdma_segment_t));
+	}
+
+	return 0;
+}
+
+static void cdma_teardown(struct cdma_state *_state)
+{
+	if(_state->ring)
+		dma_free_coherent(&_state->dev->dev,
+				_state->num_channels * CDMA_RING_SIZE * sizeof(cdma_segment_t),
+				_state->ring, _state->ring_dma);
+}
+
+static void cdma_publish(struct cdma_state *_state)
+{
+	dev_info(&_state->dev->dev, "driver started.\n");
+
+	// Channel state must be visible before the fast path in
+	// cdma_get_state can see the pointer.
+	smp_wmb();
+	cdma_state = _state;
+	complete_all(&cdma_completion);
+}
+
 static int cdma_probe(struct platform_device *_dev)
 {
 	struct cdma_state *state;
@@ -679,45 +875,34 @@ static int cdma_probe(struct platform_device *_dev)
 		dev_info(&_dev->dev, "enabling clock.\n");
 	}
 
-	state->dev = _dev;
 	state->irq = res->start;
 	state->num_channels = resource_size(res);
-	
-	for(i = res->start; i <= res->end; i++)
-	{
-		ret = request_irq(i, cdma_irq_handler, IRQF_SHARED, "apple-cdma", state);
-		if(ret < 0)
-		{
-			dev_err(&_dev->dev, "failed to request irq %d.\n", i);
-			goto err_aes;
-		}
-	}
+	if(state->num_channels > CDMA_MAX_CHANNELS)
+		state->num_channels = CDMA_MAX_CHANNELS;
 
-	state->pool = dma_pool_create("apple-cdma", &_dev->dev, sizeof(cdma_segment_t),
-			sizeof(cdma_segment_t),	0);
-	if(!state->pool)
-	{
-		dev_err(&_dev->dev, "failed to create DMA pool.\n");
-		ret = -ENOMEM;
-		goto err_irqs;
-	}
+	ret = cdma_setup(state, _dev);
+	if(ret)
+		goto err_aes;
 
 	for(i = 0; i < state->num_channels; i++)
 	{
-		struct cdma_channel_state *cstate = &state->channels[i];
-		init_completion(&cstate->completion);
-		INIT_LIST_HEAD(&cstate->segments);
+		ret = request_irq(state->irq + i, cdma_irq_handler, IRQF_SHARED, "apple-cdma", state);
+		if(ret < 0)
+		{
+			dev_err(&_dev->dev, "failed to request irq %d.\n", state->irq + i);
+			goto err_irqs;
+		}
 	}
 
-	dev_info(&state->dev->dev, "driver started.\n");
-	cdma_state = state;
-	complete_all(&cdma_completion);
 	platform_set_drvdata(_dev, state);
+	cdma_publish(state);
 	goto exit;
 
 err_irqs:
-	for(i = res->start; i <= res->end; i++)
-		free_irq(i, state);
+	while(--i >= 0)
+		free_irq(state->irq + i, state);
+
+	cdma_teardown(state);
 
 err_aes:
 	iounmap(state->aes_regs);
@@ -738,9 +923,6 @@ static int cdma_remove(struct platform_device *_dev)
 	if(!state)
 		return 0;
 
-	if(state->pool)
-		dma_pool_destroy(state->pool);
-
 	if(state->irq)
 	{
 		int i;
@@ -748,6 +930,8 @@ static int cdma_remove(struct platform_device *_dev)
 			free_irq(state->irq + i, state);
 	}
 
+	cdma_teardown(state);
+
 	if(state->regs)
 		iounmap(state->regs);
 
@@ -764,6 +948,86 @@ static int cdma_remove(struct platform_device *_dev)
 	return 0;
 }
 
+#ifdef CONFIG_S5L_CDMA_MOCK
+int cdma_mock_register(struct platform_device *_dev, int _num_channels, const struct cdma_mock_ops *_ops)
+{
+	struct cdma_state *state;
+	int ret;
+
+	if(cdma_state)
+	{
+		dev_err(&_dev->dev, "CDMA controller already registered.\n");
+		return -EBUSY;
+	}
+
+	if(_num_channels <= 0 || _num_channels > CDMA_MAX_CHANNELS)
+		return -EINVAL;
+
+	state = kzalloc(sizeof(struct cdma_state), GFP_KERNEL);
+	if(!state)
+		return -ENOMEM;
+
+	state->mock = _ops;
+	state->num_channels = _num_channels;
+
+	ret = cdma_setup(state, _dev);
+	if(ret)
+	{
+		kfree(state);
+		return ret;
+	}
+
+	cdma_publish(state);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(cdma_mock_register);
+
+void cdma_mock_unregister(void)
+{
+	struct cdma_state *state = cdma_state;
+	if(!state || !state->mock)
+		return;
+
+	cdma_state = NULL;
+	INIT_COMPLETION(cdma_completion);
+
+	cdma_teardown(state);
+	kfree(state);
+}
+EXPORT_SYMBOL_GPL(cdma_mock_unregister);
+
+void cdma_mock_interrupt(u32 _channel)
+{
+	struct cdma_state *state = cdma_state;
+	unsigned long flags;
+
+	if(!state || !state->mock || _channel >= state->num_channels)
+		return;
+
+	// The handler expects to run with interrupts off, like a real one.
+	local_irq_save(flags);
+	cdma_irq_handler(state->irq + _channel, state);
+	local_irq_restore(flags);
+}
+EXPORT_SYMBOL_GPL(cdma_mock_interrupt);
+
+cdma_segment_t *cdma_mock_segment(u32 _addr)
+{
+	struct cdma_state *state = cdma_state;
+	size_t size;
+
+	if(!state)
+		return NULL;
+
+	size = state->num_channels * CDMA_RING_SIZE * sizeof(cdma_segment_t);
+	if(_addr < state->ring_dma || _addr >= state->ring_dma + size)
+		return NULL;
+
+	return state->ring + ((_addr - state->ring_dma) / sizeof(cdma_segment_t));
+}
+EXPORT_SYMBOL_GPL(cdma_mock_segment);
+#endif
+
 #ifdef CONFIG_PM
 static int cdma_suspend(struct platform_device *_dev, pm_message_t _state)
 {
@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2008 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#if !defined(_BINDER_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _BINDER_TRACE_H_
+
+#include <linux/stringify.h>
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+#define TRACE_SYSTEM_STRING __stringify(TRACE_SYSTEM)
+#define TRACE_INCLUDE_FILE binder_trace
+
+/*
+ * Only binder.c includes this, after its private structures are
+ * defined. Every event carries the transaction debug_id, which is also
+ * what the transaction logs in debugfs show, so a submit can be matched
+ * with its wakeup, delivery and reply.
+ */
+struct binder_buffer;
+struct binder_node;
+struct binder_proc;
+struct binder_thread;
+struct binder_transaction;
+
+TRACE_EVENT(binder_wait_for_work,
+	    TP_PROTO(bool proc_work, bool transaction_stack, bool thread_todo),
+	    TP_ARGS(proc_work, transaction_stack, thread_todo),
+
+	    TP_STRUCT__entry(
+			     __field(bool, proc_work)
+			     __field(bool, transaction_stack)
+			     __field(bool, thread_todo)
+			     ),
+
+	    TP_fast_assign(
+			   __entry->proc_work = proc_work;
+			   __entry->transaction_stack = transaction_stack;
+			   __entry->thread_todo = thread_todo;
+			   ),
+
+	    TP_printk("proc_work=%d transaction_stack=%d thread_todo=%d",
+		      __entry->proc_work, __entry->transaction_stack,
+		      __entry->thread_todo)
+);
+
+TRACE_EVENT(binder_transaction,
+	    TP_PROTO(bool reply, struct binder_transaction *t,
+		     struct binder_node *target_node),
+	    TP_ARGS(reply, t, target_node),
+
+	    TP_STRUCT__entry(
+			     __field(int, debug_id)
+			     __field(int, target_node)
+			     __field(int, to_proc)
+			     __field(int, to_thread)
+			     __field(int, reply)
+			     __field(unsigned int, code)
+			     __field(unsigned int, flags)
+			     ),
+
+	    TP_fast_assign(
+			   __entry->debug_id = t->debug_id;
+			   __entry->target_node = target_node ?
+						  target_node->debug_id : 0;
+			   __entry->to_proc = t->to_proc->pid;
+			   __entry->to_thread = t->to_thread ?
+						t->to_thread->pid : 0;
+			   __entry->reply = reply;
+			   __entry->code = t->code;
+			   __entry->flags = t->flags;
+			   ),
+
+	    TP_printk("transaction=%d dest_node=%d dest_proc=%d dest_thread=%d reply=%d flags=0x%x code=0x%x",
+		      __entry->debug_id, __entry->target_node,
+		      __entry->to_proc, __entry->to_thread,
+		      __entry->reply, __entry->flags, __entry->code)
+);
+
+TRACE_EVENT(binder_transaction_wakeup,
+	    TP_PROTO(struct binder_transaction *t,
+		     struct binder_thread *target_thread),
+	    TP_ARGS(t, target_thread),
+
+	    TP_STRUCT__entry(
+			     __field(int, debug_id)
+			     __field(int, to_proc)
+			     __field(int, to_thread)
+			     ),
+
+	    TP_fast_assign(
+			   __entry->debug_id = t->debug_id;
+			   __entry->to_proc = t->to_proc->pid;
+			   __entry->to_thread = target_thread ?
+						target_thread->pid : 0;
+			   ),
+
+	    TP_printk("transaction=%d dest_proc=%d dest_thread=%d",
+		      __entry->debug_id, __entry->to_proc,
+		      __entry->to_thread)
+);
+
+TRACE_EVENT(binder_transaction_received,
+	    TP_PROTO(struct binder_transaction *t, bool reply),
+	    TP_ARGS(t, reply),
+
+	    TP_STRUCT__entry(
+			     __field(int, debug_id)
+			     __field(int, reply)
+			     ),
+
+	    TP_fast_assign(
+			   __entry->debug_id = t->debug_id;
+			   __entry->reply = reply;
+			   ),
+
+	    TP_printk("transaction=%d reply=%d",
+		      __entry->debug_id, __entry->reply)
+);
+
+DECLARE_EVENT_CLASS(binder_buffer_class,
+	    TP_PROTO(struct binder_buffer *buf),
+	    TP_ARGS(buf),
+
+	    TP_STRUCT__entry(
+			     __field(int, debug_id)
+			     __field(size_t, data_size)
+			     __field(size_t, offsets_size)
+			     ),
+
+	    TP_fast_assign(
+			   __entry->debug_id = buf->debug_id;
+			   __entry->data_size = buf->data_size;
+			   __entry->offsets_size = buf->offsets_size;
+			   ),
+
+	    TP_printk("transaction=%d data_size=%zd offsets_size=%zd",
+		      __entry->debug_id, __entry->data_size,
+		      __entry->offsets_size)
+);
+
+DEFINE_EVENT(binder_buffer_class, binder_transaction_alloc_buf,
+	    TP_PROTO(struct binder_buffer *buffer),
+	    TP_ARGS(buffer));
+
+DEFINE_EVENT(binder_buffer_class, binder_transaction_buffer_release,
+	    TP_PROTO(struct binder_buffer *buffer),
+	    TP_ARGS(buffer));
+
+DEFINE_EVENT(binder_buffer_class, binder_transaction_failed_buffer_release,
+	    TP_PROTO(struct binder_buffer *buffer),
+	    TP_ARGS(buffer));
+
+#endif /* _BINDER_TRACE_H_ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#include <trace/define_trace.h>
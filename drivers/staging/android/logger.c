@@ -29,20 +29,43 @@
 
 #include <asm/ioctls.h>
 
+/* writes that may be in flight at once per log, must be a power of two */
+#define LOGGER_MAX_PENDING	64
+
+/*
+ * struct logger_pending - a write that has its space but is not yet visible
+ */
+struct logger_pending {
+	size_t			start;	/* log position of the entry */
+	size_t			len;	/* header plus payload */
+	int			done;	/* copied in, waiting to be committed */
+};
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting.
+ *
+ * Offsets are log positions that only ever grow, logger_offset() maps them
+ * into the buffer. Writers do not share a sleeping lock: under 'lock' they
+ * reserve their space at w_rsv and move head past what they will overwrite,
+ * then copy without it. Entries become readable in order when w_off passes
+ * them. The mutex 'mutex' only serializes readers and the readers list.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
+	struct mutex		mutex;	/* mutex protecting the readers */
+	spinlock_t		lock;	/* protects w_rsv, head and pending */
+	wait_queue_head_t	pending_wq; /* writers waiting for a slot or room */
+	struct logger_pending	pending[LOGGER_MAX_PENDING];
+	unsigned int		pending_head; /* oldest uncommitted write */
+	unsigned int		pending_tail; /* next free slot */
+	size_t			w_rsv;	/* end of the reserved writes */
+	size_t			w_off;	/* end of the committed writes */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
 };
@@ -56,12 +79,15 @@ struct logger_log {
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
-	size_t			r_off;	/* current read head offset */
+	size_t			r_off;	/* current read position */
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
 #define logger_offset(n)	((n) & (log->size - 1))
 
+/* logger_before - is log position 'a' before 'b'? */
+#define logger_before(a, b)	((ssize_t)((a) - (b)) < 0)
+
 /*
  * file_get_log - Given a file structure, return the associated log
  *
@@ -89,7 +115,7 @@ static inline struct logger_log *file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * The entry can be overwritten at any time, callers check for that after.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -107,6 +133,35 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 	return sizeof(struct logger_entry) + val;
 }
 
+/*
+ * fix_up_reader - a reader that was lapped by the writers continues at the
+ * oldest entry still in the log. Returns nonzero if it had to be moved.
+ *
+ * Caller must hold log->mutex.
+ */
+static int fix_up_reader(struct logger_log *log, struct logger_reader *reader)
+{
+	size_t head = ACCESS_ONCE(log->head);
+
+	if (logger_before(reader->r_off, head)) {
+		reader->r_off = head;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * logger_has_entry - is there a committed entry for 'reader'?
+ *
+ * Caller must hold log->mutex.
+ */
+static int logger_has_entry(struct logger_log *log,
+			    struct logger_reader *reader)
+{
+	fix_up_reader(log, reader);
+	return logger_before(reader->r_off, ACCESS_ONCE(log->w_off));
+}
+
 /*
  * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
  * user-space buffer 'buf'. Returns 'count' on success.
@@ -118,6 +173,7 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 				   char __user *buf,
 				   size_t count)
 {
+	size_t off = logger_offset(reader->r_off);
 	size_t len;
 
 	/*
@@ -125,8 +181,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the current read head offset up to 'count' bytes or to the end of
 	 * the log, whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -137,39 +193,69 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
 /*
- * logger_read - our log's read() method
- *
- * Behavior:
+ * logger_read_entry - copies the next entry into 'buf'. Returns its length,
+ * zero if there is none, -EINVAL if it does not fit in 'count' bytes.
  *
- * 	- O_NONBLOCK works
- * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * A writer may lap us while we copy. Since writers move log->head past an
+ * entry before they overwrite it, checking the head afterwards tells
+ * whether what we got is intact.
  *
- * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
- * buffer is insufficient to hold next entry.
+ * Caller must hold log->mutex.
  */
-static ssize_t logger_read(struct file *file, char __user *buf,
-			   size_t count, loff_t *pos)
+static ssize_t logger_read_entry(struct logger_log *log,
+				 struct logger_reader *reader,
+				 char __user *buf, size_t count)
 {
-	struct logger_reader *reader = file->private_data;
-	struct logger_log *log = reader->log;
 	ssize_t ret;
+	size_t len;
+
+	do {
+		if (!logger_has_entry(log, reader))
+			return 0;
+		/* pairs with the smp_wmb() in logger_commit() */
+		smp_rmb();
+
+		len = get_entry_len(log, logger_offset(reader->r_off));
+		smp_rmb();
+		if (fix_up_reader(log, reader))
+			continue;
+		if (count < len)
+			return -EINVAL;
+
+		ret = do_read_log_to_user(log, reader, buf, len);
+		if (ret < 0)
+			return ret;
+		/* pairs with the smp_mb() in logger_reserve() */
+		smp_rmb();
+	} while (fix_up_reader(log, reader));
+
+	reader->r_off += len;
+	return len;
+}
+
+/*
+ * logger_wait_for_entry - waits until 'reader' has something to read
+ *
+ * Returns zero once it does, -EAGAIN or -EINTR otherwise.
+ */
+static int logger_wait_for_entry(struct file *file, struct logger_log *log,
+				 struct logger_reader *reader)
+{
+	int ret = 0;
+	int empty;
 	DEFINE_WAIT(wait);
 
-start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
 		mutex_lock(&log->mutex);
-		ret = (log->w_off == reader->r_off);
+		empty = !logger_has_entry(log, reader);
 		mutex_unlock(&log->mutex);
-		if (!ret)
+		if (!empty)
 			break;
 
 		if (file->f_flags & O_NONBLOCK) {
@@ -186,136 +272,217 @@ start:
 	}
 
 	finish_wait(&log->wq, &wait);
+	return ret;
+}
+
+/*
+ * logger_read_iov - reads one entry into each segment of 'iov', as many as
+ * there are without blocking once the first one is in.
+ */
+static ssize_t logger_read_iov(struct file *file, const struct iovec *iov,
+			       unsigned long nr_segs)
+{
+	struct logger_reader *reader = file->private_data;
+	struct logger_log *log = reader->log;
+	ssize_t total, ret;
+	unsigned long seg;
+
+start:
+	ret = logger_wait_for_entry(file, log, reader);
 	if (ret)
 		return ret;
 
+	total = 0;
 	mutex_lock(&log->mutex);
-
-	/* is there still something to read or did we race? */
-	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
-		goto start;
-	}
-
-	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
-	if (count < ret) {
-		ret = -EINVAL;
-		goto out;
+	for (seg = 0; seg < nr_segs; seg++) {
+		ret = logger_read_entry(log, reader, iov[seg].iov_base,
+					iov[seg].iov_len);
+		if (ret <= 0)
+			break;
+		total += ret;
 	}
-
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
-
-out:
 	mutex_unlock(&log->mutex);
 
+	if (total)
+		return total;
+	/* did we race with the writers lapping us? */
+	if (!ret)
+		goto start;
 	return ret;
 }
 
 /*
- * get_next_entry - return the offset of the first valid entry at least 'len'
- * bytes after 'off'.
+ * logger_read - our log's read() method
  *
- * Caller must hold log->mutex.
+ * Behavior:
+ *
+ * 	- O_NONBLOCK works
+ * 	- If there are no log entries to read, blocks until log is written to
+ * 	- Atomically reads exactly one log entry
+ *
+ * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
+ * buffer is insufficient to hold next entry.
  */
-static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
+static ssize_t logger_read(struct file *file, char __user *buf,
+			   size_t count, loff_t *pos)
 {
-	size_t count = 0;
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
 
-	do {
-		size_t nr = get_entry_len(log, off);
-		off = logger_offset(off + nr);
-		count += nr;
-	} while (count < len);
+	return logger_read_iov(file, &iov, 1);
+}
+
+/*
+ * logger_aio_read - our readv() and aio_read() method
+ *
+ * Each segment gets exactly one entry, so a reader can pick up many entries
+ * with one call. Blocks like read() for the first entry only, and stops at
+ * the first segment that is too small for the next entry.
+ */
+static ssize_t logger_aio_read(struct kiocb *iocb, const struct iovec *iov,
+			       unsigned long nr_segs, loff_t ppos)
+{
+	return logger_read_iov(iocb->ki_filp, iov, nr_segs);
+}
 
-	return off;
+/*
+ * logger_reserve_blocked - must a writer of 'len' bytes wait? It must if
+ * every pending slot is taken, or if making room would move head past an
+ * entry that is still being copied in: the late copy would then land on
+ * top of newer entries.
+ */
+static int logger_reserve_blocked(struct logger_log *log, size_t len)
+{
+	return ACCESS_ONCE(log->pending_tail) - ACCESS_ONCE(log->pending_head)
+		== LOGGER_MAX_PENDING ||
+	       logger_before(ACCESS_ONCE(log->w_off),
+			     ACCESS_ONCE(log->w_rsv) + len - log->size);
 }
 
 /*
- * clock_interval - is a < c < b in mod-space? Put another way, does the line
- * from a to b cross c?
+ * logger_reserve - reserves 'len' bytes at the write end of the log and
+ * returns the slot tracking them. The head, where new and lapped readers
+ * start, is pulled forward past every entry the new one will overwrite.
+ * Those entries are all committed, logger_reserve_blocked() waits for
+ * that.
  */
-static inline int clock_interval(size_t a, size_t b, size_t c)
+static struct logger_pending *logger_reserve(struct logger_log *log,
+					     size_t len)
 {
-	if (b < a) {
-		if (a < c || b >= c)
-			return 1;
-	} else {
-		if (a < c && b >= c)
-			return 1;
+	struct logger_pending *p;
+
+	spin_lock(&log->lock);
+	while (logger_reserve_blocked(log, len)) {
+		spin_unlock(&log->lock);
+		wait_event(log->pending_wq, !logger_reserve_blocked(log, len));
+		spin_lock(&log->lock);
 	}
 
-	return 0;
+	p = &log->pending[log->pending_tail++ & (LOGGER_MAX_PENDING - 1)];
+	p->start = log->w_rsv;
+	p->len = len;
+	p->done = 0;
+	log->w_rsv += len;
+
+	while (log->w_rsv - log->head > log->size)
+		log->head += get_entry_len(log, logger_offset(log->head));
+	spin_unlock(&log->lock);
+
+	/* readers must see the new head before we overwrite anything */
+	smp_mb();
+
+	return p;
 }
 
 /*
- * fix_up_readers - walk the list of all readers and "fix up" any who were
- * lapped by the writer; also do the same for the default "start head".
- * We do this by "pulling forward" the readers and start head to the first
- * entry after the new write head.
- *
- * The caller needs to hold log->mutex.
+ * logger_commit - marks a reserved entry as written and makes every written
+ * entry that is no longer behind an unfinished one readable.
  */
-static void fix_up_readers(struct logger_log *log, size_t len)
+static void logger_commit(struct logger_log *log, struct logger_pending *p)
 {
-	size_t old = log->w_off;
-	size_t new = logger_offset(old + len);
-	struct logger_reader *reader;
+	int freed = 0;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	/* the entry must be complete before readers can see it */
+	smp_wmb();
 
-	list_for_each_entry(reader, &log->readers, list)
-		if (clock_interval(old, new, reader->r_off))
-			reader->r_off = get_next_entry(log, reader->r_off, len);
+	spin_lock(&log->lock);
+	p->done = 1;
+	while (log->pending_head != log->pending_tail) {
+		p = &log->pending[log->pending_head &
+				  (LOGGER_MAX_PENDING - 1)];
+		if (!p->done)
+			break;
+		log->w_off = p->start + p->len;
+		log->pending_head++;
+		freed = 1;
+	}
+	spin_unlock(&log->lock);
+
+	/* pairs with prepare_to_wait() in the readers and writers */
+	smp_mb();
+	if (freed && waitqueue_active(&log->pending_wq))
+		wake_up(&log->pending_wq);
+	if (waitqueue_active(&log->wq))
+		wake_up_interruptible(&log->wq);
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at position 'pos'
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to have reserved the space.
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, size_t pos,
+			 const void *buf, size_t count)
 {
+	size_t off = logger_offset(pos);
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log->w_off + count);
-
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * do_write_log_user - writes 'count' bytes from the user-space buffer 'buf'
+ * to the log 'log' at position 'pos'
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to have reserved the space.
  *
  * Returns 'count' on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
+static ssize_t do_write_log_from_user(struct logger_log *log, size_t pos,
 				      const void __user *buf, size_t count)
 {
+	size_t off = logger_offset(pos);
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
+	len = min(count, log->size - off);
+	if (len && copy_from_user(log->buffer + off, buf, len))
 		return -EFAULT;
 
 	if (count != len)
 		if (copy_from_user(log->buffer, buf + len, count - len))
 			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
-
 	return count;
 }
 
+/*
+ * do_clear_log - zeroes 'count' bytes of 'log' at position 'pos'
+ */
+static void do_clear_log(struct logger_log *log, size_t pos, size_t count)
+{
+	size_t off = logger_offset(pos);
+	size_t len;
+
+	len = min(count, log->size - off);
+	memset(log->buffer + off, 0, len);
+
+	if (count != len)
+		memset(log->buffer, 0, count - len);
+}
+
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
@@ -325,10 +492,11 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
+	struct logger_pending *p;
 	struct logger_entry header;
 	struct timespec now;
 	ssize_t ret = 0;
+	size_t pos;
 
 	now = current_kernel_time();
 
@@ -342,17 +510,11 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	p = logger_reserve(log, sizeof(struct logger_entry) + header.len);
+	pos = p->start;
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	do_write_log(log, pos, &header, sizeof(struct logger_entry));
+	pos += sizeof(struct logger_entry);
 
 	while (nr_segs-- > 0) {
 		size_t len;
@@ -362,21 +524,23 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log, pos, iov->iov_base, len);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+			/*
+			 * The space is taken and later entries may be
+			 * done already, so keep the entry but blank it.
+			 */
+			do_clear_log(log, pos, header.len - ret);
+			ret = nr;
+			break;
 		}
 
 		iov++;
+		pos += nr;
 		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
-
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	logger_commit(log, p);
 
 	return ret;
 }
@@ -412,7 +576,7 @@ static int logger_open(struct inode *inode, struct file *file)
 		INIT_LIST_HEAD(&reader->list);
 
 		mutex_lock(&log->mutex);
-		reader->r_off = log->head;
+		reader->r_off = ACCESS_ONCE(log->head);
 		list_add_tail(&reader->list, &log->readers);
 		mutex_unlock(&log->mutex);
 
@@ -432,7 +596,11 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
+		struct logger_log *log = reader->log;
+
+		mutex_lock(&log->mutex);
 		list_del(&reader->list);
+		mutex_unlock(&log->mutex);
 		kfree(reader);
 	}
 
@@ -463,7 +631,7 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	poll_wait(file, &log->wq, wait);
 
 	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	if (logger_has_entry(log, reader))
 		ret |= POLLIN | POLLRDNORM;
 	mutex_unlock(&log->mutex);
 
@@ -488,10 +656,10 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off >= reader->r_off)
-			ret = log->w_off - reader->r_off;
+		if (logger_has_entry(log, reader))
+			ret = ACCESS_ONCE(log->w_off) - reader->r_off;
 		else
-			ret = (log->size - reader->r_off) + log->w_off;
+			ret = 0;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -499,19 +667,26 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
-		if (log->w_off != reader->r_off)
-			ret = get_entry_len(log, reader->r_off);
-		else
+		ret = 0;
+		while (logger_has_entry(log, reader)) {
+			smp_rmb();
+			ret = get_entry_len(log, logger_offset(reader->r_off));
+			smp_rmb();
+			if (!fix_up_reader(log, reader))
+				break;
 			ret = 0;
+		}
 		break;
 	case LOGGER_FLUSH_LOG:
 		if (!(file->f_mode & FMODE_WRITE)) {
 			ret = -EBADF;
 			break;
 		}
-		list_for_each_entry(reader, &log->readers, list)
-			reader->r_off = log->w_off;
+		spin_lock(&log->lock);
 		log->head = log->w_off;
+		spin_unlock(&log->lock);
+		list_for_each_entry(reader, &log->readers, list)
+			reader->r_off = log->head;
 		ret = 0;
 		break;
 	}
@@ -524,6 +699,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 static const struct file_operations logger_fops = {
 	.owner = THIS_MODULE,
 	.read = logger_read,
+	.aio_read = logger_aio_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
 	.unlocked_ioctl = logger_ioctl,
@@ -550,6 +726,11 @@ static struct logger_log VAR = { \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
+	.pending_wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .pending_wq), \
+	.pending_head = 0, \
+	.pending_tail = 0, \
+	.w_rsv = 0, \
 	.w_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
@@ -16,6 +16,10 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Processes are kept on one list per oom_adj value, so finding a victim
+ * only looks at the highest bucket that has one. The scan_* and kill_count
+ * parameters report how often and how long the shrinker looked.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +39,7 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/ktime.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -55,6 +60,20 @@ static int lowmem_minfree_size = 4;
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
 
+/*
+ * Thread group leaders by oom_adj, OOM_DISABLE first. Protected by
+ * tasklist_lock, fork and exit hold it for writing already.
+ */
+#define LOWMEM_BUCKETS (OOM_ADJUST_MAX - OOM_DISABLE + 1)
+static struct list_head lowmem_buckets[LOWMEM_BUCKETS];
+static int lowmem_buckets_ready;
+
+static uint32_t lowmem_scan_count;
+static uint32_t lowmem_skip_count;
+static uint32_t lowmem_kill_count;
+static unsigned long lowmem_scan_time_us;
+static uint32_t lowmem_scan_time_max_us;
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -79,6 +98,56 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
+static struct list_head *lowmem_bucket(int oom_adj)
+{
+	if (oom_adj < OOM_DISABLE)
+		oom_adj = OOM_DISABLE;
+	if (oom_adj > OOM_ADJUST_MAX)
+		oom_adj = OOM_ADJUST_MAX;
+	return &lowmem_buckets[oom_adj - OOM_DISABLE];
+}
+
+void lowmem_task_add(struct task_struct *p)
+{
+	INIT_LIST_HEAD(&p->lowmem_entry);
+	if (lowmem_buckets_ready)
+		list_add_tail(&p->lowmem_entry, lowmem_bucket(p->signal->oom_adj));
+}
+
+void lowmem_task_del(struct task_struct *p)
+{
+	if (lowmem_buckets_ready)
+		list_del_init(&p->lowmem_entry);
+}
+
+void lowmem_task_replace(struct task_struct *old, struct task_struct *new)
+{
+	if (lowmem_buckets_ready)
+		list_replace_init(&old->lowmem_entry, &new->lowmem_entry);
+}
+
+void lowmem_task_adj_changed(struct task_struct *p)
+{
+	struct task_struct *leader;
+
+	write_lock_irq(&tasklist_lock);
+	leader = p->group_leader;
+	/* an empty entry means the process is gone already */
+	if (lowmem_buckets_ready && !list_empty(&leader->lowmem_entry))
+		list_move_tail(&leader->lowmem_entry,
+			       lowmem_bucket(leader->signal->oom_adj));
+	write_unlock_irq(&tasklist_lock);
+}
+
+static void lowmem_scan_done(ktime_t start)
+{
+	unsigned long us = ktime_us_delta(ktime_get(), start);
+
+	lowmem_scan_time_us += us;
+	if (us > lowmem_scan_time_max_us)
+		lowmem_scan_time_max_us = us;
+}
+
 static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
 	struct task_struct *p;
@@ -86,6 +155,8 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	int rem = 0;
 	int tasksize;
 	int i;
+	int adj;
+	ktime_t start;
 	int min_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
 	int selected_oom_adj;
@@ -102,8 +173,11 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	 *
 	 */
 	if (lowmem_deathpending &&
-	    time_before_eq(jiffies, lowmem_deathpending_timeout))
+	    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
+		if (sc->nr_to_scan > 0)
+			lowmem_skip_count++;
 		return 0;
+	}
 
 	if (lowmem_adj_size < array_size)
 		array_size = lowmem_adj_size;
@@ -130,41 +204,48 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		return rem;
 	}
 	selected_oom_adj = min_adj;
+	if (min_adj < OOM_DISABLE)
+		min_adj = OOM_DISABLE;
 
+	start = ktime_get();
+	lowmem_scan_count++;
 	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
+	/* the highest bucket with a candidate has the victim */
+	for (adj = OOM_ADJUST_MAX; adj >= min_adj && !selected; adj--) {
+		list_for_each_entry(p, lowmem_bucket(adj), lowmem_entry) {
+			struct mm_struct *mm;
+			struct signal_struct *sig;
+			int oom_adj;
+
+			task_lock(p);
+			mm = p->mm;
+			sig = p->signal;
+			if (!mm || !sig) {
+				task_unlock(p);
 				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
+			}
+			oom_adj = sig->oom_adj;
+			if (oom_adj < min_adj) {
+				task_unlock(p);
+				continue;
+			}
+			tasksize = get_mm_rss(mm);
+			task_unlock(p);
+			if (tasksize <= 0)
 				continue;
+			if (selected) {
+				if (oom_adj < selected_oom_adj)
+					continue;
+				if (oom_adj == selected_oom_adj &&
+				    tasksize <= selected_tasksize)
+					continue;
+			}
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_adj = oom_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     p->pid, p->comm, oom_adj, tasksize);
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
 	}
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
@@ -174,10 +255,12 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		lowmem_deathpending_timeout = jiffies + HZ;
 		force_sig(SIGKILL, selected);
 		rem -= selected_tasksize;
+		lowmem_kill_count++;
 	}
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
 		     sc->nr_to_scan, sc->gfp_mask, rem);
 	read_unlock(&tasklist_lock);
+	lowmem_scan_done(start);
 	return rem;
 }
 
@@ -188,6 +271,17 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	struct task_struct *p;
+	int i;
+
+	write_lock_irq(&tasklist_lock);
+	for (i = 0; i < LOWMEM_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_buckets[i]);
+	for_each_process(p)
+		list_add_tail(&p->lowmem_entry, lowmem_bucket(p->signal->oom_adj));
+	lowmem_buckets_ready = 1;
+	write_unlock_irq(&tasklist_lock);
+
 	task_free_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
 	return 0;
@@ -205,6 +299,11 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(scan_count, lowmem_scan_count, uint, S_IRUGO);
+module_param_named(scan_skip_count, lowmem_skip_count, uint, S_IRUGO);
+module_param_named(scan_time_us, lowmem_scan_time_us, ulong, S_IRUGO);
+module_param_named(scan_time_max_us, lowmem_scan_time_max_us, uint, S_IRUGO);
+module_param_named(kill_count, lowmem_kill_count, uint, S_IRUGO);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
@@ -0,0 +1,199 @@
+/*
+ * Compressed RAM block device
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com/
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/lzo.h>
+#include <linux/vmalloc.h>
+#include <linux/zlib.h>
+
+#include "zram_drv.h"
+
+static void *lzo_create(void)
+{
+	return kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
+}
+
+static void lzo_destroy(void *private)
+{
+	kfree(private);
+}
+
+static int lzo_compress(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *private)
+{
+	return lzo1x_1_compress(src, PAGE_SIZE, dst, dst_len, private);
+}
+
+static int lzo_decompress(const unsigned char *src, size_t src_len,
+			unsigned char *dst, void *private)
+{
+	size_t dst_len = PAGE_SIZE;
+
+	return lzo1x_decompress_safe(src, src_len, dst, &dst_len);
+}
+
+static struct zram_backend zram_lzo = {
+	.name = "lzo",
+	.create = lzo_create,
+	.destroy = lzo_destroy,
+	.compress = lzo_compress,
+	.decompress = lzo_decompress,
+};
+
+#ifdef CONFIG_ZRAM_DEFLATE
+/*
+ * Raw deflate with a window that covers one page and a memory level
+ * that keeps the workspace of each stream near 128K.
+ */
+#define DEFLATE_WINBITS		12
+#define DEFLATE_MEMLEVEL	8
+
+struct deflate_private {
+	struct z_stream_s comp;
+	struct z_stream_s decomp;
+};
+
+static void deflate_destroy(void *private)
+{
+	struct deflate_private *dp = private;
+
+	if (dp->comp.workspace) {
+		zlib_deflateEnd(&dp->comp);
+		vfree(dp->comp.workspace);
+	}
+	if (dp->decomp.workspace) {
+		zlib_inflateEnd(&dp->decomp);
+		vfree(dp->decomp.workspace);
+	}
+	kfree(dp);
+}
+
+static void *deflate_create(void)
+{
+	struct deflate_private *dp;
+
+	dp = kzalloc(sizeof(*dp), GFP_KERNEL);
+	if (!dp)
+		return NULL;
+
+	dp->comp.workspace = vzalloc(zlib_deflate_workspacesize(
+				-DEFLATE_WINBITS, DEFLATE_MEMLEVEL));
+	if (!dp->comp.workspace)
+		goto fail;
+	if (zlib_deflateInit2(&dp->comp, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+			-DEFLATE_WINBITS, DEFLATE_MEMLEVEL,
+			Z_DEFAULT_STRATEGY) != Z_OK) {
+		vfree(dp->comp.workspace);
+		dp->comp.workspace = NULL;
+		goto fail;
+	}
+
+	dp->decomp.workspace = vzalloc(zlib_inflate_workspacesize());
+	if (!dp->decomp.workspace)
+		goto fail;
+	if (zlib_inflateInit2(&dp->decomp, -DEFLATE_WINBITS) != Z_OK) {
+		vfree(dp->decomp.workspace);
+		dp->decomp.workspace = NULL;
+		goto fail;
+	}
+
+	return dp;
+
+fail:
+	deflate_destroy(dp);
+	return NULL;
+}
+
+static int deflate_compress(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *private)
+{
+	struct deflate_private *dp = private;
+	struct z_stream_s *stream = &dp->comp;
+
+	if (zlib_deflateReset(stream) != Z_OK)
+		return -EINVAL;
+
+	stream->next_in = src;
+	stream->avail_in = PAGE_SIZE;
+	stream->next_out = dst;
+	stream->avail_out = *dst_len;
+
+	if (zlib_deflate(stream, Z_FINISH) != Z_STREAM_END)
+		return -EINVAL;
+
+	*dst_len = stream->total_out;
+	return 0;
+}
+
+static int deflate_decompress(const unsigned char *src, size_t src_len,
+			unsigned char *dst, void *private)
+{
+	struct deflate_private *dp = private;
+	struct z_stream_s *stream = &dp->decomp;
+	int ret;
+
+	if (zlib_inflateReset(stream) != Z_OK)
+		return -EINVAL;
+
+	stream->next_in = src;
+	stream->avail_in = src_len;
+	stream->next_out = dst;
+	stream->avail_out = PAGE_SIZE;
+
+	ret = zlib_inflate(stream, Z_SYNC_FLUSH);
+	/* Raw inflate may want one more byte to see the end, as in crypto */
+	if (ret == Z_OK && !stream->avail_in && stream->avail_out) {
+		u8 zerostuff = 0;
+
+		stream->next_in = &zerostuff;
+		stream->avail_in = 1;
+		ret = zlib_inflate(stream, Z_FINISH);
+	}
+	if (ret != Z_STREAM_END || stream->total_out != PAGE_SIZE)
+		return -EINVAL;
+
+	return 0;
+}
+
+static struct zram_backend zram_deflate = {
+	.name = "deflate",
+	.decompress_private = 1,
+	.create = deflate_create,
+	.destroy = deflate_destroy,
+	.compress = deflate_compress,
+	.decompress = deflate_decompress,
+};
+#endif
+
+/* The first one is the default */
+struct zram_backend *zram_backends[] = {
+	&zram_lzo,
+#ifdef CONFIG_ZRAM_DEFLATE
+	&zram_deflate,
+#endif
+	NULL,
+};
+
+struct zram_backend *zram_find_backend(const char *name)
+{
+	int i;
+
+	for (i = 0; zram_backends[i]; i++)
+		if (sysfs_streq(name, zram_backends[i]->name))
+			return zram_backends[i];
+
+	return NULL;
+}
@@ -25,11 +25,14 @@
 #include <linux/bitops.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/completion.h>
 #include <linux/device.h>
+#include <linux/fs.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
+#include <linux/jhash.h>
+#include <linux/ktime.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
 
@@ -89,21 +92,82 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+static void zram_stat_compress(struct zram *zram, size_t clen, s64 ns)
+{
+	spin_lock(&zram->stat64_lock);
+	zram->stats.num_compress++;
+	zram->stats.compress_size += clen;
+	zram->stats.compress_time += ns;
+	spin_unlock(&zram->stat64_lock);
+}
+
+static void zram_stat_decompress(struct zram *zram, s64 ns)
+{
+	spin_lock(&zram->stat64_lock);
+	zram->stats.num_decompress++;
+	zram->stats.decompress_time += ns;
+	spin_unlock(&zram->stat64_lock);
+}
+
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
 	return 1;
 }
 
+/*
+ * Gives back the blocks freed while reads were in flight, once none are.
+ * Caller must hold zram->table_lock for writing.
+ */
+static void zram_release_stale_blocks(struct zram *zram)
+{
+	unsigned long blk;
+
+	if (!zram->bd_nr_stale || atomic_read(&zram->bd_inflight))
+		return;
+
+	for_each_set_bit(blk, zram->bd_stale, zram->bd_nr_blocks) {
+		clear_bit(blk, zram->bd_stale);
+		clear_bit(blk, zram->bd_bitmap);
+	}
+	zram->bd_nr_stale = 0;
+}
+
+static unsigned long zram_alloc_block(struct zram *zram)
+{
+	unsigned long blk;
+
+	if (zram->bd_nr_stale) {
+		write_lock(&zram->table_lock);
+		zram_release_stale_blocks(zram);
+		write_unlock(&zram->table_lock);
+	}
+
+	do {
+		blk = find_next_zero_bit(zram->bd_bitmap,
+					zram->bd_nr_blocks, 1);
+		if (blk >= zram->bd_nr_blocks)
+			return 0;
+	} while (test_and_set_bit(blk, zram->bd_bitmap));
+
+	return blk;
+}
+
+static void zram_free_block(struct zram *zram, unsigned long blk)
+{
+	clear_bit(blk, zram->bd_bitmap);
+}
+
 static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 {
 	if (!zram->disksize) {
@@ -133,39 +197,79 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+/*
+ * Caller must hold zram->table_lock for writing.
+ */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
 
-	if (unlikely(!page)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
+	/* No memory is allocated for same filled pages. */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		if (!zram->table[index].element)
 			zram_stat_dec(&zram->stats.pages_zero);
+		zram_stat_dec(&zram->stats.pages_same);
+		zram->table[index].element = 0;
+		return;
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		unsigned long blk = zram->table[index].element;
+
+		zram_clear_flag(zram, index, ZRAM_WB);
+		/* A read started before this one may still be on the block */
+		if (atomic_read(&zram->bd_inflight)) {
+			set_bit(blk, zram->bd_stale);
+			zram->bd_nr_stale++;
+		} else {
+			zram_free_block(zram, blk);
 		}
+		zram_stat_dec(&zram->stats.bd_count);
+		zram->table[index].element = 0;
 		return;
 	}
 
+	if (unlikely(!zram->table[index].handle))
+		return;
+
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page(zram->table[index].page);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
+	if (zram_test_flag(zram, index, ZRAM_DEDUP)) {
+		struct zram_dedup *dedup = zram->table[index].dedup;
 
-	xv_free(zram->mem_pool, page, offset);
+		zram_clear_flag(zram, index, ZRAM_DEDUP);
+		clen = dedup->clen;
+		if (clen <= PAGE_SIZE / 2)
+			zram_stat_dec(&zram->stats.good_compress);
+
+		/* Others still use the object */
+		if (--dedup->refcount) {
+			zram_stat_dec(&zram->stats.pages_dedup);
+			zram_stat_dec(&zram->stats.pages_stored);
+			zram->table[index].handle = 0;
+			zram->table[index].size = 0;
+			return;
+		}
+
+		if (!RB_EMPTY_NODE(&dedup->node))
+			rb_erase(&dedup->node, &zram->dedup_root);
+		zs_free(zram->mem_pool, dedup->handle);
+		kfree(dedup);
+		goto out;
+	}
+
+	clen = zram->table[index].size;
+	zs_free(zram->mem_pool, zram->table[index].handle);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
@@ -173,16 +277,24 @@ out:
 	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
 }
 
-static void handle_zero_page(struct page *page)
+static void handle_same_page(struct page *page, unsigned long element)
 {
 	void *user_mem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	memset(user_mem, 0, PAGE_SIZE);
+	if (!element) {
+		memset(user_mem, 0, PAGE_SIZE);
+	} else {
+		unsigned long *p = user_mem;
+		unsigned int pos;
+
+		for (pos = 0; pos != PAGE_SIZE / sizeof(*p); pos++)
+			p[pos] = element;
+	}
 	kunmap_atomic(user_mem, KM_USER0);
 
 	flush_dcache_page(page);
@@ -194,8 +306,7 @@ static void handle_uncompressed_page(struct zram *zram,
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
+	cmem = kmap_atomic(zram->table[index].page, KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
@@ -204,71 +315,399 @@ static void handle_uncompressed_page(struct zram *zram,
 	flush_dcache_page(page);
 }
 
+static struct zram_stream *zram_stream_get(struct zram *zram)
+{
+	struct zram_stream *zstrm;
+
+	spin_lock(&zram->stream_lock);
+	while (list_empty(&zram->stream_idle)) {
+		spin_unlock(&zram->stream_lock);
+		wait_event(zram->stream_wait,
+			!list_empty(&zram->stream_idle));
+		spin_lock(&zram->stream_lock);
+	}
+	zstrm = list_first_entry(&zram->stream_idle, struct zram_stream, list);
+	list_del(&zstrm->list);
+	spin_unlock(&zram->stream_lock);
+
+	return zstrm;
+}
+
+static void zram_stream_put(struct zram *zram, struct zram_stream *zstrm)
+{
+	spin_lock(&zram->stream_lock);
+	list_add(&zstrm->list, &zram->stream_idle);
+	spin_unlock(&zram->stream_lock);
+
+	/* pairs with the barrier in wait_event() */
+	smp_mb();
+	if (waitqueue_active(&zram->stream_wait))
+		wake_up(&zram->stream_wait);
+}
+
+static void zram_destroy_streams(struct zram *zram)
+{
+	struct zram_stream *zstrm, *tmp;
+
+	list_for_each_entry_safe(zstrm, tmp, &zram->stream_idle, list) {
+		list_del(&zstrm->list);
+		zram->backend->destroy(zstrm->private);
+		free_pages((unsigned long)zstrm->buffer,
+			get_order(ZRAM_STREAM_BUFFER_SIZE));
+		kfree(zstrm);
+	}
+	zram->num_streams = 0;
+}
+
+static int zram_create_streams(struct zram *zram)
+{
+	int i;
+
+	for (i = 0; i < num_online_cpus(); i++) {
+		struct zram_stream *zstrm;
+
+		zstrm = kzalloc(sizeof(*zstrm), GFP_KERNEL);
+		if (!zstrm)
+			break;
+
+		zstrm->private = zram->backend->create();
+		/* compressed output can be a bit larger than the page */
+		zstrm->buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO,
+					get_order(ZRAM_STREAM_BUFFER_SIZE));
+		if (!zstrm->private || !zstrm->buffer) {
+			if (zstrm->private)
+				zram->backend->destroy(zstrm->private);
+			free_pages((unsigned long)zstrm->buffer,
+				get_order(ZRAM_STREAM_BUFFER_SIZE));
+			kfree(zstrm);
+			break;
+		}
+
+		list_add(&zstrm->list, &zram->stream_idle);
+		zram->num_streams++;
+	}
+
+	/* Fewer streams than CPUs only limits parallelism */
+	return zram->num_streams ? 0 : -ENOMEM;
+}
+
+/*
+ * Returns the shared object holding 'clen' bytes of compressed data 'src'
+ * with checksum 'checksum', if there is one.
+ *
+ * Caller must hold zram->table_lock.
+ */
+static struct zram_dedup *zram_dedup_find(struct zram *zram, u32 checksum,
+				const unsigned char *src, size_t clen)
+{
+	struct rb_node *n = zram->dedup_root.rb_node;
+
+	while (n) {
+		struct zram_dedup *dedup;
+		unsigned char *cmem;
+		int match;
+
+		dedup = rb_entry(n, struct zram_dedup, node);
+		if (checksum < dedup->checksum) {
+			n = n->rb_left;
+			continue;
+		}
+		if (checksum > dedup->checksum) {
+			n = n->rb_right;
+			continue;
+		}
+
+		if (dedup->clen != clen)
+			return NULL;
+
+		cmem = zs_map_object(zram->mem_pool, dedup->handle, ZS_MM_RO);
+		match = !memcmp(cmem + sizeof(struct zobj_header), src, clen);
+		zs_unmap_object(zram->mem_pool, dedup->handle);
+
+		return match ? dedup : NULL;
+	}
+
+	return NULL;
+}
+
+/*
+ * Makes 'new' findable, unless another object has the same checksum.
+ *
+ * Caller must hold zram->table_lock for writing.
+ */
+static void zram_dedup_insert(struct zram *zram, struct zram_dedup *new)
+{
+	struct rb_node **p = &zram->dedup_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct zram_dedup *dedup;
+
+	while (*p) {
+		parent = *p;
+		dedup = rb_entry(parent, struct zram_dedup, node);
+
+		if (new->checksum < dedup->checksum) {
+			p = &(*p)->rb_left;
+		} else if (new->checksum > dedup->checksum) {
+			p = &(*p)->rb_right;
+		} else {
+			RB_CLEAR_NODE(&new->node);
+			return;
+		}
+	}
+
+	rb_link_node(&new->node, parent, p);
+	rb_insert_color(&new->node, &zram->dedup_root);
+}
+
+/*
+ * Decompresses the page stored at 'index' into 'page'. 'zstrm' is only
+ * needed by backends that decompress with the stream private.
+ *
+ * Caller must hold zram->table_lock.
+ */
+static int zram_decompress_page(struct zram *zram, struct zram_stream *zstrm,
+				struct page *page, u32 index)
+{
+	int ret;
+	ktime_t start;
+	unsigned long handle;
+	unsigned char *user_mem, *cmem;
+
+	/* Page is stored uncompressed since it's incompressible */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		handle_uncompressed_page(zram, page, index);
+		return 0;
+	}
+
+	if (zram_test_flag(zram, index, ZRAM_DEDUP))
+		handle = zram->table[index].dedup->handle;
+	else
+		handle = zram->table[index].handle;
+
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+	user_mem = kmap_atomic(page, KM_USER0);
+
+	start = ktime_get();
+	ret = zram->backend->decompress(
+		cmem + sizeof(struct zobj_header), zram->table[index].size,
+		user_mem, zstrm ? zstrm->private : NULL);
+
+	kunmap_atomic(user_mem, KM_USER0);
+	zs_unmap_object(zram->mem_pool, handle);
+
+	/* Should NEVER happen */
+	if (unlikely(ret)) {
+		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
+		return ret;
+	}
+
+	zram_stat_decompress(zram, ktime_to_ns(ktime_sub(ktime_get(), start)));
+	flush_dcache_page(page);
+
+	return 0;
+}
+
+/*
+ * A read bio some of whose pages are on the backing device. It completes
+ * when the last of the backing device reads does.
+ */
+struct zram_bd_read {
+	struct zram *zram;
+	struct bio *parent;
+	atomic_t pending;	/* backing device bios, plus one until submitted */
+	int error;
+};
+
+static void zram_bd_read_put(struct zram_bd_read *rd)
+{
+	if (!atomic_dec_and_test(&rd->pending))
+		return;
+
+	if (rd->error) {
+		bio_io_error(rd->parent);
+	} else {
+		set_bit(BIO_UPTODATE, &rd->parent->bi_flags);
+		bio_endio(rd->parent, 0);
+	}
+	kfree(rd);
+}
+
+static void zram_bd_read_end_io(struct bio *bio, int err)
+{
+	struct zram_bd_read *rd = bio->bi_private;
+
+	if (err)
+		rd->error = err;
+	bio_put(bio);
+	atomic_dec(&rd->zram->bd_inflight);
+	zram_bd_read_put(rd);
+}
+
+/*
+ * Starts reading 'bvec' of 'parent' from block 'blk' of the backing
+ * device. The first call sets up '*rdp', which then owns completing
+ * 'parent'. The caller counts the read in zram->bd_inflight while it
+ * still holds table_lock, so 'blk' is not reused; it is uncounted when
+ * the read ends or fails to start.
+ */
+static int zram_bd_read(struct zram *zram, struct zram_bd_read **rdp,
+			struct bio *parent, struct bio_vec *bvec,
+			unsigned long blk)
+{
+	struct bio *bio;
+	struct zram_bd_read *rd = *rdp;
+
+	if (!rd) {
+		rd = kmalloc(sizeof(*rd), GFP_NOIO);
+		if (!rd)
+			goto fail;
+		rd->zram = zram;
+		rd->parent = parent;
+		atomic_set(&rd->pending, 1);
+		rd->error = 0;
+		*rdp = rd;
+	}
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		goto fail;
+
+	bio->bi_bdev = zram->backing_dev;
+	bio->bi_sector = blk << SECTORS_PER_PAGE_SHIFT;
+	if (!bio_add_page(bio, bvec->bv_page, bvec->bv_len,
+			bvec->bv_offset)) {
+		bio_put(bio);
+		atomic_dec(&zram->bd_inflight);
+		return -EIO;
+	}
+	bio->bi_end_io = zram_bd_read_end_io;
+	bio->bi_private = rd;
+
+	atomic_inc(&rd->pending);
+	submit_bio(READ, bio);
+	zram_stat64_inc(zram, &zram->stats.bd_reads);
+
+	return 0;
+
+fail:
+	atomic_dec(&zram->bd_inflight);
+	return -ENOMEM;
+}
+
+static void zram_bd_write_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/* Writes 'page' to block 'blk' of the backing device and waits for it */
+static int zram_bd_write(struct zram *zram, struct page *page,
+			unsigned long blk)
+{
+	int ret;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	bio = bio_alloc(GFP_KERNEL, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->backing_dev;
+	bio->bi_sector = blk << SECTORS_PER_PAGE_SHIFT;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+	bio->bi_end_io = zram_bd_write_end_io;
+	bio->bi_private = &done;
+
+	submit_bio(WRITE, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
 static void zram_read(struct zram *zram, struct bio *bio)
 {
 
 	int i;
 	u32 index;
 	struct bio_vec *bvec;
+	struct zram_bd_read *rd = NULL;
 
 	zram_stat64_inc(zram, &zram->stats.num_reads);
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
-		size_t clen;
 		struct page *page;
-		struct zobj_header *zheader;
-		unsigned char *user_mem, *cmem;
+		struct zram_stream *zstrm = NULL;
 
 		page = bvec->bv_page;
 
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			handle_zero_page(page);
-			index++;
-			continue;
-		}
+		if (zram->backend->decompress_private)
+			zstrm = zram_stream_get(zram);
 
-		/* Requested page is not present in compressed area */
-		if (unlikely(!zram->table[index].page)) {
-			pr_debug("Read before write: sector=%lu, size=%u",
-				(ulong)(bio->bi_sector), bio->bi_size);
-			handle_zero_page(page);
-			index++;
-			continue;
-		}
+		read_lock(&zram->table_lock);
 
-		/* Page is stored uncompressed since it's incompressible */
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-			handle_uncompressed_page(zram, page, index);
-			index++;
-			continue;
-		}
+		/* Readers only ever clear this bit, so the read lock is enough */
+		zram_clear_flag(zram, index, ZRAM_IDLE);
 
-		user_mem = kmap_atomic(page, KM_USER0);
-		clen = PAGE_SIZE;
+		if (zram_test_flag(zram, index, ZRAM_SAME)) {
+			unsigned long element = zram->table[index].element;
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+			read_unlock(&zram->table_lock);
+			handle_same_page(page, element);
+			goto next;
+		}
 
-		ret = lzo1x_decompress_safe(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
+		if (zram_test_flag(zram, index, ZRAM_WB)) {
+			unsigned long blk = zram->table[index].element;
 
-		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
+			atomic_inc(&zram->bd_inflight);
+			read_unlock(&zram->table_lock);
+			ret = zram_bd_read(zram, &rd, bio, bvec, blk);
+			if (unlikely(ret)) {
+				pr_err("Backing device read failed! err=%d, "
+					"page=%u\n", ret, index);
+				goto fail;
+			}
+			goto next;
+		}
 
-		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
-			pr_err("Decompression failed! err=%d, page=%u\n",
-				ret, index);
-			zram_stat64_inc(zram, &zram->stats.failed_reads);
-			goto out;
+		/* Requested page is not present in compressed area */
+		if (unlikely(!zram->table[index].handle)) {
+			read_unlock(&zram->table_lock);
+			pr_debug("Read before write: sector=%lu, size=%u",
+				(ulong)(bio->bi_sector), bio->bi_size);
+			handle_same_page(page, 0);
+			goto next;
 		}
 
-		flush_dcache_page(page);
+		ret = zram_decompress_page(zram, zstrm, page, index);
+		read_unlock(&zram->table_lock);
+
+		/* Return bio error if decompression failed */
+		if (unlikely(ret))
+			goto fail;
+next:
+		if (zstrm)
+			zram_stream_put(zram, zstrm);
 		index++;
+		continue;
+fail:
+		if (zstrm)
+			zram_stream_put(zram, zstrm);
+		zram_stat64_inc(zram, &zram->stats.failed_reads);
+		goto out;
+	}
+
+	/* Pages on the backing device complete the bio when they are read */
+	if (rd) {
+		zram_bd_read_put(rd);
+		return;
 	}
 
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
@@ -276,6 +715,11 @@ static void zram_read(struct zram *zram, struct bio *bio)
 	return;
 
 out:
+	if (rd) {
+		rd->error = -EIO;
+		zram_bd_read_put(rd);
+		return;
+	}
 	bio_io_error(bio);
 }
 
@@ -290,57 +734,72 @@ static void zram_write(struct zram *zram, struct bio *bio)
 
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
-		u32 offset;
+		u32 checksum = 0;
 		size_t clen;
+		ktime_t start;
+		unsigned long element;
+		unsigned long handle = 0;
 		struct zobj_header *zheader;
-		struct page *page, *page_store;
+		struct zram_stream *zstrm;
+		struct zram_dedup *dedup = NULL;
+		struct page *page, *page_store = NULL;
 		unsigned char *user_mem, *cmem, *src;
 
 		page = bvec->bv_page;
-		src = zram->compress_buffer;
 
-		/*
-		 * System overwrites unused sectors. Free memory associated
-		 * with this sector now.
-		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
-			zram_free_page(zram, index);
-
-		mutex_lock(&zram->lock);
+		/* Getting a stream may sleep, do it before kmap_atomic() */
+		zstrm = zram_stream_get(zram);
 
 		user_mem = kmap_atomic(page, KM_USER0);
-		if (page_zero_filled(user_mem)) {
+		if (page_same_filled(user_mem, &element)) {
 			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
-			zram_stat_inc(&zram->stats.pages_zero);
-			zram_set_flag(zram, index, ZRAM_ZERO);
+			zram_stream_put(zram, zstrm);
+			/*
+			 * System overwrites unused sectors. Free memory
+			 * associated with this sector now.
+			 */
+			write_lock(&zram->table_lock);
+			zram_free_page(zram, index);
+			if (!element)
+				zram_stat_inc(&zram->stats.pages_zero);
+			zram_stat_inc(&zram->stats.pages_same);
+			zram_set_flag(zram, index, ZRAM_SAME);
+			zram->table[index].element = element;
+			write_unlock(&zram->table_lock);
 			index++;
 			continue;
 		}
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+		src = zstrm->buffer;
+
+		clen = ZRAM_STREAM_BUFFER_SIZE;
+		start = ktime_get();
+		ret = zram->backend->compress(user_mem, src, &clen,
+					zstrm->private);
 
 		kunmap_atomic(user_mem, KM_USER0);
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
+		if (unlikely(ret)) {
+			zram_stream_put(zram, zstrm);
 			pr_err("Compression failed! err=%d\n", ret);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
 		}
 
+		zram_stat_compress(zram, clen,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
+
 		/*
 		 * Page is incompressible. Store it as-is (uncompressed)
 		 * since we do not want to return too many disk write
 		 * errors which has side effect of hanging the system.
 		 */
 		if (unlikely(clen > max_zpage_size)) {
+			zram_stream_put(zram, zstrm);
+
 			clen = PAGE_SIZE;
 			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
 				pr_info("Error allocating memory for "
 					"incompressible page: %u\n", index);
 				zram_stat64_inc(zram,
@@ -348,52 +807,100 @@ static void zram_write(struct zram *zram, struct bio *bio)
 				goto out;
 			}
 
-			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
 			src = kmap_atomic(page, KM_USER0);
+			cmem = kmap_atomic(page_store, KM_USER1);
+			memcpy(cmem, src, PAGE_SIZE);
+			kunmap_atomic(cmem, KM_USER1);
+			kunmap_atomic(src, KM_USER0);
 			goto memstore;
 		}
 
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
+		if (zram->dedup) {
+			checksum = jhash(src, clen, 0);
+
+			write_lock(&zram->table_lock);
+			dedup = zram_dedup_find(zram, checksum, src, clen);
+			if (dedup) {
+				/* Take the reference before dropping ours */
+				dedup->refcount++;
+				zram_free_page(zram, index);
+				zram_set_flag(zram, index, ZRAM_DEDUP);
+				zram->table[index].dedup = dedup;
+				zram->table[index].size = clen;
+
+				zram_stat_inc(&zram->stats.pages_stored);
+				zram_stat_inc(&zram->stats.pages_dedup);
+				if (clen <= PAGE_SIZE / 2)
+					zram_stat_inc(&zram->stats.good_compress);
+				write_unlock(&zram->table_lock);
+
+				zram_stream_put(zram, zstrm);
+				index++;
+				continue;
+			}
+			write_unlock(&zram->table_lock);
+
+			/* Without it the page is just not shareable */
+			dedup = kmalloc(sizeof(*dedup), GFP_NOIO);
+		}
+
+		handle = zs_malloc(zram->mem_pool, clen + sizeof(*zheader));
+		if (!handle) {
+			zram_stream_put(zram, zstrm);
+			kfree(dedup);
 			pr_info("Error allocating memory for compressed "
 				"page: %u, size=%zu\n", index, clen);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
 		}
 
-memstore:
-		zram->table[index].offset = offset;
-
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
 
 #if 0
 		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
-			cmem += sizeof(*zheader);
-		}
+		zheader = (struct zobj_header *)cmem;
+		zheader->table_idx = index;
+		cmem += sizeof(*zheader);
 #endif
 
 		memcpy(cmem, src, clen);
 
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			kunmap_atomic(src, KM_USER0);
+		zs_unmap_object(zram->mem_pool, handle);
+		zram_stream_put(zram, zstrm);
+
+memstore:
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now, and put the new object in its place.
+		 */
+		write_lock(&zram->table_lock);
+		zram_free_page(zram, index);
+
+		if (unlikely(page_store)) {
+			zram->table[index].page = page_store;
+			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+			zram_stat_inc(&zram->stats.pages_expand);
+		} else if (dedup) {
+			dedup->handle = handle;
+			dedup->clen = clen;
+			dedup->checksum = checksum;
+			dedup->refcount = 1;
+			zram_dedup_insert(zram, dedup);
+			zram_set_flag(zram, index, ZRAM_DEDUP);
+			zram->table[index].dedup = dedup;
+			zram->table[index].size = clen;
+		} else {
+			zram->table[index].handle = handle;
+			zram->table[index].size = clen;
+		}
 
 		/* Update stats */
 		zram_stat64_add(zram, &zram->stats.compr_size, clen);
 		zram_stat_inc(&zram->stats.pages_stored);
 		if (clen <= PAGE_SIZE / 2)
 			zram_stat_inc(&zram->stats.good_compress);
+		write_unlock(&zram->table_lock);
 
-		mutex_unlock(&zram->lock);
 		index++;
 	}
 
@@ -453,41 +960,205 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	return 0;
 }
 
-void zram_reset_device(struct zram *zram)
+static void zram_release_backing_dev(struct zram *zram)
+{
+	if (!zram->backing_dev)
+		return;
+
+	blkdev_put(zram->backing_dev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	vfree(zram->bd_bitmap);
+	zram->backing_dev = NULL;
+	zram->bd_bitmap = NULL;
+	zram->bd_stale = NULL;
+	zram->bd_nr_stale = 0;
+	zram->bd_nr_blocks = 0;
+}
+
+/*
+ * Caller must hold zram->init_lock, and the device must not be
+ * initialized yet.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	unsigned long nr_blocks, *bitmap;
+	struct block_device *bdev;
+
+	bdev = blkdev_get_by_path(path, FMODE_READ | FMODE_WRITE | FMODE_EXCL,
+				zram);
+	if (IS_ERR(bdev))
+		return PTR_ERR(bdev);
+
+	nr_blocks = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	bitmap = NULL;
+	/* The blocks in use, then the stale ones */
+	if (nr_blocks > 1)
+		bitmap = vzalloc(2 * BITS_TO_LONGS(nr_blocks) * sizeof(long));
+	if (!bitmap) {
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+		return nr_blocks > 1 ? -ENOMEM : -EINVAL;
+	}
+
+	zram_release_backing_dev(zram);
+	zram->backing_dev = bdev;
+	zram->bd_bitmap = bitmap;
+	zram->bd_stale = bitmap + BITS_TO_LONGS(nr_blocks);
+	zram->bd_nr_blocks = nr_blocks;
+
+	return 0;
+}
+
+/*
+ * Marks every page held in memory idle. A page stays idle until it is
+ * read or written again.
+ *
+ * Caller must hold zram->init_lock.
+ */
+void zram_mark_idle(struct zram *zram)
 {
 	size_t index;
 
-	mutex_lock(&zram->init_lock);
-	zram->init_done = 0;
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		write_lock(&zram->table_lock);
+		if (zram->table[index].handle &&
+		    !zram_test_flag(zram, index, ZRAM_SAME) &&
+		    !zram_test_flag(zram, index, ZRAM_WB))
+			zram_set_flag(zram, index, ZRAM_IDLE);
+		write_unlock(&zram->table_lock);
+	}
+}
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
+/*
+ * Pages written back are the ones held in memory that are idle, or if
+ * 'huge' is set, stored uncompressed. Pages sharing an object are left
+ * alone, writing one back would not free its memory.
+ *
+ * Caller must hold zram->table_lock.
+ */
+static int zram_wb_candidate(struct zram *zram, size_t index, int huge)
+{
+	if (!zram->table[index].handle ||
+	    zram_test_flag(zram, index, ZRAM_SAME) ||
+	    zram_test_flag(zram, index, ZRAM_WB) ||
+	    zram_test_flag(zram, index, ZRAM_DEDUP))
+		return 0;
 
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	if (huge)
+		return zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+
+	return zram_test_flag(zram, index, ZRAM_IDLE);
+}
+
+/*
+ * Moves pages from memory to the backing device, one page at a time.
+ * A page that is freed or rewritten while it is being copied keeps its
+ * new contents and the copy is dropped.
+ *
+ * Caller must hold zram->init_lock.
+ */
+int zram_writeback(struct zram *zram, int huge)
+{
+	int ret = 0;
+	size_t index;
+	unsigned long blk = 0;
+	struct page *page;
+
+	if (!zram->backing_dev)
+		return -ENODEV;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
 
-	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
+		struct zram_stream *zstrm = NULL;
 
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
+		if (!blk) {
+			blk = zram_alloc_block(zram);
+			if (!blk) {
+				ret = -ENOSPC;
+				break;
+			}
+		}
 
-		if (!page)
+		write_lock(&zram->table_lock);
+		if (!zram_wb_candidate(zram, index, huge)) {
+			write_unlock(&zram->table_lock);
 			continue;
+		}
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+		write_unlock(&zram->table_lock);
+
+		if (zram->backend->decompress_private)
+			zstrm = zram_stream_get(zram);
 
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
+		read_lock(&zram->table_lock);
+		if (zram_test_flag(zram, index, ZRAM_UNDER_WB))
+			ret = zram_decompress_page(zram, zstrm, page, index);
 		else
-			xv_free(zram->mem_pool, page, offset);
+			ret = -EAGAIN;
+		read_unlock(&zram->table_lock);
+
+		if (zstrm)
+			zram_stream_put(zram, zstrm);
+
+		if (!ret)
+			ret = zram_bd_write(zram, page, blk);
+
+		write_lock(&zram->table_lock);
+		if (ret || !zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+			zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+			write_unlock(&zram->table_lock);
+			if (ret == -EAGAIN)
+				ret = 0;
+			if (ret)
+				break;
+			continue;
+		}
+
+		/* Still the page we copied, drop it from memory */
+		zram_free_page(zram, index);
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram->table[index].element = blk;
+		zram_stat_inc(&zram->stats.bd_count);
+		write_unlock(&zram->table_lock);
+
+		zram_stat64_inc(zram, &zram->stats.bd_writes);
+		blk = 0;
+		cond_resched();
 	}
 
+	if (blk)
+		zram_free_block(zram, blk);
+	__free_page(page);
+
+	return ret;
+}
+
+void zram_reset_device(struct zram *zram)
+{
+	size_t index;
+
+	mutex_lock(&zram->init_lock);
+	zram->init_done = 0;
+
+	/* Free various per-device buffers */
+	zram_destroy_streams(zram);
+
+	/*
+	 * Free all pages that are still in this zram device. No I/O is in
+	 * flight, so table_lock is not needed.
+	 */
+	if (zram->table)
+		for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++)
+			zram_free_page(zram, index);
+	zram->dedup_root = RB_ROOT;
+
+	zram_release_backing_dev(zram);
+
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -511,17 +1182,12 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
+	if (!zram->backend)
+		zram->backend = zram_backends[0];
 
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = zram_create_streams(zram);
+	if (ret) {
+		pr_err("Error allocating compression streams\n");
 		goto fail;
 	}
 
@@ -540,7 +1206,7 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool(GFP_NOIO | __GFP_HIGHMEM);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -566,10 +1232,44 @@ void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	write_lock(&zram->table_lock);
 	zram_free_page(zram, index);
+	write_unlock(&zram->table_lock);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
+/*
+ * Compacts the pools of all devices under memory pressure. Returns the
+ * number of pages compaction could still free.
+ */
+static int zram_shrink(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	unsigned long pages = 0;
+	int i;
+
+	for (i = 0; i < num_devices; i++) {
+		struct zram *zram = &devices[i];
+
+		/* Being set up or reset, or we got here from doing so */
+		if (!mutex_trylock(&zram->init_lock))
+			continue;
+
+		if (zram->init_done) {
+			if (sc->nr_to_scan)
+				zs_compact(zram->mem_pool);
+			pages += zs_get_compactable_pages(zram->mem_pool);
+		}
+		mutex_unlock(&zram->init_lock);
+	}
+
+	return min_t(unsigned long, pages, INT_MAX);
+}
+
+static struct shrinker zram_shrinker = {
+	.shrink = zram_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
 static const struct block_device_operations zram_devops = {
 	.swap_slot_free_notify = zram_slot_free_notify,
 	.owner = THIS_MODULE
@@ -579,9 +1279,15 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	mutex_init(&zram->lock);
 	mutex_init(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	rwlock_init(&zram->table_lock);
+	atomic_set(&zram->bd_inflight, 0);
+	zram->dedup_root = RB_ROOT;
+	zram->backend = zram_backends[0];
+	INIT_LIST_HEAD(&zram->stream_idle);
+	spin_lock_init(&zram->stream_lock);
+	init_waitqueue_head(&zram->stream_wait);
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -690,6 +1396,8 @@ static int __init zram_init(void)
 			goto free_devices;
 	}
 
+	register_shrinker(&zram_shrinker);
+
 	return 0;
 
 free_devices:
@@ -707,6 +1415,8 @@ static void __exit zram_exit(void)
 	int i;
 	struct zram *zram;
 
+	unregister_shrinker(&zram_shrinker);
+
 	for (i = 0; i < num_devices; i++) {
 		zram = &devices[i];
 
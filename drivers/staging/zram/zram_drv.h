@@ -17,8 +17,10 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/wait.h>
 
-#include "xvmalloc.h"
+#include "zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -51,8 +53,8 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - sizeof(unsigned long) - sizeof(struct zobj_header)
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -68,18 +70,47 @@ enum zram_pageflags {
 	/* Page is stored uncompressed */
 	ZRAM_UNCOMPRESSED,
 
-	/* Page consists entirely of zeros */
-	ZRAM_ZERO,
+	/* Page is one word repeated, kept in table[page_no].element */
+	ZRAM_SAME,
+
+	/* Page shares a compressed object, table[page_no].dedup */
+	ZRAM_DEDUP,
+
+	/* Page is on the backing device, in block table[page_no].element */
+	ZRAM_WB,
+
+	/* Page is being copied to the backing device */
+	ZRAM_UNDER_WB,
+
+	/* Page was not accessed since pages were last marked idle */
+	ZRAM_IDLE,
 
 	__NR_ZRAM_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
+/*
+ * A compressed object that identical pages share. Only objects whose
+ * checksum is unique are in the tree, the rest are never shared.
+ */
+struct zram_dedup {
+	struct rb_node node;
+	unsigned long handle;
+	u32 clen;
+	u32 checksum;
+	u32 refcount;	/* pages using it, under table_lock */
+};
+
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
+	union {
+		unsigned long handle;		/* zsmalloc object */
+		struct page *page;		/* ZRAM_UNCOMPRESSED */
+		unsigned long element;		/* ZRAM_SAME, ZRAM_WB */
+		struct zram_dedup *dedup;	/* ZRAM_DEDUP */
+	};
+	u16 size;	/* compressed size */
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
 } __attribute__((aligned(4)));
@@ -92,20 +123,82 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
+	u64 num_compress;	/* pages run through the compressor */
+	u64 compress_size;	/* their total compressed size */
+	u64 compress_time;	/* ns spent compressing */
+	u64 num_decompress;	/* pages decompressed */
+	u64 decompress_time;	/* ns spent decompressing */
+	u64 bd_reads;		/* pages read from the backing device */
+	u64 bd_writes;		/* pages written back to it */
 	u32 pages_zero;		/* no. of zero filled pages */
+	u32 pages_same;		/* pages of one repeated word, zero included */
+	u32 pages_dedup;	/* pages sharing another page's object */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u32 bd_count;		/* pages on the backing device */
+};
+
+/*
+ * Compression context. Each device keeps one per online CPU so that
+ * concurrent writers compress in parallel.
+ */
+struct zram_stream {
+	void *private;		/* backend state */
+	void *buffer;
+	struct list_head list;
+};
+
+/* Size of the compression output buffer of each stream */
+#define ZRAM_STREAM_BUFFER_SIZE	(2 * PAGE_SIZE)
+
+/*
+ * A compressor. compress() reads one page and gets the space left in 'dst'
+ * in '*dst_len'; both return zero on success.
+ */
+struct zram_backend {
+	const char *name;
+	int decompress_private;	/* decompress() needs the stream private */
+	void *(*create)(void);
+	void (*destroy)(void *private);
+	int (*compress)(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *private);
+	int (*decompress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst, void *private);
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct zram_backend *backend;	/* set before init */
+	int dedup;			/* share identical objects */
+	struct rb_root dedup_root;	/* under table_lock */
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	/*
+	 * Protect table entries and the page counters in stats. Readers
+	 * hold it while they decompress, writers only while they swap
+	 * in a new object.
+	 */
+	rwlock_t table_lock;
+	struct list_head stream_idle;	/* idle compression streams */
+	spinlock_t stream_lock;		/* protect stream_idle */
+	wait_queue_head_t stream_wait;	/* writers waiting for a stream */
+	int num_streams;
+	/*
+	 * Optional device that idle or incompressible pages are written
+	 * back to, set before init. Block 0 is never used.
+	 */
+	struct block_device *backing_dev;
+	unsigned long *bd_bitmap;	/* blocks in use */
+	unsigned long bd_nr_blocks;
+	/*
+	 * Blocks freed while reads from the backing device were in flight.
+	 * They stay in use until no read is, since one of those reads may
+	 * be of the block. Under table_lock.
+	 */
+	unsigned long *bd_stale;
+	unsigned long bd_nr_stale;
+	atomic_t bd_inflight;		/* backing device reads in flight */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -126,7 +219,13 @@ extern unsigned int num_devices;
 extern struct attribute_group zram_disk_attr_group;
 #endif
 
+extern struct zram_backend *zram_backends[];
+extern struct zram_backend *zram_find_backend(const char *name);
+
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_mark_idle(struct zram *zram);
+extern int zram_writeback(struct zram *zram, int huge);
 
 #endif
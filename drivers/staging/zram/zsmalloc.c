@@ -0,0 +1,630 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * Objects of one size class are packed back to back into runs of a few
+ * order-0 pages, so there is no per-object header beyond one link word
+ * and an object may span two pages. Callers only get a handle; the
+ * object behind it is reached through zs_map_object(). Handles point to
+ * a small record of the object's run and index, which is all that
+ * changes when compaction moves the object into a fuller run and frees
+ * the emptied one.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+/*
+ * Handles are two words, so a kmalloc() of one would take a whole
+ * minimum-size slab object; give them a cache of their own.
+ */
+static struct kmem_cache *zs_handle_cachep;
+
+static unsigned int get_class_idx(size_t size)
+{
+	if (size <= ZS_MIN_ALLOC_SIZE)
+		return 0;
+
+	return DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE, ZS_SIZE_CLASS_DELTA);
+}
+
+/* The run length that leaves the least unused space at its end */
+static unsigned int get_pages_per_run(unsigned int size)
+{
+	unsigned int i, best = 1, best_used = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_RUN; i++) {
+		unsigned int bytes = i * PAGE_SIZE;
+		unsigned int used = (bytes / size) * size * 100 / bytes;
+
+		if (used > best_used) {
+			best_used = used;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+static unsigned long *link_map(struct zs_run *run, struct size_class *class,
+				unsigned int idx)
+{
+	unsigned long off = (unsigned long)idx * class->size;
+
+	return kmap_atomic(run->pages[off >> PAGE_SHIFT], KM_USER0) +
+		(off & ~PAGE_MASK);
+}
+
+static void link_unmap(unsigned long *link)
+{
+	kunmap_atomic(link, KM_USER0);
+}
+
+/*
+ * Copies 'len' bytes from 'pos' within object 'idx' to 'buf', or the
+ * other way if 'to_obj' is set.
+ */
+static void obj_copy(struct zs_run *run, struct size_class *class,
+			unsigned int idx, unsigned int pos, char *buf,
+			unsigned int len, int to_obj)
+{
+	unsigned long off = (unsigned long)idx * class->size + pos;
+
+	while (len) {
+		unsigned int offset = off & ~PAGE_MASK;
+		unsigned int n = min_t(unsigned int, len, PAGE_SIZE - offset);
+		char *addr;
+
+		addr = kmap_atomic(run->pages[off >> PAGE_SHIFT], KM_USER0);
+		if (to_obj)
+			memcpy(addr + offset, buf, n);
+		else
+			memcpy(buf, addr + offset, n);
+		kunmap_atomic(addr, KM_USER0);
+
+		off += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+static enum zs_fullness get_fullness(struct size_class *class,
+				struct zs_run *run)
+{
+	if (run->inuse == class->objs_per_run)
+		return ZS_FULL;
+	if (run->inuse * 4 >= class->objs_per_run * ZS_ALMOST_FULL)
+		return ZS_ALMOST_FULL_GROUP;
+	return ZS_ALMOST_EMPTY;
+}
+
+/*
+ * Puts 'run' on the list matching its use. Runs that just lost an object
+ * go to the end of the almost empty list, where compaction takes them
+ * from.
+ */
+static void fix_fullness(struct size_class *class, struct zs_run *run,
+			int freed)
+{
+	enum zs_fullness fullness = get_fullness(class, run);
+
+	if (fullness != run->fullness) {
+		run->fullness = fullness;
+		list_move(&run->list, &class->fullness_list[fullness]);
+	} else if (freed && fullness == ZS_ALMOST_EMPTY) {
+		list_move_tail(&run->list, &class->fullness_list[fullness]);
+	}
+}
+
+/* The fullest run with room, other than 'skip' */
+static struct zs_run *find_run(struct size_class *class, struct zs_run *skip)
+{
+	struct list_head *head;
+	struct zs_run *run;
+
+	head = &class->fullness_list[ZS_ALMOST_FULL_GROUP];
+	if (!list_empty(head))
+		return list_first_entry(head, struct zs_run, list);
+
+	head = &class->fullness_list[ZS_ALMOST_EMPTY];
+	if (list_empty(head))
+		return NULL;
+	run = list_first_entry(head, struct zs_run, list);
+
+	return run != skip ? run : NULL;
+}
+
+static void obj_alloc(struct size_class *class, struct zs_run *run,
+			struct zs_handle *handle)
+{
+	unsigned int idx = run->freelist;
+	unsigned long *link;
+
+	link = link_map(run, class, idx);
+	run->freelist = *link >> 1;
+	*link = (unsigned long)handle | ZS_OBJ_ALLOCATED;
+	link_unmap(link);
+
+	run->inuse++;
+	class->objs_inuse++;
+
+	handle->run = run;
+	handle->idx = idx;
+}
+
+static void obj_free(struct size_class *class, struct zs_run *run,
+			unsigned int idx)
+{
+	unsigned long *link;
+
+	link = link_map(run, class, idx);
+	*link = (unsigned long)run->freelist << 1;
+	link_unmap(link);
+
+	run->freelist = idx;
+	run->inuse--;
+	class->objs_inuse--;
+}
+
+static void free_run(struct zs_pool *pool, struct size_class *class,
+			struct zs_run *run)
+{
+	unsigned int i;
+
+	for (i = 0; i < class->pages_per_run; i++)
+		if (run->pages[i])
+			__free_page(run->pages[i]);
+	kfree(run);
+
+	atomic_long_sub(class->pages_per_run, &pool->pages_allocated);
+}
+
+static struct zs_run *alloc_run(struct zs_pool *pool, unsigned int class_idx)
+{
+	struct size_class *class = &pool->classes[class_idx];
+	struct zs_run *run;
+	unsigned int i;
+
+	run = kzalloc(sizeof(*run), pool->flags & ~__GFP_HIGHMEM);
+	if (!run)
+		return NULL;
+
+	atomic_long_add(class->pages_per_run, &pool->pages_allocated);
+
+	for (i = 0; i < class->pages_per_run; i++) {
+		run->pages[i] = alloc_page(pool->flags);
+		if (!run->pages[i]) {
+			free_run(pool, class, run);
+			return NULL;
+		}
+	}
+
+	/* Chain all objects into the free list, it ends at objs_per_run */
+	for (i = 0; i < class->objs_per_run; i++) {
+		unsigned long *link = link_map(run, class, i);
+
+		*link = (unsigned long)(i + 1) << 1;
+		link_unmap(link);
+	}
+
+	run->class = class_idx;
+	run->freelist = 0;
+	run->fullness = ZS_NR_FULLNESS;
+	INIT_LIST_HEAD(&run->list);
+
+	return run;
+}
+
+/**
+ * zs_create_pool - Creates an allocation pool to work from.
+ * @flags: allocation flags used to grow the pool
+ *
+ * Returns NULL on failure.
+ */
+struct zs_pool *zs_create_pool(gfp_t flags)
+{
+	struct zs_pool *pool;
+	unsigned int i;
+	int cpu;
+
+	if (!zs_handle_cachep)
+		return NULL;
+
+	pool = vzalloc(sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+		int j;
+
+		spin_lock_init(&class->lock);
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_run = get_pages_per_run(class->size);
+		class->objs_per_run = class->pages_per_run * PAGE_SIZE /
+					class->size;
+		for (j = 0; j < ZS_NR_FULLNESS; j++)
+			INIT_LIST_HEAD(&class->fullness_list[j]);
+	}
+
+	pool->flags = flags;
+	rwlock_init(&pool->migrate_lock);
+	atomic_long_set(&pool->pages_allocated, 0);
+	atomic_long_set(&pool->pages_compacted, 0);
+
+	pool->areas = alloc_percpu(struct zs_map_area);
+	if (!pool->areas)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct zs_map_area *area = per_cpu_ptr(pool->areas, cpu);
+
+		area->buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!area->buf)
+			goto fail;
+	}
+
+	return pool;
+
+fail:
+	zs_destroy_pool(pool);
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	unsigned int i;
+	int cpu;
+
+	if (!pool)
+		return;
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+		struct zs_run *run, *tmp;
+		int j;
+
+		for (j = 0; j < ZS_NR_FULLNESS; j++) {
+			list_for_each_entry_safe(run, tmp,
+					&class->fullness_list[j], list) {
+				WARN_ONCE(1, "zsmalloc: objects left in pool\n");
+				free_run(pool, class, run);
+			}
+		}
+	}
+
+	if (pool->areas) {
+		for_each_possible_cpu(cpu)
+			kfree(per_cpu_ptr(pool->areas, cpu)->buf);
+		free_percpu(pool->areas);
+	}
+
+	vfree(pool);
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
+
+/**
+ * zs_malloc - Allocate block of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of block to allocate
+ *
+ * Returns a handle to the new object, or zero on failure.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size)
+{
+	struct zs_handle *handle;
+	struct size_class *class;
+	unsigned int class_idx;
+	struct zs_run *run;
+
+	size += ZS_LINK_SIZE;
+	if (unlikely(size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	handle = kmem_cache_alloc(zs_handle_cachep,
+				pool->flags & ~__GFP_HIGHMEM);
+	if (!handle)
+		return 0;
+
+	class_idx = get_class_idx(size);
+	class = &pool->classes[class_idx];
+
+	spin_lock(&class->lock);
+	run = find_run(class, NULL);
+	if (!run) {
+		spin_unlock(&class->lock);
+
+		run = alloc_run(pool, class_idx);
+		if (!run) {
+			kmem_cache_free(zs_handle_cachep, handle);
+			return 0;
+		}
+
+		spin_lock(&class->lock);
+		class->nr_runs++;
+	}
+
+	obj_alloc(class, run, handle);
+	fix_fullness(class, run, 0);
+	spin_unlock(&class->lock);
+
+	return (unsigned long)handle;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+void zs_free(struct zs_pool *pool, unsigned long obj)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct size_class *class;
+	struct zs_run *run;
+
+	if (unlikely(!obj))
+		return;
+
+	read_lock(&pool->migrate_lock);
+	run = handle->run;
+	class = &pool->classes[run->class];
+
+	spin_lock(&class->lock);
+	obj_free(class, run, handle->idx);
+	if (run->inuse) {
+		fix_fullness(class, run, 1);
+		run = NULL;
+	} else {
+		list_del(&run->list);
+		class->nr_runs--;
+	}
+	spin_unlock(&class->lock);
+	read_unlock(&pool->migrate_lock);
+
+	if (run)
+		free_run(pool, class, run);
+	kmem_cache_free(zs_handle_cachep, handle);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/**
+ * zs_map_object - get address of allocated object from handle.
+ * @pool: pool from which the object was allocated
+ * @handle: handle returned from zs_malloc
+ * @mm: how the object is going to be accessed
+ *
+ * The object cannot move until zs_unmap_object(). Like kmap_atomic(),
+ * the caller must not sleep in between, and only one object can be
+ * mapped per cpu at a time.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long obj,
+			enum zs_mapmode mm)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct size_class *class;
+	struct zs_map_area *area;
+	struct zs_run *run;
+	unsigned long off;
+	unsigned int offset;
+
+	/* Also keeps us on this cpu */
+	read_lock(&pool->migrate_lock);
+
+	run = handle->run;
+	class = &pool->classes[run->class];
+	off = (unsigned long)handle->idx * class->size;
+	offset = off & ~PAGE_MASK;
+
+	area = this_cpu_ptr(pool->areas);
+	area->mm = mm;
+
+	if (offset + class->size <= PAGE_SIZE) {
+		area->vaddr = kmap_atomic(run->pages[off >> PAGE_SHIFT],
+					KM_USER0);
+		return area->vaddr + offset + ZS_LINK_SIZE;
+	}
+
+	/* The object spans two pages */
+	area->vaddr = NULL;
+	if (mm != ZS_MM_WO)
+		obj_copy(run, class, handle->idx, 0, area->buf,
+			class->size, 0);
+
+	return area->buf + ZS_LINK_SIZE;
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long obj)
+{
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct zs_map_area *area;
+
+	area = this_cpu_ptr(pool->areas);
+	if (area->vaddr) {
+		kunmap_atomic(area->vaddr, KM_USER0);
+	} else if (area->mm != ZS_MM_RO) {
+		struct size_class *class = &pool->classes[handle->run->class];
+
+		/* Leave the link alone, it may not have been read */
+		obj_copy(handle->run, class, handle->idx, ZS_LINK_SIZE,
+			area->buf + ZS_LINK_SIZE,
+			class->size - ZS_LINK_SIZE, 1);
+	}
+
+	read_unlock(&pool->migrate_lock);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+/*
+ * Empties the emptiest run of 'class' into the fullest ones, one run at
+ * a time, for as long as the other runs have room for a whole run.
+ * Returns the number of pages freed.
+ */
+static unsigned long zs_compact_class(struct zs_pool *pool,
+				struct size_class *class)
+{
+	unsigned long freed = 0;
+
+	for (;;) {
+		struct zs_map_area *area;
+		struct zs_run *src;
+		unsigned int idx;
+
+		write_lock(&pool->migrate_lock);
+		spin_lock(&class->lock);
+
+		src = NULL;
+		if (class->nr_runs * class->objs_per_run - class->objs_inuse <
+				class->objs_per_run ||
+				list_empty(&class->fullness_list[ZS_ALMOST_EMPTY]))
+			goto unlock;
+
+		src = list_entry(class->fullness_list[ZS_ALMOST_EMPTY].prev,
+				struct zs_run, list);
+
+		/* No mapper can be using the buffer while we hold the lock */
+		area = this_cpu_ptr(pool->areas);
+
+		for (idx = 0; idx < class->objs_per_run && src->inuse; idx++) {
+			struct zs_handle *handle;
+			unsigned long *link, val;
+			struct zs_run *dst;
+
+			link = link_map(src, class, idx);
+			val = *link;
+			link_unmap(link);
+			if (!(val & ZS_OBJ_ALLOCATED))
+				continue;
+
+			dst = find_run(class, src);
+			if (!dst)
+				break;
+
+			handle = (struct zs_handle *)(val & ~ZS_OBJ_ALLOCATED);
+			obj_copy(src, class, idx, ZS_LINK_SIZE,
+				area->buf, class->size - ZS_LINK_SIZE, 0);
+			obj_alloc(class, dst, handle);
+			obj_copy(dst, class, handle->idx, ZS_LINK_SIZE,
+				area->buf, class->size - ZS_LINK_SIZE, 1);
+			obj_free(class, src, idx);
+			fix_fullness(class, dst, 0);
+		}
+
+		if (src->inuse) {
+			fix_fullness(class, src, 1);
+			src = NULL;
+		} else {
+			list_del(&src->list);
+			class->nr_runs--;
+		}
+unlock:
+		spin_unlock(&class->lock);
+		write_unlock(&pool->migrate_lock);
+
+		if (!src)
+			break;
+
+		free_run(pool, class, src);
+		freed += class->pages_per_run;
+		cond_resched();
+	}
+
+	return freed;
+}
+
+/**
+ * zs_compact - Moves objects out of sparsely used runs and frees them.
+ * @pool: pool to compact
+ *
+ * May sleep. Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	unsigned long freed = 0;
+	unsigned int i;
+
+	for (i = 0; i < ZS_NR_CLASSES; i++)
+		freed += zs_compact_class(pool, &pool->classes[i]);
+
+	atomic_long_add(freed, &pool->pages_compacted);
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
+
+/*
+ * Bytes of the pool's pages that hold no object, which is what
+ * fragmentation costs.
+ */
+u64 zs_get_unused_bytes(struct zs_pool *pool)
+{
+	u64 used = 0;
+	unsigned int i;
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+
+		spin_lock(&class->lock);
+		used += (u64)class->objs_inuse * class->size;
+		spin_unlock(&class->lock);
+	}
+
+	return zs_get_total_size_bytes(pool) - used;
+}
+EXPORT_SYMBOL_GPL(zs_get_unused_bytes);
+
+/* Pages zs_compact() would free if it ran now */
+unsigned long zs_get_compactable_pages(struct zs_pool *pool)
+{
+	unsigned long pages = 0;
+	unsigned int i;
+
+	for (i = 0; i < ZS_NR_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+		unsigned long free;
+
+		spin_lock(&class->lock);
+		free = class->nr_runs * class->objs_per_run -
+			class->objs_inuse;
+		pages += free / class->objs_per_run * class->pages_per_run;
+		spin_unlock(&class->lock);
+	}
+
+	return pages;
+}
+EXPORT_SYMBOL_GPL(zs_get_compactable_pages);
+
+unsigned long zs_get_compacted_pages(struct zs_pool *pool)
+{
+	return atomic_long_read(&pool->pages_compacted);
+}
+EXPORT_SYMBOL_GPL(zs_get_compacted_pages);
+
+static int __init zs_init(void)
+{
+	zs_handle_cachep = KMEM_CACHE(zs_handle, 0);
+	if (!zs_handle_cachep)
+		return -ENOMEM;
+
+	return 0;
+}
+core_initcall(zs_init);
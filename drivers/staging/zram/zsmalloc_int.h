@@ -0,0 +1,113 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/* User configurable params */
+
+/*
+ * A run is up to this many order-0 pages that the objects of one size
+ * class are packed into back to back, so objects can span a page
+ * boundary. More pages waste less at the end of the run.
+ */
+#define ZS_MAX_PAGES_PER_RUN	4
+
+/*
+ * Objects are rounded up to classes this many bytes apart. Must be a
+ * multiple of sizeof(unsigned long), so the link at the head of an
+ * object never spans a page.
+ */
+#define ZS_SIZE_CLASS_DELTA	16
+
+/* Includes the link */
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+/* End of user params */
+
+#define ZS_NR_CLASSES	\
+	((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) / ZS_SIZE_CLASS_DELTA + 1)
+
+/*
+ * Every object starts with a link word. While the object is allocated it
+ * holds its handle with ZS_OBJ_ALLOCATED set, so compaction can find the
+ * handle of an object it moves. While it is free it holds the index of
+ * the next free object of the run, shifted left by one.
+ */
+#define ZS_LINK_SIZE		sizeof(unsigned long)
+#define ZS_OBJ_ALLOCATED	1UL
+
+/*
+ * Runs whose use is at least this fraction (in quarters) of their objects
+ * are filled first and never compacted away.
+ */
+#define ZS_ALMOST_FULL		3
+
+enum zs_fullness {
+	ZS_ALMOST_EMPTY,
+	ZS_ALMOST_FULL_GROUP,
+	ZS_FULL,
+	ZS_NR_FULLNESS,
+};
+
+struct zs_run {
+	struct list_head list;		/* in a fullness list of the class */
+	unsigned int class;		/* index into pool->classes */
+	unsigned int inuse;		/* allocated objects */
+	unsigned int freelist;		/* first free object */
+	enum zs_fullness fullness;
+	struct page *pages[ZS_MAX_PAGES_PER_RUN];
+};
+
+/* What a handle points to, the only thing that changes when objects move */
+struct zs_handle {
+	struct zs_run *run;
+	unsigned int idx;
+};
+
+struct size_class {
+	spinlock_t lock;
+	unsigned int size;		/* object size, link included */
+	unsigned int pages_per_run;
+	unsigned int objs_per_run;
+	struct list_head fullness_list[ZS_NR_FULLNESS];
+
+	/* stats, under lock */
+	unsigned long nr_runs;
+	unsigned long objs_inuse;
+};
+
+/* Where a mapped object is, per cpu */
+struct zs_map_area {
+	char *vaddr;		/* kmap of the object's page, or NULL */
+	char *buf;		/* copy of an object spanning two pages */
+	enum zs_mapmode mm;
+};
+
+struct zs_pool {
+	gfp_t flags;
+	struct size_class classes[ZS_NR_CLASSES];
+	/*
+	 * Objects only move with this held for writing. Mapping an object
+	 * or freeing it holds it for reading.
+	 */
+	rwlock_t migrate_lock;
+	struct zs_map_area __percpu *areas;
+	atomic_long_t pages_allocated;
+	atomic_long_t pages_compacted;
+};
+
+#endif
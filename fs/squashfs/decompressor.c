@@ -25,6 +25,11 @@
 #include <linux/mutex.h>
 #include <linux/slab.h>
 #include <linux/buffer_head.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include <linux/cpumask.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
@@ -36,6 +41,28 @@
  * Squashfs, allowing multiple decompressors to be easily supported
  */
 
+/*
+ * Decompressor streams are kept in a per-mount pool so that reads of
+ * different blocks can be decompressed in parallel.  One stream is created
+ * at mount time, further streams are created on demand whenever all the
+ * existing ones are busy, up to squashfs_max_decompressors().  Once the
+ * pool is full readers wait for a stream to be returned.
+ */
+struct squashfs_stream {
+	void			*comp_opts;
+	int			comp_opts_len;
+	spinlock_t		lock;
+	struct list_head	idle;
+	wait_queue_head_t	wait;
+	int			created;
+	int			max;
+};
+
+struct decomp_stream {
+	void			*stream;
+	struct list_head	list;
+};
+
 static const struct squashfs_decompressor squashfs_lzma_unsupported_comp_ops = {
 	NULL, NULL, NULL, LZMA_COMPRESSION, "lzma", 0
 };
@@ -77,14 +104,110 @@ const struct squashfs_decompressor *squashfs_lookup_decompressor(int id)
 }
 
 
-void *squashfs_decompressor_init(struct super_block *sb, unsigned short flags)
+int squashfs_max_decompressors(void)
+{
+	return num_online_cpus();
+}
+
+
+static struct decomp_stream *squashfs_create_stream(
+	struct squashfs_sb_info *msblk, struct squashfs_stream *pool)
+{
+	struct decomp_stream *decomp;
+	int err;
+
+	decomp = kmalloc(sizeof(*decomp), GFP_KERNEL);
+	if (decomp == NULL)
+		return ERR_PTR(-ENOMEM);
+
+	decomp->stream = msblk->decompressor->init(msblk, pool->comp_opts,
+		pool->comp_opts_len);
+	if (IS_ERR(decomp->stream)) {
+		err = PTR_ERR(decomp->stream);
+		kfree(decomp);
+		return ERR_PTR(err);
+	}
+
+	return decomp;
+}
+
+
+static struct decomp_stream *squashfs_get_stream(
+	struct squashfs_sb_info *msblk, struct squashfs_stream *pool)
+{
+	struct decomp_stream *decomp;
+
+	while (1) {
+		spin_lock(&pool->lock);
+		if (!list_empty(&pool->idle)) {
+			decomp = list_entry(pool->idle.next,
+				struct decomp_stream, list);
+			list_del(&decomp->list);
+			spin_unlock(&pool->lock);
+			return decomp;
+		}
+
+		if (pool->created < pool->max) {
+			pool->created++;
+			spin_unlock(&pool->lock);
+
+			decomp = squashfs_create_stream(msblk, pool);
+			if (!IS_ERR(decomp))
+				return decomp;
+
+			/*
+			 * Out of memory, make do with the streams we have
+			 * rather than retrying the allocation on every read
+			 */
+			spin_lock(&pool->lock);
+			pool->created--;
+			pool->max = pool->created;
+		}
+		spin_unlock(&pool->lock);
+
+		wait_event(pool->wait, !list_empty(&pool->idle));
+	}
+}
+
+
+static void squashfs_put_stream(struct squashfs_stream *pool,
+	struct decomp_stream *decomp)
+{
+	spin_lock(&pool->lock);
+	list_add(&decomp->list, &pool->idle);
+	spin_unlock(&pool->lock);
+	wake_up(&pool->wait);
+}
+
+
+int squashfs_decompress(struct squashfs_sb_info *msblk, void **buffer,
+	struct buffer_head **bh, int b, int offset, int length, int srclength,
+	int pages)
+{
+	struct squashfs_stream *pool = msblk->stream;
+	struct decomp_stream *decomp = squashfs_get_stream(msblk, pool);
+	int res;
+
+	res = msblk->decompressor->decompress(msblk, decomp->stream, buffer,
+		bh, b, offset, length, srclength, pages);
+	squashfs_put_stream(pool, decomp);
+
+	return res;
+}
+
+
+struct squashfs_stream *squashfs_decompressor_init(struct super_block *sb,
+	unsigned short flags)
 {
 	struct squashfs_sb_info *msblk = sb->s_fs_info;
-	void *strm, *buffer = NULL;
-	int length = 0;
+	struct squashfs_stream *pool;
+	struct decomp_stream *decomp;
+	void *buffer = NULL;
+	int length = 0, err;
 
 	/*
-	 * Read decompressor specific options from file system if present
+	 * Read decompressor specific options from file system if present.
+	 * They are kept for as long as the pool, to create further streams
 	 */
 	if (SQUASHFS_COMP_OPTS(flags)) {
 		buffer = kmalloc(PAGE_CACHE_SIZE, GFP_KERNEL);
@@ -96,15 +219,65 @@ void *squashfs_decompressor_init(struct super_block *sb, unsigned short flags)
 			PAGE_CACHE_SIZE, 1);
 
 		if (length < 0) {
-			strm = ERR_PTR(length);
-			goto finished;
+			err = length;
+			goto failed;
 		}
 	}
 
-	strm = msblk->decompressor->init(msblk, buffer, length);
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (pool == NULL) {
+		err = -ENOMEM;
+		goto failed;
+	}
+
+	pool->comp_opts = buffer;
+	pool->comp_opts_len = length;
+	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->idle);
+	init_waitqueue_head(&pool->wait);
+	pool->max = squashfs_max_decompressors();
 
-finished:
+	/*
+	 * Always create the first stream now, so that bad compressor
+	 * options fail the mount rather than the first read
+	 */
+	decomp = squashfs_create_stream(msblk, pool);
+	if (IS_ERR(decomp)) {
+		err = PTR_ERR(decomp);
+		kfree(pool);
+		goto failed;
+	}
+
+	list_add(&decomp->list, &pool->idle);
+	pool->created = 1;
+
+	return pool;
+
+failed:
 	kfree(buffer);
+	return ERR_PTR(err);
+}
+
+
+void squashfs_decompressor_free(struct squashfs_sb_info *msblk,
+	struct squashfs_stream *pool)
+{
+	struct decomp_stream *decomp;
+	int freed = 0;
+
+	if (pool == NULL)
+		return;
+
+	while (!list_empty(&pool->idle)) {
+		decomp = list_entry(pool->idle.next, struct decomp_stream, list);
+		list_del(&decomp->list);
+		msblk->decompressor->free(decomp->stream);
+		kfree(decomp);
+		freed++;
+	}
 
-	return strm;
+	/* every stream should have been returned by now */
+	WARN_ON(freed != pool->created);
+	kfree(pool->comp_opts);
+	kfree(pool);
 }
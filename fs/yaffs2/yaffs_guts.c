@@ -35,10 +35,14 @@
 
 #include "yaffs_attribs.h"
 
-/* Note YAFFS_GC_GOOD_ENOUGH must be <= YAFFS_GC_PASSIVE_THRESHOLD */
-#define YAFFS_GC_GOOD_ENOUGH 2
 #define YAFFS_GC_PASSIVE_THRESHOLD 4
 
+/* Most bucket entries looked at to pick a block to gc */
+#define YAFFS_GC_PICK_TRIES 32
+
+/* Gc passes per unit of urgency in one background call */
+#define YAFFS_BG_GC_PASSES 4
+
 #include "yaffs_ecc.h"
 
 /* Forward declarations */
@@ -46,6 +50,9 @@
 static int yaffs_wr_data_obj(struct yaffs_obj *in, int inode_chunk,
 			     const u8 * buffer, int n_bytes, int use_reserve);
 
+static void yaffs_gc_file_block(struct yaffs_dev *dev, int block_no);
+static void yaffs_gc_unfile_block(struct yaffs_dev *dev, int block_no);
+
 
 
 /* Function to calculate chunk and offset */
@@ -146,6 +153,8 @@ u8 *yaffs_get_temp_buffer(struct yaffs_dev * dev, int line_no)
 {
 	int i, j;
 
+	spin_lock(&dev->temp_lock);
+
 	dev->temp_in_use++;
 	if (dev->temp_in_use > dev->max_temp)
 		dev->max_temp = dev->temp_in_use;
@@ -160,10 +169,15 @@ u8 *yaffs_get_temp_buffer(struct yaffs_dev * dev, int line_no)
 					    dev->temp_buffer[j].line;
 			}
 
+			spin_unlock(&dev->temp_lock);
 			return dev->temp_buffer[i].buffer;
 		}
 	}
 
+	dev->unmanaged_buffer_allocs++;
+
+	spin_unlock(&dev->temp_lock);
+
 	yaffs_trace(YAFFS_TRACE_BUFFERS,
 		"Out of temp buffers at line %d, other held by lines:",
 		line_no);
@@ -175,8 +189,7 @@ u8 *yaffs_get_temp_buffer(struct yaffs_dev * dev, int line_no)
 	 * This is not good.
 	 */
 
-	dev->unmanaged_buffer_allocs++;
-	return kmalloc(dev->data_bytes_per_chunk, GFP_NOFS);
+	return kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
 
 }
 
@@ -184,22 +197,29 @@ void yaffs_release_temp_buffer(struct yaffs_dev *dev, u8 * buffer, int line_no)
 {
 	int i;
 
+	spin_lock(&dev->temp_lock);
+
 	dev->temp_in_use--;
 
 	for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++) {
 		if (dev->temp_buffer[i].buffer == buffer) {
 			dev->temp_buffer[i].line = 0;
+			spin_unlock(&dev->temp_lock);
 			return;
 		}
 	}
 
+	if (buffer)
+		dev->unmanaged_buffer_deallocs++;
+
+	spin_unlock(&dev->temp_lock);
+
 	if (buffer) {
 		/* assume it is an unmanaged one. */
 		yaffs_trace(YAFFS_TRACE_BUFFERS,
 		  "Releasing unmanaged temp buffer in line %d",
 		   line_no);
 		kfree(buffer);
-		dev->unmanaged_buffer_deallocs++;
 	}
 
 }
@@ -477,6 +497,7 @@ static int yaffs_alloc_chunk(struct yaffs_dev *dev, int use_reserver,
 		/* If the block is full set the state to full */
 		if (dev->alloc_page >= dev->param.chunks_per_block) {
 			bi->block_state = YAFFS_BLOCK_STATE_FULL;
+			yaffs_gc_file_block(dev, dev->alloc_block);
 			dev->alloc_block = -1;
 		}
 
@@ -515,6 +536,7 @@ void yaffs_skip_rest_of_block(struct yaffs_dev *dev)
 		    yaffs_get_block_info(dev, dev->alloc_block);
 		if (bi->block_state == YAFFS_BLOCK_STATE_ALLOCATING) {
 			bi->block_state = YAFFS_BLOCK_STATE_FULL;
+			yaffs_gc_file_block(dev, dev->alloc_block);
 			dev->alloc_block = -1;
 		}
 	}
@@ -1201,6 +1223,7 @@ static void yaffs_soft_del_chunk(struct yaffs_dev *dev, int chunk)
 		the_block->soft_del_pages++;
 		dev->n_free_chunks++;
 		yaffs2_update_oldest_dirty_seq(dev, block_no, the_block);
+		yaffs_gc_file_block(dev, block_no);
 	}
 }
 
@@ -1394,73 +1417,125 @@ static int yaffs_change_obj_name(struct yaffs_obj *obj,
  *   In Linux, the page cache provides read buffering and the short op cache 
  *   provides write buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   Caches in use are hashed by object and chunk id and kept on an lru list.
+ *   Dirty ones are also on a dirty list, so writing them back does not look
+ *   at clean ones. An object's dirty chunks are written back together in
+ *   chunk id order, so they land next to each other in flash.
  */
 
+static inline struct list_head *yaffs_cache_chain(struct yaffs_dev *dev,
+						  const struct yaffs_obj *obj,
+						  int chunk_id)
+{
+	return &dev->cache_hash[(obj->obj_id * 31 + chunk_id) &
+				dev->cache_hash_mask];
+}
+
+static void yaffs_cache_set_dirty(struct yaffs_dev *dev,
+				  struct yaffs_cache *cache)
+{
+	if (!cache->dirty) {
+		cache->dirty = 1;
+		list_add_tail(&cache->dirty_link, &dev->cache_dirty);
+		dev->n_dirty_caches++;
+	}
+}
+
+static void yaffs_cache_set_clean(struct yaffs_dev *dev,
+				  struct yaffs_cache *cache)
+{
+	if (cache->dirty) {
+		cache->dirty = 0;
+		list_del_init(&cache->dirty_link);
+		dev->n_dirty_caches--;
+	}
+}
+
+/* Give a cache an object's chunk. The data is up to the caller. */
+static void yaffs_cache_attach(struct yaffs_dev *dev,
+			       struct yaffs_cache *cache,
+			       struct yaffs_obj *obj, int chunk_id)
+{
+	cache->object = obj;
+	cache->chunk_id = chunk_id;
+	cache->dirty = 0;
+	cache->locked = 0;
+	cache->n_bytes = 0;
+	list_add(&cache->hash_link, yaffs_cache_chain(dev, obj, chunk_id));
+	list_move_tail(&cache->lru_link, &dev->cache_lru);
+}
+
+/* Drop whatever a cache holds, without writing it back */
+static void yaffs_cache_release(struct yaffs_dev *dev,
+				struct yaffs_cache *cache)
+{
+	if (!cache->object)
+		return;
+
+	yaffs_cache_set_clean(dev, cache);
+	list_del_init(&cache->hash_link);
+	list_move(&cache->lru_link, &dev->cache_free);
+	cache->object = NULL;
+}
+
 static int yaffs_obj_cache_dirty(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
 	struct yaffs_cache *cache;
-	int n_caches = obj->my_dev->param.n_caches;
 
-	for (i = 0; i < n_caches; i++) {
-		cache = &dev->cache[i];
-		if (cache->object == obj && cache->dirty)
+	if (dev->param.n_caches < 1)
+		return 0;
+
+	list_for_each_entry(cache, &dev->cache_dirty, dirty_link) {
+		if (cache->object == obj)
 			return 1;
 	}
 
 	return 0;
 }
 
+static int yaffs_cache_cmp(const void *a, const void *b)
+{
+	const struct yaffs_cache *ca = *(struct yaffs_cache * const *)a;
+	const struct yaffs_cache *cb = *(struct yaffs_cache * const *)b;
+
+	return ca->chunk_id - cb->chunk_id;
+}
+
 static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int lowest = -99;	/* Stop compiler whining. */
-	int i;
 	struct yaffs_cache *cache;
-	int chunk_written = 0;
-	int n_caches = obj->my_dev->param.n_caches;
-
-	if (n_caches > 0) {
-		do {
-			cache = NULL;
-
-			/* Find the dirty cache for this object with the lowest chunk id. */
-			for (i = 0; i < n_caches; i++) {
-				if (dev->cache[i].object == obj &&
-				    dev->cache[i].dirty) {
-					if (!cache
-					    || dev->cache[i].chunk_id <
-					    lowest) {
-						cache = &dev->cache[i];
-						lowest = cache->chunk_id;
-					}
-				}
-			}
-
-			if (cache && !cache->locked) {
-				/* Write it out and free it up */
+	int chunk_written = 1;
+	int n_flush = 0;
+	int i;
 
-				chunk_written =
-				    yaffs_wr_data_obj(cache->object,
-						      cache->chunk_id,
-						      cache->data,
-						      cache->n_bytes, 1);
-				cache->dirty = 0;
-				cache->object = NULL;
-			}
+	if (dev->param.n_caches < 1)
+		return;
 
-		} while (cache && chunk_written > 0);
+	list_for_each_entry(cache, &dev->cache_dirty, dirty_link) {
+		if (cache->object == obj && !cache->locked)
+			dev->cache_flush[n_flush++] = cache;
+	}
 
-		if (cache)
-			/* Hoosterman, disk full while writing cache out. */
-			yaffs_trace(YAFFS_TRACE_ERROR,
-				"yaffs tragedy: no space during cache write");
+	if (n_flush > 1)
+		sort(dev->cache_flush, n_flush, sizeof(struct yaffs_cache *),
+		     yaffs_cache_cmp, NULL);
 
+	/* Write them out and free them up */
+	for (i = 0; i < n_flush && chunk_written > 0; i++) {
+		cache = dev->cache_flush[i];
+		chunk_written = yaffs_wr_data_obj(cache->object,
+						  cache->chunk_id,
+						  cache->data,
+						  cache->n_bytes, 1);
+		yaffs_cache_release(dev, cache);
 	}
 
+	if (chunk_written <= 0)
+		/* Hoosterman, disk full while writing cache out. */
+		yaffs_trace(YAFFS_TRACE_ERROR,
+			"yaffs tragedy: no space during cache write");
 }
 
 /*yaffs_flush_whole_cache(dev)
@@ -1470,139 +1545,116 @@ static void yaffs_flush_file_cache(struct yaffs_obj *obj)
 
 void yaffs_flush_whole_cache(struct yaffs_dev *dev)
 {
-	struct yaffs_obj *obj;
-	int n_caches = dev->param.n_caches;
-	int i;
+	struct yaffs_cache *cache;
+	int n_dirty;
 
-	/* Find a dirty object in the cache and flush it...
-	 * until there are no further dirty objects.
+	if (dev->param.n_caches < 1)
+		return;
+
+	/* Flush the object of the oldest dirty cache until there are none,
+	 * or a flush gets nowhere.
 	 */
 	do {
-		obj = NULL;
-		for (i = 0; i < n_caches && !obj; i++) {
-			if (dev->cache[i].object && dev->cache[i].dirty)
-				obj = dev->cache[i].object;
-
-		}
-		if (obj)
-			yaffs_flush_file_cache(obj);
-
-	} while (obj);
+		n_dirty = dev->n_dirty_caches;
+		if (list_empty(&dev->cache_dirty))
+			break;
+		cache = list_first_entry(&dev->cache_dirty,
+					 struct yaffs_cache, dirty_link);
+		yaffs_flush_file_cache(cache->object);
+	} while (dev->n_dirty_caches < n_dirty);
 
 }
 
-/* Grab us a cache chunk for use.
- * First look for an empty one.
- * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
+/* Grab a cache chunk without flushing anything: an empty one, else the
+ * least recently used clean one. Readers use this, they must not write.
  */
-static struct yaffs_cache *yaffs_grab_chunk_worker(struct yaffs_dev *dev)
+static struct yaffs_cache *yaffs_grab_clean_chunk_cache(struct yaffs_dev *dev)
 {
-	int i;
+	struct yaffs_cache *cache;
 
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (!dev->cache[i].object)
-				return &dev->cache[i];
+	if (!list_empty(&dev->cache_free))
+		return list_first_entry(&dev->cache_free,
+					struct yaffs_cache, lru_link);
+
+	list_for_each_entry(cache, &dev->cache_lru, lru_link) {
+		if (!cache->dirty && !cache->locked) {
+			yaffs_cache_release(dev, cache);
+			return cache;
 		}
 	}
 
 	return NULL;
 }
 
+/* Grab us a cache chunk for use.
+ * First look for an empty one.
+ * Then look for the least recently used non-dirty one.
+ * Then write back the object of the least recently used dirty one and look
+ * again.
+ */
 static struct yaffs_cache *yaffs_grab_chunk_cache(struct yaffs_dev *dev)
 {
 	struct yaffs_cache *cache;
-	struct yaffs_obj *the_obj;
-	int usage;
-	int i;
-	int pushout;
 
-	if (dev->param.n_caches > 0) {
-		/* Try find a non-dirty one... */
+	if (dev->param.n_caches < 1)
+		return NULL;
 
-		cache = yaffs_grab_chunk_worker(dev);
+	cache = yaffs_grab_clean_chunk_cache(dev);
+	if (cache)
+		return cache;
 
-		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
-			 * NB what's here is not very accurate, we actually flush the object
-			 * the last recently used page.
-			 */
+	list_for_each_entry(cache, &dev->cache_lru, lru_link) {
+		if (!cache->locked) {
+			yaffs_flush_file_cache(cache->object);
+			return yaffs_grab_clean_chunk_cache(dev);
+		}
+	}
 
-			/* With locking we can't assume we can use entry zero */
+	return NULL;
+}
 
-			the_obj = NULL;
-			usage = -1;
-			cache = NULL;
-			pushout = -1;
+/* Find a cached chunk */
+static struct yaffs_cache *yaffs_lookup_chunk_cache(const struct yaffs_obj *obj,
+						    int chunk_id)
+{
+	struct yaffs_dev *dev = obj->my_dev;
+	struct yaffs_cache *cache;
 
-			for (i = 0; i < dev->param.n_caches; i++) {
-				if (dev->cache[i].object &&
-				    !dev->cache[i].locked &&
-				    (dev->cache[i].last_use < usage
-				     || !cache)) {
-					usage = dev->cache[i].last_use;
-					the_obj = dev->cache[i].object;
-					cache = &dev->cache[i];
-					pushout = i;
-				}
-			}
+	if (dev->param.n_caches < 1)
+		return NULL;
 
-			if (!cache || cache->dirty) {
-				/* Flush and try again */
-				yaffs_flush_file_cache(the_obj);
-				cache = yaffs_grab_chunk_worker(dev);
-			}
+	list_for_each_entry(cache, yaffs_cache_chain(dev, obj, chunk_id),
+			    hash_link) {
+		if (cache->object == obj && cache->chunk_id == chunk_id)
+			return cache;
+	}
 
-		}
-		return cache;
-	} else {
-		return NULL;
-        }
+	return NULL;
 }
 
-/* Find a cached chunk */
+/* Find a cached chunk for a read or write, counting hits and misses */
 static struct yaffs_cache *yaffs_find_chunk_cache(const struct yaffs_obj *obj,
 						  int chunk_id)
 {
 	struct yaffs_dev *dev = obj->my_dev;
-	int i;
-	if (dev->param.n_caches > 0) {
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object == obj &&
-			    dev->cache[i].chunk_id == chunk_id) {
-				dev->cache_hits++;
+	struct yaffs_cache *cache = yaffs_lookup_chunk_cache(obj, chunk_id);
 
-				return &dev->cache[i];
-			}
-		}
-	}
-	return NULL;
+	if (cache)
+		dev->cache_hits++;
+	else if (dev->param.n_caches > 0)
+		dev->cache_misses++;
+
+	return cache;
 }
 
 /* Mark the chunk for the least recently used algorithym */
 static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
 			    int is_write)
 {
+	list_move_tail(&cache->lru_link, &dev->cache_lru);
 
-	if (dev->param.n_caches > 0) {
-		if (dev->cache_last_use < 0 || dev->cache_last_use > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->param.n_caches; i++)
-				dev->cache[i].last_use = 0;
-
-			dev->cache_last_use = 0;
-		}
-
-		dev->cache_last_use++;
-
-		cache->last_use = dev->cache_last_use;
-
-		if (is_write)
-			cache->dirty = 1;
-	}
+	if (is_write)
+		yaffs_cache_set_dirty(dev, cache);
 }
 
 /* Invalidate a single cache page.
@@ -1611,13 +1663,10 @@ static void yaffs_use_cache(struct yaffs_dev *dev, struct yaffs_cache *cache,
  */
 static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
 {
-	if (object->my_dev->param.n_caches > 0) {
-		struct yaffs_cache *cache =
-		    yaffs_find_chunk_cache(object, chunk_id);
+	struct yaffs_cache *cache = yaffs_lookup_chunk_cache(object, chunk_id);
 
-		if (cache)
-			cache->object = NULL;
-	}
+	if (cache)
+		yaffs_cache_release(object->my_dev, cache);
 }
 
 /* Invalidate all the cache pages associated with this object
@@ -1625,15 +1674,16 @@ static void yaffs_invalidate_chunk_cache(struct yaffs_obj *object, int chunk_id)
  */
 static void yaffs_invalidate_whole_cache(struct yaffs_obj *in)
 {
-	int i;
 	struct yaffs_dev *dev = in->my_dev;
+	struct yaffs_cache *cache;
+	struct yaffs_cache *next;
 
-	if (dev->param.n_caches > 0) {
-		/* Invalidate it. */
-		for (i = 0; i < dev->param.n_caches; i++) {
-			if (dev->cache[i].object == in)
-				dev->cache[i].object = NULL;
-		}
+	if (dev->param.n_caches < 1)
+		return;
+
+	list_for_each_entry_safe(cache, next, &dev->cache_lru, lru_link) {
+		if (cache->object == in)
+			yaffs_cache_release(dev, cache);
 	}
 }
 
@@ -2298,12 +2348,156 @@ struct yaffs_obj *yaffs_link_obj(struct yaffs_obj *parent, const YCHAR * name,
 
 /*------------------------- Block Management and Page Allocation ----------------*/
 
+/*
+ * Gc buckets.
+ * Full blocks that have pages to reclaim are kept in buckets by how many
+ * pages they still use, so gc finds a dirty block without scanning the
+ * block array. A block is refiled wherever it gets dirtier or fills up and
+ * unfiled when it starts being collected or erased. Any other change to a
+ * filed block is caught when gc meets it in a bucket.
+ */
+
+static inline struct yaffs_gc_link *yaffs_gc_link(struct yaffs_dev *dev,
+						  int block_no)
+{
+	return &dev->gc_links[block_no - dev->internal_start_block];
+}
+
+/* Returns the bucket a block belongs in, or -1 if it is not a candidate */
+static int yaffs_gc_bucket_for(struct yaffs_dev *dev,
+			       struct yaffs_block_info *bi)
+{
+	int pages_used = bi->pages_in_use - bi->soft_del_pages;
+
+	if (bi->block_state != YAFFS_BLOCK_STATE_FULL ||
+	    pages_used >= dev->param.chunks_per_block)
+		return -1;
+
+	return pages_used * YAFFS_GC_N_BUCKETS / dev->param.chunks_per_block;
+}
+
+static void yaffs_gc_clear_buckets(struct yaffs_dev *dev)
+{
+	int n_blocks = dev->internal_end_block - dev->internal_start_block + 1;
+	int i;
+
+	if (!dev->gc_links)
+		return;
+
+	for (i = 0; i < n_blocks; i++) {
+		dev->gc_links[i].next = 0;
+		dev->gc_links[i].prev = 0;
+		dev->gc_links[i].bucket = -1;
+	}
+	memset(dev->gc_bucket_head, 0, sizeof(dev->gc_bucket_head));
+	memset(dev->gc_bucket_tail, 0, sizeof(dev->gc_bucket_tail));
+}
+
+static void yaffs_gc_unfile_block(struct yaffs_dev *dev, int block_no)
+{
+	struct yaffs_gc_link *link;
+	int bucket;
+
+	if (!dev->gc_links)
+		return;
+
+	link = yaffs_gc_link(dev, block_no);
+	bucket = link->bucket;
+	if (bucket < 0)
+		return;
+
+	if (link->prev)
+		yaffs_gc_link(dev, link->prev)->next = link->next;
+	else
+		dev->gc_bucket_head[bucket] = link->next;
+	if (link->next)
+		yaffs_gc_link(dev, link->next)->prev = link->prev;
+	else
+		dev->gc_bucket_tail[bucket] = link->prev;
+
+	link->next = 0;
+	link->prev = 0;
+	link->bucket = -1;
+}
+
+/* Files a block at the end of the bucket it now belongs in, if any. */
+static void yaffs_gc_file_block(struct yaffs_dev *dev, int block_no)
+{
+	struct yaffs_gc_link *link;
+	int bucket;
+
+	if (!dev->gc_links)
+		return;
+
+	link = yaffs_gc_link(dev, block_no);
+	bucket = yaffs_gc_bucket_for(dev, yaffs_get_block_info(dev, block_no));
+	if (bucket == link->bucket)
+		return;
+
+	yaffs_gc_unfile_block(dev, block_no);
+	if (bucket < 0)
+		return;
+
+	link->bucket = bucket;
+	link->prev = dev->gc_bucket_tail[bucket];
+	if (link->prev)
+		yaffs_gc_link(dev, link->prev)->next = block_no;
+	else
+		dev->gc_bucket_head[bucket] = block_no;
+	dev->gc_bucket_tail[bucket] = block_no;
+}
+
+/* Refiles every block, after the block states have been set wholesale. */
+static void yaffs_gc_fill_buckets(struct yaffs_dev *dev)
+{
+	int i;
+
+	yaffs_gc_clear_buckets(dev);
+	for (i = dev->internal_start_block; i <= dev->internal_end_block; i++)
+		yaffs_gc_file_block(dev, i);
+}
+
+/*
+ * Finds the dirtiest block that may be collected, looking at no more than
+ * YAFFS_GC_PICK_TRIES filed blocks. Blocks that were filed under a state
+ * they no longer have are refiled on the way. Within a bucket the blocks
+ * that have been filed longest come first.
+ */
+static unsigned yaffs_gc_pick_block(struct yaffs_dev *dev, int *pages_used)
+{
+	struct yaffs_block_info *bi;
+	int tries = YAFFS_GC_PICK_TRIES;
+	int bucket;
+	u32 block_no;
+	u32 next;
+
+	for (bucket = 0; bucket < YAFFS_GC_N_BUCKETS; bucket++) {
+		for (block_no = dev->gc_bucket_head[bucket];
+		     block_no && tries > 0; block_no = next, tries--) {
+			next = yaffs_gc_link(dev, block_no)->next;
+			bi = yaffs_get_block_info(dev, block_no);
+			if (yaffs_gc_bucket_for(dev, bi) != bucket) {
+				yaffs_gc_file_block(dev, block_no);
+				continue;
+			}
+			if (yaffs_block_ok_for_gc(dev, bi)) {
+				*pages_used = bi->pages_in_use -
+				    bi->soft_del_pages;
+				return block_no;
+			}
+		}
+	}
+
+	return 0;
+}
+
 static int yaffs_init_blocks(struct yaffs_dev *dev)
 {
 	int n_blocks = dev->internal_end_block - dev->internal_start_block + 1;
 
 	dev->block_info = NULL;
 	dev->chunk_bits = NULL;
+	dev->gc_links = NULL;
 
 	dev->alloc_block = -1;	/* force it to get a new one */
 
@@ -2333,9 +2527,22 @@ static int yaffs_init_blocks(struct yaffs_dev *dev)
 	}
 
 	if (dev->block_info && dev->chunk_bits) {
+		dev->gc_links =
+		    kmalloc(n_blocks * sizeof(struct yaffs_gc_link), GFP_NOFS);
+		if (!dev->gc_links) {
+			dev->gc_links =
+			    vmalloc(n_blocks * sizeof(struct yaffs_gc_link));
+			dev->gc_links_alt = 1;
+		} else {
+			dev->gc_links_alt = 0;
+		}
+	}
+
+	if (dev->block_info && dev->chunk_bits && dev->gc_links) {
 		memset(dev->block_info, 0,
 		       n_blocks * sizeof(struct yaffs_block_info));
 		memset(dev->chunk_bits, 0, dev->chunk_bit_stride * n_blocks);
+		yaffs_gc_clear_buckets(dev);
 		return YAFFS_OK;
 	}
 
@@ -2359,6 +2566,13 @@ static void yaffs_deinit_blocks(struct yaffs_dev *dev)
 		kfree(dev->chunk_bits);
 	dev->chunk_bits_alt = 0;
 	dev->chunk_bits = NULL;
+
+	if (dev->gc_links_alt && dev->gc_links)
+		vfree(dev->gc_links);
+	else if (dev->gc_links)
+		kfree(dev->gc_links);
+	dev->gc_links_alt = 0;
+	dev->gc_links = NULL;
 }
 
 void yaffs_block_became_dirty(struct yaffs_dev *dev, int block_no)
@@ -2379,6 +2593,7 @@ void yaffs_block_became_dirty(struct yaffs_dev *dev, int block_no)
 	yaffs2_clear_oldest_dirty_seq(dev, bi);
 
 	bi->block_state = YAFFS_BLOCK_STATE_DIRTY;
+	yaffs_gc_unfile_block(dev, block_no);
 
 	/* If this is the block being garbage collected then stop gc'ing this block */
 	if (block_no == dev->gc_block)
@@ -2468,8 +2683,10 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 
 	/*yaffs_verify_free_chunks(dev); */
 
-	if (bi->block_state == YAFFS_BLOCK_STATE_FULL)
+	if (bi->block_state == YAFFS_BLOCK_STATE_FULL) {
 		bi->block_state = YAFFS_BLOCK_STATE_COLLECTING;
+		yaffs_gc_unfile_block(dev, block);
+	}
 
 	bi->has_shrink_hdr = 0;	/* clear the flag so that the block can erase */
 
@@ -2679,6 +2896,7 @@ static int yaffs_gc_block(struct yaffs_dev *dev, int block, int whole_block)
 		 * because checkpointing does not restore gc.
 		 */
 		bi->block_state = YAFFS_BLOCK_STATE_FULL;
+		yaffs_gc_file_block(dev, block);
 	} else {
 		/* The gc completed. */
 		/* Do any required cleanups */
@@ -2724,7 +2942,6 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 				    int aggressive, int background)
 {
 	int i;
-	int iterations;
 	unsigned selected = 0;
 	int prioritised = 0;
 	int prioritised_exist = 0;
@@ -2763,19 +2980,17 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 			dev->has_pending_prioritised_gc = 0;
 	}
 
-	/* If we're doing aggressive GC then we are happy to take a less-dirty block, and
-	 * search harder.
+	/* If we're doing aggressive GC then we are happy to take a less-dirty block.
 	 * else (we're doing a leasurely gc), then we only bother to do this if the
-	 * block has only a few pages in use.
+	 * block has only a few pages in use. The more urgent background gc
+	 * is, the less dirty a block it takes.
 	 */
 
 	if (!selected) {
-		int pages_used;
-		int n_blocks =
-		    dev->internal_end_block - dev->internal_start_block + 1;
+		int pages_used = 0;
+
 		if (aggressive) {
 			threshold = dev->param.chunks_per_block;
-			iterations = n_blocks;
 		} else {
 			int max_threshold;
 
@@ -2787,40 +3002,17 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 			if (max_threshold < YAFFS_GC_PASSIVE_THRESHOLD)
 				max_threshold = YAFFS_GC_PASSIVE_THRESHOLD;
 
-			threshold = background ? (dev->gc_not_done + 2) * 2 : 0;
+			threshold = background ?
+			    (dev->gc_not_done + 2) * 2 +
+			    dev->gc_urgency * max_threshold / 2 : 0;
 			if (threshold < YAFFS_GC_PASSIVE_THRESHOLD)
 				threshold = YAFFS_GC_PASSIVE_THRESHOLD;
 			if (threshold > max_threshold)
 				threshold = max_threshold;
-
-			iterations = n_blocks / 16 + 1;
-			if (iterations > 100)
-				iterations = 100;
 		}
 
-		for (i = 0;
-		     i < iterations &&
-		     (dev->gc_dirtiest < 1 ||
-		      dev->gc_pages_in_use > YAFFS_GC_GOOD_ENOUGH); i++) {
-			dev->gc_block_finder++;
-			if (dev->gc_block_finder < dev->internal_start_block ||
-			    dev->gc_block_finder > dev->internal_end_block)
-				dev->gc_block_finder =
-				    dev->internal_start_block;
-
-			bi = yaffs_get_block_info(dev, dev->gc_block_finder);
-
-			pages_used = bi->pages_in_use - bi->soft_del_pages;
-
-			if (bi->block_state == YAFFS_BLOCK_STATE_FULL &&
-			    pages_used < dev->param.chunks_per_block &&
-			    (dev->gc_dirtiest < 1
-			     || pages_used < dev->gc_pages_in_use)
-			    && yaffs_block_ok_for_gc(dev, bi)) {
-				dev->gc_dirtiest = dev->gc_block_finder;
-				dev->gc_pages_in_use = pages_used;
-			}
-		}
+		dev->gc_dirtiest = yaffs_gc_pick_block(dev, &pages_used);
+		dev->gc_pages_in_use = pages_used;
 
 		if (dev->gc_dirtiest > 0 && dev->gc_pages_in_use <= threshold)
 			selected = dev->gc_dirtiest;
@@ -2865,8 +3057,8 @@ static unsigned yaffs_find_gc_block(struct yaffs_dev *dev,
 	} else {
 		dev->gc_not_done++;
 		yaffs_trace(YAFFS_TRACE_GC,
-			"GC none: finder %d skip %d threshold %d dirtiest %d using %d oldest %d%s",
-			dev->gc_block_finder, dev->gc_not_done, threshold,
+			"GC none: skip %d threshold %d dirtiest %d using %d oldest %d%s",
+			dev->gc_not_done, threshold,
 			dev->gc_dirtiest, dev->gc_pages_in_use,
 			dev->oldest_dirty_block, background ? " bg" : "");
 	}
@@ -2891,6 +3083,8 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 	int min_erased;
 	int erased_chunks;
 	int checkpt_block_adjust;
+	int collected = 0;
+	s64 start_us = 0;
 
 	if (dev->param.gc_control && (dev->param.gc_control(dev) & 1) == 0)
 		return YAFFS_OK;
@@ -2900,6 +3094,9 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 		return YAFFS_OK;
 	}
 
+	if (!background)
+		start_us = Y_CLOCK_US();
+
 	/* This loop should pass the first time.
 	 * We'll only see looping here if the collection does not increase space.
 	 */
@@ -2959,6 +3156,7 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 				dev->n_erased_blocks, aggressive);
 
 			gc_ok = yaffs_gc_block(dev, dev->gc_block, aggressive);
+			collected = 1;
 		}
 
 		if (dev->n_erased_blocks < (dev->param.n_reserved_blocks)
@@ -2971,6 +3169,16 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
 	} while ((dev->n_erased_blocks < dev->param.n_reserved_blocks) &&
 		 (dev->gc_block > 0) && (max_tries < 2));
 
+	/* Writers should hardly ever get here; record what it cost them */
+	if (collected && !background) {
+		u32 elapsed_us = (u32) (Y_CLOCK_US() - start_us);
+
+		dev->fg_gcs++;
+		dev->fg_gc_total_us += elapsed_us;
+		if (elapsed_us > dev->fg_gc_max_us)
+			dev->fg_gc_max_us = elapsed_us;
+	}
+
 	return aggressive ? gc_ok : YAFFS_OK;
 }
 
@@ -2981,11 +3189,27 @@ static int yaffs_check_gc(struct yaffs_dev *dev, int background)
  */
 int yaffs_bg_gc(struct yaffs_dev *dev, unsigned urgency)
 {
-	int erased_chunks = dev->n_erased_blocks * dev->param.chunks_per_block;
+	int erased_chunks;
+	u32 work_done;
+	int passes = urgency ? urgency * YAFFS_BG_GC_PASSES : 1;
 
 	yaffs_trace(YAFFS_TRACE_BACKGROUND, "Background gc %u", urgency);
 
-	yaffs_check_gc(dev, 1);
+	/*
+	 * Each pass copies a few chunks. When writes are catching up with
+	 * the erased space, do several so the writers don't have to.
+	 */
+	dev->gc_urgency = urgency;
+	do {
+		work_done = dev->n_gc_copies + dev->n_erasures;
+		yaffs_check_gc(dev, 1);
+		work_done = dev->n_gc_copies + dev->n_erasures - work_done;
+		erased_chunks =
+		    dev->n_erased_blocks * dev->param.chunks_per_block;
+	} while (--passes > 0 && work_done &&
+		 erased_chunks <= dev->n_free_chunks / 2);
+	dev->gc_urgency = 0;
+
 	return erased_chunks > dev->n_free_chunks / 2;
 }
 
@@ -3067,6 +3291,8 @@ void yaffs_chunk_del(struct yaffs_dev *dev, int chunk_id, int mark_flash,
 		    bi->block_state != YAFFS_BLOCK_STATE_ALLOCATING &&
 		    bi->block_state != YAFFS_BLOCK_STATE_NEEDS_SCANNING) {
 			yaffs_block_became_dirty(dev, block);
+		} else {
+			yaffs_gc_file_block(dev, block);
 		}
 
 	}
@@ -3201,11 +3427,11 @@ static int yaffs_do_xattrib_fetch(struct yaffs_obj *obj, const YCHAR * name,
 	/* If we know that the object has no xattribs then don't do all the
 	 * reading and parsing.
 	 */
-	if (obj->xattr_known && !obj->has_xattr) {
-		if (name)
-			return -ENODATA;
-		else
-			return 0;
+	if (obj->xattr_known) {
+		/* Pairs with the smp_wmb() below */
+		smp_rmb();
+		if (!obj->has_xattr)
+			return name ? -ENODATA : 0;
 	}
 
 	buffer = (char *)yaffs_get_temp_buffer(dev, __LINE__);
@@ -3221,8 +3447,11 @@ static int yaffs_do_xattrib_fetch(struct yaffs_obj *obj, const YCHAR * name,
 		x_buffer = buffer + x_offs;
 
 		if (!obj->xattr_known) {
+			mutex_lock(&dev->lazy_lock);
 			obj->has_xattr = nval_hasvalues(x_buffer, x_size);
+			smp_wmb();
 			obj->xattr_known = 1;
+			mutex_unlock(&dev->lazy_lock);
 		}
 
 		if (name)
@@ -3270,8 +3499,15 @@ static void yaffs_check_obj_details_loaded(struct yaffs_obj *in)
 
 	dev = in->my_dev;
 
+	if (!in->lazy_loaded) {
+		/* Pairs with the smp_wmb() below */
+		smp_rmb();
+		return;
+	}
+
+	mutex_lock(&dev->lazy_lock);
+
 	if (in->lazy_loaded && in->hdr_chunk > 0) {
-		in->lazy_loaded = 0;
 		chunk_data = yaffs_get_temp_buffer(dev, __LINE__);
 
 		result =
@@ -3291,7 +3527,13 @@ static void yaffs_check_obj_details_loaded(struct yaffs_obj *in)
 		}
 
 		yaffs_release_temp_buffer(dev, chunk_data, __LINE__);
+
+		/* Readers that see the flag clear must see the details */
+		smp_wmb();
+		in->lazy_loaded = 0;
 	}
+
+	mutex_unlock(&dev->lazy_lock);
 }
 
 static void yaffs_load_name_from_oh(struct yaffs_dev *dev, YCHAR * name,
@@ -3566,50 +3808,49 @@ int yaffs_file_rd(struct yaffs_obj *in, u8 * buffer, loff_t offset, int n_bytes)
 		else
 			n_copy = dev->data_bytes_per_chunk - start;
 
+		/* Readers share the cache, and only fill clean chunks of it */
+		if (dev->param.n_caches > 0)
+			mutex_lock(&dev->cache_lock);
+
 		cache = yaffs_find_chunk_cache(in, chunk);
 
 		/* If the chunk is already in the cache or it is less than a whole chunk
 		 * or we're using inband tags then use the cache (if there is caching)
 		 * else bypass the cache.
 		 */
-		if (cache || n_copy != dev->data_bytes_per_chunk
-		    || dev->param.inband_tags) {
-			if (dev->param.n_caches > 0) {
-
-				/* If we can't find the data in the cache, then load it up. */
-
-				if (!cache) {
-					cache =
-					    yaffs_grab_chunk_cache(in->my_dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
-					yaffs_rd_data_obj(in, chunk,
-							  cache->data);
-					cache->n_bytes = 0;
-				}
-
-				yaffs_use_cache(dev, cache, 0);
-
-				cache->locked = 1;
+		if (!cache && (n_copy != dev->data_bytes_per_chunk
+			       || dev->param.inband_tags) &&
+		    dev->param.n_caches > 0) {
+			/* If we can't find the data in the cache, then load it up. */
+			cache = yaffs_grab_clean_chunk_cache(dev);
+			if (cache) {
+				yaffs_cache_attach(dev, cache, in, chunk);
+				yaffs_rd_data_obj(in, chunk, cache->data);
+			}
+		}
 
-				memcpy(buffer, &cache->data[start], n_copy);
+		if (cache) {
+			yaffs_use_cache(dev, cache, 0);
+			memcpy(buffer, &cache->data[start], n_copy);
+		}
 
-				cache->locked = 0;
-			} else {
-				/* Read into the local buffer then copy.. */
+		if (dev->param.n_caches > 0)
+			mutex_unlock(&dev->cache_lock);
 
-				u8 *local_buffer =
-				    yaffs_get_temp_buffer(dev, __LINE__);
-				yaffs_rd_data_obj(in, chunk, local_buffer);
+		if (cache) {
+			/* Done, copied from the cache */
+		} else if (n_copy != dev->data_bytes_per_chunk
+			   || dev->param.inband_tags) {
+			/* Read into the local buffer then copy.. */
 
-				memcpy(buffer, &local_buffer[start], n_copy);
+			u8 *local_buffer =
+			    yaffs_get_temp_buffer(dev, __LINE__);
+			yaffs_rd_data_obj(in, chunk, local_buffer);
 
-				yaffs_release_temp_buffer(dev, local_buffer,
-							  __LINE__);
-			}
+			memcpy(buffer, &local_buffer[start], n_copy);
 
+			yaffs_release_temp_buffer(dev, local_buffer,
+						  __LINE__);
 		} else {
 
 			/* A full chunk. Read directly into the supplied buffer. */
@@ -3707,12 +3948,12 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 				if (!cache
 				    && yaffs_check_alloc_available(dev, 1)) {
 					cache = yaffs_grab_chunk_cache(dev);
-					cache->object = in;
-					cache->chunk_id = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
-					yaffs_rd_data_obj(in, chunk,
-							  cache->data);
+					if (cache) {
+						yaffs_cache_attach(dev, cache,
+								   in, chunk);
+						yaffs_rd_data_obj(in, chunk,
+								  cache->data);
+					}
 				} else if (cache &&
 					   !cache->dirty &&
 					   !yaffs_check_alloc_available(dev,
@@ -3740,7 +3981,8 @@ int yaffs_do_file_wr(struct yaffs_obj *in, const u8 * buffer, loff_t offset,
 						     cache->chunk_id,
 						     cache->data,
 						     cache->n_bytes, 1);
-						cache->dirty = 0;
+						yaffs_cache_set_clean(dev,
+								      cache);
 					}
 
 				} else {
@@ -4776,6 +5018,11 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		return YAFFS_FAIL;
 	}
 
+	spin_lock_init(&dev->temp_lock);
+	mutex_init(&dev->cache_lock);
+	mutex_init(&dev->lazy_lock);
+	mutex_init(&dev->nand_read_lock);
+
 	dev->internal_start_block = dev->param.start_block;
 	dev->internal_end_block = dev->param.end_block;
 	dev->block_offset = 0;
@@ -4916,7 +5163,10 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 	dev->passive_gc_count = 0;
 	dev->oldest_dirty_gc_count = 0;
 	dev->bg_gcs = 0;
-	dev->gc_block_finder = 0;
+	dev->gc_urgency = 0;
+	dev->fg_gcs = 0;
+	dev->fg_gc_max_us = 0;
+	dev->fg_gc_total_us = 0;
 	dev->buffered_block = -1;
 	dev->doing_buffered_block_rewrite = 0;
 	dev->n_deleted_files = 0;
@@ -4939,38 +5189,60 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		init_failed = 1;
 
 	dev->cache = NULL;
+	dev->cache_hash = NULL;
+	dev->cache_flush = NULL;
 	dev->gc_cleanup_list = NULL;
+	INIT_LIST_HEAD(&dev->cache_lru);
+	INIT_LIST_HEAD(&dev->cache_free);
+	INIT_LIST_HEAD(&dev->cache_dirty);
+	dev->n_dirty_caches = 0;
 
 	if (!init_failed && dev->param.n_caches > 0) {
 		int i;
 		void *buf;
-		int cache_bytes =
-		    dev->param.n_caches * sizeof(struct yaffs_cache);
+		int cache_bytes;
+		int n_chains;
 
 		if (dev->param.n_caches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->param.n_caches = YAFFS_MAX_SHORT_OP_CACHES;
 
+		cache_bytes = dev->param.n_caches * sizeof(struct yaffs_cache);
+		n_chains = 1 << calc_shifts_ceiling(dev->param.n_caches);
+		dev->cache_hash_mask = n_chains - 1;
+
 		dev->cache = kmalloc(cache_bytes, GFP_NOFS);
+		dev->cache_hash =
+		    kmalloc(n_chains * sizeof(struct list_head), GFP_NOFS);
+		dev->cache_flush =
+		    kmalloc(dev->param.n_caches * sizeof(struct yaffs_cache *),
+			    GFP_NOFS);
 
 		buf = (u8 *) dev->cache;
+		if (!dev->cache_hash || !dev->cache_flush)
+			buf = NULL;
 
 		if (dev->cache)
 			memset(dev->cache, 0, cache_bytes);
 
+		for (i = 0; i < n_chains && buf; i++)
+			INIT_LIST_HEAD(&dev->cache_hash[i]);
+
 		for (i = 0; i < dev->param.n_caches && buf; i++) {
 			dev->cache[i].object = NULL;
-			dev->cache[i].last_use = 0;
 			dev->cache[i].dirty = 0;
+			INIT_LIST_HEAD(&dev->cache[i].hash_link);
+			INIT_LIST_HEAD(&dev->cache[i].dirty_link);
+			list_add_tail(&dev->cache[i].lru_link,
+				      &dev->cache_free);
 			dev->cache[i].data = buf =
 			    kmalloc(dev->param.total_bytes_per_chunk, GFP_NOFS);
 		}
 		if (!buf)
 			init_failed = 1;
-
-		dev->cache_last_use = 0;
 	}
 
 	dev->cache_hits = 0;
+	dev->cache_misses = 0;
 
 	if (!init_failed) {
 		dev->gc_cleanup_list =
@@ -5036,6 +5308,8 @@ int yaffs_guts_initialise(struct yaffs_dev *dev)
 		yaffs_fix_hanging_objs(dev);
 		if (dev->param.empty_lost_n_found)
 			yaffs_empty_l_n_f(dev);
+		if (!init_failed)
+			yaffs_gc_fill_buckets(dev);
 	}
 
 	if (init_failed) {
@@ -5087,6 +5361,10 @@ void yaffs_deinitialise(struct yaffs_dev *dev)
 			kfree(dev->cache);
 			dev->cache = NULL;
 		}
+		kfree(dev->cache_hash);
+		dev->cache_hash = NULL;
+		kfree(dev->cache_flush);
+		dev->cache_flush = NULL;
 
 		kfree(dev->gc_cleanup_list);
 
@@ -5132,21 +5410,13 @@ int yaffs_get_n_free_chunks(struct yaffs_dev *dev)
 	/* This is what we report to the outside world */
 
 	int n_free;
-	int n_dirty_caches;
 	int blocks_for_checkpt;
-	int i;
 
 	n_free = dev->n_free_chunks;
 	n_free += dev->n_deleted_files;
 
-	/* Now count the number of dirty chunks in the cache and subtract those */
-
-	for (n_dirty_caches = 0, i = 0; i < dev->param.n_caches; i++) {
-		if (dev->cache[i].dirty)
-			n_dirty_caches++;
-	}
-
-	n_free -= n_dirty_caches;
+	/* Now subtract the number of dirty chunks in the cache */
+	n_free -= dev->n_dirty_caches;
 
 	n_free -=
 	    ((dev->param.n_reserved_blocks + 1) * dev->param.chunks_per_block);
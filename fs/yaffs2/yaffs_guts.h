@@ -83,10 +83,13 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA  0x21
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	1024
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
+/* Full blocks are filed for gc in this many buckets by pages still in use */
+#define YAFFS_GC_N_BUCKETS		16
+
 /* We limit the number attempts at sucessfully saving a chunk of data.
  * Small-page devices have 32 pages per block; large-page devices have 64.
  * Default to something in the order of 5 to 10 blocks worth of chunks.
@@ -110,11 +113,13 @@
 struct yaffs_cache {
 	struct yaffs_obj *object;
 	int chunk_id;
-	int last_use;
 	int dirty;
 	int n_bytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
 	u8 *data;
+	struct list_head hash_link;	/* In a hash chain while it has an object */
+	struct list_head lru_link;	/* In the lru list, else the free list */
+	struct list_head dirty_link;	/* In the dirty list while dirty */
 };
 
 /* Tags structures in RAM
@@ -286,6 +291,16 @@ struct yaffs_block_info {
 
 };
 
+/*
+ * Links a block into its gc bucket. Kept beside the block info rather than
+ * in it, because the block info goes into checkpoints as it is.
+ */
+struct yaffs_gc_link {
+	u32 next;		/* block number, or 0 at the end of the bucket */
+	u32 prev;
+	int bucket;		/* -1 when not filed */
+};
+
 /* -------------------------- Object structure -------------------------------*/
 /* This is the object structure as stored on NAND */
 
@@ -506,8 +521,9 @@ struct yaffs_param {
 	/* reserved blocks on NOR and RAM. */
 
 	int n_caches;		/* If <= 0, then short op caching is disabled, else
-				 * the number of short op caches (don't use too many).
-				 * 10 to 20 is a good bet.
+				 * the number of short op caches, at most
+				 * YAFFS_MAX_SHORT_OP_CACHES. Lookups are hashed, so
+				 * the size is bounded by memory rather than by search.
 				 */
 	int use_nand_ecc;	/* Flag to decide whether or not to use NANDECC on data (yaffs1) */
 	int no_tags_ecc;	/* Flag to decide whether or not to do ECC on packed tags (yaffs2) */
@@ -547,6 +563,10 @@ struct yaffs_param {
 	int (*query_block_fn) (struct yaffs_dev * dev, int block_no,
 			       enum yaffs_block_state * state,
 			       u32 * seq_number);
+	/* Optional: the tags, without data, of consecutive chunks at once */
+	int (*read_block_tags_fn) (struct yaffs_dev * dev,
+				   int nand_chunk, int n_chunks,
+				   struct yaffs_ext_tags * tags);
 #endif
 
 	/* The remove_obj_fn function must be supplied by OS flavours that
@@ -574,6 +594,7 @@ struct yaffs_param {
 	int auto_unicode;
 #endif
 	int always_check_erased;	/* Force chunk erased check always on */
+	int n_scan_threads;	/* Threads reading ahead for the yaffs2 scan, 0 for none */
 };
 
 struct yaffs_dev {
@@ -641,6 +662,12 @@ struct yaffs_dev {
 				 * Must be consistent with chunks_per_block.
 				 */
 
+	/* Gc candidates: full blocks that are not fully in use, dirtiest first */
+	struct yaffs_gc_link *gc_links;
+	unsigned gc_links_alt:1;	/* was allocated using alternative strategy */
+	u32 gc_bucket_head[YAFFS_GC_N_BUCKETS];
+	u32 gc_bucket_tail[YAFFS_GC_N_BUCKETS];
+
 	int n_erased_blocks;
 	int alloc_block;	/* Current block being allocated off */
 	u32 alloc_page;
@@ -664,7 +691,7 @@ struct yaffs_dev {
 
 	unsigned has_pending_prioritised_gc;	/* We think this device might have pending prioritised gcs */
 	unsigned gc_disable;
-	unsigned gc_block_finder;
+	unsigned gc_urgency;	/* 0..2, how hard background gc should try */
 	unsigned gc_dirtiest;
 	unsigned gc_pages_in_use;
 	unsigned gc_not_done;
@@ -685,7 +712,24 @@ struct yaffs_dev {
 	int doing_buffered_block_rewrite;
 
 	struct yaffs_cache *cache;
-	int cache_last_use;
+	struct list_head *cache_hash;	/* Chains of caches by object and chunk */
+	u32 cache_hash_mask;
+	struct list_head cache_lru;	/* In use, least recently used first */
+	struct list_head cache_free;
+	struct list_head cache_dirty;
+	int n_dirty_caches;
+	struct yaffs_cache **cache_flush;	/* Caches to write back in order */
+
+	/*
+	 * The OS glue runs operations that only read under a shared lock,
+	 * and anything else exclusively. These serialise what readers
+	 * still change between themselves.
+	 */
+	spinlock_t temp_lock;		/* temp_buffer and its stats */
+	struct mutex cache_lock;	/* readers' use of the short op cache */
+	struct mutex lazy_lock;		/* details readers load into objects */
+	struct mutex nand_read_lock;	/* chunk reads and the error handling
+					 * and stats they update */
 
 	/* Stuff for background deletion and unlinked files. */
 	struct yaffs_obj *unlinked_dir;	/* Directory where unlinked and deleted files live. */
@@ -724,6 +768,9 @@ struct yaffs_dev {
 	u32 oldest_dirty_gc_count;
 	u32 n_gc_blocks;
 	u32 bg_gcs;
+	u32 fg_gcs;		/* Collections done inline by the writer */
+	u32 fg_gc_max_us;	/* Longest of those */
+	u64 fg_gc_total_us;
 	u32 n_retired_writes;
 	u32 n_retired_blocks;
 	u32 n_ecc_fixed;
@@ -734,6 +781,7 @@ struct yaffs_dev {
 	u32 n_unmarked_deletions;
 	u32 refresh_count;
 	u32 cache_hits;
+	u32 cache_misses;
 
 };
 
@@ -24,14 +24,23 @@ struct yaffs_linux_context {
 	struct super_block *super;
 	struct task_struct *bg_thread;	/* Background thread for this device */
 	int bg_running;
-	struct mutex gross_lock;	/* Gross locking mutex*/
+	/*
+	 * Gross lock. Operations that only read take it shared, the rest
+	 * exclusively.
+	 */
+	struct rw_semaphore gross_lock;
 	u8 *spare_buffer;	/* For mtdif2 use. Don't know the size of the buffer
 				 * at compile time so we have to allocate it.
 				 */
 	struct list_head search_contexts;
+	spinlock_t search_lock;		/* protects search_contexts */
+	/* What the background thread paces gc by, under the gross lock */
+	unsigned long gc_sampled;	/* jiffies at the last sample */
+	u32 gc_sampled_writes;		/* writes other than gc copies by then */
+	unsigned gc_write_rate;		/* chunks per second, averaged */
+	unsigned long last_write;	/* jiffies when writes were last seen */
 	void (*put_super_fn) (struct super_block * sb);
 
-	struct task_struct *readdir_process;
 	unsigned mount_id;
 };
 
@@ -25,6 +25,9 @@ int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 
 	int realigned_chunk = nand_chunk - dev->chunk_offset;
 
+	/* Readers run concurrently, the drivers share buffers between reads */
+	mutex_lock(&dev->nand_read_lock);
+
 	dev->n_page_reads++;
 
 	/* If there are no tags provided, use local tags to get prioritised gc working */
@@ -47,9 +50,49 @@ int yaffs_rd_chunk_tags_nand(struct yaffs_dev *dev, int nand_chunk,
 		yaffs_handle_chunk_error(dev, bi);
 	}
 
+	mutex_unlock(&dev->nand_read_lock);
+
 	return result;
 }
 
+/*
+ * Reads the tags of every chunk in a block, for scanning. Errors are not
+ * handled here: the scan handles them as it comes to each chunk.
+ */
+int yaffs_rd_block_tags_nand(struct yaffs_dev *dev, int block_no,
+			     struct yaffs_ext_tags *tags)
+{
+	int n_chunks = dev->param.chunks_per_block;
+	int realigned_chunk = block_no * n_chunks - dev->chunk_offset;
+	int result = YAFFS_FAIL;
+	int i;
+
+	mutex_lock(&dev->nand_read_lock);
+
+	dev->n_page_reads += n_chunks;
+
+	if (dev->param.read_block_tags_fn)
+		result = dev->param.read_block_tags_fn(dev, realigned_chunk,
+						       n_chunks, tags);
+
+	/* Without a block read, or if it failed, read them one by one */
+	if (result != YAFFS_OK) {
+		for (i = 0; i < n_chunks; i++) {
+			if (dev->param.read_chunk_tags_fn)
+				dev->param.read_chunk_tags_fn(dev,
+						realigned_chunk + i,
+						NULL, &tags[i]);
+			else
+				yaffs_tags_compat_rd(dev, realigned_chunk + i,
+						     NULL, &tags[i]);
+		}
+	}
+
+	mutex_unlock(&dev->nand_read_lock);
+
+	return YAFFS_OK;
+}
+
 int yaffs_wr_chunk_tags_nand(struct yaffs_dev *dev,
 			     int nand_chunk,
 			     const u8 * buffer, struct yaffs_ext_tags *tags)
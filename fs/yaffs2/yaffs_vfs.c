@@ -96,6 +96,8 @@ unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
 unsigned int yaffs_gc_control = 1;
 unsigned int yaffs_bg_enable = 1;
+unsigned int yaffs_scan_threads = 2;
+unsigned int yaffs_idle_checkpoint;
 
 /* Module Parameters */
 module_param(yaffs_trace_mask, uint, 0644);
@@ -103,6 +105,8 @@ module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
 module_param(yaffs_bg_enable, uint, 0644);
+module_param(yaffs_scan_threads, uint, 0644);
+module_param(yaffs_idle_checkpoint, uint, 0644);
 
 
 #define yaffs_inode_to_obj_lv(iptr) ((iptr)->i_private)
@@ -123,14 +127,31 @@ static unsigned yaffs_gc_control_callback(struct yaffs_dev *dev)
 static void yaffs_gross_lock(struct yaffs_dev *dev)
 {
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locking %p", current);
-	mutex_lock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	down_write(&(yaffs_dev_to_lc(dev)->gross_lock));
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locked %p", current);
 }
 
 static void yaffs_gross_unlock(struct yaffs_dev *dev)
 {
 	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs unlocking %p", current);
-	mutex_unlock(&(yaffs_dev_to_lc(dev)->gross_lock));
+	up_write(&(yaffs_dev_to_lc(dev)->gross_lock));
+}
+
+/*
+ * For operations that do not change the file system. They run
+ * concurrently, the few things they do change have locks in the device.
+ */
+static void yaffs_gross_lock_shared(struct yaffs_dev *dev)
+{
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locking shared %p", current);
+	down_read(&(yaffs_dev_to_lc(dev)->gross_lock));
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs locked shared %p", current);
+}
+
+static void yaffs_gross_unlock_shared(struct yaffs_dev *dev)
+{
+	yaffs_trace(YAFFS_TRACE_LOCK, "yaffs unlocking shared %p", current);
+	up_read(&(yaffs_dev_to_lc(dev)->gross_lock));
 }
 
 static void yaffs_fill_inode_from_obj(struct inode *inode,
@@ -155,13 +176,13 @@ static struct inode *yaffs_iget(struct super_block *sb, unsigned long ino)
 	 * need to lock again.
 	 */
 
-	yaffs_gross_lock(dev);
+	yaffs_gross_lock_shared(dev);
 
 	obj = yaffs_find_by_number(dev, inode->i_ino);
 
 	yaffs_fill_inode_from_obj(inode, obj);
 
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_shared(dev);
 
 	unlock_new_inode(inode);
 	return inode;
@@ -372,8 +393,7 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry,
 
 	struct yaffs_dev *dev = yaffs_inode_to_obj(dir)->my_dev;
 
-	if (current != yaffs_dev_to_lc(dev)->readdir_process)
-		yaffs_gross_lock(dev);
+	yaffs_gross_lock_shared(dev);
 
 	yaffs_trace(YAFFS_TRACE_OS,
 		"yaffs_lookup for %d:%s",
@@ -384,8 +404,7 @@ static struct dentry *yaffs_lookup(struct inode *dir, struct dentry *dentry,
 	obj = yaffs_get_equivalent_obj(obj);	/* in case it was a hardlink */
 
 	/* Can't hold gross lock when calling yaffs_get_inode() */
-	if (current != yaffs_dev_to_lc(dev)->readdir_process)
-		yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_shared(dev);
 
 	if (obj) {
 		yaffs_trace(YAFFS_TRACE_OS,
@@ -599,9 +618,9 @@ static ssize_t yaffs_getxattr(struct dentry * dentry, const char *name, void *bu
 
 	if (error == 0) {
 		dev = obj->my_dev;
-		yaffs_gross_lock(dev);
+		yaffs_gross_lock_shared(dev);
 		error = yaffs_get_xattrib(obj, name, buff, size);
-		yaffs_gross_unlock(dev);
+		yaffs_gross_unlock_shared(dev);
 
 	}
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_getxattr done returning %d", error);
@@ -649,9 +668,9 @@ static ssize_t yaffs_listxattr(struct dentry * dentry, char *buff, size_t size)
 
 	if (error == 0) {
 		dev = obj->my_dev;
-		yaffs_gross_lock(dev);
+		yaffs_gross_lock_shared(dev);
 		error = yaffs_list_xattrib(obj, buff, size);
-		yaffs_gross_unlock(dev);
+		yaffs_gross_unlock_shared(dev);
 
 	}
 	yaffs_trace(YAFFS_TRACE_OS,
@@ -696,7 +715,8 @@ static const struct inode_operations yaffs_dir_inode_operations = {
  *
  * A seach context lives for the duration of a readdir.
  *
- * All these functions must be called while yaffs is locked.
+ * All these functions must be called while yaffs is locked. Readdirs
+ * only lock it shared, so the list itself has search_lock too.
  */
 
 struct yaffs_search_context {
@@ -727,7 +747,9 @@ static struct yaffs_search_context *yaffs_new_search(struct yaffs_obj *dir)
 			    list_entry(dir->variant.dir_variant.children.next,
 				       struct yaffs_obj, siblings);
 		INIT_LIST_HEAD(&sc->others);
+		spin_lock(&yaffs_dev_to_lc(dev)->search_lock);
 		list_add(&sc->others, &(yaffs_dev_to_lc(dev)->search_contexts));
+		spin_unlock(&yaffs_dev_to_lc(dev)->search_lock);
 	}
 	return sc;
 }
@@ -738,7 +760,9 @@ static struct yaffs_search_context *yaffs_new_search(struct yaffs_obj *dir)
 static void yaffs_search_end(struct yaffs_search_context *sc)
 {
 	if (sc) {
+		spin_lock(&yaffs_dev_to_lc(sc->dev)->search_lock);
 		list_del(&sc->others);
+		spin_unlock(&yaffs_dev_to_lc(sc->dev)->search_lock);
 		kfree(sc);
 	}
 }
@@ -777,13 +801,14 @@ static void yaffs_remove_obj_callback(struct yaffs_obj *obj)
 
 	struct list_head *i;
 	struct yaffs_search_context *sc;
-	struct list_head *search_contexts =
-	    &(yaffs_dev_to_lc(obj->my_dev)->search_contexts);
+	struct yaffs_linux_context *lc = yaffs_dev_to_lc(obj->my_dev);
+	struct list_head *search_contexts = &lc->search_contexts;
 
 	/* Iterate through the directory search contexts.
 	 * If any are currently on the object being removed, then advance
 	 * the search context to the next object to prevent a hanging pointer.
 	 */
+	spin_lock(&lc->search_lock);
 	list_for_each(i, search_contexts) {
 		if (i) {
 			sc = list_entry(i, struct yaffs_search_context, others);
@@ -791,6 +816,7 @@ static void yaffs_remove_obj_callback(struct yaffs_obj *obj)
 				yaffs_search_advance(sc);
 		}
 	}
+	spin_unlock(&lc->search_lock);
 
 }
 
@@ -809,9 +835,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 	obj = yaffs_dentry_to_obj(f->f_dentry);
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
-
-	yaffs_dev_to_lc(dev)->readdir_process = current;
+	yaffs_gross_lock_shared(dev);
 
 	offset = f->f_pos;
 
@@ -828,12 +852,12 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		yaffs_trace(YAFFS_TRACE_OS,
 			"yaffs_readdir: entry . ino %d",
 			(int)inode->i_ino);
-		yaffs_gross_unlock(dev);
+		yaffs_gross_unlock_shared(dev);
 		if (filldir(dirent, ".", 1, offset, inode->i_ino, DT_DIR) < 0) {
-			yaffs_gross_lock(dev);
+			yaffs_gross_lock_shared(dev);
 			goto out;
 		}
-		yaffs_gross_lock(dev);
+		yaffs_gross_lock_shared(dev);
 		offset++;
 		f->f_pos++;
 	}
@@ -841,14 +865,14 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 		yaffs_trace(YAFFS_TRACE_OS,
 			"yaffs_readdir: entry .. ino %d",
 			(int)f->f_dentry->d_parent->d_inode->i_ino);
-		yaffs_gross_unlock(dev);
+		yaffs_gross_unlock_shared(dev);
 		if (filldir(dirent, "..", 2, offset,
 			    f->f_dentry->d_parent->d_inode->i_ino,
 			    DT_DIR) < 0) {
-			yaffs_gross_lock(dev);
+			yaffs_gross_lock_shared(dev);
 			goto out;
 		}
-		yaffs_gross_lock(dev);
+		yaffs_gross_lock_shared(dev);
 		offset++;
 		f->f_pos++;
 	}
@@ -875,17 +899,17 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 				"yaffs_readdir: %s inode %d",
 				name, yaffs_get_obj_inode(l));
 
-			yaffs_gross_unlock(dev);
+			yaffs_gross_unlock_shared(dev);
 
 			if (filldir(dirent,
 				    name,
 				    strlen(name),
 				    offset, this_inode, this_type) < 0) {
-				yaffs_gross_lock(dev);
+				yaffs_gross_lock_shared(dev);
 				goto out;
 			}
 
-			yaffs_gross_lock(dev);
+			yaffs_gross_lock_shared(dev);
 
 			offset++;
 			f->f_pos++;
@@ -895,8 +919,7 @@ static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
 
 out:
 	yaffs_search_end(sc);
-	yaffs_dev_to_lc(dev)->readdir_process = NULL;
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_shared(dev);
 
 	return ret_val;
 }
@@ -1020,11 +1043,11 @@ static int yaffs_readlink(struct dentry *dentry, char __user * buffer,
 
 	struct yaffs_dev *dev = yaffs_dentry_to_obj(dentry)->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_gross_lock_shared(dev);
 
 	alias = yaffs_get_symlink_alias(yaffs_dentry_to_obj(dentry));
 
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_shared(dev);
 
 	if (!alias)
 		return -ENOMEM;
@@ -1040,10 +1063,10 @@ static void *yaffs_follow_link(struct dentry *dentry, struct nameidata *nd)
 	void *ret;
 	struct yaffs_dev *dev = yaffs_dentry_to_obj(dentry)->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_gross_lock_shared(dev);
 
 	alias = yaffs_get_symlink_alias(yaffs_dentry_to_obj(dentry));
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_shared(dev);
 
 	if (!alias) {
 		ret = ERR_PTR(-ENOMEM);
@@ -1148,12 +1171,12 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_gross_lock(dev);
+	yaffs_gross_lock_shared(dev);
 
 	ret = yaffs_file_rd(obj, pg_buf,
 			    pg->index << PAGE_CACHE_SHIFT, PAGE_CACHE_SIZE);
 
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_shared(dev);
 
 	if (ret >= 0)
 		ret = 0;
@@ -1290,11 +1313,11 @@ static ssize_t yaffs_hold_space(struct file *f)
 
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_gross_lock_shared(dev);
 
 	n_free_chunks = yaffs_get_n_free_chunks(dev);
 
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_shared(dev);
 
 	return (n_free_chunks > 20) ? 1 : 0;
 }
@@ -1308,9 +1331,9 @@ static void yaffs_release_space(struct file *f)
 
 	dev = obj->my_dev;
 
-	yaffs_gross_lock(dev);
+	yaffs_gross_lock_shared(dev);
 
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_shared(dev);
 }
 
 static int yaffs_write_begin(struct file *filp, struct address_space *mapping,
@@ -1461,7 +1484,7 @@ static int yaffs_statfs(struct dentry *dentry, struct kstatfs *buf)
 
 	yaffs_trace(YAFFS_TRACE_OS, "yaffs_statfs");
 
-	yaffs_gross_lock(dev);
+	yaffs_gross_lock_shared(dev);
 
 	buf->f_type = YAFFS_MAGIC;
 	buf->f_bsize = sb->s_blocksize;
@@ -1513,7 +1536,7 @@ static int yaffs_statfs(struct dentry *dentry, struct kstatfs *buf)
 	buf->f_ffree = 0;
 	buf->f_bavail = buf->f_bfree;
 
-	yaffs_gross_unlock(dev);
+	yaffs_gross_unlock_shared(dev);
 	return 0;
 }
 
@@ -1545,20 +1568,54 @@ static void yaffs_flush_super(struct super_block *sb, int do_checkpoint)
 		yaffs_checkpoint_save(dev);
 }
 
+/*
+ * Samples how fast the writers use up chunks, leaving out what gc copies.
+ * The rate is averaged over samples at least YAFFS_BG_SAMPLE apart.
+ */
+#define YAFFS_BG_SAMPLE (HZ / 10 + 1)
+
+static void yaffs_bg_sample_writes(struct yaffs_dev *dev, unsigned long now)
+{
+	struct yaffs_linux_context *context = yaffs_dev_to_lc(dev);
+	u32 writes = dev->n_page_writes - dev->n_gc_copies;
+	unsigned long elapsed = now - context->gc_sampled;
+	unsigned rate;
+
+	if (elapsed < YAFFS_BG_SAMPLE)
+		return;
+
+	rate = (writes - context->gc_sampled_writes) * HZ / elapsed;
+	context->gc_write_rate = (context->gc_write_rate * 3 + rate) / 4;
+	context->gc_sampled = now;
+	context->gc_sampled_writes = writes;
+	if (rate)
+		context->last_write = now;
+}
+
+/* Seconds of writing at the current rate that background gc looks ahead */
+#define YAFFS_BG_LOOKAHEAD 4
+
 static unsigned yaffs_bg_gc_urgency(struct yaffs_dev *dev)
 {
 	unsigned erased_chunks =
 	    dev->n_erased_blocks * dev->param.chunks_per_block;
 	struct yaffs_linux_context *context = yaffs_dev_to_lc(dev);
 	unsigned scattered = 0;	/* Free chunks not in an erased block */
+	unsigned headroom = 0;	/* Chunks to write before writers do gc */
 
 	if (erased_chunks < dev->n_free_chunks)
 		scattered = (dev->n_free_chunks - erased_chunks);
+	if (erased_chunks > dev->n_free_chunks / 4)
+		headroom = erased_chunks - dev->n_free_chunks / 4;
 
 	if (!context->bg_running)
 		return 0;
 	else if (scattered < (dev->param.chunks_per_block * 2))
 		return 0;
+	else if (headroom < context->gc_write_rate)
+		return 2;
+	else if (headroom < context->gc_write_rate * YAFFS_BG_LOOKAHEAD)
+		return 1;
 	else if (erased_chunks > dev->n_free_chunks / 2)
 		return 0;
 	else if (erased_chunks > dev->n_free_chunks / 4)
@@ -1567,6 +1624,31 @@ static unsigned yaffs_bg_gc_urgency(struct yaffs_dev *dev)
 		return 2;
 }
 
+/*
+ * With yaffs_idle_checkpoint set, a checkpoint is written once there have
+ * been no writes for that many seconds, so that a crash during a quiet
+ * spell mounts from the checkpoint rather than by scanning.
+ */
+static void yaffs_bg_checkpoint(struct yaffs_dev *dev, unsigned long now)
+{
+	struct yaffs_linux_context *context = yaffs_dev_to_lc(dev);
+	struct super_block *sb = context->super;
+
+	if (!yaffs_idle_checkpoint || dev->read_only ||
+	    dev->is_checkpointed || yaffs_bg_gc_urgency(dev) ||
+	    time_before(now, context->last_write + yaffs_idle_checkpoint * HZ))
+		return;
+
+	yaffs_trace(YAFFS_TRACE_BACKGROUND | YAFFS_TRACE_CHECKPOINT,
+		"yaffs_background idle checkpoint");
+
+	yaffs_flush_super(sb, 1);
+	sb->s_dirt = 0;
+
+	/* Whether or not it took, don't try again until the next idle spell */
+	context->last_write = now;
+}
+
 static int yaffs_do_sync_fs(struct super_block *sb, int request_checkpoint)
 {
 
@@ -1630,6 +1712,13 @@ static int yaffs_bg_thread_fn(void *data)
 	yaffs_trace(YAFFS_TRACE_BACKGROUND,
 		"yaffs_background starting for dev %p", (void *)dev);
 
+	yaffs_gross_lock(dev);
+	context->gc_sampled = now;
+	context->gc_sampled_writes = dev->n_page_writes - dev->n_gc_copies;
+	context->gc_write_rate = 0;
+	context->last_write = now;
+	yaffs_gross_unlock(dev);
+
 	set_freezable();
 	while (context->bg_running) {
 		yaffs_trace(YAFFS_TRACE_BACKGROUND, "yaffs_background");
@@ -1649,6 +1738,10 @@ static int yaffs_bg_thread_fn(void *data)
 			next_dir_update = now + HZ;
 		}
 
+		yaffs_bg_sample_writes(dev, now);
+		if (yaffs_bg_enable)
+			yaffs_bg_checkpoint(dev, now);
+
 		if (time_after(now, next_gc) && yaffs_bg_enable) {
 			if (!dev->is_checkpointed) {
 				urgency = yaffs_bg_gc_urgency(dev);
@@ -1657,6 +1750,8 @@ static int yaffs_bg_thread_fn(void *data)
 					next_gc = now + HZ / 20 + 1;
 				else if (urgency > 0)
 					next_gc = now + HZ / 10 + 1;
+				else if (context->gc_write_rate)
+					next_gc = now + HZ / 2;
 				else
 					next_gc = now + HZ * 2;
 			} else	{
@@ -1757,6 +1852,7 @@ struct yaffs_options {
 	int skip_checkpoint_read;
 	int skip_checkpoint_write;
 	int no_cache;
+	int n_caches;		/* 0 to size the cache from memory */
 	int tags_ecc_on;
 	int tags_ecc_overridden;
 	int lazy_loading_enabled;
@@ -1765,6 +1861,22 @@ struct yaffs_options {
 	int empty_lost_and_found_overridden;
 };
 
+/*
+ * Unless the mount says otherwise the short op cache gets about 1/2048 of
+ * memory, and never less than the ten chunks it always had.
+ */
+static int yaffs_default_n_caches(int chunk_bytes)
+{
+	unsigned long n = (totalram_pages >> 11) * PAGE_SIZE / chunk_bytes;
+
+	if (n < 10)
+		n = 10;
+	if (n > YAFFS_MAX_SHORT_OP_CACHES)
+		n = YAFFS_MAX_SHORT_OP_CACHES;
+
+	return n;
+}
+
 #define MAX_OPT_LEN 30
 static int yaffs_parse_options(struct yaffs_options *options,
 			       const char *options_str)
@@ -1812,6 +1924,16 @@ static int yaffs_parse_options(struct yaffs_options *options,
 			options->empty_lost_and_found_overridden = 1;
 		} else if (!strcmp(cur_opt, "no-cache")) {
 			options->no_cache = 1;
+		} else if (!strncmp(cur_opt, "cache-size=", 11)) {
+			options->n_caches =
+			    simple_strtoul(cur_opt + 11, NULL, 0);
+			if (options->n_caches < 1 ||
+			    options->n_caches > YAFFS_MAX_SHORT_OP_CACHES) {
+				printk(KERN_INFO
+				       "yaffs: cache-size must be 1 to %d\n",
+				       YAFFS_MAX_SHORT_OP_CACHES);
+				error = 1;
+			}
 		} else if (!strcmp(cur_opt, "no-checkpoint-read")) {
 			options->skip_checkpoint_read = 1;
 		} else if (!strcmp(cur_opt, "no-checkpoint-write")) {
@@ -2214,7 +2336,6 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 	param->chunks_per_block = YAFFS_CHUNKS_PER_BLOCK;
 	param->total_bytes_per_chunk = YAFFS_BYTES_PER_CHUNK;
 	param->n_reserved_blocks = 5;
-	param->n_caches = (options.no_cache) ? 0 : 10;
 	param->inband_tags = options.inband_tags;
 
 #ifdef CONFIG_YAFFS_DISABLE_LAZY_LOAD
@@ -2261,6 +2382,7 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 		param->read_chunk_tags_fn = nandmtd2_read_chunk_tags;
 		param->bad_block_fn = nandmtd2_mark_block_bad;
 		param->query_block_fn = nandmtd2_query_block;
+		param->read_block_tags_fn = nandmtd2_read_block_tags;
 		yaffs_dev_to_lc(dev)->spare_buffer = 
 		                kmalloc(mtd->oobsize, GFP_NOFS);
 		param->is_yaffs2 = 1;
@@ -2295,6 +2417,15 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 
 	param->skip_checkpt_rd = options.skip_checkpoint_read;
 	param->skip_checkpt_wr = options.skip_checkpoint_write;
+	param->n_scan_threads = yaffs_scan_threads;
+
+	if (options.no_cache)
+		param->n_caches = 0;
+	else if (options.n_caches)
+		param->n_caches = options.n_caches;
+	else
+		param->n_caches =
+		    yaffs_default_n_caches(param->total_bytes_per_chunk);
 
 	mutex_lock(&yaffs_context_lock);
 	/* Get a mount id */
@@ -2317,9 +2448,10 @@ static struct super_block *yaffs_internal_read_super(int yaffs_version,
 
 	/* Directory search handling... */
 	INIT_LIST_HEAD(&(yaffs_dev_to_lc(dev)->search_contexts));
+	spin_lock_init(&(yaffs_dev_to_lc(dev)->search_lock));
 	param->remove_obj_fn = yaffs_remove_obj_callback;
 
-	mutex_init(&(yaffs_dev_to_lc(dev)->gross_lock));
+	init_rwsem(&(yaffs_dev_to_lc(dev)->gross_lock));
 
 	yaffs_gross_lock(dev);
 
@@ -2472,6 +2604,14 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 		    dev->oldest_dirty_gc_count);
 	buf += sprintf(buf, "n_gc_blocks........... %u\n", dev->n_gc_blocks);
 	buf += sprintf(buf, "bg_gcs................ %u\n", dev->bg_gcs);
+	buf += sprintf(buf, "fg_gcs................ %u\n", dev->fg_gcs);
+	buf +=
+	    sprintf(buf, "fg_gc_total_us........ %llu\n",
+		    (unsigned long long)dev->fg_gc_total_us);
+	buf += sprintf(buf, "fg_gc_max_us.......... %u\n", dev->fg_gc_max_us);
+	buf +=
+	    sprintf(buf, "bg_write_rate......... %u\n",
+		    yaffs_dev_to_lc(dev)->gc_write_rate);
 	buf +=
 	    sprintf(buf, "n_retired_writes...... %u\n", dev->n_retired_writes);
 	buf +=
@@ -2484,6 +2624,14 @@ static char *yaffs_dump_dev_part1(char *buf, struct yaffs_dev *dev)
 	    sprintf(buf, "n_tags_ecc_unfixed.... %u\n",
 		    dev->n_tags_ecc_unfixed);
 	buf += sprintf(buf, "cache_hits............ %u\n", dev->cache_hits);
+	buf += sprintf(buf, "cache_misses.......... %u\n", dev->cache_misses);
+	buf +=
+	    sprintf(buf, "cache_hit_percent..... %u\n",
+		    dev->cache_hits + dev->cache_misses ?
+		    (u32) div_u64((u64) dev->cache_hits * 100,
+				  dev->cache_hits + dev->cache_misses) : 0);
+	buf +=
+	    sprintf(buf, "n_dirty_caches........ %d\n", dev->n_dirty_caches);
 	buf +=
 	    sprintf(buf, "n_deleted_files....... %u\n", dev->n_deleted_files);
 	buf +=
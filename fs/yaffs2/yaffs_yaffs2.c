@@ -954,6 +954,210 @@ static int yaffs2_ybicmp(const void *a, const void *b)
 		return aseq - bseq;
 }
 
+/*
+ * Scan read-ahead.
+ * Reader threads read the tags of the blocks to scan, each block with one
+ * read where the driver can, up to a window of blocks ahead of the scan.
+ * The scan itself still goes through the blocks in sequence order, since
+ * newer chunks decide what older ones mean. The readers only read tags;
+ * they leave chunk errors and everything else to the scan.
+ */
+#define YAFFS_SCAN_MAX_THREADS 4
+#define YAFFS_SCAN_SLOTS_PER_THREAD 4
+
+struct yaffs_scan_slot {
+	int iter;		/* block_index entry in the slot, or -1 */
+	struct yaffs_ext_tags *tags;
+};
+
+struct yaffs_scan_ahead {
+	struct yaffs_dev *dev;
+	struct yaffs_block_index *block_index;
+	struct yaffs_scan_slot *slots;
+	int n_slots;
+	struct yaffs_ext_tags *tags;
+	int alt_tags;
+	int n_threads;
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	int next_iter;		/* next entry for a reader, counting down */
+	int done_iter;		/* last entry the scan has finished with */
+	int stop;
+	struct completion exited;
+};
+
+static struct yaffs_scan_slot *yaffs2_scan_slot(struct yaffs_scan_ahead *sa,
+						int iter)
+{
+	return &sa->slots[iter % sa->n_slots];
+}
+
+/* A reader may take the next entry once the scan has freed its slot */
+static int yaffs2_scan_claim(struct yaffs_scan_ahead *sa, int *iter)
+{
+	int claimed = 0;
+
+	spin_lock(&sa->lock);
+	if (sa->stop || sa->next_iter < 0) {
+		*iter = -1;
+		claimed = 1;
+	} else if (sa->done_iter <= sa->next_iter + sa->n_slots) {
+		*iter = sa->next_iter--;
+		claimed = 1;
+	}
+	spin_unlock(&sa->lock);
+
+	return claimed;
+}
+
+static int yaffs2_scan_reader(void *data)
+{
+	struct yaffs_scan_ahead *sa = data;
+	struct yaffs_scan_slot *slot;
+	int iter;
+
+	while (1) {
+		wait_event(sa->wait, yaffs2_scan_claim(sa, &iter));
+		if (iter < 0)
+			break;
+
+		slot = yaffs2_scan_slot(sa, iter);
+		yaffs_rd_block_tags_nand(sa->dev,
+					 sa->block_index[iter].block,
+					 slot->tags);
+
+		spin_lock(&sa->lock);
+		slot->iter = iter;
+		spin_unlock(&sa->lock);
+		wake_up_all(&sa->wait);
+	}
+
+	complete_and_exit(&sa->exited, 0);
+}
+
+static int yaffs2_scan_slot_ready(struct yaffs_scan_ahead *sa,
+				  struct yaffs_scan_slot *slot, int iter)
+{
+	int ready;
+
+	spin_lock(&sa->lock);
+	ready = (slot->iter == iter);
+	spin_unlock(&sa->lock);
+
+	return ready;
+}
+
+/* Returns the tags of each chunk of the block at a block_index entry */
+static struct yaffs_ext_tags *yaffs2_scan_tags(struct yaffs_scan_ahead *sa,
+					       int iter)
+{
+	struct yaffs_scan_slot *slot = yaffs2_scan_slot(sa, iter);
+
+	if (sa->n_threads)
+		wait_event(sa->wait, yaffs2_scan_slot_ready(sa, slot, iter));
+	else
+		yaffs_rd_block_tags_nand(sa->dev, sa->block_index[iter].block,
+					 slot->tags);
+
+	return slot->tags;
+}
+
+static void yaffs2_scan_done(struct yaffs_scan_ahead *sa, int iter)
+{
+	spin_lock(&sa->lock);
+	yaffs2_scan_slot(sa, iter)->iter = -1;
+	sa->done_iter = iter;
+	spin_unlock(&sa->lock);
+	wake_up_all(&sa->wait);
+}
+
+static void yaffs2_scan_ahead_stop(struct yaffs_scan_ahead *sa)
+{
+	int i;
+
+	if (!sa)
+		return;
+
+	spin_lock(&sa->lock);
+	sa->stop = 1;
+	spin_unlock(&sa->lock);
+	wake_up_all(&sa->wait);
+
+	for (i = 0; i < sa->n_threads; i++)
+		wait_for_completion(&sa->exited);
+
+	if (sa->alt_tags)
+		vfree(sa->tags);
+	else
+		kfree(sa->tags);
+	kfree(sa->slots);
+	kfree(sa);
+}
+
+static struct yaffs_scan_ahead *yaffs2_scan_ahead_start(struct yaffs_dev *dev,
+				struct yaffs_block_index *block_index,
+				int n_to_scan)
+{
+	struct yaffs_scan_ahead *sa;
+	struct task_struct *reader;
+	int n_threads = dev->param.n_scan_threads;
+	int tags_bytes;
+	int i;
+
+	/* The scan itself keeps one cpu busy */
+	if (n_threads > num_online_cpus() - 1)
+		n_threads = num_online_cpus() - 1;
+	if (n_threads > YAFFS_SCAN_MAX_THREADS)
+		n_threads = YAFFS_SCAN_MAX_THREADS;
+	if (n_threads < 0)
+		n_threads = 0;
+
+	sa = kzalloc(sizeof(*sa), GFP_NOFS);
+	if (!sa)
+		return NULL;
+
+	sa->dev = dev;
+	sa->block_index = block_index;
+	sa->n_slots = n_threads ? n_threads * YAFFS_SCAN_SLOTS_PER_THREAD : 1;
+	sa->next_iter = n_to_scan - 1;
+	sa->done_iter = n_to_scan;
+	spin_lock_init(&sa->lock);
+	init_waitqueue_head(&sa->wait);
+	init_completion(&sa->exited);
+
+	tags_bytes = sa->n_slots * dev->param.chunks_per_block *
+	    sizeof(struct yaffs_ext_tags);
+	sa->tags = kmalloc(tags_bytes, GFP_NOFS);
+	if (!sa->tags) {
+		sa->tags = vmalloc(tags_bytes);
+		sa->alt_tags = 1;
+	}
+	sa->slots = kmalloc(sa->n_slots * sizeof(struct yaffs_scan_slot),
+			    GFP_NOFS);
+	if (!sa->tags || !sa->slots) {
+		yaffs2_scan_ahead_stop(sa);
+		return NULL;
+	}
+
+	for (i = 0; i < sa->n_slots; i++) {
+		sa->slots[i].iter = -1;
+		sa->slots[i].tags =
+		    &sa->tags[i * dev->param.chunks_per_block];
+	}
+
+	for (i = 0; i < n_threads; i++) {
+		reader = kthread_run(yaffs2_scan_reader, sa, "yaffs-scan-%d", i);
+		if (IS_ERR(reader))
+			break;
+		sa->n_threads++;
+	}
+
+	yaffs_trace(YAFFS_TRACE_SCAN, "scanning with %d reader threads",
+		sa->n_threads);
+
+	return sa;
+}
+
 int yaffs2_scan_backwards(struct yaffs_dev *dev)
 {
 	struct yaffs_ext_tags tags;
@@ -986,6 +1190,8 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 	struct yaffs_block_index *block_index = NULL;
 	int alt_block_index = 0;
+	struct yaffs_scan_ahead *sa;
+	struct yaffs_ext_tags *block_tags;
 
 	yaffs_trace(YAFFS_TRACE_SCAN,
 		"yaffs2_scan_backwards starts  intstartblk %d intendblk %d...",
@@ -1086,6 +1292,13 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 	end_iter = n_to_scan - 1;
 	yaffs_trace(YAFFS_TRACE_SCAN_DEBUG, "%d blocks to scan", n_to_scan);
 
+	sa = yaffs2_scan_ahead_start(dev, block_index, n_to_scan);
+	if (!sa) {
+		yaffs_trace(YAFFS_TRACE_SCAN,
+			"yaffs2_scan_backwards() could not allocate tags!");
+		alloc_failed = 1;
+	}
+
 	/* For each block.... backwards */
 	for (block_iter = end_iter; !alloc_failed && block_iter >= start_iter;
 	     block_iter--) {
@@ -1102,6 +1315,8 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 		deleted = 0;
 
+		block_tags = yaffs2_scan_tags(sa, block_iter);
+
 		/* For each chunk in each block that needs scanning.... */
 		found_chunks = 0;
 		for (c = dev->param.chunks_per_block - 1;
@@ -1114,8 +1329,9 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 
 			chunk = blk * dev->param.chunks_per_block + c;
 
-			result = yaffs_rd_chunk_tags_nand(dev, chunk, NULL,
-							  &tags);
+			tags = block_tags[c];
+			if (tags.ecc_result > YAFFS_ECC_RESULT_NO_ERROR)
+				yaffs_handle_chunk_error(dev, bi);
 
 			/* Let's have a good look at this chunk... */
 
@@ -1571,8 +1787,11 @@ int yaffs2_scan_backwards(struct yaffs_dev *dev)
 			yaffs_block_became_dirty(dev, blk);
 		}
 
+		yaffs2_scan_done(sa, block_iter);
 	}
 
+	yaffs2_scan_ahead_stop(sa);
+
 	yaffs_skip_rest_of_block(dev);
 
 	if (alt_block_index)
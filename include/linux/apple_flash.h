@@ -3,6 +3,7 @@
 
 #include <linux/scatterlist.h>
 #include <linux/device.h>
+#include <linux/list.h>
 #include <plat/cdma.h>
 
 typedef uint32_t page_t;
@@ -32,6 +33,11 @@ enum apple_nand_info
 	VFL_PAGES_PER_BLOCK,
 	VFL_USABLE_BLOCKS_PER_BANK,
 	VFL_FTL_TYPE,
+	VFL_FTL_CTRL_BLOCK_0,
+	VFL_FTL_CTRL_BLOCK_1,
+	VFL_FTL_CTRL_BLOCK_2,
+
+	FTL_NUM_PAGES,
 };
 
 enum apple_vfl_detection
@@ -106,6 +112,43 @@ extern int apple_nand_erase_block(struct apple_nand*, u16 _ce, page_t _page);
 extern int apple_nand_register(struct apple_nand*, struct apple_vfl*, struct device*);
 extern void apple_nand_unregister(struct apple_nand*);
 
+/*
+ * Appends the bytes [_offset, _offset+_len) of the _src list to _dst,
+ * extending the last entry of _dst where the memory carries on.
+ * *_dst_num is the number of _dst entries in use and is updated.
+ */
+extern int apple_sg_copy_range(struct scatterlist *_dst, size_t _dst_max,
+		size_t *_dst_num, struct scatterlist *_src, size_t _src_num,
+		size_t _offset, size_t _len);
+
+/*
+ * Walks a scatterlist forward across calls to apple_sg_cursor_copy, so
+ * that copying it out unit by unit doesn't restart from the head each
+ * time. Offsets passed in must not go backwards.
+ */
+struct apple_sg_cursor
+{
+	struct scatterlist *sg;
+	size_t num;
+	size_t base;
+};
+
+extern void apple_sg_cursor_init(struct apple_sg_cursor *_cur,
+		struct scatterlist *_src, size_t _src_num);
+extern int apple_sg_cursor_copy(struct scatterlist *_dst, size_t _dst_max,
+		size_t *_dst_num, struct apple_sg_cursor *_cur,
+		size_t _offset, size_t _len);
+
+/*
+ * Splits _src into _count units of _unit bytes and hands unit i to
+ * list _part[i]. The lists are allocated here, free them with
+ * apple_sg_split_free.
+ */
+extern int apple_sg_split(struct scatterlist *_src, size_t _src_num,
+		size_t _unit, size_t _count, const int *_part, int _num_parts,
+		struct scatterlist **_dst, size_t *_dst_num);
+extern void apple_sg_split_free(struct scatterlist **_dst, int _num_parts);
+
 struct apple_vfl
 {
 	int num_devices;
@@ -116,6 +159,7 @@ struct apple_vfl
 	struct apple_chip_map *chips;
 
 	void *private;
+	struct list_head list;
 
 	void (*cleanup)(struct apple_vfl*);
 
@@ -129,14 +173,35 @@ struct apple_vfl
 		struct scatterlist *_sg_data, size_t _sg_num_data,
 		struct scatterlist *_sg_oob, size_t _sg_num_oob);
 
+	int (*erase)(struct apple_vfl *, int _count, page_t *_blocks);
+
 	int (*get)(struct apple_vfl *, int _info);
 	int (*set)(struct apple_vfl *, int _info, int _val);
 };
 
 extern void apple_vfl_init(struct apple_vfl*);
 extern int apple_vfl_register(struct apple_vfl*, enum apple_vfl_detection _detect);
+
+// Registers a VFL whose ops are already set up, skipping detection.
+extern int apple_vfl_add(struct apple_vfl*);
 extern void apple_vfl_unregister(struct apple_vfl*);
 
+/*
+ * Something that sits on top of a VFL, such as an FTL. add is called
+ * for every VFL that is registered, including those that were there
+ * before the user, and remove before the VFL goes away.
+ */
+struct apple_vfl_user
+{
+	struct list_head list;
+
+	void (*add)(struct apple_vfl *);
+	void (*remove)(struct apple_vfl *);
+};
+
+extern void apple_vfl_register_user(struct apple_vfl_user*);
+extern void apple_vfl_unregister_user(struct apple_vfl_user*);
+
 extern int apple_vfl_special_page(struct apple_vfl*, u16 _ce, char _page[16],
 		uint8_t* _buffer, size_t _amt);
 extern int apple_vfl_read_nand_pages(struct apple_vfl*,
@@ -177,10 +242,13 @@ static inline int apple_vfl_set(struct apple_vfl *_nd, int _id, int _val)
 	return _nd->set(_nd, _id, _val);
 }
 
+struct apple_ftl_blk;
+
 struct apple_ftl
 {
 	struct apple_vfl *vfl;
 	void *private;
+	struct apple_ftl_blk *blk;
 
 	int (*read)(struct apple_ftl *, size_t _count, page_t *_pages,
 		struct scatterlist *_sg_data, size_t _sg_num_data);
@@ -188,8 +256,22 @@ struct apple_ftl
 	int (*write)(struct apple_ftl *, size_t _count, page_t *_pages,
 		struct scatterlist *_sg_data, size_t _sg_num_data);
 
+	int (*sync)(struct apple_ftl *);
+
 	int (*get)(struct apple_ftl *, int _info);
 	int (*set)(struct apple_ftl *, int _info, int _val);
 };
 
+static inline int apple_ftl_get(struct apple_ftl *_ftl, int _id)
+{
+	if(!_ftl)
+		return 0;
+
+	return _ftl->get(_ftl, _id);
+}
+
+// Exposes an FTL as a block device, FTL_NUM_PAGES pages of NAND_PAGE_SIZE.
+extern int apple_ftl_register(struct apple_ftl*);
+extern void apple_ftl_unregister(struct apple_ftl*);
+
 #endif //_LINUX_APPLE_FLASH_H
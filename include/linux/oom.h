@@ -70,6 +70,33 @@ extern unsigned long badness(struct task_struct *p, struct mem_cgroup *mem,
 
 extern struct task_struct *find_lock_task_mm(struct task_struct *p);
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+/* Keep the lowmemorykiller's oom_adj buckets current, tasklist_lock held */
+extern void lowmem_task_add(struct task_struct *p);
+extern void lowmem_task_del(struct task_struct *p);
+extern void lowmem_task_replace(struct task_struct *old,
+				struct task_struct *new);
+/* Called without tasklist_lock after oom_adj of p's thread group changed */
+extern void lowmem_task_adj_changed(struct task_struct *p);
+#else
+static inline void lowmem_task_add(struct task_struct *p)
+{
+}
+
+static inline void lowmem_task_del(struct task_struct *p)
+{
+}
+
+static inline void lowmem_task_replace(struct task_struct *old,
+				       struct task_struct *new)
+{
+}
+
+static inline void lowmem_task_adj_changed(struct task_struct *p)
+{
+}
+#endif
+
 /* sysctls */
 extern int sysctl_oom_dump_tasks;
 extern int sysctl_oom_kill_allocating_task;
@@ -0,0 +1,650 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -g -I../../drivers/staging/android -o binder-pingpong binder-pingpong.c -lpthread */
+
+/*
+ * Binder ping-pong benchmark
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Measures synchronous binder round trips. The parent becomes the context
+ * manager and hands out handles; it forks one server and one client
+ * process per pair. Every client sends BC_TRANSACTIONs with a payload of
+ * the requested size to its own server, which echoes it back in a
+ * BC_REPLY. All clients start together, so running several pairs shows
+ * how well the driver scales when unrelated processes talk at once, and
+ * running several threads per pair shows contention inside one process.
+ *
+ * Each payload size given with -s is one round with fresh clients, the
+ * servers stay up across rounds. Every call is timed on its own; the
+ * round reports the overall rate and the latency percentiles.
+ *
+ * The binder trace events (events/binder/ in the tracing directory) give
+ * the driver's side of the same calls, keyed by transaction id.
+ *
+ * The context manager slot must be free, so stop servicemanager first
+ * (or run this where there is none).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "binder.h"
+
+#define MAP_SIZE	(128 * 1024)
+#define MAX_PAIRS	64
+#define MAX_THREADS	16
+#define MAX_SIZES	16
+
+enum {
+	CODE_REGISTER = 1,
+	CODE_LOOKUP,
+	CODE_PING,
+};
+
+struct bstate {
+	int fd;
+	void *map;
+};
+
+struct wbuf {
+	uint8_t data[512];
+	size_t len;
+};
+
+/* one per client thread, in memory shared with the parent */
+struct span {
+	uint64_t start;
+	uint64_t end;
+};
+
+static const char *device = "/dev/binder";
+static unsigned threads = 1;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void put32(struct wbuf *w, uint32_t v)
+{
+	memcpy(w->data + w->len, &v, sizeof(v));
+	w->len += sizeof(v);
+}
+
+static void putptr(struct wbuf *w, const void *p)
+{
+	memcpy(w->data + w->len, &p, sizeof(p));
+	w->len += sizeof(p);
+}
+
+static void puttxn(struct wbuf *w, uint32_t cmd,
+		   const struct binder_transaction_data *tr)
+{
+	put32(w, cmd);
+	memcpy(w->data + w->len, tr, sizeof(*tr));
+	w->len += sizeof(*tr);
+}
+
+static void binder_setup(struct bstate *bs)
+{
+	struct binder_version vers;
+
+	/*
+	 * Open after fork, the driver keys its process state on the
+	 * opener and a shared fd would make all of us one process.
+	 */
+	bs->fd = open(device, O_RDWR);
+	if (bs->fd < 0)
+		die(device);
+	if (ioctl(bs->fd, BINDER_VERSION, &vers) < 0)
+		die("BINDER_VERSION");
+	if (vers.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder protocol %ld, expected %d\n",
+			vers.protocol_version, BINDER_CURRENT_PROTOCOL_VERSION);
+		exit(1);
+	}
+	bs->map = mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, bs->fd, 0);
+	if (bs->map == MAP_FAILED)
+		die("mmap");
+}
+
+/* Writes w (if not empty) and reads into rbuf, returns bytes read. */
+static size_t binder_io(struct bstate *bs, struct wbuf *w,
+			void *rbuf, size_t rsize)
+{
+	struct binder_write_read bwr;
+
+	memset(&bwr, 0, sizeof(bwr));
+	if (w && w->len) {
+		bwr.write_size = w->len;
+		bwr.write_buffer = (unsigned long)w->data;
+	}
+	bwr.read_size = rsize;
+	bwr.read_buffer = (unsigned long)rbuf;
+	while (ioctl(bs->fd, BINDER_WRITE_READ, &bwr) < 0) {
+		if (errno != EINTR)
+			die("BINDER_WRITE_READ");
+		/* the write part went through already */
+		bwr.write_size = 0;
+	}
+	if (w)
+		w->len = 0;
+	return bwr.read_consumed;
+}
+
+/*
+ * Handles the commands every role sees. Reference requests on our own
+ * node are acknowledged through w. Returns the size of the payload that
+ * follows cmd, or -1 if the caller has to look at it.
+ */
+static int handle_common(uint32_t cmd, const uint8_t *p, struct wbuf *w)
+{
+	const struct binder_ptr_cookie *pc = (const void *)p;
+
+	switch (cmd) {
+	case BR_NOOP:
+	case BR_SPAWN_LOOPER:
+	case BR_TRANSACTION_COMPLETE:
+		return 0;
+	case BR_INCREFS:
+	case BR_ACQUIRE:
+		put32(w, cmd == BR_INCREFS ? BC_INCREFS_DONE : BC_ACQUIRE_DONE);
+		putptr(w, pc->ptr);
+		putptr(w, pc->cookie);
+		return sizeof(*pc);
+	case BR_RELEASE:
+	case BR_DECREFS:
+		return sizeof(*pc);
+	case BR_DEAD_REPLY:
+	case BR_FAILED_REPLY:
+		fprintf(stderr, "%d: transaction failed (%s)\n", getpid(),
+			cmd == BR_DEAD_REPLY ? "dead reply" : "failed reply");
+		exit(1);
+	case BR_ERROR:
+		fprintf(stderr, "%d: BR_ERROR %d\n", getpid(), *(int *)p);
+		exit(1);
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Sends one transaction and waits for the reply. If reply is NULL the
+ * reply buffer is handed back to the driver with the next write in w,
+ * otherwise the caller has to free it.
+ */
+static void binder_call(struct bstate *bs, struct wbuf *w, uint32_t handle,
+			uint32_t code, const void *data, size_t size,
+			const size_t *offs, size_t offs_size,
+			struct binder_transaction_data *reply)
+{
+	struct binder_transaction_data tr;
+	uint8_t rbuf[256];
+
+	memset(&tr, 0, sizeof(tr));
+	tr.target.handle = handle;
+	tr.code = code;
+	tr.data_size = size;
+	tr.offsets_size = offs_size;
+	tr.data.ptr.buffer = data;
+	tr.data.ptr.offsets = offs;
+	puttxn(w, BC_TRANSACTION, &tr);
+
+	for (;;) {
+		size_t len = binder_io(bs, w, rbuf, sizeof(rbuf));
+		const uint8_t *p = rbuf;
+
+		while (p < rbuf + len) {
+			uint32_t cmd = *(const uint32_t *)p;
+			int n;
+
+			p += sizeof(cmd);
+			n = handle_common(cmd, p, w);
+			if (n >= 0) {
+				p += n;
+				continue;
+			}
+			if (cmd != BR_REPLY) {
+				fprintf(stderr, "%d: unexpected command %x\n",
+					getpid(), cmd);
+				exit(1);
+			}
+			memcpy(&tr, p, sizeof(tr));
+			if (reply) {
+				*reply = tr;
+				return;
+			}
+			put32(w, BC_FREE_BUFFER);
+			putptr(w, tr.data.ptr.buffer);
+			return;
+		}
+	}
+}
+
+/*
+ * Reads transactions and answers them through handler, until count of
+ * them are done. ~0u means forever.
+ */
+static void serve(struct bstate *bs, struct wbuf *w,
+		  void (*handler)(struct wbuf *,
+				  const struct binder_transaction_data *),
+		  unsigned count)
+{
+	uint8_t rbuf[256];
+
+	while (count) {
+		size_t len = binder_io(bs, w, rbuf, sizeof(rbuf));
+		const uint8_t *p = rbuf;
+
+		while (p < rbuf + len) {
+			struct binder_transaction_data tr;
+			uint32_t cmd = *(const uint32_t *)p;
+			int n;
+
+			p += sizeof(cmd);
+			n = handle_common(cmd, p, w);
+			if (n >= 0) {
+				p += n;
+				continue;
+			}
+			if (cmd != BR_TRANSACTION) {
+				fprintf(stderr, "%d: unexpected command %x\n",
+					getpid(), cmd);
+				exit(1);
+			}
+			memcpy(&tr, p, sizeof(tr));
+			p += sizeof(tr);
+			handler(w, &tr);
+			/* the reply reads from the buffer, free it after */
+			put32(w, BC_FREE_BUFFER);
+			putptr(w, tr.data.ptr.buffer);
+			if (count != ~0u)
+				count--;
+		}
+	}
+	/* flush the last BC_FREE_BUFFER */
+	if (w->len)
+		binder_io(bs, w, NULL, 0);
+}
+
+static uint32_t handles[MAX_PAIRS];
+
+static void registry_handler(struct wbuf *w,
+			     const struct binder_transaction_data *tr)
+{
+	struct binder_transaction_data reply;
+	/* read by the driver when w is written, so not on the stack */
+	static struct flat_binder_object obj;
+	static const size_t offs[1] = { 0 };
+	uint32_t idx;
+
+	memset(&reply, 0, sizeof(reply));
+	switch (tr->code) {
+	case CODE_REGISTER: {
+		const struct flat_binder_object *in = tr->data.ptr.buffer;
+
+		memcpy(&idx, (const uint8_t *)tr->data.ptr.buffer + sizeof(*in),
+		       sizeof(idx));
+		if (idx >= MAX_PAIRS || in->type != BINDER_TYPE_HANDLE)
+			break;
+		handles[idx] = in->handle;
+		/* the buffer's reference goes away with the buffer */
+		put32(w, BC_ACQUIRE);
+		put32(w, in->handle);
+		break;
+	}
+	case CODE_LOOKUP:
+		memcpy(&idx, tr->data.ptr.buffer, sizeof(idx));
+		if (idx >= MAX_PAIRS)
+			break;
+		memset(&obj, 0, sizeof(obj));
+		obj.type = BINDER_TYPE_HANDLE;
+		obj.flags = 0x7f | FLAT_BINDER_FLAG_ACCEPTS_FDS;
+		obj.handle = handles[idx];
+		reply.data_size = sizeof(obj);
+		reply.offsets_size = sizeof(offs);
+		reply.data.ptr.buffer = &obj;
+		reply.data.ptr.offsets = offs;
+		break;
+	}
+	puttxn(w, BC_REPLY, &reply);
+}
+
+static void echo_handler(struct wbuf *w,
+			 const struct binder_transaction_data *tr)
+{
+	struct binder_transaction_data reply;
+
+	memset(&reply, 0, sizeof(reply));
+	reply.data_size = tr->data_size;
+	reply.data.ptr.buffer = tr->data.ptr.buffer;
+	reply.data.ptr.offsets = tr->data.ptr.buffer;
+	puttxn(w, BC_REPLY, &reply);
+}
+
+static void *server_thread(void *arg)
+{
+	struct wbuf w = { .len = 0 };
+
+	put32(&w, BC_ENTER_LOOPER);
+	serve(arg, &w, echo_handler, ~0u);
+	return NULL;
+}
+
+static void run_server(unsigned pair)
+{
+	struct bstate bs;
+	struct wbuf w = { .len = 0 };
+	static struct {
+		struct flat_binder_object obj;
+		uint32_t idx;
+	} msg;
+	static const size_t offs[1] = { 0 };
+	unsigned i;
+
+	binder_setup(&bs);
+	memset(&msg, 0, sizeof(msg));
+	msg.obj.type = BINDER_TYPE_BINDER;
+	msg.obj.flags = 0x7f | FLAT_BINDER_FLAG_ACCEPTS_FDS;
+	msg.obj.binder = &msg;
+	msg.obj.cookie = NULL;
+	msg.idx = pair;
+	binder_call(&bs, &w, 0, CODE_REGISTER, &msg, sizeof(msg),
+		    offs, sizeof(offs), NULL);
+
+	/* one looper per client thread, none of them ever has to wait */
+	for (i = 1; i < threads; i++) {
+		pthread_t tid;
+
+		if (pthread_create(&tid, NULL, server_thread, &bs))
+			die("pthread_create");
+	}
+	put32(&w, BC_ENTER_LOOPER);
+	serve(&bs, &w, echo_handler, ~0u);
+	exit(0);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct client_thread {
+	struct bstate *bs;
+	uint32_t handle;
+	size_t size;
+	unsigned iterations;
+	int ready_fd;
+	int go_fd;
+	uint32_t *lat;
+	struct span *span;
+};
+
+static void *client_thread(void *arg)
+{
+	struct client_thread *ct = arg;
+	struct wbuf w = { .len = 0 };
+	uint8_t *payload;
+	uint64_t t0, t1;
+	unsigned i;
+	char c = 0;
+
+	payload = calloc(1, ct->size ? ct->size : 1);
+	if (!payload)
+		die("calloc");
+
+	/* one warm-up call, so the server's pages are in place */
+	binder_call(ct->bs, &w, ct->handle, CODE_PING, payload, ct->size,
+		    NULL, 0, NULL);
+
+	if (write(ct->ready_fd, &c, 1) != 1 || read(ct->go_fd, &c, 1) != 1)
+		die("start barrier");
+
+	t0 = now_ns();
+	ct->span->start = t0;
+	for (i = 0; i < ct->iterations; i++) {
+		binder_call(ct->bs, &w, ct->handle, CODE_PING, payload,
+			    ct->size, NULL, 0, NULL);
+		t1 = now_ns();
+		ct->lat[i] = t1 - t0 > UINT32_MAX ? UINT32_MAX : t1 - t0;
+		t0 = t1;
+	}
+	ct->span->end = t0;
+	/* hand back the last reply buffer */
+	binder_io(ct->bs, &w, NULL, 0);
+	free(payload);
+	return NULL;
+}
+
+static void run_client(unsigned pair, unsigned iterations, size_t size,
+		       int ready_fd, int go_fd, uint32_t *lat,
+		       struct span *span)
+{
+	struct client_thread ct[MAX_THREADS];
+	pthread_t tids[MAX_THREADS];
+	struct bstate bs;
+	struct wbuf w = { .len = 0 };
+	struct binder_transaction_data reply;
+	uint32_t handle;
+	unsigned i;
+
+	binder_setup(&bs);
+	binder_call(&bs, &w, 0, CODE_LOOKUP, &pair, sizeof(pair),
+		    NULL, 0, &reply);
+	if (reply.data_size < sizeof(struct flat_binder_object)) {
+		fprintf(stderr, "client %u: lookup failed\n", pair);
+		exit(1);
+	}
+	handle = ((const struct flat_binder_object *)
+		  reply.data.ptr.buffer)->handle;
+	/* take our own reference before the reply's goes away */
+	put32(&w, BC_ACQUIRE);
+	put32(&w, handle);
+	put32(&w, BC_FREE_BUFFER);
+	putptr(&w, reply.data.ptr.buffer);
+	binder_io(&bs, &w, NULL, 0);
+
+	for (i = 0; i < threads; i++) {
+		ct[i].bs = &bs;
+		ct[i].handle = handle;
+		ct[i].size = size;
+		ct[i].iterations = iterations;
+		ct[i].ready_fd = ready_fd;
+		ct[i].go_fd = go_fd;
+		ct[i].lat = lat + (size_t)(pair * threads + i) * iterations;
+		ct[i].span = span + pair * threads + i;
+		if (pthread_create(&tids[i], NULL, client_thread, &ct[i]))
+			die("pthread_create");
+	}
+	for (i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	exit(0);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* pct in tenths of a percent, lat must be sorted */
+static uint32_t percentile(const uint32_t *lat, size_t n, unsigned pct)
+{
+	return lat[(n - 1) * pct / 1000];
+}
+
+static void report(size_t size, uint32_t *lat, size_t n,
+		   const struct span *span, unsigned nspans)
+{
+	uint64_t start = span[0].start, end = span[0].end;
+	unsigned i;
+
+	for (i = 1; i < nspans; i++) {
+		if (span[i].start < start)
+			start = span[i].start;
+		if (span[i].end > end)
+			end = span[i].end;
+	}
+	qsort(lat, n, sizeof(*lat), cmp_u32);
+	printf("%8zu %10.0f %8u %8u %8u %8u %8u\n", size,
+	       n * 1e9 / (end - start),
+	       percentile(lat, n, 500), percentile(lat, n, 900),
+	       percentile(lat, n, 990), percentile(lat, n, 999),
+	       lat[n - 1]);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-p pairs] [-t threads per pair] [-n iterations]"
+		" [-s payload bytes[,bytes...]] [-d device]\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned pairs = 1, iterations = 10000, nsizes = 0, i, j;
+	size_t sizes[MAX_SIZES], nlat;
+	pid_t servers[MAX_PAIRS], clients[MAX_PAIRS];
+	int ready[2], go[2];
+	struct wbuf w = { .len = 0 };
+	struct bstate bs;
+	struct span *span;
+	uint32_t *lat;
+	char *arg, *tok;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:t:n:s:d:")) != -1) {
+		switch (opt) {
+		case 'p':
+			pairs = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			nsizes = 0;
+			for (arg = optarg; (tok = strsep(&arg, ","));) {
+				if (nsizes == MAX_SIZES)
+					usage(argv[0]);
+				sizes[nsizes++] = strtoul(tok, NULL, 0);
+			}
+			break;
+		case 'd':
+			device = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!nsizes)
+		sizes[nsizes++] = 64;
+	if (!pairs || pairs > MAX_PAIRS || !iterations ||
+	    !threads || threads > MAX_THREADS)
+		usage(argv[0]);
+	/* every thread can have a call and a reply in flight */
+	for (i = 0; i < nsizes; i++)
+		if (sizes[i] * threads > MAP_SIZE / 4)
+			usage(argv[0]);
+
+	nlat = (size_t)pairs * threads * iterations;
+	lat = mmap(NULL, nlat * sizeof(*lat), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	span = mmap(NULL, pairs * threads * sizeof(*span),
+		    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (lat == MAP_FAILED || span == MAP_FAILED)
+		die("mmap");
+
+	binder_setup(&bs);
+	if (ioctl(bs.fd, BINDER_SET_CONTEXT_MGR, 0) < 0) {
+		if (errno == EBUSY)
+			fprintf(stderr, "context manager already set, "
+				"is servicemanager running?\n");
+		die("BINDER_SET_CONTEXT_MGR");
+	}
+	put32(&w, BC_ENTER_LOOPER);
+
+	if (pipe(ready) || pipe(go))
+		die("pipe");
+
+	for (i = 0; i < pairs; i++) {
+		servers[i] = fork();
+		if (servers[i] < 0)
+			die("fork");
+		if (!servers[i])
+			run_server(i);
+	}
+	serve(&bs, &w, registry_handler, pairs);
+
+	printf("%u pair(s), %u thread(s) per pair, %u iterations per thread\n",
+	       pairs, threads, iterations);
+	printf("%8s %10s %8s %8s %8s %8s %8s\n", "size", "calls/s",
+	       "p50 ns", "p90", "p99", "p99.9", "max");
+	for (j = 0; j < nsizes; j++) {
+		for (i = 0; i < pairs; i++) {
+			clients[i] = fork();
+			if (clients[i] < 0)
+				die("fork");
+			if (!clients[i])
+				run_client(i, iterations, sizes[j],
+					   ready[1], go[0], lat, span);
+		}
+		serve(&bs, &w, registry_handler, pairs);
+
+		for (i = 0; i < pairs * threads; i++) {
+			char c;
+
+			if (read(ready[0], &c, 1) != 1)
+				die("start barrier");
+		}
+		for (i = 0; i < pairs * threads; i++) {
+			if (write(go[1], "g", 1) != 1)
+				die("start barrier");
+		}
+		for (i = 0; i < pairs; i++) {
+			int status;
+
+			if (waitpid(clients[i], &status, 0) < 0 ||
+			    !WIFEXITED(status) || WEXITSTATUS(status)) {
+				fprintf(stderr, "client %u failed\n", i);
+				exit(1);
+			}
+		}
+		report(sizes[j], lat, nlat, span, pairs * threads);
+	}
+
+	for (i = 0; i < pairs; i++) {
+		kill(servers[i], SIGTERM);
+		waitpid(servers[i], NULL, 0);
+	}
+	return 0;
+}
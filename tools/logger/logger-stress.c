@@ -0,0 +1,279 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -g -I../../drivers/staging/android -o logger-stress logger-stress.c -lpthread */
+
+/*
+ * Logger write stress test
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Measures how many entries a log takes per second as the number of
+ * writers grows. Each round flushes the log, then runs 1, 2, ... writer
+ * threads, each with its own descriptor, that log entries the way liblog
+ * does (priority, tag and message in one writev()) for a fixed time.
+ *
+ * One reader drains the log at the same time with readv(), one entry per
+ * segment, and checks that every entry it gets is intact. Entries the
+ * reader never saw because the writers lapped it are reported as lost;
+ * that is expected once the writers outrun it.
+ *
+ * Use a log nothing else writes to, as it gets flushed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+#include "logger.h"
+
+#define MAX_WRITERS	64
+#define MAX_BATCH	256
+
+static const char *device = "/dev/log/main";
+static int seconds = 2;
+static int payload = 64;
+static int batch = 32;
+
+static volatile int stop;
+
+struct writer {
+	pthread_t thread;
+	int fd;
+	unsigned long count;
+	unsigned long errors;
+};
+
+struct reader {
+	pthread_t thread;
+	int fd;
+	unsigned long count;
+	unsigned long bad;
+	unsigned long calls;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void *writer_main(void *arg)
+{
+	struct writer *w = arg;
+	unsigned char prio = 4;
+	char tag[] = "logger-stress";
+	char msg[LOGGER_ENTRY_MAX_PAYLOAD];
+	struct iovec iov[3];
+
+	memset(msg, 'x', payload);
+	msg[payload - 1] = '\0';
+
+	iov[0].iov_base = &prio;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = tag;
+	iov[1].iov_len = sizeof(tag);
+	iov[2].iov_base = msg;
+	iov[2].iov_len = payload;
+
+	while (!stop) {
+		if (writev(w->fd, iov, 3) < 0)
+			w->errors++;
+		else
+			w->count++;
+	}
+	return NULL;
+}
+
+/* the payload written above, and only that, must come back */
+static int entry_ok(const struct logger_entry *e, size_t len)
+{
+	const char *msg = e->msg;
+
+	if (len != sizeof(*e) + e->len)
+		return 0;
+	if (e->len != 1 + sizeof("logger-stress") + payload)
+		return 0;
+	if (strcmp(msg + 1, "logger-stress"))
+		return 0;
+	msg += 1 + sizeof("logger-stress");
+	return msg[0] == 'x' && msg[payload - 1] == '\0';
+}
+
+static void *reader_main(void *arg)
+{
+	static char bufs[MAX_BATCH][LOGGER_ENTRY_MAX_LEN];
+	struct iovec iov[MAX_BATCH];
+	struct reader *r = arg;
+	struct pollfd pfd;
+	int i;
+
+	for (i = 0; i < batch; i++) {
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len = LOGGER_ENTRY_MAX_LEN;
+	}
+	pfd.fd = r->fd;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		ssize_t ret = readv(r->fd, iov, batch);
+		size_t off;
+
+		if (ret < 0) {
+			if (errno != EAGAIN && errno != EINTR) {
+				perror("readv");
+				break;
+			}
+			/* the writers are done once the log is empty */
+			if (stop)
+				break;
+			poll(&pfd, 1, 100);
+			continue;
+		}
+
+		r->calls++;
+		for (i = 0, off = 0; off < (size_t)ret; i++) {
+			struct logger_entry *e = iov[i].iov_base;
+			size_t len = sizeof(*e) + e->len;
+
+			if (!entry_ok(e, len))
+				r->bad++;
+			r->count++;
+			off += len;
+		}
+	}
+	return NULL;
+}
+
+static int run(int nr_writers)
+{
+	struct writer writers[MAX_WRITERS];
+	unsigned long written = 0, errors = 0;
+	struct reader reader;
+	uint64_t t0, t1;
+	int fd, i;
+
+	fd = open(device, O_WRONLY);
+	if (fd < 0) {
+		perror(device);
+		return -1;
+	}
+	if (ioctl(fd, LOGGER_FLUSH_LOG) < 0) {
+		perror("LOGGER_FLUSH_LOG");
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	memset(&reader, 0, sizeof(reader));
+	reader.fd = open(device, O_RDONLY | O_NONBLOCK);
+	if (reader.fd < 0) {
+		perror(device);
+		return -1;
+	}
+
+	memset(writers, 0, sizeof(writers));
+	for (i = 0; i < nr_writers; i++) {
+		writers[i].fd = open(device, O_WRONLY);
+		if (writers[i].fd < 0) {
+			perror(device);
+			return -1;
+		}
+	}
+
+	stop = 0;
+	pthread_create(&reader.thread, NULL, reader_main, &reader);
+	t0 = now_ns();
+	for (i = 0; i < nr_writers; i++)
+		pthread_create(&writers[i].thread, NULL, writer_main,
+			       &writers[i]);
+
+	sleep(seconds);
+	stop = 1;
+
+	for (i = 0; i < nr_writers; i++) {
+		pthread_join(writers[i].thread, NULL);
+		written += writers[i].count;
+		errors += writers[i].errors;
+		close(writers[i].fd);
+	}
+	t1 = now_ns();
+	pthread_join(reader.thread, NULL);
+	close(reader.fd);
+
+	printf("%3d writers: %10.0f entries/s %10.0f per writer"
+	       "  read %lu (%.1f per readv) lost %lu bad %lu errors %lu\n",
+	       nr_writers, written * 1e9 / (t1 - t0),
+	       written * 1e9 / (t1 - t0) / nr_writers, reader.count,
+	       reader.calls ? (double)reader.count / reader.calls : 0.0,
+	       written > reader.count ? written - reader.count : 0,
+	       reader.bad, errors);
+
+	return reader.bad ? -1 : 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-w max writers] [-t seconds per round]"
+		" [-s payload bytes] [-b readv batch] [-d device]\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int max_writers = 4;
+	int opt, i, ret = 0;
+
+	while ((opt = getopt(argc, argv, "w:t:s:b:d:")) != -1) {
+		switch (opt) {
+		case 'w':
+			max_writers = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 's':
+			payload = atoi(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'd':
+			device = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (max_writers < 1 || max_writers > MAX_WRITERS || seconds < 1 ||
+	    batch < 1 || batch > MAX_BATCH || payload < 2 ||
+	    1 + sizeof("logger-stress") + payload > LOGGER_ENTRY_MAX_PAYLOAD)
+		usage(argv[0]);
+
+	for (i = 1; i <= max_writers; i++)
+		if (run(i))
+			ret = 1;
+
+	return ret;
+}
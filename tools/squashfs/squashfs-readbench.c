@@ -0,0 +1,220 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -g -o squashfs-readbench squashfs-readbench.c -lpthread */
+
+/*
+ * squashfs parallel read benchmark
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Measures how squashfs read throughput scales with the number of reader
+ * threads. It collects the regular files under a directory on a mounted
+ * squashfs, then each round runs 1, 2, ... threads which share the files
+ * out between them and read them from start to end.
+ *
+ * Before every round the files are dropped from the page cache with
+ * posix_fadvise(), so each round has to decompress them again. The
+ * compressed blocks stay in the buffer cache, so the figure is mostly
+ * decompression rather than device speed.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define MAX_THREADS	64
+#define BUF_SIZE	(128 * 1024)
+
+static char **files;
+static int nr_files;
+static int max_files;
+static int passes = 1;
+
+struct worker {
+	pthread_t thread;
+	int index;
+	int nr_threads;
+	unsigned long long bytes;
+	unsigned long errors;
+	uint64_t ns;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int add_file(const char *path, const struct stat *st, int type,
+		    struct FTW *ftw)
+{
+	(void)ftw;
+
+	if (type != FTW_F || !S_ISREG(st->st_mode) || !st->st_size)
+		return 0;
+
+	if (nr_files == max_files) {
+		max_files = max_files ? max_files * 2 : 256;
+		files = realloc(files, max_files * sizeof(*files));
+		if (!files) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	files[nr_files++] = strdup(path);
+	return 0;
+}
+
+static void drop_cache(void)
+{
+	int i, fd;
+
+	for (i = 0; i < nr_files; i++) {
+		fd = open(files[i], O_RDONLY);
+		if (fd < 0)
+			continue;
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	char *buf;
+	uint64_t t0;
+	ssize_t n;
+	int i, fd;
+
+	buf = malloc(BUF_SIZE);
+	if (!buf) {
+		w->errors++;
+		return NULL;
+	}
+
+	t0 = now_ns();
+	for (i = w->index; i < nr_files; i += w->nr_threads) {
+		fd = open(files[i], O_RDONLY);
+		if (fd < 0) {
+			w->errors++;
+			continue;
+		}
+		while ((n = read(fd, buf, BUF_SIZE)) > 0)
+			w->bytes += n;
+		if (n < 0)
+			w->errors++;
+		close(fd);
+	}
+	w->ns = now_ns() - t0;
+
+	free(buf);
+	return NULL;
+}
+
+static int run(int nr_threads)
+{
+	struct worker workers[MAX_THREADS];
+	unsigned long long bytes = 0;
+	unsigned long errors = 0;
+	uint64_t ns, best = 0;
+	int i, pass;
+
+	for (pass = 0; pass < passes; pass++) {
+		drop_cache();
+
+		memset(workers, 0, sizeof(workers));
+		for (i = 0; i < nr_threads; i++) {
+			workers[i].index = i;
+			workers[i].nr_threads = nr_threads;
+			pthread_create(&workers[i].thread, NULL, worker_main,
+				       &workers[i]);
+		}
+
+		bytes = 0;
+		ns = 0;
+		for (i = 0; i < nr_threads; i++) {
+			struct worker *w = &workers[i];
+
+			pthread_join(w->thread, NULL);
+			bytes += w->bytes;
+			errors += w->errors;
+			if (w->ns > ns)
+				ns = w->ns;
+		}
+
+		if (!best || ns < best)
+			best = ns;
+	}
+
+	printf("%3d threads: %10.1f MB/s  errors %lu\n", nr_threads,
+	       best ? bytes * 1e9 / best / (1024 * 1024) : 0.0, errors);
+
+	return errors ? -1 : 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-c max threads] [-p passes per round] directory\n",
+		name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt, i, ret = 0;
+
+	while ((opt = getopt(argc, argv, "c:p:")) != -1) {
+		switch (opt) {
+		case 'c':
+			max_threads = atoi(optarg);
+			break;
+		case 'p':
+			passes = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1 || max_threads < 1 ||
+	    max_threads > MAX_THREADS || passes < 1)
+		usage(argv[0]);
+
+	if (nftw(argv[optind], add_file, 16, FTW_PHYS) < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (!nr_files) {
+		fprintf(stderr, "%s: no files to read\n", argv[optind]);
+		return 1;
+	}
+
+	for (i = 1; i <= max_threads; i++)
+		if (run(i))
+			ret = 1;
+
+	return ret;
+}
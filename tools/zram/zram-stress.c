@@ -0,0 +1,262 @@
+/* $(CROSS_COMPILE)cc -Wall -Wextra -g -o zram-stress zram-stress.c -lpthread */
+
+/*
+ * zram parallel I/O stress test
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ */
+
+/*
+ * Measures how zram throughput scales with the number of CPUs doing I/O,
+ * the way swap-out from several reclaiming CPUs would. Each round runs
+ * 1, 2, ... threads, each pinned to its own CPU and owning its own slice
+ * of the device. The threads write pages with O_DIRECT for a fixed time,
+ * then read their slice back and check it, and the round reports pages
+ * per second for both.
+ *
+ * Each page is half random bytes and half a repeating pattern, so it
+ * compresses to about half its size, like typical anonymous memory.
+ *
+ * This overwrites the device, do not point it at one that is in use.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#define MAX_THREADS	64
+
+static const char *device = "/dev/zram0";
+static int seconds = 2;
+static int batch = 1;
+static long page_size;
+static uint64_t disk_size;
+
+static volatile int stop;
+
+struct worker {
+	pthread_t thread;
+	int cpu;
+	int fd;
+	uint64_t first;		/* first page of this thread's slice */
+	uint64_t pages;		/* pages in the slice */
+	uint64_t written;	/* highest page written + 1 */
+	unsigned long writes;
+	unsigned long reads;
+	unsigned long bad;
+	uint64_t write_ns;
+	uint64_t read_ns;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* contents of page 'n', reproducible so the read back can be checked */
+static void fill_page(unsigned char *p, uint64_t n)
+{
+	uint32_t x = (uint32_t)n * 2654435761u + 1;
+	long i;
+
+	for (i = 0; i < page_size / 2; i++) {
+		x = x * 1103515245 + 12345;
+		p[i] = x >> 16;
+	}
+	for (; i < page_size; i++)
+		p[i] = (unsigned char)(n + i % 64);
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	unsigned char *buf, *check;
+	uint64_t n, t0;
+	cpu_set_t set;
+	int i;
+
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu, &set);
+	sched_setaffinity(0, sizeof(set), &set);
+
+	if (posix_memalign((void **)&buf, page_size, batch * page_size) ||
+	    posix_memalign((void **)&check, page_size, page_size)) {
+		w->bad++;
+		return NULL;
+	}
+
+	t0 = now_ns();
+	for (n = 0; !stop; n += batch) {
+		if (n + batch > w->pages)
+			n = 0;
+		for (i = 0; i < batch; i++)
+			fill_page(buf + i * page_size, w->first + n + i);
+		if (pwrite(w->fd, buf, batch * page_size,
+			   (w->first + n) * page_size) != batch * page_size) {
+			perror("pwrite");
+			w->bad++;
+			break;
+		}
+		w->writes += batch;
+		if (n + batch > w->written)
+			w->written = n + batch;
+	}
+	w->write_ns = now_ns() - t0;
+
+	t0 = now_ns();
+	for (n = 0; n + batch <= w->written; n += batch) {
+		if (pread(w->fd, buf, batch * page_size,
+			  (w->first + n) * page_size) != batch * page_size) {
+			perror("pread");
+			w->bad++;
+			break;
+		}
+		w->reads += batch;
+	}
+	w->read_ns = now_ns() - t0;
+
+	/* check a sample outside the timed loop */
+	for (n = 0; n < w->written; n += 97) {
+		if (pread(w->fd, buf, page_size, (w->first + n) * page_size) !=
+		    page_size)
+			break;
+		fill_page(check, w->first + n);
+		if (memcmp(buf, check, page_size))
+			w->bad++;
+	}
+
+	free(buf);
+	free(check);
+	return NULL;
+}
+
+static int run(int nr_threads)
+{
+	struct worker workers[MAX_THREADS];
+	unsigned long writes = 0, reads = 0, bad = 0;
+	uint64_t write_ns = 0, read_ns = 0, slice;
+	int i;
+
+	slice = disk_size / page_size / nr_threads;
+	slice -= slice % batch;
+	if (!slice)
+		return -1;
+
+	memset(workers, 0, sizeof(workers));
+	stop = 0;
+	for (i = 0; i < nr_threads; i++) {
+		struct worker *w = &workers[i];
+
+		w->cpu = i;
+		w->first = i * slice;
+		w->pages = slice;
+		w->fd = open(device, O_RDWR | O_DIRECT);
+		if (w->fd < 0) {
+			perror(device);
+			return -1;
+		}
+		pthread_create(&w->thread, NULL, worker_main, w);
+	}
+
+	sleep(seconds);
+	stop = 1;
+
+	for (i = 0; i < nr_threads; i++) {
+		struct worker *w = &workers[i];
+
+		pthread_join(w->thread, NULL);
+		close(w->fd);
+		writes += w->writes;
+		reads += w->reads;
+		bad += w->bad;
+		if (w->write_ns > write_ns)
+			write_ns = w->write_ns;
+		if (w->read_ns > read_ns)
+			read_ns = w->read_ns;
+	}
+
+	printf("%3d cpus: write %10.0f pages/s  read %10.0f pages/s  bad %lu\n",
+	       nr_threads, write_ns ? writes * 1e9 / write_ns : 0.0,
+	       read_ns ? reads * 1e9 / read_ns : 0.0, bad);
+
+	return bad ? -1 : 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-c max cpus] [-t seconds per round]"
+		" [-b pages per I/O] [-d device]\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt, fd, i, ret = 0;
+
+	while ((opt = getopt(argc, argv, "c:t:b:d:")) != -1) {
+		switch (opt) {
+		case 'c':
+			max_threads = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'd':
+			device = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (max_threads < 1 || max_threads > MAX_THREADS || seconds < 1 ||
+	    batch < 1)
+		usage(argv[0]);
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	fd = open(device, O_RDONLY);
+	if (fd < 0) {
+		perror(device);
+		return 1;
+	}
+	if (ioctl(fd, BLKGETSIZE64, &disk_size) < 0) {
+		perror("BLKGETSIZE64");
+		return 1;
+	}
+	close(fd);
+
+	for (i = 1; i <= max_threads; i++)
+		if (run(i))
+			ret = 1;
+
+	return ret;
+}